@@ -0,0 +1,242 @@
+#include "autoindex.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+
+struct autoindex_entry {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char *page;
+    size_t page_len;
+};
+
+static struct autoindex_entry CACHE[AUTOINDEX_CACHE_SIZE] = {0};
+
+/* growable output buffer for the listing */
+struct page_buff {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static int page_append(struct page_buff *page, const char *str, size_t len) {
+    if(page->len + len + 1 > page->size) {
+        size_t new_size = page->size ? page->size : 1024;
+        while(page->len + len + 1 > new_size) new_size *= 2;
+        char *data = realloc(page->data, new_size);
+        if(!data) return -1;
+        page->data = data;
+        page->size = new_size;
+    }
+    memcpy(page->data + page->len, str, len);
+    page->len += len;
+    page->data[page->len] = '\0';
+    return 0;
+}
+
+static int page_append_str(struct page_buff *page, const char *str) {
+    return page_append(page, str, strlen(str));
+}
+
+/* appends `str` with html's special characters escaped */
+static int page_append_html(struct page_buff *page, const char *str) {
+    for(; *str; str++) {
+        int ret;
+        switch(*str) {
+            case '&': ret = page_append_str(page, "&amp;"); break;
+            case '<': ret = page_append_str(page, "&lt;"); break;
+            case '>': ret = page_append_str(page, "&gt;"); break;
+            case '"': ret = page_append_str(page, "&quot;"); break;
+            default: ret = page_append(page, str, 1); break;
+        }
+        if(ret) return ret;
+    }
+    return 0;
+}
+
+/* appends `str` percent-encoded so that it can be used in an href */
+static int page_append_url(struct page_buff *page, const char *str) {
+    static const char hex[] = "0123456789ABCDEF";
+    for(; *str; str++) {
+        unsigned char c = *str;
+        if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                || (c >= '0' && c <= '9') || strchr("-._~/", c)) {
+            if(page_append(page, (char*)&c, 1)) return -1;
+        }
+        else {
+            char enc[3] = {'%', hex[c >> 4], hex[c & 0xf]};
+            if(page_append(page, enc, 3)) return -1;
+        }
+    }
+    return 0;
+}
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+/* reads the entries of `path`, directories get a trailing '/'
+ * Returns: the number of entries, -1 on error */
+static ssize_t read_names(const char *path, char ***names) {
+    DIR *dir = 0;
+    struct dirent *dirent;
+    size_t len = 0;
+    size_t size = 32;
+
+    *names = malloc(sizeof(char*) * size);
+    if(!*names) return -1;
+
+    dir = opendir(path);
+    if(!dir) goto failure;
+
+    while((dirent = readdir(dir))) {
+        size_t name_len = strlen(dirent->d_name);
+        _Bool is_dir = dirent->d_type == DT_DIR;
+
+        if(dirent->d_name[0] == '.') continue;
+
+        if(dirent->d_type == DT_UNKNOWN || dirent->d_type == DT_LNK) {
+            struct stat st;
+            if(fstatat(dirfd(dir), dirent->d_name, &st, 0) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+            }
+        }
+        if(len == size) {
+            char **new_names = realloc(*names, sizeof(char*) * size * 2);
+            if(!new_names) goto failure;
+            *names = new_names;
+            size *= 2;
+        }
+        char *name = malloc(name_len + 2);
+        if(!name) goto failure;
+        memcpy(name, dirent->d_name, name_len);
+        name[name_len] = is_dir ? '/' : '\0';
+        name[name_len + 1] = '\0';
+        (*names)[len++] = name;
+    }
+    closedir(dir);
+
+    qsort(*names, len, sizeof(char*), cmp_names);
+    return len;
+
+failure:
+    if(dir) closedir(dir);
+    for(size_t i = 0; i < len; i++) {
+        free((*names)[i]);
+    }
+    free(*names);
+    *names = 0;
+    return -1;
+}
+
+/* renders the listing of `path` into `page`
+ * Returns: 0 on success, -1 on error */
+static int render(const char *path, const char *url, struct page_buff *page) {
+    char **names;
+    ssize_t nb_names;
+    int ret = -1;
+
+    nb_names = read_names(path, &names);
+    if(nb_names < 0) return -1;
+
+    if(page_append_str(page, "<!DOCTYPE html><html><head><title>Index of /")
+            || page_append_html(page, url)
+            || page_append_str(page, "</title></head><body><h1>Index of /")
+            || page_append_html(page, url)
+            || page_append_str(page, "</h1><ul>")) {
+        goto cleanup;
+    }
+    if(*url && page_append_str(page, "<li><a href=\"../\">../</a></li>")) {
+        goto cleanup;
+    }
+    for(ssize_t i = 0; i < nb_names; i++) {
+        if(page_append_str(page, "<li><a href=\"")
+                || page_append_url(page, names[i])
+                || page_append_str(page, "\">")
+                || page_append_html(page, names[i])
+                || page_append_str(page, "</a></li>")) {
+            goto cleanup;
+        }
+    }
+    if(page_append_str(page, "</ul></body></html>")) goto cleanup;
+    ret = 0;
+
+cleanup:
+    for(ssize_t i = 0; i < nb_names; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+/* FNV-1a */
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    for(; *path; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void entry_cleanup(struct autoindex_entry *entry) {
+    free(entry->path);
+    free(entry->page);
+    memset(entry, 0, sizeof(*entry));
+}
+
+int autoindex_get(
+        const char *path,
+        const char *url,
+        const struct stat *st,
+        const char **page,
+        size_t *page_len) {
+    struct autoindex_entry *entry = CACHE + hash_path(path) % AUTOINDEX_CACHE_SIZE;
+    struct page_buff buff = {0};
+
+    if(entry->path
+            && entry->dev == st->st_dev
+            && entry->ino == st->st_ino
+            && entry->mtime.tv_sec == st->st_mtim.tv_sec
+            && entry->mtime.tv_nsec == st->st_mtim.tv_nsec
+            && !strcmp(entry->path, path)) {
+        *page = entry->page;
+        *page_len = entry->page_len;
+        return 0;
+    }
+
+    if(render(path, url, &buff)) {
+        logging(WARN, "unable to render the index of `%s`", path);
+        free(buff.data);
+        return -1;
+    }
+
+    entry_cleanup(entry);
+    entry->path = strdup(path);
+    if(!entry->path) {
+        free(buff.data);
+        return -1;
+    }
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = st->st_mtim;
+    entry->page = buff.data;
+    entry->page_len = buff.len;
+
+    *page = entry->page;
+    *page_len = entry->page_len;
+    return 0;
+}
+
+void autoindex_cleanup(void) {
+    for(size_t i = 0; i < AUTOINDEX_CACHE_SIZE; i++) {
+        entry_cleanup(CACHE + i);
+    }
+}
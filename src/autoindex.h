@@ -0,0 +1,26 @@
+#ifndef AUTOINDEX_H
+#define AUTOINDEX_H 1
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* number of rendered listings kept around */
+#define AUTOINDEX_CACHE_SIZE 64
+
+/* Gets an html listing of the directory at `path`, `url` is the path the
+ * listing is served under and `st` the directory's current stat.
+ * Listings are cached and only rendered again once the directory's mtime
+ * changes.
+ * `*page` stays valid until the next call to `autoindex_get`
+ * Returns: 0 on success, -1 on error, check errno */
+int autoindex_get(
+        const char *path,
+        const char *url,
+        const struct stat *st,
+        const char **page,
+        size_t *page_len);
+
+/* drops every cached listing */
+void autoindex_cleanup(void);
+
+#endif
@@ -0,0 +1,70 @@
+#include "bufpool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/* free buffers are chained through their first bytes */
+struct free_buffer {
+    struct free_buffer *next;
+};
+
+static pthread_mutex_t LOCK = PTHREAD_MUTEX_INITIALIZER;
+static struct free_buffer *FREE = 0;
+static size_t NB_FREE = 0;
+static size_t IN_USE = 0;
+
+char *bufpool_get(void) {
+    struct free_buffer *buffer;
+
+    pthread_mutex_lock(&LOCK);
+    buffer = FREE;
+    if(buffer) {
+        FREE = buffer->next;
+        NB_FREE--;
+    }
+    IN_USE++;
+    pthread_mutex_unlock(&LOCK);
+    if(buffer) return (char*)buffer;
+
+    buffer = malloc(BUFPOOL_BUFFER_SIZE);
+    if(!buffer) {
+        pthread_mutex_lock(&LOCK);
+        IN_USE--;
+        pthread_mutex_unlock(&LOCK);
+    }
+    return (char*)buffer;
+}
+
+void bufpool_put(char *buffer) {
+    struct free_buffer *freed = (struct free_buffer*)buffer;
+
+    if(!buffer) return;
+    pthread_mutex_lock(&LOCK);
+    IN_USE--;
+    if(NB_FREE < BUFPOOL_MAX_FREE) {
+        freed->next = FREE;
+        FREE = freed;
+        NB_FREE++;
+        freed = 0;
+    }
+    pthread_mutex_unlock(&LOCK);
+    free(freed);
+}
+
+void bufpool_stats(struct bufpool_stats *stats) {
+    pthread_mutex_lock(&LOCK);
+    stats->in_use = IN_USE;
+    stats->free = NB_FREE;
+    pthread_mutex_unlock(&LOCK);
+}
+
+void bufpool_cleanup(void) {
+    pthread_mutex_lock(&LOCK);
+    while(FREE) {
+        struct free_buffer *next = FREE->next;
+        free(FREE);
+        FREE = next;
+    }
+    NB_FREE = 0;
+    pthread_mutex_unlock(&LOCK);
+}
@@ -0,0 +1,32 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H 1
+
+#include <stddef.h>
+
+/* what a connection reads a request into, BUFFSIZE */
+#define BUFPOOL_BUFFER_SIZE 4096
+
+/* free buffers kept for the next connections, the others go back to malloc */
+#define BUFPOOL_MAX_FREE 64
+
+struct bufpool_stats {
+    /* lent out right now */
+    size_t in_use;
+    /* kept for reuse */
+    size_t free;
+};
+
+/* Lends a buffer of BUFPOOL_BUFFER_SIZE bytes, its content is undefined.
+ * Connections only hold one while they have data in flight.
+ * Returns: the buffer, 0 on error */
+char *bufpool_get(void);
+
+/* gives back a buffer from `bufpool_get`, 0 is ignored */
+void bufpool_put(char *buffer);
+
+void bufpool_stats(struct bufpool_stats *stats);
+
+/* frees the buffers kept for reuse */
+void bufpool_cleanup(void);
+
+#endif
@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+#include "cache_rule.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONTROL_NAME "Cache-Control: "
+#define EXPIRES_NAME "Expires: "
+#define CRLF "\r\n"
+
+/* the directives of Cache-Control a rule can send, those ending with `=`
+ * take a number of seconds */
+static const char *const DIRECTIVES[] = {
+    "public",
+    "private",
+    "no-cache",
+    "no-store",
+    "no-transform",
+    "must-revalidate",
+    "proxy-revalidate",
+    "immutable",
+    "max-age=",
+    "s-maxage=",
+    "stale-while-revalidate=",
+    "stale-if-error=",
+};
+
+/* Checks `directive`, `len` bytes long, is one of DIRECTIVES
+ * Returns: its seconds, 0 for those without, -1 if it is not one */
+static long directive_check(const char *directive, size_t len) {
+    for(size_t i = 0; i < sizeof(DIRECTIVES) / sizeof(*DIRECTIVES); i++) {
+        size_t name_len = strlen(DIRECTIVES[i]);
+        const char *seconds = directive + name_len;
+        char *end;
+        long value;
+
+        if(len < name_len || memcmp(directive, DIRECTIVES[i], name_len)) continue;
+        if(DIRECTIVES[i][name_len - 1] != '=') return len == name_len ? 0 : -1;
+        if(seconds == directive + len || *seconds < '0' || *seconds > '9') return -1;
+        value = strtol(seconds, &end, 10);
+        if(end != directive + len || value < 0 || value > 0x7fffffffL) return -1;
+        return value;
+    }
+    return -1;
+}
+
+/* Returns: 1 if `glob` has a wildcard */
+static int has_wildcard(const char *glob, size_t len) {
+    return memchr(glob, '*', len) != 0;
+}
+
+/* Decides how `rule->match` is compared */
+static void match_compile(struct cache_rule *rule) {
+    const char *match = rule->match;
+    size_t len = strlen(match);
+
+    rule->literal = match;
+    rule->literal_len = len;
+    if(match[0] == '/') {
+        if(!has_wildcard(match, len)) {
+            rule->kind = CACHE_PATH_EXACT;
+        }
+        else if(len >= 3 && !strcmp(match + len - 3, "/**")
+                && !has_wildcard(match, len - 3)) {
+            /* the `/` before `**` is kept, `/dir` does not cover `/dirt` */
+            rule->kind = CACHE_PATH_PREFIX;
+            rule->literal_len = len - 2;
+        }
+        else {
+            rule->kind = CACHE_PATH_GLOB;
+        }
+    }
+    else if(strchr(match, '/')) {
+        if(len >= 2 && !strcmp(match + len - 2, "/*")) {
+            rule->kind = CACHE_TYPE_PREFIX;
+            rule->literal_len = len - 1;
+        }
+        else {
+            rule->kind = CACHE_TYPE_EXACT;
+        }
+    }
+    else if(match[0] == '*' && !has_wildcard(match + 1, len - 1)) {
+        rule->kind = CACHE_NAME_SUFFIX;
+        rule->literal = match + 1;
+        rule->literal_len = len - 1;
+    }
+    else {
+        rule->kind = CACHE_NAME_GLOB;
+    }
+}
+
+int cache_rule_parse(const char *value, struct cache_rule *rule) {
+    const char *cur = strchr(value, ' ');
+    FILE *lines = 0;
+    FILE *directives = 0;
+    size_t directives_len = 0;
+    int first = 1;
+
+    memset(rule, 0, sizeof(*rule));
+    rule->max_age = -1;
+    rule->written = (time_t)-1;
+    if(!cur || cur == value) return -1;
+    rule->match = strndup(value, cur - value);
+    if(!rule->match) goto failure;
+    /* a MIME type has no more than one `/` and no `*` before it */
+    if(rule->match[0] != '/' && strchr(rule->match, '/')
+            && (strchr(rule->match, '/') != strrchr(rule->match, '/')
+                || has_wildcard(rule->match, strchr(rule->match, '/') - rule->match))) {
+        goto failure;
+    }
+    match_compile(rule);
+
+    directives = open_memstream(&rule->directives, &directives_len);
+    if(!directives) goto failure;
+    for(;;) {
+        size_t len;
+        long seconds;
+
+        while(*cur == ' ') cur++;
+        if(!*cur) break;
+        len = strcspn(cur, " ");
+        if(len == sizeof("expires") - 1 && !memcmp(cur, "expires", len)) {
+            rule->expires = 1;
+            cur += len;
+            continue;
+        }
+        seconds = directive_check(cur, len);
+        if(seconds < 0) goto failure;
+        if(!memcmp(cur, "max-age=", sizeof("max-age=") - 1)) rule->max_age = seconds;
+        fprintf(directives, "%s%.*s", first ? "" : " ", (int)len, cur);
+        first = 0;
+        cur += len;
+    }
+    if(fclose(directives)) {
+        directives = 0;
+        goto failure;
+    }
+    directives = 0;
+    /* the date is relative to max-age */
+    if(first || (rule->expires && rule->max_age < 0)) goto failure;
+
+    lines = open_memstream(&rule->lines, &rule->lines_len);
+    if(!lines) goto failure;
+    fputs(CONTROL_NAME, lines);
+    for(const char *c = rule->directives; *c; c++) {
+        if(*c == ' ') fputs(", ", lines);
+        else fputc(*c, lines);
+    }
+    rule->control_len = ftell(lines) - (sizeof(CONTROL_NAME) - 1);
+    fputs(CRLF, lines);
+    if(rule->expires) {
+        fprintf(lines, EXPIRES_NAME"%*s"CRLF, CACHE_DATE_LEN, "");
+    }
+    if(fclose(lines)) goto failure;
+    return 0;
+
+failure:
+    if(directives) fclose(directives);
+    cache_rule_cleanup(rule);
+    return -1;
+}
+
+void cache_rule_cleanup(struct cache_rule *rule) {
+    free(rule->match);
+    free(rule->directives);
+    free(rule->lines);
+    memset(rule, 0, sizeof(*rule));
+}
+
+/* Matches `s` against `glob`, `*` does not cross a `/` and `**` does
+ * Returns: 1 if it matches */
+static int glob_match(const char *glob, const char *s) {
+    while(*glob) {
+        if(glob[0] == '*' && glob[1] == '*') {
+            glob += 2;
+            for(;; s++) {
+                if(glob_match(glob, s)) return 1;
+                if(!*s) return 0;
+            }
+        }
+        if(*glob == '*') {
+            glob++;
+            for(;; s++) {
+                if(glob_match(glob, s)) return 1;
+                if(!*s || *s == '/') return 0;
+            }
+        }
+        if(*glob != *s) return 0;
+        glob++;
+        s++;
+    }
+    return !*s;
+}
+
+struct cache_rule *cache_rule_match(
+        struct cache_rule *rules,
+        size_t nb_rules,
+        const char *path,
+        const char *type) {
+    size_t path_len;
+    const char *name;
+    size_t type_len;
+
+    if(!nb_rules) return 0;
+    path_len = strlen(path);
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    /* the parameters, `; charset=...`, are not part of the type */
+    type_len = type ? strcspn(type, "; ") : 0;
+
+    for(size_t i = 0; i < nb_rules; i++) {
+        const struct cache_rule *rule = rules + i;
+        size_t len = rule->literal_len;
+
+        switch(rule->kind) {
+            case CACHE_PATH_EXACT:
+                if(path_len == len && !memcmp(path, rule->literal, len)) break;
+                continue;
+            case CACHE_PATH_PREFIX:
+                if(path_len >= len && !memcmp(path, rule->literal, len)) break;
+                continue;
+            case CACHE_PATH_GLOB:
+                if(glob_match(rule->match, path)) break;
+                continue;
+            case CACHE_NAME_SUFFIX:
+                if(path_len >= len && !memcmp(path + path_len - len, rule->literal, len)) {
+                    break;
+                }
+                continue;
+            case CACHE_NAME_GLOB:
+                if(glob_match(rule->match, name)) break;
+                continue;
+            case CACHE_TYPE_EXACT:
+                if(type_len == len && !strncasecmp(type, rule->literal, len)) break;
+                continue;
+            case CACHE_TYPE_PREFIX:
+                if(type_len > len && !strncasecmp(type, rule->literal, len)) break;
+                continue;
+        }
+        return rules + i;
+    }
+    return 0;
+}
+
+const char *cache_rule_lines(struct cache_rule *rule, time_t now) {
+    char date[CACHE_DATE_LEN + 1];
+    time_t expires;
+    struct tm tm;
+
+    if(!rule->expires || rule->written == now) return rule->lines;
+    expires = now + rule->max_age;
+    if(!gmtime_r(&expires, &tm)
+            || strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm)
+                != CACHE_DATE_LEN) {
+        return rule->lines;
+    }
+    memcpy(rule->lines + rule->lines_len - CACHE_DATE_LEN - 2, date, CACHE_DATE_LEN);
+    rule->written = now;
+    return rule->lines;
+}
+
+const char *cache_rule_control(const struct cache_rule *rule, size_t *len) {
+    *len = rule->control_len;
+    return rule->lines + sizeof(CONTROL_NAME) - 1;
+}
+
+const char *cache_rule_expires(const struct cache_rule *rule) {
+    if(!rule->expires) return 0;
+    return rule->lines + rule->lines_len - CACHE_DATE_LEN - 2;
+}
@@ -0,0 +1,81 @@
+#ifndef CACHE_RULE_H
+#define CACHE_RULE_H 1
+
+#include <stddef.h>
+#include <time.h>
+
+/* an IMF-fixdate, `Sun, 06 Nov 1994 08:49:37 GMT` */
+#define CACHE_DATE_LEN 29
+
+/* what the match of a rule is compared with, decided when it is parsed */
+enum cache_match {
+    /* `/path`, the path as is */
+    CACHE_PATH_EXACT,
+    /* a path ending with `**` and nothing else wild, every path under it */
+    CACHE_PATH_PREFIX,
+    /* any other path, `*` stops at a `/` and `**` does not */
+    CACHE_PATH_GLOB,
+    /* `*.css`, the end of the file name */
+    CACHE_NAME_SUFFIX,
+    /* `name*.txt`, a glob on the file name alone */
+    CACHE_NAME_GLOB,
+    /* `text/css`, the MIME type */
+    CACHE_TYPE_EXACT,
+    /* a MIME type whose subtype is `*` */
+    CACHE_TYPE_PREFIX,
+};
+
+/* a `cache` key */
+struct cache_rule {
+    /* the glob or MIME type, as configured */
+    char *match;
+    enum cache_match kind;
+    /* what is compared with memcmp, within `match`, for the kinds that
+     * are not globs */
+    const char *literal;
+    size_t literal_len;
+    /* seconds of `max-age`, -1 without it */
+    long max_age;
+    /* sends `Expires` too, `max_age` from now */
+    int expires;
+    /* the directives as configured, `expires` left out */
+    char *directives;
+    /* length of the value of Cache-Control in `lines` */
+    size_t control_len;
+    /* `Cache-Control: <directives>\r\n` and, for `expires`, `Expires: <date>\r\n`,
+     * ready to be appended to a response */
+    char *lines;
+    size_t lines_len;
+    /* when the date in `lines` was last written */
+    time_t written;
+};
+
+/* Parses `<match> <directive>...` into `rule`, `match` is a path glob
+ * starting with `/`, a glob on the file name like `*.css` or a MIME type
+ * whose subtype can be `*`. The directives are those of Cache-Control, plus `expires`.
+ * Returns: 0 on success, -1 on error */
+int cache_rule_parse(const char *value, struct cache_rule *rule);
+
+void cache_rule_cleanup(struct cache_rule *rule);
+
+/* Finds the first of `rules` matching the file at `path`, relative to the
+ * site's base_dir and starting with `/`, of MIME type `type`
+ * Returns: the rule, 0 if none matches */
+struct cache_rule *cache_rule_match(
+        struct cache_rule *rules,
+        size_t nb_rules,
+        const char *path,
+        const char *type);
+
+/* Brings the `Expires` date of `rule` to `now`, once per second
+ * Returns: `rule->lines` */
+const char *cache_rule_lines(struct cache_rule *rule, time_t now);
+
+/* Returns: the value of `Cache-Control` in `rule->lines` */
+const char *cache_rule_control(const struct cache_rule *rule, size_t *len);
+
+/* Returns: the value of `Expires` in `rule->lines`, CACHE_DATE_LEN bytes
+ * brought to date by `cache_rule_lines`, 0 without one */
+const char *cache_rule_expires(const struct cache_rule *rule);
+
+#endif
@@ -2,20 +2,78 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netdb.h>
 
 #include "config.h"
 
 #define MIN(a,b) (a < b ? a : b)
+#define MAX(a,b) (a > b ? a : b)
 
-struct config CONFIG = {
+/* values of a freshly parsed config, -1 marks unset keys */
+static const struct config CONFIG_DEFAULT = {
     .bind_addr = 0,
     .http_port = -1,
     .https_port = -1,
     .pem_file = 0,
     .base_dir = 0,
     .base_dir_len = -1,
+    .autoindex = -1,
+    .path_filter = -1,
+    .pack_file = 0,
+    .drain_timeout = -1,
+    .listen_backlog = -1,
+    .tcp_defer_accept = -1,
+    .tcp_fastopen = -1,
+    .tcp_nodelay = -1,
+    .unix_socket = 0,
+    .unix_socket_mode = -1,
+    .health_path = 0,
+    .health_path_len = 0,
+    .status_path = 0,
+    .status_allow = 0,
+    .nb_status_allow = 0,
+    .redirects = 0,
+    .nb_redirects = 0,
+    .cache_rules = 0,
+    .nb_cache_rules = 0,
+    .vhosts = 0,
+    .nb_vhosts = 0,
+    .proxies = 0,
+    .nb_proxies = 0,
+    .fastcgi = 0,
+    .nb_fastcgi = 0,
+    .fastcgi_workers = -1,
+    .handshake_threads = -1,
+    .fs_threads = -1,
+    .send_rate = -1,
+    .egress_rate = -1,
+    .send_timeout = -1,
+    .rate_limit_requests = -1,
+    .rate_limit_bytes = -1,
+    .rate_limit_burst = -1,
+    .rate_limit_action = -1,
+    .overload_connections = -1,
+    .overload_lag = -1,
+    .overload_handshakes = -1,
+    .overload_action = -1,
+    .error_page_paths = {0},
+    .rate_limit = {0},
+    .overload = {0},
+    .error_pages = {{0}},
+    .vhost_table = {0},
+    .router = {0},
+    .pack = {0},
+    .refs = 1,
 };
 
+/* the published snapshot */
+static struct config *CURRENT = 0;
+
+static pthread_mutex_t CURRENT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
 /* Extracts the key and the value out of a line formatted like
  * <key> = <value>\0 -> <key>\0= <value>\0
  * Returns: < 0 on err, 0 otherwise */
@@ -74,6 +132,20 @@ static int key_value_split(char *line, char **key, char **value) {
     return 0;
 }
 
+/* parses true/false, yes/no, on/off and 1/0
+ * Returns: 1 or 0, -1 if `value` is not a boolean */
+static int parse_bool(const char *value) {
+    if(!strcmp(value, "true") || !strcmp(value, "yes")
+            || !strcmp(value, "on") || !strcmp(value, "1")) {
+        return 1;
+    }
+    if(!strcmp(value, "false") || !strcmp(value, "no")
+            || !strcmp(value, "off") || !strcmp(value, "0")) {
+        return 0;
+    }
+    return -1;
+}
+
 #define CONFIG_STR_BUFFER_SIZE 128
 
 static char *CONFIG_ERR_STR = 0;
@@ -86,9 +158,80 @@ const char *get_config_err(void) {
     return err;
 }
 
-/* loads a config from `f`
- * Returns: < 0 on error, 0 otherwise */
-int load_config(FILE *f) {
+/* Sets `key` of the `[vhost]` section being read, only the keys of a site
+ * can be set there
+ * Returns: 0 on success, -1 on error (see `get_config_err`) */
+static int vhost_key(struct vhost *vhost, const char *key, const char *value, int line_num) {
+    if(!strcmp(key, "server_name")) {
+        if(vhost_add_names(vhost, value)) {
+            snprintf(CONFIG_STR_BUFFER,
+                    CONFIG_STR_BUFFER_SIZE,
+                    "line %d: unable to parse `%s` must be host names",
+                    line_num,
+                    value);
+            CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+            return -1;
+        }
+        return 0;
+    }
+    if(!strcmp(key, "base_dir") || !strcmp(key, "pem_file")) {
+        char **field = key[0] == 'b' ? &vhost->base_dir : &vhost->pem_file;
+        if(*field) {
+            snprintf(CONFIG_STR_BUFFER,
+                    CONFIG_STR_BUFFER_SIZE,
+                    "line %d: duplicate key `%s` defined previously",
+                    line_num,
+                    key);
+            CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+            return -1;
+        }
+        *field = strdup(value);
+        if(!*field) return -1;
+        if(field == &vhost->base_dir) vhost->base_dir_len = strlen(value);
+        return 0;
+    }
+    if(!strcmp(key, "autoindex")) {
+        if(vhost->autoindex != -1) {
+            snprintf(CONFIG_STR_BUFFER,
+                    CONFIG_STR_BUFFER_SIZE,
+                    "line %d: duplicate key `autoindex` defined previously",
+                    line_num);
+            CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+            return -1;
+        }
+        vhost->autoindex = parse_bool(value);
+        if(vhost->autoindex == -1) {
+            snprintf(CONFIG_STR_BUFFER,
+                    CONFIG_STR_BUFFER_SIZE,
+                    "unable to parse `%s` must be either true or false",
+                    value);
+            CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+            return -1;
+        }
+        return 0;
+    }
+    snprintf(CONFIG_STR_BUFFER,
+            CONFIG_STR_BUFFER_SIZE,
+            "line %d: `%s` can not be set in a [vhost] section",
+            line_num,
+            key);
+    CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+    return -1;
+}
+
+/* Returns: 1 if `line` opens a `[vhost]` section, -1 if it is some other
+ * section, 0 if it is not a section header */
+static int section_start(const char *line) {
+    while(isspace((unsigned char)*line)) line++;
+    if(*line != '[') return 0;
+    if(strncmp(line, "[vhost]", sizeof("[vhost]") - 1)) return -1;
+    line += sizeof("[vhost]") - 1;
+    while(isspace((unsigned char)*line)) line++;
+    return *line ? -1 : 1;
+}
+
+struct config *config_parse(FILE *f) {
+    struct config *config;
     int ret_val = -1;
     int line_num = 0;
     char *line = 0;
@@ -100,6 +243,9 @@ int load_config(FILE *f) {
     char *key;
     char *value;
 
+    config = malloc(sizeof(struct config));
+    if(!config) return 0;
+    *config = CONFIG_DEFAULT;
 
     while((line_len = getline(&line, &line_size, f)) != -1) {
         line_num++;
@@ -109,6 +255,27 @@ int load_config(FILE *f) {
         /* empty line */
         if(line_len <= 1) continue;
 
+        /* the keys that follow are the section's, up to the next one */
+        switch(section_start(line)) {
+            case 1: {
+                struct vhost *vhosts = realloc(
+                        config->vhosts,
+                        (config->nb_vhosts + 1) * sizeof(struct vhost));
+                if(!vhosts) goto cleanup;
+                config->vhosts = vhosts;
+                memset(vhosts + config->nb_vhosts, 0, sizeof(struct vhost));
+                vhosts[config->nb_vhosts++].autoindex = -1;
+                continue;
+            }
+            case -1:
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: unknown section, only [vhost] is",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+        }
+
         split_ret = key_value_split(line, &key, &value);
         switch(split_ret) {
             case KV_NoKey:
@@ -154,12 +321,18 @@ int load_config(FILE *f) {
             case KV_Comment:
                 continue;
         }
+        if(config->nb_vhosts) {
+            if(vhost_key(config->vhosts + config->nb_vhosts - 1, key, value, line_num)) {
+                goto cleanup;
+            }
+            continue;
+        }
         /* must be a line with a key and a value */
         size_t key_len = strlen(key) + 1;
         if(key_len == sizeof("bind_addr")
                 && !strncmp("bind_addr", key, key_len)) {
 
-            if(CONFIG.bind_addr) {
+            if(config->bind_addr) {
                 snprintf(CONFIG_STR_BUFFER,
                         CONFIG_STR_BUFFER_SIZE,
                         "line %d: duplicate key `bind_addr` defined previously",
@@ -168,14 +341,12 @@ int load_config(FILE *f) {
                 goto cleanup;
             }
 
-            int value_len = strlen(value);
-            CONFIG.bind_addr = malloc(value_len);
-            strncpy(CONFIG.bind_addr, value, value_len);
+            config->bind_addr = strdup(value);
         }
         else if(key_len == sizeof("http_port")
                 && !strncmp("http_port", key, key_len)) {
 
-            if(CONFIG.http_port != -1) {
+            if(config->http_port != -1) {
                 snprintf(CONFIG_STR_BUFFER,
                         CONFIG_STR_BUFFER_SIZE,
                         "line %d: duplicate key `http_port` defined previously",
@@ -195,13 +366,13 @@ int load_config(FILE *f) {
                 goto cleanup;
             }
             else {
-                CONFIG.http_port = port;
+                config->http_port = port;
             }
         }
         else if(key_len == sizeof("https_port")
                 && !strncmp("https_port", key, key_len)) {
 
-            if(CONFIG.https_port != -1) {
+            if(config->https_port != -1) {
                 snprintf(CONFIG_STR_BUFFER,
                         CONFIG_STR_BUFFER_SIZE,
                         "line %d: duplicate key `https_port` defined previously",
@@ -221,13 +392,13 @@ int load_config(FILE *f) {
                 goto cleanup;
             }
             else {
-                CONFIG.https_port = port;
+                config->https_port = port;
             }
         }
         else if(key_len == sizeof("pem_file")
                 && !strncmp("pem_file", key, key_len)) {
 
-            if(CONFIG.pem_file) {
+            if(config->pem_file) {
                 snprintf(CONFIG_STR_BUFFER,
                         CONFIG_STR_BUFFER_SIZE,
                         "line %d: duplicate key `pem_file` defined previously",
@@ -236,14 +407,12 @@ int load_config(FILE *f) {
                 goto cleanup;
             }
 
-            int value_len = strlen(value);
-            CONFIG.pem_file = malloc(value_len);
-            strncpy(CONFIG.pem_file, value, value_len);
+            config->pem_file = strdup(value);
         }
         else if(key_len == sizeof("base_dir")
                 && !strncmp("base_dir", key, key_len)) {
 
-            if(CONFIG.base_dir) {
+            if(config->base_dir) {
                 snprintf(CONFIG_STR_BUFFER,
                         CONFIG_STR_BUFFER_SIZE,
                         "line %d: duplicate key `base_dir` defined previously",
@@ -252,36 +421,1119 @@ int load_config(FILE *f) {
                 goto cleanup;
             }
 
-            int value_len = strlen(value);
-            CONFIG.base_dir = malloc(value_len);
-            CONFIG.base_dir_len = value_len;
-            strncpy(CONFIG.base_dir, value, value_len);
+            config->base_dir = strdup(value);
+            config->base_dir_len = strlen(value);
         }
-        else {
-            snprintf(CONFIG_STR_BUFFER,
-                    CONFIG_STR_BUFFER_SIZE,
-                    "line %d: unknown key `%s`",
-                    line_num,
-                    key);
-            CONFIG_ERR_STR = CONFIG_STR_BUFFER;
-            goto cleanup;
+        else if(key_len == sizeof("autoindex")
+                && !strncmp("autoindex", key, key_len)) {
+
+            if(config->autoindex != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `autoindex` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            config->autoindex = parse_bool(value);
+            if(config->autoindex == -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be either true or false",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
         }
-    }
-    if(line_num == 0) {
-        snprintf(CONFIG_STR_BUFFER,
-                CONFIG_STR_BUFFER_SIZE,
-                "unable to read the config file: `%s`",
-                strerror(errno));
-        CONFIG_ERR_STR = CONFIG_STR_BUFFER;
-        goto cleanup;
-    }
-    ret_val = 0;
-cleanup:
-    free(line);
-    return ret_val;
+        else if(key_len == sizeof("pack_file")
+                && !strncmp("pack_file", key, key_len)) {
+
+            if(config->pack_file) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `pack_file` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            config->pack_file = strdup(value);
+        }
+        else if(key_len == sizeof("drain_timeout")
+                && !strncmp("drain_timeout", key, key_len)) {
+
+            if(config->drain_timeout != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `drain_timeout` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long timeout = strtol(value, &end, 10);
+            if(*end != '\0' || timeout < 1 || timeout > 86400) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of seconds between 1 and 86400",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->drain_timeout = timeout;
+        }
+        else if(key_len == sizeof("listen_backlog")
+                && !strncmp("listen_backlog", key, key_len)) {
+
+            if(config->listen_backlog != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `listen_backlog` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long backlog = strtol(value, &end, 10);
+            if(*end != '\0' || backlog < 1 || backlog > 65535) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of connections between 1 and 65535",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->listen_backlog = backlog;
+        }
+        else if(key_len == sizeof("tcp_defer_accept")
+                && !strncmp("tcp_defer_accept", key, key_len)) {
+
+            if(config->tcp_defer_accept != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `tcp_defer_accept` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long defer = strtol(value, &end, 10);
+            if(*end != '\0' || defer < 0 || defer > 3600) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of seconds between 0 and 3600",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->tcp_defer_accept = defer;
+        }
+        else if(key_len == sizeof("tcp_fastopen")
+                && !strncmp("tcp_fastopen", key, key_len)) {
+
+            if(config->tcp_fastopen != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `tcp_fastopen` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long fastopen = strtol(value, &end, 10);
+            if(*end != '\0' || fastopen < 0 || fastopen > 65535) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of connections between 0 and 65535",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->tcp_fastopen = fastopen;
+        }
+        else if(key_len == sizeof("tcp_nodelay")
+                && !strncmp("tcp_nodelay", key, key_len)) {
+
+            if(config->tcp_nodelay != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `tcp_nodelay` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            config->tcp_nodelay = parse_bool(value);
+            if(config->tcp_nodelay == -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be either true or false",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+        }
+        else if(key_len == sizeof("path_filter")
+                && !strncmp("path_filter", key, key_len)) {
+
+            if(config->path_filter != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `path_filter` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            config->path_filter = parse_bool(value);
+            if(config->path_filter == -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be either true or false",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+        }
+        else if(key_len == sizeof("unix_socket")
+                && !strncmp("unix_socket", key, key_len)) {
+
+            if(config->unix_socket) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `unix_socket` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            if(strlen(value) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: the path of `unix_socket` is too long",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->unix_socket = strdup(value);
+        }
+        else if(key_len == sizeof("unix_socket_mode")
+                && !strncmp("unix_socket_mode", key, key_len)) {
+
+            if(config->unix_socket_mode != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `unix_socket_mode` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long mode = strtol(value, &end, 8);
+            if(*end != '\0' || mode < 0 || mode > 0777) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be an octal mode between 0 and 0777",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->unix_socket_mode = mode;
+        }
+        else if(key_len == sizeof("health_path")
+                && !strncmp("health_path", key, key_len)) {
+
+            if(config->health_path) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `health_path` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            /* compared as is against the request line */
+            if(value[0] != '/' || strpbrk(value, " \t?")) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a path starting with `/`",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->health_path = strdup(value);
+            config->health_path_len = strlen(value);
+        }
+        else if(key_len == sizeof("status_path")
+                && !strncmp("status_path", key, key_len)) {
+
+            if(config->status_path) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `status_path` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            if(value[0] != '/' || strpbrk(value, " \t?")) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a path starting with `/`",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->status_path = strdup(value);
+        }
+        else if(key_len == sizeof("status_allow")
+                && !strncmp("status_allow", key, key_len)) {
+            /* one network per key, the key can be repeated */
+            struct peer_net *nets = realloc(
+                    config->status_allow,
+                    (config->nb_status_allow + 1) * sizeof(struct peer_net));
+            if(!nets) goto cleanup;
+            config->status_allow = nets;
+
+            if(peer_net_parse(value, nets + config->nb_status_allow)) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: unable to parse `%s` must be `<address>[/<prefix length>]`",
+                        line_num,
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->nb_status_allow++;
+        }
+        else if(key_len == sizeof("redirect")
+                && !strncmp("redirect", key, key_len)) {
+            /* one per path, the key can be repeated */
+            struct redirect *redirects = realloc(
+                    config->redirects,
+                    (config->nb_redirects + 1) * sizeof(struct redirect));
+            if(!redirects) goto cleanup;
+            config->redirects = redirects;
+
+            if(redirect_parse(value, redirects + config->nb_redirects)) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: unable to parse `%s` must be `/<path> <location>`",
+                        line_num,
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->nb_redirects++;
+        }
+        else if(key_len == sizeof("cache")
+                && !strncmp("cache", key, key_len)) {
+            /* the first matching rule wins, the key can be repeated */
+            struct cache_rule *rules = realloc(
+                    config->cache_rules,
+                    (config->nb_cache_rules + 1) * sizeof(struct cache_rule));
+            if(!rules) goto cleanup;
+            config->cache_rules = rules;
+
+            if(cache_rule_parse(value, rules + config->nb_cache_rules)) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: unable to parse `%s` must be "
+                        "`<match> <directive>... [expires]`",
+                        line_num,
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->nb_cache_rules++;
+        }
+        else if(key_len == sizeof("error_page")
+                && !strncmp("error_page", key, key_len)) {
+            /* one per status, the key can be repeated */
+            char *end = 0;
+            long status = strtol(value, &end, 10);
+            int kind = error_page_kind(status);
+
+            if(end == value || *end != ' ' || kind == -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: unable to parse `%s` must be `<status> <path>` for a status among 404 405 411 418 426 431 500 502",
+                        line_num,
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            if(config->error_page_paths[kind]) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate `error_page` for %ld defined previously",
+                        line_num,
+                        status);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            while(*end == ' ') end++;
+            config->error_page_paths[kind] = strdup(end);
+        }
+        else if(key_len == sizeof("proxy")
+                && !strncmp("proxy", key, key_len)) {
+            /* one per route, the key can be repeated */
+            struct proxy_route *proxies = realloc(
+                    config->proxies,
+                    (config->nb_proxies + 1) * sizeof(struct proxy_route));
+            if(!proxies) goto cleanup;
+            config->proxies = proxies;
+
+            if(proxy_route_parse(value, proxies + config->nb_proxies)) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: unable to parse `%s` must be `/<prefix> <host>:<port>` or `/<prefix> unix:<path>`",
+                        line_num,
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->nb_proxies++;
+        }
+        else if(key_len == sizeof("fastcgi")
+                && !strncmp("fastcgi", key, key_len)) {
+            /* one per route, the key can be repeated */
+            struct fcgi_route *fastcgi = realloc(
+                    config->fastcgi,
+                    (config->nb_fastcgi + 1) * sizeof(struct fcgi_route));
+            if(!fastcgi) goto cleanup;
+            config->fastcgi = fastcgi;
+
+            if(fcgi_route_parse(value, fastcgi + config->nb_fastcgi)) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: unable to parse `%s` must be `/<prefix> unix:<path> [<command>]` or `.<ext> unix:<path> [<command>]`",
+                        line_num,
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->nb_fastcgi++;
+        }
+        else if(key_len == sizeof("fastcgi_workers")
+                && !strncmp("fastcgi_workers", key, key_len)) {
+
+            if(config->fastcgi_workers != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `fastcgi_workers` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long workers = strtol(value, &end, 10);
+            if(*end != '\0' || workers < 1 || workers > FCGI_WORKERS_MAX) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of workers between 1 and %d",
+                        value,
+                        FCGI_WORKERS_MAX);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->fastcgi_workers = workers;
+        }
+        else if(key_len == sizeof("handshake_threads")
+                && !strncmp("handshake_threads", key, key_len)) {
+
+            if(config->handshake_threads != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `handshake_threads` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long threads = strtol(value, &end, 10);
+            if(*end != '\0' || threads < 0 || threads > HANDSHAKE_THREADS_MAX) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of threads between 0 and %d",
+                        value,
+                        HANDSHAKE_THREADS_MAX);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->handshake_threads = threads;
+        }
+        else if(key_len == sizeof("fs_threads")
+                && !strncmp("fs_threads", key, key_len)) {
+
+            if(config->fs_threads != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `fs_threads` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long threads = strtol(value, &end, 10);
+            if(*end != '\0' || threads < 0 || threads > FSPOOL_THREADS_MAX) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of threads between 0 and %d",
+                        value,
+                        FSPOOL_THREADS_MAX);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->fs_threads = threads;
+        }
+        else if(key_len == sizeof("send_rate")
+                && !strncmp("send_rate", key, key_len)) {
+
+            if(config->send_rate != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `send_rate` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long rate = strtol(value, &end, 10);
+            if(*end != '\0' || (rate != 0 && rate < 1024)) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be 0 or a number of bytes per second from 1024",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->send_rate = rate;
+        }
+        else if(key_len == sizeof("egress_rate")
+                && !strncmp("egress_rate", key, key_len)) {
+
+            if(config->egress_rate != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `egress_rate` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long rate = strtol(value, &end, 10);
+            if(*end != '\0' || (rate != 0 && rate < 1024)) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be 0 or a number of bytes per second from 1024",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->egress_rate = rate;
+        }
+        else if(key_len == sizeof("send_timeout")
+                && !strncmp("send_timeout", key, key_len)) {
+
+            if(config->send_timeout != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `send_timeout` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long timeout = strtol(value, &end, 10);
+            if(*end != '\0' || timeout < 0 || timeout > 86400) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of seconds up to a day, 0 for none",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->send_timeout = timeout;
+        }
+        else if(key_len == sizeof("rate_limit_requests")
+                && !strncmp("rate_limit_requests", key, key_len)) {
+
+            if(config->rate_limit_requests != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `rate_limit_requests` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long requests = strtol(value, &end, 10);
+            if(*end != '\0' || requests < 0 || requests > RATELIMIT_MAX_TOKENS) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of requests per second between 0 and %d",
+                        value,
+                        RATELIMIT_MAX_TOKENS);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->rate_limit_requests = requests;
+        }
+        else if(key_len == sizeof("rate_limit_bytes")
+                && !strncmp("rate_limit_bytes", key, key_len)) {
+
+            if(config->rate_limit_bytes != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `rate_limit_bytes` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long bytes = strtol(value, &end, 10);
+            if(*end != '\0' || (bytes != 0 && bytes < 1024)
+                    || bytes / 1024 > RATELIMIT_MAX_TOKENS) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be 0 or a number of bytes per second between 1024 and %ld",
+                        value,
+                        (long)RATELIMIT_MAX_TOKENS * 1024);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->rate_limit_bytes = bytes;
+        }
+        else if(key_len == sizeof("rate_limit_burst")
+                && !strncmp("rate_limit_burst", key, key_len)) {
+
+            if(config->rate_limit_burst != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `rate_limit_burst` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long burst = strtol(value, &end, 10);
+            if(*end != '\0' || burst < 1 || burst > 3600) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be a number of seconds between 1 and 3600",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->rate_limit_burst = burst;
+        }
+        else if(key_len == sizeof("rate_limit_action")
+                && !strncmp("rate_limit_action", key, key_len)) {
+
+            if(config->rate_limit_action != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `rate_limit_action` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            if(!strcmp(value, "close")) {
+                config->rate_limit_action = RATELIMIT_CLOSE;
+            }
+            else if(!strcmp(value, "429")) {
+                config->rate_limit_action = RATELIMIT_429;
+            }
+            else {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be `close` or `429`",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+        }
+        else if(key_len == sizeof("overload_connections")
+                && !strncmp("overload_connections", key, key_len)) {
+
+            if(config->overload_connections != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `overload_connections` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long connections = strtol(value, &end, 10);
+            if(*end != '\0' || connections < 0 || connections > UINT32_MAX) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be 0 or a number of connections",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->overload_connections = connections;
+        }
+        else if(key_len == sizeof("overload_lag")
+                && !strncmp("overload_lag", key, key_len)) {
+
+            if(config->overload_lag != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `overload_lag` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long lag = strtol(value, &end, 10);
+            if(*end != '\0' || lag < 0 || lag > 60000) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be 0 or a number of milliseconds up to 60000",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->overload_lag = lag;
+        }
+        else if(key_len == sizeof("overload_handshakes")
+                && !strncmp("overload_handshakes", key, key_len)) {
+
+            if(config->overload_handshakes != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `overload_handshakes` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            char *end=0;
+            long handshakes = strtol(value, &end, 10);
+            if(*end != '\0' || handshakes < 0 || handshakes > UINT32_MAX) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be 0 or a number of handshakes",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+            config->overload_handshakes = handshakes;
+        }
+        else if(key_len == sizeof("overload_action")
+                && !strncmp("overload_action", key, key_len)) {
+
+            if(config->overload_action != -1) {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "line %d: duplicate key `overload_action` defined previously",
+                        line_num);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+
+            if(!strcmp(value, "503")) {
+                config->overload_action = OVERLOAD_503;
+            }
+            else if(!strcmp(value, "pause")) {
+                config->overload_action = OVERLOAD_PAUSE;
+            }
+            else {
+                snprintf(CONFIG_STR_BUFFER,
+                        CONFIG_STR_BUFFER_SIZE,
+                        "unable to parse `%s` must be `503` or `pause`",
+                        value);
+                CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+                goto cleanup;
+            }
+        }
+        else {
+            snprintf(CONFIG_STR_BUFFER,
+                    CONFIG_STR_BUFFER_SIZE,
+                    "line %d: unknown key `%s`",
+                    line_num,
+                    key);
+            CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+            goto cleanup;
+        }
+    }
+    if(line_num == 0) {
+        snprintf(CONFIG_STR_BUFFER,
+                CONFIG_STR_BUFFER_SIZE,
+                "unable to read the config file: `%s`",
+                strerror(errno));
+        CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+        goto cleanup;
+    }
+    ret_val = 0;
+cleanup:
+    free(line);
+    if(ret_val) {
+        config_put(config);
+        return 0;
+    }
+    return config;
+}
+
+int config_prepare(struct config *config) {
+    struct stat st;
+
+    if(config->drain_timeout == -1) {
+        config->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    }
+    if(config->listen_backlog == -1) {
+        config->listen_backlog = DEFAULT_LISTEN_BACKLOG;
+    }
+    if(config->tcp_defer_accept == -1) {
+        config->tcp_defer_accept = DEFAULT_TCP_DEFER_ACCEPT;
+    }
+    if(config->tcp_fastopen == -1) {
+        config->tcp_fastopen = DEFAULT_TCP_FASTOPEN;
+    }
+    if(config->tcp_nodelay == -1) {
+        config->tcp_nodelay = 1;
+    }
+    if(config->path_filter == -1) {
+        config->path_filter = 0;
+    }
+    if(config->fastcgi_workers == -1) {
+        config->fastcgi_workers = DEFAULT_FASTCGI_WORKERS;
+    }
+    if(config->handshake_threads == -1) {
+        config->handshake_threads = 0;
+    }
+    if(config->fs_threads == -1) {
+        config->fs_threads = 0;
+    }
+    if(config->send_rate == -1) {
+        config->send_rate = 0;
+    }
+    if(config->egress_rate == -1) {
+        config->egress_rate = 0;
+    }
+    if(config->send_timeout == -1) {
+        config->send_timeout = DEFAULT_SEND_TIMEOUT;
+    }
+    if(config->unix_socket_mode == -1) {
+        config->unix_socket_mode = DEFAULT_UNIX_SOCKET_MODE;
+    }
+    if(config->rate_limit_action == -1) {
+        config->rate_limit_action = RATELIMIT_429;
+    }
+    if(config->rate_limit_burst == -1) {
+        config->rate_limit_burst = DEFAULT_RATE_LIMIT_BURST;
+    }
+    if(config->overload_action == -1) {
+        config->overload_action = OVERLOAD_503;
+    }
+    config->overload.connections = MAX(config->overload_connections, 0);
+    config->overload.lag_ms = MAX(config->overload_lag, 0);
+    config->overload.handshakes = MAX(config->overload_handshakes, 0);
+    config->rate_limit.requests = MAX(config->rate_limit_requests, 0);
+    config->rate_limit.bytes = MAX(config->rate_limit_bytes, 0);
+    config->rate_limit.burst = config->rate_limit_burst;
+    /* a full bucket has to fit in the table's 32 bit levels */
+    if((uint64_t)config->rate_limit.requests * config->rate_limit.burst
+                > RATELIMIT_MAX_TOKENS
+            || config->rate_limit.bytes / 1024 * config->rate_limit.burst
+                > RATELIMIT_MAX_TOKENS) {
+        snprintf(CONFIG_STR_BUFFER,
+                CONFIG_STR_BUFFER_SIZE,
+                "rate limits times `rate_limit_burst` must stay under %d requests and %d KiB",
+                RATELIMIT_MAX_TOKENS,
+                RATELIMIT_MAX_TOKENS);
+        CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+        return -1;
+    }
+    if(config->https_port == -1) {
+        CONFIG_ERR_STR = "missing key `https_port`";
+        return -1;
+    }
+    if(!config->pem_file) {
+        CONFIG_ERR_STR = "missing key `pem_file`";
+        return -1;
+    }
+    if(!config->base_dir && !config->pack_file) {
+        CONFIG_ERR_STR = "missing key `base_dir`";
+        return -1;
+    }
+    if(config->base_dir
+            && (stat(config->base_dir, &st) == -1 || !S_ISDIR(st.st_mode))) {
+        snprintf(CONFIG_STR_BUFFER,
+                CONFIG_STR_BUFFER_SIZE,
+                "`%s` is not a directory",
+                config->base_dir);
+        CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+        return -1;
+    }
+    for(int i = 0; i < NB_ERROR_PAGES; i++) {
+        if(!config->error_page_paths[i]) {
+            config->error_pages[i] = *error_page_default(i);
+            continue;
+        }
+        if(error_page_load(config->error_pages + i, i, config->error_page_paths[i])) {
+            snprintf(CONFIG_STR_BUFFER,
+                    CONFIG_STR_BUFFER_SIZE,
+                    "unable to load the error page `%s`",
+                    config->error_page_paths[i]);
+            CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+            return -1;
+        }
+    }
+    if(config->pack_file && pack_open(config->pack_file, &config->pack)) {
+        snprintf(CONFIG_STR_BUFFER,
+                CONFIG_STR_BUFFER_SIZE,
+                "unable to load the archive `%s`",
+                config->pack_file);
+        CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+        return -1;
+    }
+    for(size_t i = 0; i < config->nb_vhosts; i++) {
+        struct vhost *vhost = config->vhosts + i;
+        if(!vhost->nb_names || !vhost->base_dir) {
+            snprintf(CONFIG_STR_BUFFER,
+                    CONFIG_STR_BUFFER_SIZE,
+                    "[vhost] %zu is missing `server_name` or `base_dir`",
+                    i + 1);
+            CONFIG_ERR_STR = CONFIG_STR_BUFFER;
+            return -1;
+        }
+        if(vhost->autoindex == -1) vhost->autoindex = 0;
+    }
+    if(vhost_table_build(&config->vhost_table, config->vhosts, config->nb_vhosts)) {
+        CONFIG_ERR_STR = "two [vhost] sections share a `server_name`";
+        return -1;
+    }
+    if(endpoints_register(&config->router, config)) {
+        CONFIG_ERR_STR = "unable to set up the routes served from memory";
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes `value` as a quoted string, unset keys are left out */
+static void write_str(FILE *f, const char *key, const char *value) {
+    if(value) fprintf(f, "%s = \"%s\"\n", key, value);
+}
+
+static void write_int(FILE *f, const char *key, long value) {
+    if(value != -1) fprintf(f, "%s = %ld\n", key, value);
+}
+
+static void write_bool(FILE *f, const char *key, int value) {
+    if(value != -1) fprintf(f, "%s = %s\n", key, value ? "true" : "false");
+}
+
+/* Writes the upstream of `route` as `host:port` or `unix:path` */
+static void write_proxy(FILE *f, const struct proxy_route *route) {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+
+    if(route->addr.ss_family == AF_UNIX) {
+        fprintf(f, "proxy = \"%s unix:%s\"\n", route->prefix,
+                ((const struct sockaddr_un*)&route->addr)->sun_path);
+        return;
+    }
+    if(getnameinfo((const struct sockaddr*)&route->addr, route->addr_len,
+                host, sizeof(host), port, sizeof(port),
+                NI_NUMERICHOST | NI_NUMERICSERV)) {
+        return;
+    }
+    fprintf(f, "proxy = \"%s %s:%s\"\n", route->prefix, host, port);
+}
+
+int save_config(FILE *f) {
+    struct config *config = config_get();
+    int ret;
+
+    if(!config) return -1;
+    ret = write_config(f, config);
+    config_put(config);
+    return ret;
+}
+
+int write_config(FILE *f, const struct config *config) {
+    write_str(f, "bind_addr", config->bind_addr);
+    write_int(f, "http_port", config->http_port);
+    write_int(f, "https_port", config->https_port);
+    write_str(f, "pem_file", config->pem_file);
+    write_str(f, "base_dir", config->base_dir);
+    write_bool(f, "autoindex", config->autoindex);
+    write_bool(f, "path_filter", config->path_filter);
+    write_str(f, "pack_file", config->pack_file);
+    write_int(f, "drain_timeout", config->drain_timeout);
+    write_int(f, "listen_backlog", config->listen_backlog);
+    write_int(f, "tcp_defer_accept", config->tcp_defer_accept);
+    write_int(f, "tcp_fastopen", config->tcp_fastopen);
+    write_bool(f, "tcp_nodelay", config->tcp_nodelay);
+    write_str(f, "unix_socket", config->unix_socket);
+    if(config->unix_socket) {
+        fprintf(f, "unix_socket_mode = 0%o\n", config->unix_socket_mode);
+    }
+    write_str(f, "health_path", config->health_path);
+    write_str(f, "status_path", config->status_path);
+    for(size_t i = 0; i < config->nb_status_allow; i++) {
+        char net[PEER_NET_STR_SIZE];
+        peer_net_format(config->status_allow + i, net);
+        fprintf(f, "status_allow = \"%s\"\n", net);
+    }
+    for(size_t i = 0; i < config->nb_redirects; i++) {
+        fprintf(f, "redirect = \"%s %s\"\n",
+                config->redirects[i].from, config->redirects[i].to);
+    }
+    for(size_t i = 0; i < config->nb_cache_rules; i++) {
+        fprintf(f, "cache = \"%s %s%s\"\n",
+                config->cache_rules[i].match,
+                config->cache_rules[i].directives,
+                config->cache_rules[i].expires ? " expires" : "");
+    }
+    for(size_t i = 0; i < config->nb_proxies; i++) {
+        write_proxy(f, config->proxies + i);
+    }
+    for(size_t i = 0; i < config->nb_fastcgi; i++) {
+        const struct fcgi_route *route = config->fastcgi + i;
+        fprintf(f, "fastcgi = \"%s unix:%s%s%s\"\n",
+                route->match, route->addr.sun_path,
+                route->command ? " " : "", route->command ? route->command : "");
+    }
+    write_int(f, "fastcgi_workers", config->fastcgi_workers);
+    write_int(f, "handshake_threads", config->handshake_threads);
+    write_int(f, "fs_threads", config->fs_threads);
+    write_int(f, "send_rate", config->send_rate);
+    write_int(f, "egress_rate", config->egress_rate);
+    write_int(f, "send_timeout", config->send_timeout);
+    write_int(f, "rate_limit_requests", config->rate_limit_requests);
+    write_int(f, "rate_limit_bytes", config->rate_limit_bytes);
+    write_int(f, "rate_limit_burst", config->rate_limit_burst);
+    write_str(f, "rate_limit_action",
+            config->rate_limit_action == RATELIMIT_CLOSE ? "close" : "429");
+    write_int(f, "overload_connections", config->overload_connections);
+    write_int(f, "overload_lag", config->overload_lag);
+    write_int(f, "overload_handshakes", config->overload_handshakes);
+    write_str(f, "overload_action",
+            config->overload_action == OVERLOAD_PAUSE ? "pause" : "503");
+    for(int i = 0; i < NB_ERROR_PAGES; i++) {
+        if(!config->error_page_paths[i]) continue;
+        fprintf(f, "error_page = \"%d %s\"\n",
+                error_page_default(i)->status, config->error_page_paths[i]);
+    }
+    /* sections take every key up to the next one, they come last */
+    for(size_t i = 0; i < config->nb_vhosts; i++) {
+        const struct vhost *vhost = config->vhosts + i;
+
+        const char *name = vhost->names;
+
+        fputs("\n[vhost]\nserver_name = \"", f);
+        for(size_t j = 0; j < vhost->nb_names; j++, name += strlen(name) + 1) {
+            fprintf(f, j ? " %s" : "%s", name);
+        }
+        fputs("\"\n", f);
+        write_str(f, "base_dir", vhost->base_dir);
+        write_str(f, "pem_file", vhost->pem_file);
+        write_bool(f, "autoindex", vhost->autoindex);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+struct config *config_get(void) {
+    struct config *config;
+
+    pthread_mutex_lock(&CURRENT_LOCK);
+    config = CURRENT;
+    if(config) {
+        __atomic_add_fetch(&config->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&CURRENT_LOCK);
+    return config;
+}
+
+void config_put(struct config *config) {
+    if(!config) return;
+    if(__atomic_sub_fetch(&config->refs, 1, __ATOMIC_ACQ_REL)) return;
+
+    free(config->bind_addr);
+    free(config->pem_file);
+    free(config->base_dir);
+    free(config->pack_file);
+    free(config->unix_socket);
+    free(config->health_path);
+    free(config->status_path);
+    free(config->status_allow);
+    for(size_t i = 0; i < config->nb_redirects; i++) {
+        redirect_cleanup(config->redirects + i);
+    }
+    free(config->redirects);
+    for(size_t i = 0; i < config->nb_cache_rules; i++) {
+        cache_rule_cleanup(config->cache_rules + i);
+    }
+    free(config->cache_rules);
+    router_cleanup(&config->router);
+    for(size_t i = 0; i < config->nb_vhosts; i++) {
+        vhost_cleanup(config->vhosts + i);
+    }
+    free(config->vhosts);
+    vhost_table_cleanup(&config->vhost_table);
+    for(size_t i = 0; i < config->nb_proxies; i++) {
+        proxy_route_cleanup(config->proxies + i);
+    }
+    free(config->proxies);
+    for(size_t i = 0; i < config->nb_fastcgi; i++) {
+        fcgi_route_cleanup(config->fastcgi + i);
+    }
+    free(config->fastcgi);
+    for(int i = 0; i < NB_ERROR_PAGES; i++) {
+        free(config->error_page_paths[i]);
+        error_page_cleanup(config->error_pages + i);
+    }
+    pack_close(&config->pack);
+    free(config);
+}
+
+void config_publish(struct config *config) {
+    struct config *old;
+
+    pthread_mutex_lock(&CURRENT_LOCK);
+    old = CURRENT;
+    CURRENT = config;
+    pthread_mutex_unlock(&CURRENT_LOCK);
+
+    /* the previous snapshot lives on until its last holder is done */
+    config_put(old);
+}
+
+int load_config(FILE *f) {
+    struct config *config = config_parse(f);
+    if(!config) return -1;
+    if(config_prepare(config)) {
+        config_put(config);
+        return -1;
+    }
+    config_publish(config);
+    return 0;
 }
 
 void cleanup_config() {
-    free(CONFIG.pem_file);
-    free(CONFIG.bind_addr);
+    config_publish(0);
 }
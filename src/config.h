@@ -2,6 +2,37 @@
 #define CONFIG_H 1
 #include <stdio.h>
 
+#include "pack.h"
+#include "proxy.h"
+#include "fcgi.h"
+#include "router.h"
+#include "endpoints.h"
+#include "cache_rule.h"
+#include "vhost.h"
+#include "handshake.h"
+#include "fspool.h"
+#include "egress.h"
+#include "overload.h"
+#include "ratelimit.h"
+#include "error_page.h"
+
+#define DEFAULT_DRAIN_TIMEOUT 30
+
+/* connections waiting to be accepted */
+#define DEFAULT_LISTEN_BACKLOG 256
+
+/* seconds a connection can stay silent before it is handed to accept */
+#define DEFAULT_TCP_DEFER_ACCEPT 5
+
+/* pending TCP Fast Open connections, 0 turns it off */
+#define DEFAULT_TCP_FASTOPEN 256
+
+/* workers started for each FastCGI app */
+#define DEFAULT_FASTCGI_WORKERS 4
+
+/* permissions of the unix socket, the front proxy is usually in the group */
+#define DEFAULT_UNIX_SOCKET_MODE 0660
+
 struct config {
     char *bind_addr;
     int http_port;
@@ -9,10 +40,86 @@ struct config {
     char *pem_file;
     char *base_dir;
     size_t base_dir_len;
+    /* render a listing for directories without an index.html */
+    int autoindex;
+    /* keep a filter of the paths under base_dir, see pathfilter.h */
+    int path_filter;
+    /* archive built by sv-pack, served instead of base_dir */
+    char *pack_file;
+    /* seconds an upgraded process has to finish its connections */
+    int drain_timeout;
+    /* listener options, see `listener_tune` */
+    int listen_backlog;
+    int tcp_defer_accept;
+    int tcp_fastopen;
+    int tcp_nodelay;
+    /* also listen on a Unix socket at that path when set */
+    char *unix_socket;
+    int unix_socket_mode;
+    /* answered with a fixed 200 before any other work when set */
+    char *health_path;
+    size_t health_path_len;
+    /* served from memory when set, see endpoints.h */
+    char *status_path;
+    /* the clients it is served to, from the `status_allow` keys, nobody
+     * without them */
+    struct peer_net *status_allow;
+    size_t nb_status_allow;
+    /* answered with a 308, from the `redirect` keys */
+    struct redirect *redirects;
+    size_t nb_redirects;
+    /* Cache-Control and Expires of the files served, from the `cache` keys */
+    struct cache_rule *cache_rules;
+    size_t nb_cache_rules;
+    /* sites picked by the Host header, from the `[vhost]` sections */
+    struct vhost *vhosts;
+    size_t nb_vhosts;
+    /* paths forwarded to an upstream, from the `proxy` keys */
+    struct proxy_route *proxies;
+    size_t nb_proxies;
+    /* paths sent to a FastCGI app, from the `fastcgi` keys */
+    struct fcgi_route *fastcgi;
+    size_t nb_fastcgi;
+    int fastcgi_workers;
+    /* threads doing the TLS handshakes, 0 to do them while serving */
+    int handshake_threads;
+    /* threads opening and looking at the files served, 0 to do it while
+     * serving */
+    int fs_threads;
+    /* bytes per second of each large file sent, and of all of them, 0 for
+     * no limit, see egress.h */
+    long send_rate;
+    long egress_rate;
+    /* seconds a large file goes on without its client taking any of it */
+    int send_timeout;
+    /* per client limits as parsed from the `rate_limit_*` keys */
+    long rate_limit_requests;
+    long rate_limit_bytes;
+    int rate_limit_burst;
+    int rate_limit_action;
+    /* past these the server is overloaded, see overload.h, from the
+     * `overload_*` keys */
+    long overload_connections;
+    long overload_lag;
+    long overload_handshakes;
+    int overload_action;
+    /* files replacing the built-in pages, from the `error_page` keys */
+    char *error_page_paths[NB_ERROR_PAGES];
+    /* built by `config_prepare` out of the keys above */
+    struct ratelimit_limits rate_limit;
+    struct overload_limits overload;
+    /* every page, the built-in ones where no file was given */
+    struct error_page error_pages[NB_ERROR_PAGES];
+    /* the names of `vhosts`, built by `config_prepare` */
+    struct vhost_table vhost_table;
+    /* the routes served from memory, built by `config_prepare` */
+    struct router router;
+    /* mapped by `config_prepare` when pack_file is set */
+    struct pack pack;
+    /* holders of the snapshot, it is freed when the last one lets go */
+    int refs;
 };
 
-extern struct config CONFIG;
-
 enum KV_SPLIT_ERR {
     KV_NoKey = -1,
     KV_NoValue = -2,
@@ -26,15 +133,42 @@ enum KV_SPLIT_ERR {
  * Returns: < 0 on error, 0 otherwise*/
 int save_config(FILE *f);
 
+/* saves `config`, one that is not the published one, to `f`
+ * Returns: < 0 on error, 0 otherwise */
+int write_config(FILE *f, const struct config *config);
+
 /* returns a pointer to the last error the config encountered */
 const char *get_config_err(void);
 
-/* loads a config from `f`
+/* Parses `f` into a new snapshot, nothing is published
+ * Returns: the snapshot with one reference held, 0 on error
+ * if an error occurred, a string explaining the error can be get through
+ * `get_config_err` */
+struct config *config_parse(FILE *f);
+
+/* Checks that a parsed snapshot can be served and loads what it refers to
+ * Returns: < 0 on error (see `get_config_err`), 0 otherwise */
+int config_prepare(struct config *config);
+
+/* Snapshots are immutable once published, a connection holds on to the one
+ * it started with while reloads publish new ones.
+ * Returns: the published snapshot with a reference held for the caller */
+struct config *config_get(void);
+
+/* drops a reference taken by `config_get` or `config_parse` */
+void config_put(struct config *config);
+
+/* publishes `config`, taking over the caller's reference, the previous
+ * snapshot is freed once its last holder puts it */
+void config_publish(struct config *config);
+
+/* parses, prepares and publishes a config from `f`
  * Returns: < 0 on error, 0 otherwise
  * if an error occurred, a string explaining the error can be get through
  * `get_config_err` */
 int load_config(FILE *f);
 
+/* drops the published snapshot */
 void cleanup_config();
 
 #endif
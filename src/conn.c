@@ -1,7 +1,19 @@
 #include "conn.h"
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+/* glibc's netinet/tcp.h lacks the newer tcp_info fields */
+#include <linux/tcp.h>
+
+#include "trace.h"
 
 ssize_t SSL_writev(SSL *ssl, const struct iovec *iov, int iovcnt) {
     ssize_t size = 0;
@@ -20,52 +32,137 @@ void SSL_cleanup(SSL *ssl) {
     int fd = SSL_get_fd(ssl);
     SSL_shutdown(ssl);
     SSL_free(ssl);
-    close(fd);
+    /* no socket under an SSL on a custom BIO */
+    if(fd != -1) close(fd);
 }
 
-void conn_cleanup(struct conn *conn) {
-    switch(conn->type) {
-        case CONN_PLAIN:
-            close(conn->data.fd);
-            break;
-        case CONN_SSL:
-            SSL_cleanup(conn->data.ssl);
-            break;
+static ssize_t plain_read(struct conn *conn, void *buf, size_t size) {
+    return read(conn->data.fd, buf, size);
+}
+
+static ssize_t plain_write(struct conn *conn, const void *buf, size_t size) {
+    return write(conn->data.fd, buf, size);
+}
+
+static ssize_t plain_writev(struct conn *conn, const struct iovec *iov, size_t nbv) {
+    return writev(conn->data.fd, iov, nbv);
+}
+
+static int plain_init(struct conn *conn) {
+    return 1;
+}
+
+static void plain_cleanup(struct conn *conn) {
+    close(conn->data.fd);
+}
+
+static int plain_fd(struct conn *conn) {
+    return conn->data.fd;
+}
+
+static int plain_pending(struct conn *conn) {
+    /* nothing is buffered in userspace */
+    return 0;
+}
+
+/* Returns: 0 once `fd` is readable or hung up, -1 on error */
+static int fd_wait(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+    while(poll(&pfd, 1, -1) == -1) {
+        if(errno != EINTR) return -1;
     }
+    return 0;
+}
+
+static int plain_wait(struct conn *conn) {
+    return fd_wait(conn->data.fd);
+}
+
+static const struct conn_ops PLAIN_OPS = {
+    .read = plain_read,
+    .write = plain_write,
+    .writev = plain_writev,
+    .init = plain_init,
+    .cleanup = plain_cleanup,
+    .fd = plain_fd,
+    .pending = plain_pending,
+    .wait = plain_wait,
+};
+
+static ssize_t ssl_read(struct conn *conn, void *buf, size_t size) {
+    return SSL_read(conn->data.ssl, buf, (int)size);
+}
+
+static ssize_t ssl_write(struct conn *conn, const void *buf, size_t size) {
+    return SSL_write(conn->data.ssl, buf, (int)size);
+}
+
+static ssize_t ssl_writev(struct conn *conn, const struct iovec *iov, size_t nbv) {
+    return SSL_writev(conn->data.ssl, iov, nbv);
+}
+
+static int ssl_init(struct conn *conn) {
+    int ret;
+
+    PROBE(tls_handshake_start, SSL_get_fd(conn->data.ssl));
+    ret = SSL_accept(conn->data.ssl);
+    PROBE(tls_handshake_end, SSL_get_fd(conn->data.ssl), ret);
+    return ret;
+}
+
+static void ssl_cleanup(struct conn *conn) {
+    SSL_cleanup(conn->data.ssl);
+}
+
+static int ssl_fd(struct conn *conn) {
+    return SSL_get_fd(conn->data.ssl);
+}
+
+static int ssl_pending(struct conn *conn) {
+    /* records read off the socket but not decrypted yet count too */
+    return SSL_has_pending(conn->data.ssl);
+}
+
+static int ssl_wait(struct conn *conn) {
+    int fd = SSL_get_fd(conn->data.ssl);
+
+    /* over a custom BIO there is nothing to poll, the read blocks in it */
+    if(SSL_has_pending(conn->data.ssl) || fd == -1) return 0;
+    return fd_wait(fd);
+}
+
+static const struct conn_ops SSL_OPS = {
+    .read = ssl_read,
+    .write = ssl_write,
+    .writev = ssl_writev,
+    .init = ssl_init,
+    .cleanup = ssl_cleanup,
+    .fd = ssl_fd,
+    .pending = ssl_pending,
+    .wait = ssl_wait,
+};
+
+void conn_cleanup(struct conn *conn) {
+    PROBE(conn_closed, conn_fd(conn));
+    conn->ops->cleanup(conn);
 }
 
 ssize_t conn_read(struct conn *conn, void *buf, size_t size) {
-    switch(conn->type) {
-        case CONN_PLAIN:
-            return read(conn->data.fd, buf, size);
-        case CONN_SSL:
-            return SSL_read(conn->data.ssl, buf, (int)size);
-    }
-    return -1;
+    return conn->ops->read(conn, buf, size);
 }
 
 ssize_t conn_write(struct conn *conn, const void *buf, size_t size) {
-    switch(conn->type) {
-        case CONN_PLAIN:
-            return write(conn->data.fd, buf, size);
-        case CONN_SSL:
-            return SSL_write(conn->data.ssl, buf, (int)size);
-    }
-    return -1;
+    return conn->ops->write(conn, buf, size);
 }
 
 ssize_t conn_writev(struct conn *conn, const struct iovec *iov, size_t nbv) {
-    switch(conn->type) {
-        case CONN_PLAIN:
-            return writev(conn->data.fd, iov, nbv);
-        case CONN_SSL:
-            return SSL_writev(conn->data.ssl, iov, nbv);
-    }
-    return -1;
+    return conn->ops->writev(conn, iov, nbv);
 }
 
 int conn_new_fd(int fd, struct conn *conn) {
     conn->type = CONN_PLAIN;
+    conn->ops = &PLAIN_OPS;
     conn->data.fd = fd;
     return 0;
 }
@@ -74,6 +171,7 @@ int conn_ssl_to_conn_fd(struct conn *conn) {
     if(conn->type == CONN_SSL) {
         int fd;
         conn->type = CONN_PLAIN;
+        conn->ops = &PLAIN_OPS;
         fd = SSL_get_fd(conn->data.ssl);
         SSL_free(conn->data.ssl);
         conn->data.fd = fd;
@@ -84,36 +182,145 @@ int conn_ssl_to_conn_fd(struct conn *conn) {
 
 int conn_new_ssl(SSL *ssl, struct conn *conn) {
     conn->type = CONN_SSL;
+    conn->ops = &SSL_OPS;
     conn->data.ssl = ssl;
     return 0;
 }
 
+void conn_ctx_lean(SSL_CTX *ctx) {
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+}
+
 int conn_init(struct conn *conn) {
-    switch(conn->type) {
-        case CONN_PLAIN:
+    if(conn->handshake) return conn->handshake;
+    return conn->ops->init(conn);
+}
+
+int conn_fd(struct conn *conn) {
+    return conn->ops->fd(conn);
+}
+
+/* Returns: 1 if the first `bits` bits of `a` and `b` are the same */
+static int prefix_equal(const uint8_t *a, const uint8_t *b, int bits) {
+    int bytes = bits / 8;
+
+    if(memcmp(a, b, bytes)) return 0;
+    if(bits % 8) {
+        uint8_t mask = 0xff << (8 - bits % 8);
+        if((a[bytes] ^ b[bytes]) & mask) return 0;
+    }
+    return 1;
+}
+
+int peer_net_parse(const char *value, struct peer_net *net) {
+    char addr[INET6_ADDRSTRLEN];
+    const char *slash = strchr(value, '/');
+    size_t len = slash ? (size_t)(slash - value) : strlen(value);
+    uint8_t full[16];
+    int max;
+
+    if(len >= sizeof(addr)) return -1;
+    memcpy(addr, value, len);
+    addr[len] = '\0';
+    memset(net, 0, sizeof(*net));
+    if(inet_pton(AF_INET, addr, full) == 1) {
+        net->family = AF_INET;
+        max = 32;
+    }
+    else if(inet_pton(AF_INET6, addr, full) == 1) {
+        net->family = AF_INET6;
+        max = 128;
+    }
+    else {
+        return -1;
+    }
+    net->prefix_len = max;
+    if(slash) {
+        char *end;
+        long prefix_len;
+        if(slash[1] < '0' || slash[1] > '9') return -1;
+        prefix_len = strtol(slash + 1, &end, 10);
+        if(*end || prefix_len > max) return -1;
+        net->prefix_len = prefix_len;
+    }
+    /* `10.1.2.3/8` is `10.0.0.0/8` */
+    memcpy(net->addr, full, max / 8);
+    for(int bit = net->prefix_len; bit < max; bit++) {
+        net->addr[bit / 8] &= ~(0x80 >> bit % 8);
+    }
+    return 0;
+}
+
+void peer_net_format(const struct peer_net *net, char *out) {
+    char addr[INET6_ADDRSTRLEN] = "";
+
+    inet_ntop(net->family, net->addr, addr, sizeof(addr));
+    snprintf(out, PEER_NET_STR_SIZE, "%s/%d", addr, net->prefix_len);
+}
+
+int conn_peer_in(const struct conn *conn, const struct peer_net *nets, size_t nb_nets) {
+    const uint8_t *addr;
+    int family = conn->peer.ss_family;
+
+    if(family == AF_INET) {
+        addr = (const uint8_t*)&((const struct sockaddr_in*)&conn->peer)->sin_addr;
+    }
+    else if(family == AF_INET6) {
+        const struct in6_addr *addr6 = &((const struct sockaddr_in6*)&conn->peer)->sin6_addr;
+        addr = addr6->s6_addr;
+        /* an IPv4 client of a dual stack listener */
+        if(IN6_IS_ADDR_V4MAPPED(addr6)) {
+            family = AF_INET;
+            addr += 12;
+        }
+    }
+    else {
+        return 0;
+    }
+    for(size_t i = 0; i < nb_nets; i++) {
+        if(nets[i].family == family && prefix_equal(addr, nets[i].addr, nets[i].prefix_len)) {
             return 1;
-        case CONN_SSL:
-            return SSL_accept(conn->data.ssl);
+        }
     }
     return 0;
 }
 
+int conn_pending(struct conn *conn) {
+    return conn->ops->pending(conn);
+}
+
+int conn_wait(struct conn *conn) {
+    return conn->ops->wait(conn);
+}
+
+uint64_t conn_bytes_acked(struct conn *conn) {
+    struct tcp_info info = {0};
+    socklen_t len = sizeof(info);
+
+    if(getsockopt(conn_fd(conn), IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return 0;
+    }
+    /* older kernels fill less of the struct */
+    if(len < offsetof(struct tcp_info, tcpi_bytes_acked)
+            + sizeof(info.tcpi_bytes_acked)) {
+        return 0;
+    }
+    return info.tcpi_bytes_acked;
+}
+
+int conn_cork(struct conn *conn, int on) {
+    return setsockopt(conn_fd(conn), IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
 /* flushed the socket's buffer
  * Returns 0 on success and an err code otherwise */
 int conn_flush(struct conn *conn) {
     char buf[20];
     int flags;
-    int fd = -1;
+    int fd;
     int ret;
 
-    switch(conn->type) {
-        case CONN_PLAIN:
-            fd = conn->data.fd;
-        break;
-        case CONN_SSL:
-            fd = SSL_get_fd(conn->data.ssl);
-        break;
-    }
+    fd = conn_fd(conn);
     if(fd < 0) return EINVAL;
     /* set non-blocking */
     flags = fcntl(fd, F_GETFL, 0);
@@ -1,7 +1,10 @@
 #ifndef CONN_H
 #define CONN_H 1
 
+#include <stdint.h>
+#include <netinet/in.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <openssl/ssl.h>
 
 /* like writev but on an ssl rather than a raw fd */
@@ -15,6 +18,8 @@ void SSL_cleanup(SSL *ssl);
 enum conn_type {
     CONN_PLAIN,
     CONN_SSL,
+    /* a `struct mem_pipe`, see mem_conn.h */
+    CONN_MEM,
 };
 
 enum state {
@@ -23,13 +28,52 @@ enum state {
     WANT_WRITE,
 };
 
+struct conn;
+
+/* a network clients may come from, see `conn_peer_in` */
+struct peer_net {
+    int family;
+    /* in network order, the bits past `prefix_len` are zero */
+    uint8_t addr[16];
+    int prefix_len;
+};
+
+/* what `peer_net_format` writes at most, the nul included */
+#define PEER_NET_STR_SIZE (INET6_ADDRSTRLEN + 4)
+
+/* what a transport implements, the `conn_*` functions below go through it */
+struct conn_ops {
+    ssize_t (*read)(struct conn *conn, void *buf, size_t size);
+    ssize_t (*write)(struct conn *conn, const void *buf, size_t size);
+    ssize_t (*writev)(struct conn *conn, const struct iovec *iov, size_t nbv);
+    /* see `conn_init` */
+    int (*init)(struct conn *conn);
+    void (*cleanup)(struct conn *conn);
+    /* Returns: the socket under the transport, -1 if there is none */
+    int (*fd)(struct conn *conn);
+    /* see `conn_pending` */
+    int (*pending)(struct conn *conn);
+    /* see `conn_wait` */
+    int (*wait)(struct conn *conn);
+};
+
 struct conn {
     enum conn_type type;
     enum state state;
+    const struct conn_ops *ops;
     union {
         SSL *ssl;
         int fd;
+        struct mem_pipe *pipe;
     } data;
+    /* the client, as returned by accept */
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    /* the result of a handshake done ahead of `conn_init`, 0 if none was */
+    int handshake;
+    /* the request this connection opens was already let through by the
+     * rate limiter, before its handshake */
+    int rate_taken;
 };
 
 void conn_cleanup(struct conn *conn);
@@ -44,7 +88,12 @@ int conn_new_ssl(SSL *ssl, struct conn *conn);
 
 int conn_ssl_to_conn_fd(struct conn *conn);
 
-/* performs handshake if the connection is ssl
+/* Sets up `ctx` so that its idle connections keep as little memory as
+ * possible, the read and write buffers go back to the allocator between
+ * records */
+void conn_ctx_lean(SSL_CTX *ctx);
+
+/* performs handshake if the connection is ssl, unless it was already
  * Returns
  * 1 on success
  * <=0 on failure */
@@ -52,6 +101,40 @@ int conn_init(struct conn *conn);
 
 ssize_t conn_writev(struct conn *conn, const struct iovec *iov, size_t nbv);
 
+/* Returns: the socket under `conn`, -1 if its transport has none */
+int conn_fd(struct conn *conn);
+
+/* Parses `value`, an IPv4 or IPv6 address followed by an optional
+ * `/<prefix length>`, into `net`
+ * Returns: 0 on success, -1 if it is not one */
+int peer_net_parse(const char *value, struct peer_net *net);
+
+/* writes `net` into `out` of PEER_NET_STR_SIZE bytes, as parsed */
+void peer_net_format(const struct peer_net *net, char *out);
+
+/* Returns: 1 if the client of `conn` is in one of the `nb_nets` `nets`, 0
+ *  otherwise. A client over the unix socket never is, it can be anyone a
+ *  proxy on this machine forwards */
+int conn_peer_in(const struct conn *conn, const struct peer_net *nets, size_t nb_nets);
+
+/* Returns: 1 if bytes already received can be read without blocking */
+int conn_pending(struct conn *conn);
+
+/* Blocks until the client of `conn` sent something or went away, so that
+ * buffers are only taken for a read that has data to put in them
+ * Returns: 0 once a read would not block, -1 if the client is gone or on
+ *  error */
+int conn_wait(struct conn *conn);
+
+/* Returns: the bytes sent on `conn` that the client acknowledged, 0 if the
+ * kernel cannot tell */
+uint64_t conn_bytes_acked(struct conn *conn);
+
+/* Holds partial segments back while `on` is set so that a response's
+ * header and body go out in full packets, clearing it pushes what is held
+ * Returns: 0 on success, -1 on error */
+int conn_cork(struct conn *conn, int on);
+
 /* flushed the socket's buffer
  * Returns 0 on success and an err code otherwise */
 int conn_flush(struct conn *conn);
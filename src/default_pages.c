@@ -17,7 +17,7 @@ const char I_AM_A_TEAPOT[] = (
             "</body>"
         "</html>"
 );
-const size_t I_AM_A_TEAPOT_LEN = sizeof(I_AM_A_TEAPOT);
+const size_t I_AM_A_TEAPOT_LEN = sizeof(I_AM_A_TEAPOT) - 1;
 
 const char NOT_FOUND_PAGE[] = (
     "<!DOCTYPE html>"
@@ -31,7 +31,7 @@ const char NOT_FOUND_PAGE[] = (
             "</body>"
         "</html>"
 );
-const size_t NOT_FOUND_PAGE_LEN = sizeof(NOT_FOUND_PAGE);
+const size_t NOT_FOUND_PAGE_LEN = sizeof(NOT_FOUND_PAGE) - 1;
 
 const char UNIMPLEMENTED_PAGE[] = (
     "<!DOCTYPE html>"
@@ -40,12 +40,12 @@ const char UNIMPLEMENTED_PAGE[] = (
                 "<title>405</title>"
             "</head>"
             "<body>"
-                "<h1>UNIMPLEMENTED</h1>"
-                "<p>this server only implements http GET</p>"
+                "<h1>METHOD NOT ALLOWED</h1>"
+                "<p>this server only implements http GET, HEAD and OPTIONS</p>"
             "</body>"
         "</html>"
 );
-const size_t UNIMPLEMENTED_PAGE_LEN = sizeof(UNIMPLEMENTED_PAGE);
+const size_t UNIMPLEMENTED_PAGE_LEN = sizeof(UNIMPLEMENTED_PAGE) - 1;
 
 const char SERVER_ERROR_PAGE[] = (
     "<!DOCTYPE html>"
@@ -59,7 +59,7 @@ const char SERVER_ERROR_PAGE[] = (
             "</body>"
         "</html>"
 );
-const size_t SERVER_ERROR_PAGE_LEN = sizeof(SERVER_ERROR_PAGE);
+const size_t SERVER_ERROR_PAGE_LEN = sizeof(SERVER_ERROR_PAGE) - 1;
 
 const char UPGRADE_REQUIRED_PAGE[] = (
     "<!DOCTYPE html>"
@@ -73,4 +73,4 @@ const char UPGRADE_REQUIRED_PAGE[] = (
             "</body>"
         "</html>"
 );
-const size_t UPGRADE_REQUIRED_PAGE_LEN = sizeof(UPGRADE_REQUIRED_PAGE);
+const size_t UPGRADE_REQUIRED_PAGE_LEN = sizeof(UPGRADE_REQUIRED_PAGE) - 1;
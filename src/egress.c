@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include "egress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "file_map.h"
+#include "logging.h"
+#include "trace.h"
+
+struct egress_send {
+    struct conn conn;
+    int fd;
+    int file;
+    off_t offset;
+    size_t left;
+    size_t sent;
+    /* the file of a TLS connection without kTLS, written out of */
+    struct file_map *map;
+    /* the length of a TLS write that has to be repeated as is, 0 if none */
+    size_t retry;
+    struct timespec start;
+    /* when it last sent something, or was held back by a rate limit */
+    struct timespec progress;
+    /* 1 once sent whole, -1 once cut short, the transfer is then ended
+     * at the end of the turn */
+    int over;
+    egress_done done;
+    void *data;
+};
+
+/* served from the select loop alone, no lock */
+static struct egress_send SENDS[EGRESS_MAX_SENDS];
+static size_t NB_SENDS = 0;
+
+static int STARTED = 0;
+static uint64_t CONN_RATE = 0;
+static uint64_t TOTAL_RATE = 0;
+static unsigned TIMEOUT = DEFAULT_SEND_TIMEOUT;
+
+/* bytes every transfer together can still send, refilled at TOTAL_RATE up to
+ * a second worth of it */
+static double TOTAL_TOKENS = 0;
+static struct timespec REFILLED = {0};
+
+static struct egress_stats STATS = {0};
+
+static double seconds_between(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void refill(const struct timespec *now) {
+    if(!TOTAL_RATE) return;
+    TOTAL_TOKENS += seconds_between(&REFILLED, now) * TOTAL_RATE;
+    if(TOTAL_TOKENS > TOTAL_RATE) TOTAL_TOKENS = TOTAL_RATE;
+    REFILLED = *now;
+}
+
+void egress_start(uint64_t conn_rate, uint64_t total_rate, unsigned timeout) {
+    if(!STARTED || total_rate != TOTAL_RATE) {
+        clock_gettime(CLOCK_MONOTONIC, &REFILLED);
+        TOTAL_TOKENS = total_rate;
+    }
+    CONN_RATE = conn_rate;
+    TOTAL_RATE = total_rate;
+    TIMEOUT = timeout;
+    STARTED = 1;
+}
+
+int egress_room(struct conn *conn) {
+    int fd;
+
+    if(!STARTED || NB_SENDS == EGRESS_MAX_SENDS || conn->type == CONN_MEM) return 0;
+    fd = conn_fd(conn);
+    return fd >= 0 && fd < FD_SETSIZE;
+}
+
+/* Returns: 0 on success, -1 on error */
+static int set_blocking(int fd, int blocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if(flags == -1) return -1;
+    flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+    return fcntl(fd, F_SETFL, flags);
+}
+
+int egress_submit(
+        struct conn *conn,
+        int file,
+        size_t count,
+        egress_done done,
+        void *data) {
+    struct egress_send *send = SENDS + NB_SENDS;
+    struct file_map *map = 0;
+    off_t offset;
+    int fd;
+
+    if(!egress_room(conn)) return -1;
+    fd = conn_fd(conn);
+    offset = lseek(file, 0, SEEK_CUR);
+    if(offset < 0) return -1;
+
+    if(conn->type == CONN_SSL) {
+        SSL *ssl = conn->data.ssl;
+        int ktls = 0;
+
+#ifndef OPENSSL_NO_KTLS
+        ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#endif
+        if(!ktls) {
+            struct stat st;
+            if(fstat(file, &st) == -1 || (size_t)offset + count > (size_t)st.st_size) {
+                return -1;
+            }
+            map = file_map_get(file, &st);
+            if(!map) {
+                logging_errno(ERR, "mmap: ");
+                return -1;
+            }
+        }
+        /* a turn sends what fits, a record at a time */
+        SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE);
+    }
+    if(set_blocking(fd, 0)) {
+        if(map) file_map_put(map);
+        return -1;
+    }
+
+    memset(send, 0, sizeof(*send));
+    send->conn = *conn;
+    send->fd = fd;
+    send->file = file;
+    send->offset = offset;
+    send->left = count;
+    send->map = map;
+    send->done = done;
+    send->data = data;
+    clock_gettime(CLOCK_MONOTONIC, &send->start);
+    send->progress = send->start;
+    NB_SENDS++;
+    PROBE(send_start, file, count);
+
+    STATS.submitted++;
+    STATS.active = NB_SENDS;
+    if(NB_SENDS > STATS.max_active) STATS.max_active = NB_SENDS;
+    return 0;
+}
+
+/* Returns: the bytes `send` can send in its turn, 0 if a rate limit holds it
+ * back, `*wait` is then how many seconds for */
+static size_t allowance(
+        const struct egress_send *send,
+        const struct timespec *now,
+        double *wait) {
+    size_t bytes = send->left < EGRESS_QUANTUM ? send->left : EGRESS_QUANTUM;
+
+    /* nothing went out of it yet, it was already allowed */
+    if(send->retry) return send->retry;
+    if(CONN_RATE) {
+        double due = (double)send->sent / CONN_RATE - seconds_between(&send->start, now);
+        if(due > 0) {
+            *wait = due;
+            return 0;
+        }
+        if(bytes > CONN_RATE) bytes = CONN_RATE;
+    }
+    if(TOTAL_RATE) {
+        if(TOTAL_TOKENS < 1) {
+            *wait = (1 - TOTAL_TOKENS) / TOTAL_RATE;
+            return 0;
+        }
+        if(bytes > TOTAL_TOKENS) bytes = TOTAL_TOKENS;
+    }
+    return bytes;
+}
+
+/* Sends up to `bytes` of `send` without blocking
+ * Returns: the bytes sent, 0 if the socket is full, -1 on error */
+static ssize_t turn(struct egress_send *send, size_t bytes) {
+    SSL *ssl = send->conn.data.ssl;
+    sigjmp_buf jmp;
+    ssize_t ret;
+
+    if(send->conn.type != CONN_SSL) {
+        ret = sendfile(send->fd, send->file, &send->offset, bytes);
+        if(ret < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        return ret;
+    }
+
+    if(!send->map) {
+#ifndef OPENSSL_NO_KTLS
+        ret = SSL_sendfile(ssl, send->file, send->offset, bytes, 0);
+        if(ret <= 0) return SSL_get_error(ssl, ret) == SSL_ERROR_WANT_WRITE ? 0 : -1;
+        send->offset += ret;
+        return ret;
+#else
+        return -1;
+#endif
+    }
+
+    if(sigsetjmp(jmp, 1)) {
+        /* the file shrunk under us, see `send_mapped_file` */
+        logging(WARN, "file truncated while being sent, %zu bytes sent", send->sent);
+        file_map_invalidate(send->map);
+        SSL_set_quiet_shutdown(ssl, 1);
+        return -1;
+    }
+    file_map_guard(&jmp);
+    ret = SSL_write(ssl, (const char*)send->map->data + send->offset, bytes);
+    file_map_unguard();
+    if(ret <= 0) {
+        if(SSL_get_error(ssl, ret) != SSL_ERROR_WANT_WRITE) return -1;
+        /* the record is half written, it goes on with the same bytes */
+        send->retry = bytes;
+        return 0;
+    }
+    send->retry = 0;
+    send->offset += ret;
+    return ret;
+}
+
+static void finish(struct egress_send *send);
+
+int egress_fds(fd_set *w, struct timeval *timeout) {
+    double soonest = timeout->tv_sec + timeout->tv_usec / 1e6;
+    struct timespec now;
+    int max = -1;
+
+    if(!NB_SENDS) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    refill(&now);
+    /* a client that stopped reading would hold its slot forever */
+    for(size_t i = NB_SENDS; TIMEOUT && i > 0; i--) {
+        struct egress_send *send = SENDS + i - 1;
+        double idle = seconds_between(&send->progress, &now);
+
+        if(idle <= TIMEOUT) {
+            /* woken up in time to cut it short */
+            if(TIMEOUT - idle < soonest) soonest = TIMEOUT - idle;
+            continue;
+        }
+        logging(DEBUG, "large file stalled, %zu bytes sent, cutting it short", send->sent);
+        STATS.stalled++;
+        send->over = -1;
+        finish(send);
+    }
+    for(size_t i = 0; i < NB_SENDS; i++) {
+        double wait = 0;
+
+        if(!allowance(SENDS + i, &now, &wait)) {
+            /* held back by us, not by the client */
+            SENDS[i].progress = now;
+            STATS.throttled++;
+            if(wait < soonest) soonest = wait;
+            continue;
+        }
+        FD_SET(SENDS[i].fd, w);
+        if(SENDS[i].fd > max) max = SENDS[i].fd;
+    }
+    /* rounded up, select would come back a little early otherwise */
+    timeout->tv_sec = soonest;
+    timeout->tv_usec = (soonest - timeout->tv_sec) * 1e6 + 1;
+    if(timeout->tv_usec >= 1000000) {
+        timeout->tv_sec++;
+        timeout->tv_usec -= 1000000;
+    }
+    return max;
+}
+
+static int by_left(const void *a, const void *b) {
+    size_t left_a = SENDS[*(const size_t*)a].left;
+    size_t left_b = SENDS[*(const size_t*)b].left;
+
+    return left_a < left_b ? -1 : left_a > left_b;
+}
+
+/* Hands the connection of `send` back, the last transfer takes its place */
+static void finish(struct egress_send *send) {
+    struct conn conn = send->conn;
+    egress_done done = send->done;
+    void *data = send->data;
+
+    if(send->over > 0) STATS.completed++;
+    else STATS.failed++;
+    PROBE(send_end, send->file, send->over > 0 ? (ssize_t)send->sent : -1);
+    /* as the connection was before it was handed over */
+    set_blocking(send->fd, 1);
+    close(send->file);
+    if(send->map) file_map_put(send->map);
+    *send = SENDS[--NB_SENDS];
+    STATS.active = NB_SENDS;
+    done(&conn, data);
+}
+
+void egress_run(const fd_set *w) {
+    size_t order[EGRESS_MAX_SENDS];
+    size_t nb_ready = 0;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    refill(&now);
+    for(size_t i = 0; i < NB_SENDS; i++) {
+        if(FD_ISSET(SENDS[i].fd, w)) order[nb_ready++] = i;
+    }
+    /* the shortest transfers are done with first */
+    qsort(order, nb_ready, sizeof(*order), by_left);
+
+    for(size_t i = 0; i < nb_ready; i++) {
+        struct egress_send *send = SENDS + order[i];
+        double wait;
+        size_t bytes = allowance(send, &now, &wait);
+        ssize_t ret;
+
+        if(!bytes) {
+            STATS.throttled++;
+            continue;
+        }
+        STATS.turns++;
+        ret = turn(send, bytes);
+        if(ret < 0) {
+            send->over = -1;
+            continue;
+        }
+        if(ret) send->progress = now;
+        send->left -= ret;
+        send->sent += ret;
+        STATS.bytes += ret;
+        if(TOTAL_RATE) TOTAL_TOKENS -= ret;
+        if(!send->left) send->over = 1;
+    }
+
+    for(size_t i = NB_SENDS; i > 0; i--) {
+        if(SENDS[i - 1].over) finish(SENDS + i - 1);
+    }
+}
+
+void egress_stats(struct egress_stats *stats) {
+    *stats = STATS;
+}
+
+void egress_stop(void) {
+    while(NB_SENDS) {
+        SENDS[NB_SENDS - 1].over = -1;
+        finish(SENDS + NB_SENDS - 1);
+    }
+    STARTED = 0;
+}
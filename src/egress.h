@@ -0,0 +1,78 @@
+#ifndef EGRESS_H
+#define EGRESS_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "conn.h"
+
+/* bytes a transfer sends in a turn before the next one gets its own, files
+ * up to this size are sent in one go */
+#define EGRESS_QUANTUM (64 * 1024)
+
+/* seconds a transfer can go without sending anything while its turn is
+ * due, past it the client is taken to be gone */
+#define DEFAULT_SEND_TIMEOUT 30
+
+/* transfers taking turns at once, past it files are sent in one go */
+#define EGRESS_MAX_SENDS 256
+
+/* called once a transfer is over, sent or not, `conn` is the caller's
+ * again and is still to be cleaned up */
+typedef void (*egress_done)(struct conn *conn, void *data);
+
+struct egress_stats {
+    /* handed over, then sent whole or cut short */
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t failed;
+    /* of the failed, dropped for making no progress */
+    uint64_t stalled;
+    /* turns given, and the times a rate limit left a transfer out */
+    uint64_t turns;
+    uint64_t throttled;
+    uint64_t bytes;
+    /* taking turns right now, and at most */
+    size_t active;
+    size_t max_active;
+};
+
+/* Starts taking transfers, `conn_rate` caps each one and `total_rate` all of
+ * them together, in bytes per second, 0 for no limit. A transfer whose
+ * client takes nothing for `timeout` seconds is cut short, 0 waits on it
+ * forever. Called again, only the limits change. */
+void egress_start(uint64_t conn_rate, uint64_t total_rate, unsigned timeout);
+
+/* Returns: 1 if `egress_submit` would take a transfer on `conn` */
+int egress_room(struct conn *conn);
+
+/* Sends `count` bytes of `file`, from its offset, over `conn` whose header
+ * is already sent, in turns with the other transfers. `file` is closed
+ * once done and `done` called with `data`.
+ * Returns: 0 if the transfer is taken, -1 if the caller is left with it,
+ *  see `egress_room` */
+int egress_submit(
+        struct conn *conn,
+        int file,
+        size_t count,
+        egress_done done,
+        void *data);
+
+/* Adds the sockets of the transfers waiting for their turn to `w`, a
+ * transfer held back by a rate limit lowers `timeout` to when it can go on.
+ * The transfers past their deadline are cut short first.
+ * Returns: the highest descriptor added, -1 if none */
+int egress_fds(fd_set *w, struct timeval *timeout);
+
+/* Gives a turn to every transfer whose socket is set in `w`, the ones with
+ * the fewest bytes left first */
+void egress_run(const fd_set *w);
+
+void egress_stats(struct egress_stats *stats);
+
+/* ends the transfers left, the connections are handed to their `done` */
+void egress_stop(void);
+
+#endif
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include "endpoints.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "error_page.h"
+#include "logging.h"
+#include "pathfilter.h"
+#include "handshake.h"
+#include "bufpool.h"
+#include "egress.h"
+#include "fspool.h"
+#include "overload.h"
+
+/* the status page fits in this */
+#define STATUS_PAGE_SIZE 4096
+
+/* the status page's path is followed by this for the echo of the config */
+#define CONFIG_ECHO_SUFFIX "/config"
+
+/* uptime is counted from the first config */
+static struct timespec STARTED = {0};
+
+int redirect_parse(const char *value, struct redirect *redirect) {
+    const char *to = strchr(value, ' ');
+
+    memset(redirect, 0, sizeof(*redirect));
+    /* the path is compared as sent */
+    if(value[0] != '/' || !to || memchr(value, '?', to - value)) return -1;
+    while(*to == ' ') to++;
+    if(!*to || strpbrk(to, " \t\r\n")) return -1;
+
+    redirect->from = strndup(value, strchr(value, ' ') - value);
+    redirect->to = strdup(to);
+    if(!redirect->from || !redirect->to) {
+        redirect_cleanup(redirect);
+        return -1;
+    }
+    return 0;
+}
+
+void redirect_cleanup(struct redirect *redirect) {
+    free(redirect->from);
+    free(redirect->to);
+    memset(redirect, 0, sizeof(*redirect));
+}
+
+/* the very important teapot */
+static int teapot(
+        const struct route_request *request,
+        struct route_response *response,
+        void *data) {
+    response->error_page = ERROR_PAGE_418;
+    return 0;
+}
+
+static int redirect(
+        const struct route_request *request,
+        struct route_response *response,
+        void *data) {
+    const struct redirect *redirect = data;
+
+    response->status = 308;
+    response->reason = "Permanent Redirect";
+    response->location = redirect->to;
+    return 0;
+}
+
+static int status(
+        const struct route_request *request,
+        struct route_response *response,
+        void *data) {
+    const struct config *config = data;
+    struct pathfilter_stats filter;
+    struct handshake_stats handshakes;
+    struct bufpool_stats buffers;
+    struct egress_stats egress;
+    struct fspool_stats fs;
+    struct overload_stats overload;
+    struct timespec now;
+    char *page;
+    int len;
+
+    /* as if there was nothing there */
+    if(!request->trusted) {
+        response->error_page = ERROR_PAGE_404;
+        return 0;
+    }
+    page = malloc(STATUS_PAGE_SIZE);
+    if(!page) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pathfilter_stats(&filter);
+    handshake_stats(&handshakes);
+    bufpool_stats(&buffers);
+    egress_stats(&egress);
+    fspool_stats(&fs);
+    overload_stats(&overload);
+
+    len = snprintf(page, STATUS_PAGE_SIZE,
+            "pid: %d\n"
+            "uptime: %lld\n"
+            "proxy routes: %zu\n"
+            "fastcgi routes: %zu\n"
+            "path filter lookups: %llu\n"
+            "path filter misses: %llu\n"
+            "path filter false positives: %llu\n"
+            "path filter entries: %llu\n"
+            "path filter rebuilds: %llu\n"
+            "handshake threads: %d\n"
+            "handshakes queued: %llu\n"
+            "handshakes done while serving: %llu\n"
+            "handshakes failed: %llu\n"
+            "handshakes waiting: %llu\n"
+            "handshakes waiting at most: %llu\n"
+            "handshake wait us: %llu\n"
+            "handshake time us: %llu\n"
+            "handshake latency us at most: %llu\n"
+            "request buffers in use: %zu\n"
+            "request buffers free: %zu\n"
+            "large files sending: %zu\n"
+            "large files sending at most: %zu\n"
+            "large files sent: %llu\n"
+            "large files cut short: %llu\n"
+            "large files stalled: %llu\n"
+            "large file turns: %llu\n"
+            "large file turns held back: %llu\n"
+            "large file bytes: %llu\n"
+            "file system threads: %d\n"
+            "files looked up by threads: %llu\n"
+            "files in the page cache: %llu\n"
+            "files looked up while serving: %llu\n"
+            "files read ahead: %llu\n"
+            "file lookups waiting: %llu\n"
+            "file lookup us at most: %llu\n"
+            "overloaded: %d\n"
+            "overload episodes: %llu\n"
+            "overload connections: %llu\n"
+            "overload lag us: %llu\n"
+            "overload lag us at most: %llu\n"
+            "connections shed: %llu\n"
+            "connections dropped: %llu\n",
+            (int)getpid(),
+            (long long)(now.tv_sec - STARTED.tv_sec),
+            config->nb_proxies,
+            config->nb_fastcgi,
+            (unsigned long long)filter.lookups,
+            (unsigned long long)filter.misses,
+            (unsigned long long)filter.false_positives,
+            (unsigned long long)filter.entries,
+            (unsigned long long)filter.rebuilds,
+            config->handshake_threads,
+            (unsigned long long)handshakes.queued,
+            (unsigned long long)handshakes.overflowed,
+            (unsigned long long)handshakes.failed,
+            (unsigned long long)handshakes.depth,
+            (unsigned long long)handshakes.max_depth,
+            (unsigned long long)(handshakes.wait_ns / 1000),
+            (unsigned long long)(handshakes.handshake_ns / 1000),
+            (unsigned long long)(handshakes.max_latency_ns / 1000),
+            buffers.in_use,
+            buffers.free,
+            egress.active,
+            egress.max_active,
+            (unsigned long long)egress.completed,
+            (unsigned long long)egress.failed,
+            (unsigned long long)egress.stalled,
+            (unsigned long long)egress.turns,
+            (unsigned long long)egress.throttled,
+            (unsigned long long)egress.bytes,
+            config->fs_threads,
+            (unsigned long long)fs.queued,
+            (unsigned long long)fs.resident,
+            (unsigned long long)(fs.hot + fs.overflowed),
+            (unsigned long long)fs.readahead,
+            (unsigned long long)fs.depth,
+            (unsigned long long)(fs.max_latency_ns / 1000),
+            overload.overloaded,
+            (unsigned long long)overload.episodes,
+            (unsigned long long)overload.connections,
+            (unsigned long long)overload.lag_us,
+            (unsigned long long)overload.max_lag_us,
+            (unsigned long long)overload.shed,
+            (unsigned long long)overload.dropped);
+    if(len < 0 || len >= STATUS_PAGE_SIZE) {
+        free(page);
+        return -1;
+    }
+    response->type = "text/plain";
+    response->owned = page;
+    response->body = page;
+    response->body_len = len;
+    return 0;
+}
+
+/* the config the request is served with, in the format it is read in */
+static int config_echo(
+        const struct route_request *request,
+        struct route_response *response,
+        void *data) {
+    const struct config *config = data;
+    char *page = 0;
+    size_t len = 0;
+    FILE *f;
+
+    /* paths, upstreams and commands are not for everyone to see */
+    if(!request->trusted) {
+        response->error_page = ERROR_PAGE_404;
+        return 0;
+    }
+    f = open_memstream(&page, &len);
+    if(!f) return -1;
+    if(write_config(f, config) < 0) {
+        fclose(f);
+        free(page);
+        return -1;
+    }
+    if(fclose(f)) {
+        free(page);
+        return -1;
+    }
+    response->type = "text/plain";
+    response->owned = page;
+    response->body = page;
+    response->body_len = len;
+    return 0;
+}
+
+int endpoints_register(struct router *router, struct config *config) {
+    char path[PATH_MAX];
+
+    if(!STARTED.tv_sec && !STARTED.tv_nsec) {
+        clock_gettime(CLOCK_MONOTONIC, &STARTED);
+    }
+
+    if(router_add(router, "/teapot", 0, ROUTE_METHOD(GET), teapot, 0)) return -1;
+
+    /* every method is redirected, a 308 keeps it */
+    for(size_t i = 0; i < config->nb_redirects; i++) {
+        if(router_add(router, config->redirects[i].from, 0, ROUTE_ANY_METHOD,
+                    redirect, config->redirects + i)) {
+            logging(ERR, "`%s` already has a route", config->redirects[i].from);
+            return -1;
+        }
+    }
+
+    if(config->status_path) {
+        if(router_add(router, config->status_path, 0, ROUTE_METHOD(GET),
+                    status, config)) {
+            logging(ERR, "`%s` already has a route", config->status_path);
+            return -1;
+        }
+        if(snprintf(path, sizeof(path), "%s"CONFIG_ECHO_SUFFIX, config->status_path)
+                    >= (int)sizeof(path)
+                || router_add(router, path, 0, ROUTE_METHOD(GET), config_echo, config)) {
+            logging(ERR, "`%s` already has a route", path);
+            return -1;
+        }
+    }
+    return 0;
+}
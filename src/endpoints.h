@@ -0,0 +1,26 @@
+#ifndef ENDPOINTS_H
+#define ENDPOINTS_H 1
+
+#include "router.h"
+
+struct config;
+
+/* a `redirect` key, answered with a 308 */
+struct redirect {
+    char *from;
+    char *to;
+};
+
+/* Parses `<path> <location>` into `redirect`
+ * Returns: 0 on success, -1 on error */
+int redirect_parse(const char *value, struct redirect *redirect);
+
+void redirect_cleanup(struct redirect *redirect);
+
+/* Adds the routes served from memory to `router`: /teapot, the redirects of
+ * `config` and, when it has a status_path, the status page and the echo of
+ * the config under it, both only served to clients on this machine
+ * Returns: 0 on success, -1 on error or if two of them share a path */
+int endpoints_register(struct router *router, struct config *config);
+
+#endif
@@ -0,0 +1,162 @@
+#include "error_page.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "default_pages.h"
+#include "headers.h"
+#include "logging.h"
+
+/* room for the status line and headers in front of a body */
+#define ERROR_PAGE_HEAD_SIZE 256
+
+/* the built-in pages with their headers fit in this */
+#define ERROR_PAGE_DEFAULT_SIZE 1024
+
+static const struct {
+    int status;
+    const char *reason;
+    /* each ending in a CRLF */
+    const char *headers;
+    const char *body;
+} ERROR_PAGES[NB_ERROR_PAGES] = {
+    /* a request whose body can't be told apart from the next request */
+    [ERROR_PAGE_400] = {400, "Bad Request", "", ""},
+    [ERROR_PAGE_404] = {404, "Not Found", "", NOT_FOUND_PAGE},
+    [ERROR_PAGE_405] = {
+        405,
+        "Method Not Allowed",
+        "Allow: "ALLOWED_METHODS CRLF,
+        UNIMPLEMENTED_PAGE,
+    },
+    /* FastCGI's, apps want the length of a body up front */
+    [ERROR_PAGE_411] = {411, "Length Required", "", ""},
+    [ERROR_PAGE_418] = {418, "I'm a teapot", "", I_AM_A_TEAPOT},
+    /* TLS is the only upgrade this server knows */
+    [ERROR_PAGE_426] = {
+        426,
+        "Upgrade Required",
+        "Upgrade: TLS/1.2, HTTP/1.1"CRLF "Connection: Upgrade"CRLF,
+        UPGRADE_REQUIRED_PAGE,
+    },
+    [ERROR_PAGE_431] = {431, "Request Header Fields Too Large", "", ""},
+    [ERROR_PAGE_500] = {500, "Internal Server Error", "", SERVER_ERROR_PAGE},
+    [ERROR_PAGE_502] = {502, "Bad Gateway", "", SERVER_ERROR_PAGE},
+};
+
+static char DEFAULT_DATA[NB_ERROR_PAGES][ERROR_PAGE_DEFAULT_SIZE];
+
+static struct error_page DEFAULTS[NB_ERROR_PAGES];
+
+static pthread_once_t DEFAULTS_ONCE = PTHREAD_ONCE_INIT;
+
+/* Writes the status line and headers of `kind` for a body of `body_len`
+ * into `buff`
+ * Returns: the length written, -1 if it does not fit */
+static int head_write(enum error_page_kind kind, size_t body_len, char *buff, size_t size) {
+    int ret = snprintf(buff, size,
+            "HTTP/1.1 %d %s"CRLF
+            "Content-Type: text/html"CRLF
+            "Content-Length: %zu"CRLF
+            "%s"
+            CRLF,
+            ERROR_PAGES[kind].status,
+            ERROR_PAGES[kind].reason,
+            body_len,
+            ERROR_PAGES[kind].headers);
+    if(ret < 0 || (size_t)ret >= size) return -1;
+    return ret;
+}
+
+static void defaults_build(void) {
+    for(int i = 0; i < NB_ERROR_PAGES; i++) {
+        size_t body_len = strlen(ERROR_PAGES[i].body);
+        int head_len = head_write(i, body_len, DEFAULT_DATA[i], ERROR_PAGE_DEFAULT_SIZE);
+
+        if(head_len < 0 || head_len + body_len > ERROR_PAGE_DEFAULT_SIZE) {
+            /* only a longer built-in page gets here */
+            logging(ERR, "the built-in %d page does not fit", ERROR_PAGES[i].status);
+            head_len = 0;
+            body_len = 0;
+        }
+        memcpy(DEFAULT_DATA[i] + head_len, ERROR_PAGES[i].body, body_len);
+        DEFAULTS[i].status = ERROR_PAGES[i].status;
+        DEFAULTS[i].data = DEFAULT_DATA[i];
+        DEFAULTS[i].len = head_len + body_len;
+        DEFAULTS[i].head_len = head_len;
+        DEFAULTS[i].owned = 0;
+    }
+}
+
+int error_page_kind(int status) {
+    for(int i = 0; i < NB_ERROR_PAGES; i++) {
+        if(ERROR_PAGES[i].status == status) return i;
+    }
+    return -1;
+}
+
+const struct error_page *error_page_default(enum error_page_kind kind) {
+    pthread_once(&DEFAULTS_ONCE, defaults_build);
+    return DEFAULTS + kind;
+}
+
+int error_page_load(struct error_page *page, enum error_page_kind kind, const char *path) {
+    struct stat st;
+    char *data = 0;
+    size_t read_len = 0;
+    int head_len;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        logging_errno(ERR, "open: ");
+        return -1;
+    }
+    if(fstat(fd, &st) == -1) {
+        logging_errno(ERR, "fstat: ");
+        goto cleanup;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_size > ERROR_PAGE_MAX_SIZE) {
+        logging(ERR, "`%s` is not a file of at most %d bytes", path, ERROR_PAGE_MAX_SIZE);
+        goto cleanup;
+    }
+    data = malloc(ERROR_PAGE_HEAD_SIZE + st.st_size);
+    if(!data) {
+        logging_errno(ERR, "malloc: ");
+        goto cleanup;
+    }
+    head_len = head_write(kind, st.st_size, data, ERROR_PAGE_HEAD_SIZE);
+    if(head_len < 0) goto cleanup;
+    while(read_len < (size_t)st.st_size) {
+        ssize_t ret = read(fd, data + head_len + read_len, st.st_size - read_len);
+        if(ret <= 0) {
+            /* the Content-Length is already written */
+            logging(ERR, "`%s` changed while being read", path);
+            goto cleanup;
+        }
+        read_len += ret;
+    }
+    close(fd);
+
+    page->status = ERROR_PAGES[kind].status;
+    page->data = data;
+    page->len = head_len + read_len;
+    page->head_len = head_len;
+    page->owned = data;
+    return 0;
+
+cleanup:
+    free(data);
+    close(fd);
+    return -1;
+}
+
+void error_page_cleanup(struct error_page *page) {
+    free(page->owned);
+    memset(page, 0, sizeof(*page));
+}
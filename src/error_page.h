@@ -0,0 +1,45 @@
+#ifndef ERROR_PAGE_H
+#define ERROR_PAGE_H 1
+
+#include <stddef.h>
+
+/* responses kept whole, status line to body, and written at once */
+enum error_page_kind {
+    ERROR_PAGE_400,
+    ERROR_PAGE_404,
+    ERROR_PAGE_405,
+    ERROR_PAGE_411,
+    ERROR_PAGE_418,
+    ERROR_PAGE_426,
+    ERROR_PAGE_431,
+    ERROR_PAGE_500,
+    ERROR_PAGE_502,
+    NB_ERROR_PAGES,
+};
+
+struct error_page {
+    int status;
+    const char *data;
+    size_t len;
+    /* the status line and headers alone, what a HEAD gets */
+    size_t head_len;
+    /* read from a file named in the config, freed along with it */
+    char *owned;
+};
+
+/* largest file accepted as an error page */
+#define ERROR_PAGE_MAX_SIZE (1024 * 1024)
+
+/* Returns: the kind of page answering `status`, -1 if there is none */
+int error_page_kind(int status);
+
+/* Returns: the built-in response for `kind`, built on the first call */
+const struct error_page *error_page_default(enum error_page_kind kind);
+
+/* Builds the response for `kind` around the content of the file at `path`
+ * Returns: 0 on success, -1 on error */
+int error_page_load(struct error_page *page, enum error_page_kind kind, const char *path);
+
+void error_page_cleanup(struct error_page *page);
+
+#endif
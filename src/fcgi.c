@@ -0,0 +1,1123 @@
+#define _GNU_SOURCE
+#include "fcgi.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "logging.h"
+#include "resolve.h"
+#include "send.h"
+
+#define MIN(a,b) (a < b ? a : b)
+
+/* record types, see the FastCGI specification */
+enum fcgi_type {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+};
+
+#define FCGI_VERSION_1 1
+
+#define FCGI_HEADER_LEN 8
+
+#define FCGI_RESPONDER 1
+
+/* the app keeps the connection open once the request ended */
+#define FCGI_KEEP_CONN 1
+
+/* requests go one at a time over a connection, they all use this id */
+#define FCGI_REQUEST_ID 1
+
+#define FCGI_MAX_CONTENT 65535
+
+/* the content of a record and its padding */
+#define FCGI_MAX_RECORD (FCGI_MAX_CONTENT + 255)
+
+/* parameters of a request, they are sent as a single record */
+#define FCGI_PARAMS_SIZE 32768
+
+/* the begin request record and the header of the parameters */
+#define FCGI_PREAMBLE_LEN (3 * FCGI_HEADER_LEN)
+
+/* longest response head accepted from an app */
+#define FCGI_HEAD_SIZE 16384
+
+/* bytes of a request body read from the client at once */
+#define FCGI_BODY_CHUNK 16384
+
+/* the workers replace the shell, their pids are the ones to wait on */
+#define EXEC_PREFIX "exec "
+
+/* an idle connection to an app */
+struct pooled {
+    int used;
+    int fd;
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    time_t since;
+};
+
+/* an app started by sv, its workers accept on the same socket */
+struct app {
+    int used;
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    /* the socket file, it is only removed if it is still ours */
+    ino_t ino;
+    /* the route's command behind EXEC_PREFIX */
+    char *command;
+    int listen_fd;
+    int nb_workers;
+    /* 0 for a worker left to start */
+    pid_t pids[FCGI_WORKERS_MAX];
+    time_t started[FCGI_WORKERS_MAX];
+    /* named by the routes `fcgi_spawn` is applying */
+    int listed;
+};
+
+/* what the request line told */
+struct request_line {
+    const char *method;
+    size_t method_len;
+    /* query string included */
+    const char *target;
+    size_t target_len;
+    const char *protocol;
+    size_t protocol_len;
+    /* the header lines that follow */
+    const char *headers;
+};
+
+/* each worker has its own pool */
+static struct pooled POOL[FCGI_POOL_SIZE];
+
+static struct app APPS[FCGI_APPS_MAX];
+
+int fcgi_route_parse(const char *value, struct fcgi_route *route) {
+    const char *target = strchr(value, ' ');
+    const char *path;
+    const char *command;
+    size_t path_len;
+
+    memset(route, 0, sizeof(*route));
+    if(!target || (value[0] != '/' && value[0] != '.')) return -1;
+    route->match_len = target - value;
+    if(value[0] == '.'
+            && (route->match_len < 2 || memchr(value, '/', route->match_len))) {
+        return -1;
+    }
+
+    while(*target == ' ') target++;
+    if(strncmp(target, "unix:", sizeof("unix:") - 1)) return -1;
+    path = target + sizeof("unix:") - 1;
+    command = strchr(path, ' ');
+    path_len = command ? (size_t)(command - path) : strlen(path);
+    if(!path_len || path_len >= sizeof(route->addr.sun_path)) return -1;
+    route->addr.sun_family = AF_UNIX;
+    memcpy(route->addr.sun_path, path, path_len);
+    route->addr.sun_path[path_len] = '\0';
+    route->addr_len = offsetof(struct sockaddr_un, sun_path) + path_len + 1;
+
+    if(command) {
+        while(*command == ' ') command++;
+        if(*command) {
+            route->command = strdup(command);
+            if(!route->command) return -1;
+        }
+    }
+    route->match = strndup(value, route->match_len);
+    if(!route->match) {
+        free(route->command);
+        route->command = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void fcgi_route_cleanup(struct fcgi_route *route) {
+    free(route->match);
+    free(route->command);
+    memset(route, 0, sizeof(*route));
+}
+
+/* Returns: the route of the percent-decoded `path`, the longest match wins,
+ * 0 if there is none */
+static const struct fcgi_route *match_path(
+        const struct fcgi_route *routes,
+        size_t nb_routes,
+        const char *path,
+        size_t path_len) {
+    const struct fcgi_route *best = 0;
+
+    for(size_t i = 0; i < nb_routes; i++) {
+        const struct fcgi_route *route = routes + i;
+        size_t len = route->match_len;
+
+        if(path_len < len) continue;
+        if(route->match[0] == '.') {
+            if(memcmp(path + path_len - len, route->match, len)) continue;
+        }
+        else {
+            if(memcmp(path, route->match, len)) continue;
+            /* `/app` covers `/app/x` but not `/appx` */
+            if(route->match[len - 1] != '/' && path_len > len && path[len] != '/') {
+                continue;
+            }
+        }
+        if(!best || len > best->match_len) best = route;
+    }
+    return best;
+}
+
+/* Percent-decodes the path of the request target `target` into `out`, its
+ * leading '/' kept
+ * Returns: the decoded length, -1 if the target is malformed or too long */
+static ssize_t target_decode(const char *target, size_t target_len, char *out, size_t out_size) {
+    char raw[PATH_MAX];
+    ssize_t len;
+
+    if(!target_len || target[0] != '/' || target_len >= sizeof(raw) || out_size < 2) {
+        return -1;
+    }
+    memcpy(raw, target, target_len);
+    raw[target_len] = '\0';
+    len = resolve_decode(raw + 1, out + 1, out_size - 1);
+    if(len < 0) return -1;
+    out[0] = '/';
+    return len + 1;
+}
+
+const struct fcgi_route *fcgi_match_target(
+        const struct fcgi_route *routes,
+        size_t nb_routes,
+        const char *target,
+        size_t target_len) {
+    const char *query = memchr(target, '?', target_len);
+    char path[PATH_MAX];
+    ssize_t len;
+
+    if(!nb_routes) return 0;
+    /* matched as the file server reads it, `.ph%70` is a `.php` */
+    len = target_decode(target, query ? (size_t)(query - target) : target_len,
+            path, sizeof(path));
+    if(len < 0) return 0;
+    return match_path(routes, nb_routes, path, len);
+}
+
+const struct fcgi_route *fcgi_match(
+        const struct fcgi_route *routes,
+        size_t nb_routes,
+        const char *request,
+        size_t request_len) {
+    const char *end = request + request_len;
+    const char *target = memchr(request, ' ', request_len);
+    const char *target_end;
+
+    if(!nb_routes || !target) return 0;
+    target++;
+    target_end = target;
+    while(target_end < end && *target_end != ' ') target_end++;
+    return fcgi_match_target(routes, nb_routes, target, target_end - target);
+}
+
+/* Returns: 1 if `fd` is an idle connection the app did not close */
+static int pool_alive(int fd) {
+    char c;
+    ssize_t ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Returns: a new connection to the app of `route`, -1 on error */
+static int pool_connect(const struct fcgi_route *route) {
+    struct timeval timeout = {.tv_sec = FCGI_IO_TIMEOUT};
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        logging_errno(ERR, "socket: ");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if(connect(fd, (const struct sockaddr*)&route->addr, route->addr_len)) {
+        logging(WARN, "unable to reach the app of `%s`: %s",
+                route->match, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Takes a connection to the app of `route` out of the pool or opens one,
+ * `*reused` tells which
+ * Returns: the connection, -1 on error */
+static int pool_get(const struct fcgi_route *route, int *reused) {
+    time_t now = time(0);
+
+    for(size_t i = 0; i < FCGI_POOL_SIZE; i++) {
+        struct pooled *pooled = POOL + i;
+        if(!pooled->used
+                || pooled->addr_len != route->addr_len
+                || memcmp(&pooled->addr, &route->addr, route->addr_len)) {
+            continue;
+        }
+        pooled->used = 0;
+        if(now - pooled->since > FCGI_IDLE_TIMEOUT || !pool_alive(pooled->fd)) {
+            close(pooled->fd);
+            continue;
+        }
+        *reused = 1;
+        return pooled->fd;
+    }
+    *reused = 0;
+    return pool_connect(route);
+}
+
+/* puts `fd` back in the pool, evicting the oldest connection when full */
+static void pool_put(const struct fcgi_route *route, int fd) {
+    struct pooled *slot = POOL;
+
+    for(size_t i = 0; i < FCGI_POOL_SIZE; i++) {
+        if(!POOL[i].used) {
+            slot = POOL + i;
+            break;
+        }
+        if(POOL[i].since < slot->since) slot = POOL + i;
+    }
+    if(slot->used) close(slot->fd);
+
+    slot->used = 1;
+    slot->fd = fd;
+    memcpy(&slot->addr, &route->addr, route->addr_len);
+    slot->addr_len = route->addr_len;
+    slot->since = time(0);
+}
+
+/* ##### workers ##### */
+
+/* Returns: the app listening at the address of `route`, 0 if there is none */
+static struct app *app_find(const struct fcgi_route *route) {
+    for(size_t i = 0; i < FCGI_APPS_MAX; i++) {
+        struct app *app = APPS + i;
+        if(app->used
+                && app->addr_len == route->addr_len
+                && !memcmp(&app->addr, &route->addr, route->addr_len)) {
+            return app;
+        }
+    }
+    return 0;
+}
+
+/* Starts worker `i` of `app`
+ * Returns: 0 on success, -1 on error */
+static int worker_start(struct app *app, int i) {
+    pid_t pid;
+
+    app->started[i] = time(0);
+    pid = fork();
+    if(pid == -1) {
+        logging_errno(ERR, "fork: ");
+        return -1;
+    }
+    if(!pid) {
+        /* FCGI_LISTENSOCK_FILENO, where FastCGI apps accept */
+        if(dup2(app->listen_fd, 0) == -1) _exit(127);
+        /* the listeners and the connections of the server are not theirs */
+        close_range(3, ~0U, 0);
+        execl("/bin/sh", "sh", "-c", app->command, (char*)0);
+        _exit(127);
+    }
+    app->pids[i] = pid;
+    return 0;
+}
+
+/* Stops the worker `pid`, it is killed if it did not exit within a second */
+static void worker_stop(pid_t pid) {
+    struct timespec pause = {.tv_nsec = 10 * 1000 * 1000};
+
+    kill(pid, SIGTERM);
+    for(int i = 0; i < 100; i++) {
+        if(waitpid(pid, 0, WNOHANG)) return;
+        nanosleep(&pause, 0);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, 0, 0);
+}
+
+/* starts or stops workers until `app` has `nb_workers` */
+static void app_resize(struct app *app, int nb_workers) {
+    for(int i = nb_workers; i < app->nb_workers; i++) {
+        if(app->pids[i] > 0) worker_stop(app->pids[i]);
+        app->pids[i] = 0;
+    }
+    for(int i = app->nb_workers; i < nb_workers; i++) {
+        app->pids[i] = 0;
+        /* retried by `fcgi_reap` on failure */
+        worker_start(app, i);
+    }
+    app->nb_workers = nb_workers;
+}
+
+/* Listens at the address of `route` and starts the workers of its command
+ * Returns: 0 on success, -1 on error */
+static int app_start(struct app *app, const struct fcgi_route *route, int nb_workers) {
+    const char *path = route->addr.sun_path;
+    size_t command_len = strlen(route->command);
+    struct stat st;
+    int fd;
+
+    /* left over by a previous run, anything else is not ours to remove */
+    if(!lstat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        logging_errno(ERR, "socket: ");
+        return -1;
+    }
+    if(bind(fd, (const struct sockaddr*)&route->addr, route->addr_len)
+            || listen(fd, FCGI_LISTEN_BACKLOG)
+            || lstat(path, &st)) {
+        logging(ERR, "unable to listen on `%s`: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    app->command = malloc(sizeof(EXEC_PREFIX) + command_len);
+    if(!app->command) {
+        logging_errno(ERR, "malloc: ");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    memcpy(app->command, EXEC_PREFIX, sizeof(EXEC_PREFIX) - 1);
+    memcpy(app->command + sizeof(EXEC_PREFIX) - 1, route->command, command_len + 1);
+
+    app->used = 1;
+    app->addr = route->addr;
+    app->addr_len = route->addr_len;
+    app->ino = st.st_ino;
+    app->listen_fd = fd;
+    app->nb_workers = 0;
+    app_resize(app, nb_workers);
+    logging(INFO, "started %d workers of `%s` on `%s`", nb_workers, route->command, path);
+    return 0;
+}
+
+static void app_stop(struct app *app) {
+    struct stat st;
+
+    app_resize(app, 0);
+    close(app->listen_fd);
+    /* an upgraded process may have taken the path over */
+    if(!lstat(app->addr.sun_path, &st) && st.st_ino == app->ino) {
+        unlink(app->addr.sun_path);
+    }
+    free(app->command);
+    memset(app, 0, sizeof(*app));
+}
+
+int fcgi_spawn(const struct fcgi_route *routes, size_t nb_routes, int nb_workers) {
+    int ret = 0;
+
+    for(size_t i = 0; i < FCGI_APPS_MAX; i++) {
+        APPS[i].listed = 0;
+    }
+    for(size_t i = 0; i < nb_routes; i++) {
+        const struct fcgi_route *route = routes + i;
+        struct app *app;
+
+        if(!route->command) continue;
+        app = app_find(route);
+        if(app && strcmp(app->command + sizeof(EXEC_PREFIX) - 1, route->command)) {
+            if(app->listed) {
+                logging(ERR, "`%s` is already the socket of another command",
+                        route->addr.sun_path);
+                ret = -1;
+                continue;
+            }
+            app_stop(app);
+            app = 0;
+        }
+        if(!app) {
+            for(size_t j = 0; j < FCGI_APPS_MAX; j++) {
+                if(!APPS[j].used) {
+                    app = APPS + j;
+                    break;
+                }
+            }
+            if(!app) {
+                logging(ERR, "at most %d FastCGI apps can be started", FCGI_APPS_MAX);
+                ret = -1;
+                continue;
+            }
+            if(app_start(app, route, nb_workers)) {
+                ret = -1;
+                continue;
+            }
+        }
+        else {
+            app_resize(app, nb_workers);
+        }
+        app->listed = 1;
+    }
+    for(size_t i = 0; i < FCGI_APPS_MAX; i++) {
+        if(APPS[i].used && !APPS[i].listed) app_stop(APPS + i);
+    }
+    return ret;
+}
+
+int fcgi_reap(void) {
+    time_t now = time(0);
+    int waiting = 0;
+
+    for(size_t i = 0; i < FCGI_APPS_MAX; i++) {
+        struct app *app = APPS + i;
+        if(!app->used) continue;
+
+        for(int j = 0; j < app->nb_workers; j++) {
+            int status = 0;
+
+            if(app->pids[j] > 0) {
+                if(!waitpid(app->pids[j], &status, WNOHANG)) continue;
+                if(WIFSIGNALED(status)) {
+                    logging(WARN, "a worker of `%s` was killed by signal %d",
+                            app->addr.sun_path, WTERMSIG(status));
+                }
+                else {
+                    logging(WARN, "a worker of `%s` exited with %d",
+                            app->addr.sun_path, WEXITSTATUS(status));
+                }
+                app->pids[j] = 0;
+            }
+            /* one failing right away is not restarted in a loop */
+            if(now - app->started[j] < FCGI_RESPAWN_DELAY || worker_start(app, j)) {
+                waiting = 1;
+            }
+        }
+    }
+    return waiting;
+}
+
+void fcgi_cleanup(void) {
+    for(size_t i = 0; i < FCGI_POOL_SIZE; i++) {
+        if(POOL[i].used) close(POOL[i].fd);
+        POOL[i].used = 0;
+    }
+    for(size_t i = 0; i < FCGI_APPS_MAX; i++) {
+        if(APPS[i].used) app_stop(APPS + i);
+    }
+}
+
+/* ##### requests ##### */
+
+/* Returns: the length of the head at the start of `buff`, up to and
+ * including its empty line, 0 if it is not complete */
+static size_t head_length(const char *buff, size_t len) {
+    for(size_t i = 3; i < len; i++) {
+        if(buff[i] == '\n' && buff[i - 1] == '\r'
+                && buff[i - 2] == '\n' && buff[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns: the length of the CGI head at the start of `buff`, its empty line
+ * included, apps may end lines with a bare LF. 0 if it is not complete */
+static size_t cgi_head_length(const char *buff, size_t len) {
+    for(size_t i = 1; i < len; i++) {
+        if(buff[i] != '\n') continue;
+        if(buff[i - 1] == '\n') return i + 1;
+        if(i >= 2 && buff[i - 1] == '\r' && buff[i - 2] == '\n') return i + 1;
+    }
+    return 0;
+}
+
+/* Reads into `buff` until it holds a whole head, `*len` bytes are already in
+ * Returns: the length of the head
+ *  0 if the connection ended before anything was read
+ *  -1 on error or if the head does not fit */
+static ssize_t read_head(struct conn *from, char *buff, size_t *len, size_t size) {
+    size_t head;
+
+    while(!(head = head_length(buff, *len))) {
+        ssize_t ret;
+        if(*len == size) return -1;
+        ret = conn_read(from, buff + *len, size - *len);
+        if(ret <= 0) return *len ? -1 : 0;
+        *len += ret;
+    }
+    return head;
+}
+
+/* Returns: 1 once `len` bytes were read into `buff`
+ *  0 if the connection ended before the first one
+ *  -1 on error */
+static int read_full(struct conn *from, void *buff, size_t len) {
+    size_t got = 0;
+
+    while(got < len) {
+        ssize_t ret = conn_read(from, (char*)buff + got, len - got);
+        if(ret <= 0) return !ret && !got ? 0 : -1;
+        got += ret;
+    }
+    return 1;
+}
+
+/* Returns: 0 once all of `data` was written, -1 on error */
+static int write_all(struct conn *to, const char *data, size_t len) {
+    while(len) {
+        ssize_t ret = conn_write(to, data, len);
+        if(ret <= 0) return -1;
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void header_put(uint8_t *out, enum fcgi_type type, size_t len) {
+    out[0] = FCGI_VERSION_1;
+    out[1] = type;
+    out[2] = FCGI_REQUEST_ID >> 8;
+    out[3] = FCGI_REQUEST_ID & 0xff;
+    out[4] = len >> 8;
+    out[5] = len & 0xff;
+    /* no padding */
+    out[6] = 0;
+    out[7] = 0;
+}
+
+/* Sends `len` bytes of `data`, at most FCGI_MAX_CONTENT, as a record of
+ * `type`. An empty one ends the stream of its type.
+ * Returns: 0 on success, -1 on error */
+static int record_write(struct conn *to, enum fcgi_type type, const char *data, size_t len) {
+    uint8_t header[FCGI_HEADER_LEN];
+
+    header_put(header, type, len);
+    if(write_all(to, (const char*)header, sizeof(header))) return -1;
+    return write_all(to, data, len);
+}
+
+/* Reads the next record of our request into `data`, which has room for
+ * FCGI_MAX_RECORD bytes, the padding is dropped
+ * Returns: 1 with the record in `*type` and `*len`
+ *  0 if the connection ended before the record
+ *  -1 on error */
+static int record_read(struct conn *from, int *type, char *data, size_t *len) {
+    uint8_t header[FCGI_HEADER_LEN];
+    size_t content_len;
+    int ret;
+
+    for(;;) {
+        ret = read_full(from, header, sizeof(header));
+        if(ret <= 0) return ret;
+        if(header[0] != FCGI_VERSION_1) return -1;
+
+        content_len = header[4] << 8 | header[5];
+        if(read_full(from, data, content_len + header[6]) < 0) return -1;
+
+        /* management records and other requests are none of ours */
+        if((header[2] << 8 | header[3]) == FCGI_REQUEST_ID) break;
+    }
+    *type = header[1];
+    *len = content_len;
+    return 1;
+}
+
+/* writes the length of a name or a value, in one byte when it fits */
+static size_t param_length(uint8_t *out, size_t len) {
+    if(len < 128) {
+        out[0] = len;
+        return 1;
+    }
+    out[0] = 0x80 | (len >> 24 & 0x7f);
+    out[1] = len >> 16 & 0xff;
+    out[2] = len >> 8 & 0xff;
+    out[3] = len & 0xff;
+    return 4;
+}
+
+/* Appends the pair `name`, `value` to the `*len` bytes of parameters in
+ * `params`, which has room for FCGI_PARAMS_SIZE
+ * Returns: 0 on success, -1 if it does not fit */
+static int param_add(
+        char *params,
+        size_t *len,
+        const char *name,
+        size_t name_len,
+        const char *value,
+        size_t value_len) {
+    size_t need = name_len + value_len
+        + (name_len < 128 ? 1 : 4) + (value_len < 128 ? 1 : 4);
+
+    if(need > FCGI_PARAMS_SIZE - *len) return -1;
+    *len += param_length((uint8_t*)params + *len, name_len);
+    *len += param_length((uint8_t*)params + *len, value_len);
+    memcpy(params + *len, name, name_len);
+    *len += name_len;
+    memcpy(params + *len, value, value_len);
+    *len += value_len;
+    return 0;
+}
+
+static int param_str(char *params, size_t *len, const char *name, const char *value) {
+    return param_add(params, len, name, strlen(name), value, strlen(value));
+}
+
+/* Returns: the value of the header line `line` if it is named `name`,
+ * 0 otherwise */
+static const char *header_value(const char *line, size_t line_len, const char *name) {
+    size_t name_len = strlen(name);
+
+    if(line_len <= name_len || line[name_len] != ':'
+            || strncasecmp(line, name, name_len)) {
+        return 0;
+    }
+    line += name_len + 1;
+    while(*line == ' ' || *line == '\t') line++;
+    return line;
+}
+
+/* Splits the request line at the start of `head`
+ * Returns: 0 on success, -1 if it is malformed */
+static int request_line_parse(const char *head, size_t head_len, struct request_line *line) {
+    const char *end = memchr(head, '\r', head_len);
+
+    if(!end) return -1;
+    line->method = head;
+    line->target = memchr(head, ' ', end - head);
+    if(!line->target) return -1;
+    line->method_len = line->target - head;
+    line->target++;
+    line->protocol = memchr(line->target, ' ', end - line->target);
+    if(!line->protocol) return -1;
+    line->target_len = line->protocol - line->target;
+    line->protocol++;
+    line->protocol_len = end - line->protocol;
+    line->headers = end + 2;
+    if(!line->method_len || !line->target_len) return -1;
+    return 0;
+}
+
+/* Adds the headers of the request to `params` as HTTP_* variables, the body's
+ * length goes into `*length` and `*chunked` tells if it is chunked instead
+ * Returns: 0 on success, -1 if they do not fit, -2 if the Content-Length is
+ *  malformed or given twice, the app cannot be told where the body ends */
+static int params_headers(
+        char *params,
+        size_t *len,
+        const char *headers,
+        const char *end,
+        unsigned long long *length,
+        int *chunked) {
+    const char *line = headers;
+    int has_length = 0;
+
+    *length = 0;
+    *chunked = 0;
+    while(line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *colon;
+        const char *value;
+        char name[256] = "HTTP_";
+        size_t line_len;
+        size_t name_len;
+        size_t value_len;
+
+        if(!eol) break;
+        line_len = eol - line;
+        if(line_len && line[line_len - 1] == '\r') line_len--;
+        /* the empty line */
+        if(!line_len) break;
+
+        colon = memchr(line, ':', line_len);
+        if(!colon) {
+            line = eol + 1;
+            continue;
+        }
+        name_len = colon - line;
+        value = colon + 1;
+        while(value < line + line_len && (*value == ' ' || *value == '\t')) value++;
+        value_len = line + line_len - value;
+
+        if(header_value(line, line_len, "Content-Length")) {
+            if(has_length || content_length_parse(value, value_len, length)) {
+                return -2;
+            }
+            has_length = 1;
+            if(param_add(params, len, "CONTENT_LENGTH", sizeof("CONTENT_LENGTH") - 1,
+                        value, value_len)) {
+                return -1;
+            }
+        }
+        else if(header_value(line, line_len, "Content-Type")) {
+            if(param_add(params, len, "CONTENT_TYPE", sizeof("CONTENT_TYPE") - 1,
+                        value, value_len)) {
+                return -1;
+            }
+        }
+        else if(header_value(line, line_len, "Transfer-Encoding")) {
+            *chunked = !!strcasestr(value, "chunked");
+        }
+        /* `Proxy` would become HTTP_PROXY, which apps take for their own
+         * outgoing proxy */
+        else if(!header_value(line, line_len, "Proxy")
+                && name_len < sizeof(name) - (sizeof("HTTP_") - 1)) {
+            for(size_t i = 0; i < name_len; i++) {
+                char c = line[i];
+                if(c >= 'a' && c <= 'z') c -= 'a' - 'A';
+                else if(c == '-') c = '_';
+                name[sizeof("HTTP_") - 1 + i] = c;
+            }
+            if(param_add(params, len, name, sizeof("HTTP_") - 1 + name_len,
+                        value, value_len)) {
+                return -1;
+            }
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+/* Adds the CGI variables of the request to `params`
+ * Returns: 0 on success, -1 if they do not fit */
+static int params_build(
+        const struct fcgi_route *route,
+        const struct conn *client,
+        const char *document_root,
+        const struct request_line *line,
+        const char *path,
+        size_t path_len,
+        char *params,
+        size_t *len) {
+    const char *query = memchr(line->target, '?', line->target_len);
+    size_t script_len = path_len;
+    char addr[INET6_ADDRSTRLEN] = {0};
+    char port[8] = {0};
+    char filename[PATH_MAX];
+    int ret = 0;
+
+    /* a prefix names the script, what follows is its PATH_INFO */
+    if(route->match[0] == '/') {
+        script_len = route->match_len;
+        if(route->match[script_len - 1] == '/') script_len--;
+        if(script_len > path_len || memcmp(path, route->match, script_len)) {
+            script_len = 0;
+        }
+    }
+
+    ret |= param_str(params, len, "GATEWAY_INTERFACE", "CGI/1.1");
+    ret |= param_str(params, len, "SERVER_SOFTWARE", "sv");
+    ret |= param_add(params, len, "SERVER_PROTOCOL", sizeof("SERVER_PROTOCOL") - 1,
+            line->protocol, line->protocol_len);
+    ret |= param_add(params, len, "REQUEST_METHOD", sizeof("REQUEST_METHOD") - 1,
+            line->method, line->method_len);
+    ret |= param_add(params, len, "REQUEST_URI", sizeof("REQUEST_URI") - 1,
+            line->target, line->target_len);
+    ret |= param_add(params, len, "QUERY_STRING", sizeof("QUERY_STRING") - 1,
+            query ? query + 1 : "",
+            query ? line->target + line->target_len - query - 1 : 0);
+    ret |= param_add(params, len, "SCRIPT_NAME", sizeof("SCRIPT_NAME") - 1,
+            path, script_len);
+    ret |= param_add(params, len, "PATH_INFO", sizeof("PATH_INFO") - 1,
+            path + script_len, path_len - script_len);
+    if(document_root) {
+        int filename_len = snprintf(filename, sizeof(filename), "%s%.*s",
+                document_root, (int)script_len, path);
+        if(filename_len < 0 || (size_t)filename_len >= sizeof(filename)) return -1;
+        ret |= param_str(params, len, "DOCUMENT_ROOT", document_root);
+        ret |= param_add(params, len, "SCRIPT_FILENAME", sizeof("SCRIPT_FILENAME") - 1,
+                filename, filename_len);
+    }
+
+    if(client->peer.ss_family == AF_INET) {
+        const struct sockaddr_in *peer = (const struct sockaddr_in*)&client->peer;
+        inet_ntop(AF_INET, &peer->sin_addr, addr, sizeof(addr));
+        snprintf(port, sizeof(port), "%d", ntohs(peer->sin_port));
+    }
+    else if(client->peer.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *peer = (const struct sockaddr_in6*)&client->peer;
+        inet_ntop(AF_INET6, &peer->sin6_addr, addr, sizeof(addr));
+        snprintf(port, sizeof(port), "%d", ntohs(peer->sin6_port));
+    }
+    if(addr[0]) {
+        ret |= param_str(params, len, "REMOTE_ADDR", addr);
+        ret |= param_str(params, len, "REMOTE_PORT", port);
+    }
+    if(client->type == CONN_SSL) {
+        ret |= param_str(params, len, "HTTPS", "on");
+    }
+    return ret;
+}
+
+/* Turns the CGI head `cgi` of a response into an HTTP one in `out`, its
+ * status comes from the `Status` header
+ * Returns: the length written, -1 if it is malformed or does not fit */
+static ssize_t head_convert(const char *cgi, size_t cgi_len, char *out, size_t out_size) {
+    static const char *const DROPPED[] = {
+        "Status",
+        "Connection",
+        "Keep-Alive",
+        "Transfer-Encoding",
+        0,
+    };
+    const char *end = cgi + cgi_len;
+    const char *status = "200 OK";
+    int status_len = sizeof("200 OK") - 1;
+    size_t len = 0;
+    int ret;
+
+    for(int pass = 0; pass < 2; pass++) {
+        const char *line = cgi;
+
+        while(line < end) {
+            const char *eol = memchr(line, '\n', end - line);
+            const char *value;
+            size_t line_len;
+            int dropped = 0;
+
+            if(!eol) break;
+            line_len = eol - line;
+            if(line_len && line[line_len - 1] == '\r') line_len--;
+            if(!line_len) break;
+
+            if(!pass) {
+                if((value = header_value(line, line_len, "Status"))) {
+                    status = value;
+                    status_len = line + line_len - value;
+                }
+                else if(header_value(line, line_len, "Location")
+                        && status[0] == '2') {
+                    status = "302 Found";
+                    status_len = sizeof("302 Found") - 1;
+                }
+                line = eol + 1;
+                continue;
+            }
+
+            for(size_t i = 0; DROPPED[i]; i++) {
+                if(header_value(line, line_len, DROPPED[i])) dropped = 1;
+            }
+            if(!dropped) {
+                if(line_len + 2 > out_size - len) return -1;
+                memcpy(out + len, line, line_len);
+                memcpy(out + len + line_len, CRLF, 2);
+                len += line_len + 2;
+            }
+            line = eol + 1;
+        }
+
+        if(!pass) {
+            if(status_len < 3 || status[0] < '1' || status[0] > '5'
+                    || status[1] < '0' || status[1] > '9'
+                    || status[2] < '0' || status[2] > '9') {
+                return -1;
+            }
+            ret = snprintf(out, out_size, "HTTP/1.1 %.*s%s"CRLF,
+                    status_len, status, status_len == 3 ? " " : "");
+            if(ret < 0 || (size_t)ret >= out_size) return -1;
+            len = ret;
+        }
+    }
+
+    /* the client connection is closed after each response, it ends the
+     * body when the app did not give its length */
+    if(sizeof("Connection: close"CRLF CRLF) - 1 > out_size - len) return -1;
+    memcpy(out + len, "Connection: close"CRLF CRLF, sizeof("Connection: close"CRLF CRLF) - 1);
+    return len + sizeof("Connection: close"CRLF CRLF) - 1;
+}
+
+static void send_status(
+        struct conn *client,
+        const struct error_page *pages,
+        enum error_page_kind kind) {
+    send_error(client, pages ? pages + kind : error_page_default(kind), 0);
+}
+
+int fcgi_serve(
+        const struct fcgi_route *route,
+        struct conn *client,
+        const struct error_page *pages,
+        const char *document_root,
+        char *buff,
+        size_t buff_len,
+        size_t buff_size) {
+    char out[FCGI_PREAMBLE_LEN + FCGI_PARAMS_SIZE + FCGI_HEADER_LEN];
+    char data[FCGI_MAX_RECORD];
+    char cgi[FCGI_HEAD_SIZE];
+    char head[FCGI_HEAD_SIZE + 128];
+    char path[PATH_MAX];
+    struct request_line line;
+    const char *query;
+    struct conn app;
+    unsigned long long length;
+    ssize_t request_head;
+    ssize_t path_len;
+    ssize_t head_len;
+    size_t params_len = 0;
+    size_t body_in;
+    size_t data_len = 0;
+    size_t cgi_len = 0;
+    size_t cgi_head;
+    int chunked;
+    int parsed = 0;
+    int is_head;
+    int head_sent = 0;
+    int ended = 0;
+    int type = 0;
+    int got = -1;
+    int fd = -1;
+
+    request_head = read_head(client, buff, &buff_len, buff_size);
+    if(request_head <= 0) {
+        if(buff_len == buff_size) send_status(client, pages, ERROR_PAGE_431);
+        return -1;
+    }
+    if(request_line_parse(buff, request_head, &line)) return -1;
+    is_head = line.method_len == 4 && !memcmp(line.method, "HEAD", 4);
+
+    query = memchr(line.target, '?', line.target_len);
+    path_len = target_decode(line.target,
+            query ? (size_t)(query - line.target) : line.target_len,
+            path, sizeof(path));
+    /* SCRIPT_FILENAME stays under the document root */
+    if(path_len < 0 || resolve_has_dot_dot(path + 1)) {
+        send_status(client, pages, ERROR_PAGE_404);
+        return -1;
+    }
+
+    if(params_build(route, client, document_root, &line, path, path_len,
+                out + FCGI_PREAMBLE_LEN, &params_len)
+            || (parsed = params_headers(out + FCGI_PREAMBLE_LEN, &params_len,
+                    line.headers, buff + request_head, &length, &chunked)) == -1) {
+        send_status(client, pages, ERROR_PAGE_431);
+        return -1;
+    }
+    if(parsed) {
+        send_status(client, pages, ERROR_PAGE_400);
+        return -1;
+    }
+    if(chunked) {
+        /* CONTENT_LENGTH is how apps know where the body ends */
+        send_status(client, pages, ERROR_PAGE_411);
+        return -1;
+    }
+
+    header_put((uint8_t*)out, FCGI_BEGIN_REQUEST, FCGI_HEADER_LEN);
+    memset(out + FCGI_HEADER_LEN, 0, FCGI_HEADER_LEN);
+    out[FCGI_HEADER_LEN + 1] = FCGI_RESPONDER;
+    out[FCGI_HEADER_LEN + 2] = FCGI_KEEP_CONN;
+    header_put((uint8_t*)out + 2 * FCGI_HEADER_LEN, FCGI_PARAMS, params_len);
+    header_put((uint8_t*)out + FCGI_PREAMBLE_LEN + params_len, FCGI_PARAMS, 0);
+
+    /* the part of the body that came with the head */
+    body_in = MIN(buff_len - request_head, length);
+
+    for(;;) {
+        int reused;
+        int streamed = 0;
+        int ret;
+
+        fd = pool_get(route, &reused);
+        if(fd == -1) {
+            send_status(client, pages, ERROR_PAGE_502);
+            return -1;
+        }
+        conn_new_fd(fd, &app);
+
+        ret = write_all(&app, out, FCGI_PREAMBLE_LEN + params_len + FCGI_HEADER_LEN);
+        if(!ret && body_in) {
+            ret = record_write(&app, FCGI_STDIN, buff + request_head, body_in);
+        }
+        /* the rest of the body goes through as it comes */
+        while(!ret && length > body_in) {
+            ssize_t read_len = conn_read(client, data,
+                    MIN(length - body_in, FCGI_BODY_CHUNK));
+            streamed = 1;
+            if(read_len <= 0) {
+                close(fd);
+                return -1;
+            }
+            ret = record_write(&app, FCGI_STDIN, data, read_len);
+            body_in += read_len;
+        }
+        if(!ret) ret = record_write(&app, FCGI_STDIN, 0, 0);
+        if(!ret) {
+            got = record_read(&app, &type, data, &data_len);
+            if(got > 0) break;
+        }
+        close(fd);
+        fd = -1;
+        /* the app closed the pooled connection meanwhile, nothing was lost
+         * so another one can be tried */
+        if(reused && !streamed && (ret || !got)) continue;
+
+        logging(WARN, "no response from the app of `%s`", route->match);
+        send_status(client, pages, ERROR_PAGE_502);
+        return -1;
+    }
+
+    /* ##### relay the response ##### */
+    for(; got > 0; got = record_read(&app, &type, data, &data_len)) {
+        if(type == FCGI_END_REQUEST) {
+            ended = 1;
+            break;
+        }
+        if(type == FCGI_STDERR) {
+            logging(WARN, "`%s`: %.*s", route->match, (int)data_len, data);
+            continue;
+        }
+        if(type != FCGI_STDOUT) continue;
+
+        if(head_sent) {
+            if(!is_head && write_all(client, data, data_len)) goto cleanup;
+            continue;
+        }
+        if(data_len > sizeof(cgi) - cgi_len) {
+            logging(WARN, "the app of `%s` sent a head too long", route->match);
+            break;
+        }
+        memcpy(cgi + cgi_len, data, data_len);
+        cgi_len += data_len;
+        cgi_head = cgi_head_length(cgi, cgi_len);
+        if(!cgi_head) continue;
+
+        head_len = head_convert(cgi, cgi_head, head, sizeof(head));
+        if(head_len < 0) {
+            logging(WARN, "malformed response from the app of `%s`", route->match);
+            break;
+        }
+        head_sent = 1;
+        if(write_all(client, head, head_len)) goto cleanup;
+        if(!is_head && write_all(client, cgi + cgi_head, cgi_len - cgi_head)) {
+            goto cleanup;
+        }
+    }
+    if(!head_sent) send_status(client, pages, ERROR_PAGE_502);
+
+cleanup:
+    /* a client gone mid-response leaves the rest of it on the connection */
+    if(ended) {
+        pool_put(route, fd);
+    }
+    else {
+        close(fd);
+    }
+    return 0;
+}
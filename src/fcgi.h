@@ -0,0 +1,98 @@
+#ifndef FCGI_H
+#define FCGI_H 1
+
+#include <stddef.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "conn.h"
+#include "error_page.h"
+
+/* idle connections to the apps kept around by a worker */
+#define FCGI_POOL_SIZE 16
+
+/* seconds an idle app connection is kept */
+#define FCGI_IDLE_TIMEOUT 30
+
+/* seconds an app has to accept or answer a read or a write */
+#define FCGI_IO_TIMEOUT 30
+
+/* apps started by sv, one per socket */
+#define FCGI_APPS_MAX 16
+
+#define FCGI_WORKERS_MAX 64
+
+/* a worker dying sooner than this after its start is respawned this late */
+#define FCGI_RESPAWN_DELAY 1
+
+/* connections waiting on an app's socket */
+#define FCGI_LISTEN_BACKLOG 128
+
+struct fcgi_route {
+    /* `/<prefix>` for the requests under it, `.<ext>` for the paths
+     * ending with it */
+    char *match;
+    size_t match_len;
+    /* the app's socket */
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    /* when set, sv starts the app with the command and keeps it running */
+    char *command;
+};
+
+/* Parses `<match> unix:<path> [<command>]` into `route`
+ * Returns: 0 on success, -1 on error */
+int fcgi_route_parse(const char *value, struct fcgi_route *route);
+
+void fcgi_route_cleanup(struct fcgi_route *route);
+
+/* Finds the route of the request target `target`, query string included
+ * Returns: the route, 0 if the target is not sent to an app */
+const struct fcgi_route *fcgi_match_target(
+        const struct fcgi_route *routes,
+        size_t nb_routes,
+        const char *target,
+        size_t target_len);
+
+/* Finds the route of the request whose head starts `request`, the longest
+ * match wins
+ * Returns: the route, 0 if the request is not sent to an app */
+const struct fcgi_route *fcgi_match(
+        const struct fcgi_route *routes,
+        size_t nb_routes,
+        const char *request,
+        size_t request_len);
+
+/* Sends the request starting in `buff` to the app of `route` and streams its
+ * response to `client`. `buff` holds the `buff_len` bytes read so far, it is
+ * reused to read the rest of the request's head. Scripts are looked for
+ * under `document_root`, it can be 0.
+ * The app connection goes back to the pool once the app ended the request.
+ * Errors are answered with `pages`, the config's error pages, or the
+ * built-in ones when it is 0.
+ * Returns: 0 on success, -1 on error */
+int fcgi_serve(
+        const struct fcgi_route *route,
+        struct conn *client,
+        const struct error_page *pages,
+        const char *document_root,
+        char *buff,
+        size_t buff_len,
+        size_t buff_size);
+
+/* Starts `nb_workers` workers for each route with a command whose app is not
+ * running yet, resizes the running ones and stops the apps no route names
+ * anymore. Workers share a listening socket handed to them as their stdin,
+ * as FastCGI apps expect.
+ * Returns: 0 on success, -1 if an app could not be started */
+int fcgi_spawn(const struct fcgi_route *routes, size_t nb_routes, int nb_workers);
+
+/* Collects the workers that exited and starts them again
+ * Returns: 1 if a worker is left to start, fcgi_reap is to be called again
+ *  a little later, 0 otherwise */
+int fcgi_reap(void);
+
+/* closes the pooled app connections and stops the apps */
+void fcgi_cleanup(void);
+
+#endif
@@ -0,0 +1,132 @@
+#include "file_map.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+
+static struct file_map CACHE[FILE_MAP_CACHE_SIZE] = {0};
+
+static unsigned long CLOCK = 0;
+
+static __thread sigjmp_buf *BUS_JMP = 0;
+
+static void sigbus_handler(int sig, siginfo_t *info, void *ucontext) {
+    if(BUS_JMP) {
+        sigjmp_buf *jmp = BUS_JMP;
+        BUS_JMP = 0;
+        siglongjmp(*jmp, 1);
+    }
+    /* not one of ours, crash like we would have */
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+int file_map_init(void) {
+    struct sigaction action = {0};
+    action.sa_sigaction = sigbus_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGBUS, &action, 0)) {
+        logging_errno(ERR, "sigaction: ");
+        return -1;
+    }
+    return 0;
+}
+
+void file_map_guard(sigjmp_buf *jmp) {
+    BUS_JMP = jmp;
+}
+
+void file_map_unguard(void) {
+    BUS_JMP = 0;
+}
+
+static void file_map_unmap(struct file_map *map) {
+    if(map->data) {
+        munmap((void*)map->data, map->size);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+struct file_map *file_map_get(int fd, const struct stat *st) {
+    struct file_map *victim = 0;
+    void *data;
+
+    if(st->st_size == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    for(size_t i = 0; i < FILE_MAP_CACHE_SIZE; i++) {
+        struct file_map *map = CACHE + i;
+        if(map->cached
+                && map->dev == st->st_dev
+                && map->ino == st->st_ino
+                && map->size == (size_t)st->st_size
+                && map->mtime.tv_sec == st->st_mtim.tv_sec
+                && map->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            map->refs++;
+            map->last_use = ++CLOCK;
+            return map;
+        }
+        /* least recently used mapping nobody holds */
+        if(!map->refs && (!victim || map->last_use < victim->last_use)) {
+            victim = map;
+        }
+    }
+
+    data = mmap(0, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(data == MAP_FAILED) return 0;
+    madvise(data, st->st_size, MADV_SEQUENTIAL);
+
+    if(!victim) {
+        /* every slot is in use, hand out a mapping that won't be kept */
+        victim = calloc(1, sizeof(struct file_map));
+        if(!victim) {
+            munmap(data, st->st_size);
+            return 0;
+        }
+    }
+    else {
+        file_map_unmap(victim);
+        victim->cached = 1;
+    }
+    victim->dev = st->st_dev;
+    victim->ino = st->st_ino;
+    victim->mtime = st->st_mtim;
+    victim->size = st->st_size;
+    victim->data = data;
+    victim->refs = 1;
+    victim->last_use = ++CLOCK;
+    return victim;
+}
+
+static int in_cache(struct file_map *map) {
+    return map >= CACHE && map < CACHE + FILE_MAP_CACHE_SIZE;
+}
+
+void file_map_put(struct file_map *map) {
+    map->refs--;
+    if(map->refs > 0) return;
+    if(!in_cache(map)) {
+        file_map_unmap(map);
+        free(map);
+    }
+    else if(!map->cached) {
+        file_map_unmap(map);
+    }
+}
+
+void file_map_invalidate(struct file_map *map) {
+    map->cached = 0;
+}
+
+void file_map_cleanup(void) {
+    for(size_t i = 0; i < FILE_MAP_CACHE_SIZE; i++) {
+        file_map_unmap(CACHE + i);
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H 1
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* number of mappings kept around once their last user is done */
+#define FILE_MAP_CACHE_SIZE 32
+
+struct file_map {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    size_t size;
+    const void *data;
+    /* number of users of the mapping */
+    int refs;
+    /* 0 once the file changed, the mapping is dropped by the last user */
+    int cached;
+    unsigned long last_use;
+};
+
+/* installs the SIGBUS handler used by `file_map_guard`
+ * Returns: 0 on success, -1 otherwise */
+int file_map_init(void);
+
+/* Maps `fd` read only for sequential access, `st` is the file's current stat.
+ * A mapping of the same unchanged file is reused when there is one.
+ * Returns: the mapping, release it with `file_map_put`
+ *  0 on error, check errno */
+struct file_map *file_map_get(int fd, const struct stat *st);
+
+void file_map_put(struct file_map *map);
+
+/* stops `map` from being handed out again, eg: when the file was truncated */
+void file_map_invalidate(struct file_map *map);
+
+/* Until `file_map_unguard` is called, a SIGBUS raised by reading past the end
+ * of a truncated file siglongjmps to `jmp` instead of killing the process */
+void file_map_guard(sigjmp_buf *jmp);
+
+void file_map_unguard(void);
+
+void file_map_cleanup(void);
+
+#endif
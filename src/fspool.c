@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include "fspool.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+#include "mime.h"
+#include "resolve.h"
+
+/* a path found in the page cache */
+struct hot_path {
+    uint64_t hash;
+    /* monotonic seconds until which it is trusted to still be there */
+    time_t until;
+};
+
+/* what the pool does not count, and the paths found in the page cache,
+ * guarded by HOT_LOCK */
+static pthread_mutex_t HOT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static struct hot_path HOT[FSPOOL_HOT_SLOTS];
+static struct fspool_stats STATS = {0};
+
+/* FNV-1a of the target of `job` under its base_dir, 0 is kept for the
+ * empty slots */
+static uint64_t job_hash(const struct fs_job *job) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for(size_t i = 0; i < job->base_dir_len; i++) {
+        hash = (hash ^ (unsigned char)job->base_dir[i]) * 0x100000001b3ull;
+    }
+    hash = (hash ^ '/') * 0x100000001b3ull;
+    for(const char *c = job->file; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 0x100000001b3ull;
+    }
+    return hash ? hash : 1;
+}
+
+static time_t now_seconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/* Returns: 1 if the first FSPOOL_RESIDENT_CHECK bytes of `fd` are in the
+ * page cache, reading them would not wait on the disk */
+static int resident(int fd, size_t size) {
+    unsigned char pages[FSPOOL_RESIDENT_CHECK / 4096];
+    size_t len = size < FSPOOL_RESIDENT_CHECK ? size : FSPOOL_RESIDENT_CHECK;
+    size_t page = sysconf(_SC_PAGESIZE);
+    int ret = 1;
+    void *map;
+
+    if(!len) return 1;
+    map = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) return 0;
+    if(mincore(map, len, pages)) ret = 0;
+    for(size_t i = 0; ret && i < (len + page - 1) / page; i++) {
+        if(!(pages[i] & 1)) ret = 0;
+    }
+    munmap(map, len);
+    return ret;
+}
+
+/* opens the file of `job`, the first half of `fspool_resolve` */
+static void job_open(struct fs_job *job) {
+    job->fd = -1;
+    job->type[0] = '\0';
+    job->result = resolve_path(
+            job->base_dir,
+            job->base_dir_len,
+            job->file,
+            job->path,
+            job->path_size,
+            &job->fd,
+            &job->st);
+}
+
+/* looks at the open file of `job`, the second half of `fspool_resolve` */
+static void job_inspect(struct fs_job *job) {
+    const char *type;
+
+    if(job->result != RESOLVE_FILE) return;
+    /* copied, libmagic's answer is overwritten by the thread's next one */
+    type = mime_get(job->path, job->fd);
+    if(type) snprintf(job->type, sizeof(job->type), "%s", type);
+    /* read front to back, the kernel reads further ahead */
+    if((size_t)job->st.st_size > FSPOOL_RESIDENT_CHECK) {
+        posix_fadvise(job->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+void fspool_resolve(struct fs_job *job) {
+    job_open(job);
+    job_inspect(job);
+}
+
+/* Resolves `job`, a `struct fs_job*`, on a pool thread, noting whether the
+ * file was in the page cache and reading its start ahead if it was not
+ * Returns: 0, a file that is not there is an answer too */
+static int work(void *job) {
+    struct fs_job *fs_job = *(struct fs_job**)job;
+    int in_cache = 0;
+    int read_ahead = 0;
+
+    job_open(fs_job);
+    /* before libmagic reads the start of the file in */
+    if(fs_job->result == RESOLVE_FILE) {
+        in_cache = resident(fs_job->fd, fs_job->st.st_size);
+        /* read here rather than by the serving thread as it sends it,
+         * whatever its size */
+        if(!in_cache) {
+            readahead(fs_job->fd, 0, (size_t)fs_job->st.st_size < FSPOOL_READAHEAD
+                    ? (size_t)fs_job->st.st_size : FSPOOL_READAHEAD);
+            read_ahead = 1;
+        }
+    }
+    job_inspect(fs_job);
+
+    pthread_mutex_lock(&HOT_LOCK);
+    if(in_cache) {
+        uint64_t hash = job_hash(fs_job);
+        HOT[hash % FSPOOL_HOT_SLOTS].hash = hash;
+        HOT[hash % FSPOOL_HOT_SLOTS].until = now_seconds() + FSPOOL_HOT_TTL;
+        STATS.resident++;
+    }
+    STATS.readahead += read_ahead;
+    pthread_mutex_unlock(&HOT_LOCK);
+    return 0;
+}
+
+/* libmagic's handles are not to be shared between threads */
+static void thread_init(void) {
+    if(mime_init()) logging(WARN, "file system thread without MIME types");
+}
+
+static struct fs_job *PENDING[FSPOOL_QUEUE_SIZE];
+static struct fs_job *FINISHED[FSPOOL_QUEUE_SIZE];
+static struct timespec QUEUED[FSPOOL_QUEUE_SIZE];
+
+static struct threadpool POOL = THREADPOOL_INIT(
+        "the file system work",
+        work,
+        struct fs_job*,
+        FSPOOL_QUEUE_SIZE,
+        PENDING,
+        FINISHED,
+        QUEUED,
+        .thread_init = thread_init,
+        .thread_cleanup = mime_cleanup);
+
+int fspool_start(int nb_threads) {
+    return threadpool_start(&POOL, nb_threads);
+}
+
+int fspool_fd(void) {
+    return threadpool_fd(&POOL);
+}
+
+int fspool_submit(struct fs_job *job) {
+    uint64_t hash = job_hash(job);
+    const struct hot_path *hot = HOT + hash % FSPOOL_HOT_SLOTS;
+
+    pthread_mutex_lock(&HOT_LOCK);
+    if(hot->hash == hash && hot->until > now_seconds()) {
+        STATS.hot++;
+        pthread_mutex_unlock(&HOT_LOCK);
+        return -1;
+    }
+    pthread_mutex_unlock(&HOT_LOCK);
+    return threadpool_submit(&POOL, &job);
+}
+
+struct fs_job *fspool_collect(void) {
+    struct fs_job *job;
+
+    return threadpool_collect(&POOL, &job) ? job : 0;
+}
+
+void fspool_stats(struct fspool_stats *stats) {
+    struct threadpool_stats pool;
+
+    threadpool_stats(&POOL, &pool);
+    pthread_mutex_lock(&HOT_LOCK);
+    *stats = STATS;
+    pthread_mutex_unlock(&HOT_LOCK);
+    stats->queued = pool.queued;
+    stats->overflowed = pool.overflowed;
+    stats->depth = pool.depth;
+    stats->max_depth = pool.max_depth;
+    stats->work_ns = pool.work_ns;
+    stats->max_latency_ns = pool.max_latency_ns;
+}
+
+void fspool_stop(void) {
+    threadpool_stop(&POOL);
+}
@@ -0,0 +1,98 @@
+#ifndef FSPOOL_H
+#define FSPOOL_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "threadpool.h"
+
+#define FSPOOL_THREADS_MAX THREADPOOL_THREADS_MAX
+
+/* requests waiting on the file system threads, past it they are resolved
+ * on the serving thread */
+#define FSPOOL_QUEUE_SIZE 1024
+
+/* files found in the page cache are resolved on the serving thread for this
+ * many seconds, then looked at again by a thread */
+#define FSPOOL_HOT_TTL 10
+
+/* paths remembered as in the page cache, a newer one takes the slot of an
+ * older one */
+#define FSPOOL_HOT_SLOTS 4096
+
+/* bytes from the start of a file whose pages are checked for residency, and
+ * read ahead of a file not in the page cache */
+#define FSPOOL_RESIDENT_CHECK (1024 * 1024)
+#define FSPOOL_READAHEAD (2 * 1024 * 1024)
+
+/* room for a MIME type out of libmagic */
+#define FSPOOL_TYPE_SIZE 128
+
+/* a request target to map onto a base_dir, see `resolve_path` */
+struct fs_job {
+    const char *base_dir;
+    size_t base_dir_len;
+    /* without its leading '/' */
+    const char *file;
+    char *path;
+    size_t path_size;
+    /* one of `enum resolve_result`, with the open file and the stat it
+     * comes with */
+    int result;
+    int fd;
+    struct stat st;
+    /* the MIME type of a file, empty if it could not be found */
+    char type[FSPOOL_TYPE_SIZE];
+    /* the caller's, handed back as is */
+    void *data;
+};
+
+struct fspool_stats {
+    /* handed to the threads */
+    uint64_t queued;
+    /* resolved on the serving thread, found in the page cache earlier,
+     * then because the queue was full */
+    uint64_t hot;
+    uint64_t overflowed;
+    /* files found in the page cache by the threads, and read ahead */
+    uint64_t resident;
+    uint64_t readahead;
+    /* waiting for a thread right now, and at most */
+    uint64_t depth;
+    uint64_t max_depth;
+    /* nanoseconds spent on the file system by the threads */
+    uint64_t work_ns;
+    /* the longest from submission to completion */
+    uint64_t max_latency_ns;
+};
+
+/* Starts `nb_threads` threads resolving the requests for files, the pool
+ * replaces the running one, 0 stops it
+ * Returns: 0 on success, -1 on error, files are then resolved on the
+ *  serving thread */
+int fspool_start(int nb_threads);
+
+/* Returns: the eventfd that becomes readable once jobs are done, -1
+ *  without threads */
+int fspool_fd(void);
+
+/* Queues `job`, it is the pool's until collected
+ * Returns: 0 if a thread will do it, -1 if the caller has to, the file is
+ *  then in the page cache or the queue is full */
+int fspool_submit(struct fs_job *job);
+
+/* Does `job` on the calling thread, what a pool thread would do */
+void fspool_resolve(struct fs_job *job);
+
+/* Takes a job that is done
+ * Returns: the job, 0 if none is left */
+struct fs_job *fspool_collect(void);
+
+void fspool_stats(struct fspool_stats *stats);
+
+/* finishes the queued jobs and stops the threads, the jobs done are still
+ * to be collected */
+void fspool_stop(void);
+
+#endif
@@ -0,0 +1,1121 @@
+#include "h2.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "autoindex.h"
+#include "cache_rule.h"
+#include "default_pages.h"
+#include "file_map.h"
+#include "hpack.h"
+#include "logging.h"
+#include "mime.h"
+#include "pack.h"
+#include "ratelimit.h"
+#include "pathfilter.h"
+#include "fcgi.h"
+#include "router.h"
+#include "vhost.h"
+#include "resolve.h"
+#include "send.h"
+#include "trace.h"
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN (sizeof(PREFACE) - 1)
+
+#define FRAME_HEADER_LEN 9
+/* SETTINGS_MAX_FRAME_SIZE, the default is kept in both directions */
+#define FRAME_SIZE 16384
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+/* longest header block accepted over HEADERS and CONTINUATION frames */
+#define MAX_HEADER_BLOCK (4 * FRAME_SIZE)
+#define DEFAULT_WEIGHT 16
+/* pass a stream of weight 1 gains for a full frame */
+#define STRIDE 65536
+/* frames are queued and written together, a HEADERS frame and the DATA
+ * following it would otherwise wait on each other's ACK */
+#define OUT_SIZE (4 * (FRAME_HEADER_LEN + FRAME_SIZE))
+
+static const unsigned char ALPN_PROTOS[] = "\x02h2\x08http/1.1";
+
+/* length of "\x02h2" at the start of ALPN_PROTOS */
+#define ALPN_H2_LEN 3
+
+enum frame_type {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9,
+};
+
+enum frame_flag {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20,
+};
+
+enum h2_error {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+    H2_HTTP_1_1_REQUIRED = 0xd,
+};
+
+enum settings_id {
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+/* a response being sent, requests are answered as soon as their headers are
+ * in so only the body is left */
+struct h2_stream {
+    /* 0 for a free slot */
+    uint32_t id;
+    int64_t window;
+    /* 1 to 256 */
+    uint32_t weight;
+    /* virtual time of the stride scheduler, lowest goes next */
+    uint64_t pass;
+    const char *body;
+    size_t body_len;
+    size_t sent;
+    /* set when `body` lies in a file mapping */
+    struct file_map *map;
+    /* set when `body` is a copy owned by the stream */
+    char *page;
+};
+
+struct h2_request {
+    char method[16];
+    char path[BUFFSIZE];
+    /* `:authority`, or `host` without one, empty when too long for a name */
+    char host[VHOST_NAME_MAX + sizeof(":65535")];
+    int has_method;
+    int has_path;
+    int gzip;
+    /* a pseudo header was malformed or too long */
+    int bad;
+};
+
+struct h2_conn {
+    struct conn *conn;
+    struct config *config;
+    struct hpack_table decoder;
+    /* connection level send window */
+    int64_t window;
+    /* SETTINGS_INITIAL_WINDOW_SIZE of the peer */
+    int64_t initial_window;
+    uint32_t last_stream_id;
+    /* requests seen, the first one was paid for when the connection came */
+    uint64_t nb_requests;
+    /* the connection came in over the rate limit */
+    int limited;
+    /* the peer sent a GOAWAY, no new stream will come */
+    int goaway;
+    struct h2_stream streams[H2_MAX_STREAMS];
+    size_t nb_streams;
+    /* pass of the last stream scheduled, new streams start from it */
+    uint64_t pass;
+    /* header block reassembled from HEADERS and CONTINUATION frames */
+    uint8_t block[MAX_HEADER_BLOCK];
+    size_t block_len;
+    uint32_t block_stream;
+    uint32_t block_weight;
+    int in_block;
+    uint8_t in[FRAME_SIZE];
+    /* frames are built in place, see `frame_payload` */
+    uint8_t out[OUT_SIZE];
+    size_t out_len;
+    /* a write failed, nothing more can be sent */
+    int broken;
+    /* when the connection came, and when a request last came or data last
+     * went, CLOCK_MONOTONIC */
+    struct timespec started;
+    struct timespec active;
+};
+
+int h2_alpn_select(
+        SSL *ssl,
+        const unsigned char **out,
+        unsigned char *out_len,
+        const unsigned char *in,
+        unsigned int in_len,
+        void *arg) {
+    struct config *config = config_get();
+    /* proxied requests are only relayed over HTTP/1.1 */
+    int skip_h2 = config && config->nb_proxies;
+
+    config_put(config);
+    if(SSL_select_next_proto(
+                (unsigned char**)out,
+                out_len,
+                ALPN_PROTOS + (skip_h2 ? ALPN_H2_LEN : 0),
+                sizeof(ALPN_PROTOS) - 1 - (skip_h2 ? ALPN_H2_LEN : 0),
+                in,
+                in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int h2_negotiated(struct conn *conn) {
+    const unsigned char *proto;
+    unsigned int proto_len;
+
+    if(conn->type != CONN_SSL) return 0;
+    SSL_get0_alpn_selected(conn->data.ssl, &proto, &proto_len);
+    return proto_len == 2 && !memcmp(proto, "h2", 2);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/* Returns: 0 once `len` bytes were read, -1 on error or end of stream */
+static int read_exact(struct conn *conn, void *buf, size_t len) {
+    size_t got = 0;
+    while(got < len) {
+        ssize_t ret = conn_read(conn, (char*)buf + got, len - got);
+        if(ret <= 0) return -1;
+        got += ret;
+    }
+    return 0;
+}
+
+/* Returns: the milliseconds elapsed since `from` */
+static int64_t ms_since(const struct timespec *from) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - from->tv_sec) * 1000
+        + (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/* Returns: 1 if a frame can be read, 0 on timeout, -1 on error */
+static int input_ready(struct h2_conn *h2, int timeout_ms) {
+    struct pollfd pfd = {.fd = conn_fd(h2->conn), .events = POLLIN};
+    int ret;
+
+    if(conn_pending(h2->conn)) return 1;
+    ret = poll(&pfd, 1, timeout_ms);
+    if(ret == -1) {
+        /* a signal, the caller decides what to do with the time left */
+        if(errno == EINTR) return 0;
+        logging_errno(WARN, "poll: ");
+        return -1;
+    }
+    return ret > 0;
+}
+
+/* Writes the frames queued so far
+ * Returns: 0 on success, -1 on error */
+static int flush(struct h2_conn *h2) {
+    size_t len = h2->out_len;
+
+    h2->out_len = 0;
+    if(!len || h2->broken) return -h2->broken;
+    if(conn_write(h2->conn, h2->out, len) != (ssize_t)len) {
+        logging(INFO, "unable to send HTTP/2 frames");
+        h2->broken = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns: where to build the payload of the next frame, up to FRAME_SIZE
+ * bytes, it is queued by `send_frame` */
+static uint8_t *frame_payload(struct h2_conn *h2) {
+    /* a failure is reported by `send_frame` */
+    if(OUT_SIZE - h2->out_len < FRAME_HEADER_LEN + FRAME_SIZE) flush(h2);
+    return h2->out + h2->out_len + FRAME_HEADER_LEN;
+}
+
+/* Queues the frame whose `len` bytes of payload were built at
+ * `frame_payload`
+ * Returns: 0 on success, -1 on error */
+static int send_frame(
+        struct h2_conn *h2,
+        enum frame_type type,
+        uint8_t flags,
+        uint32_t stream_id,
+        size_t len) {
+    uint8_t *header = h2->out + h2->out_len;
+
+    if(h2->broken) return -1;
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    put32(header + 5, stream_id & MAX_WINDOW);
+    h2->out_len += FRAME_HEADER_LEN + len;
+    return 0;
+}
+
+/* like `send_frame` for the short frames built elsewhere */
+static int send_control(
+        struct h2_conn *h2,
+        enum frame_type type,
+        uint8_t flags,
+        uint32_t stream_id,
+        const void *payload,
+        size_t len) {
+    memcpy(frame_payload(h2), payload, len);
+    return send_frame(h2, type, flags, stream_id, len);
+}
+
+/* Sends a GOAWAY, the connection is over
+ * Returns: -1, for the callers to pass along */
+static int conn_error(struct h2_conn *h2, enum h2_error code) {
+    uint8_t payload[8];
+
+    if(code != H2_NO_ERROR) {
+        logging(INFO, "HTTP/2 connection error %d", code);
+    }
+    put32(payload, h2->last_stream_id);
+    put32(payload + 4, code);
+    send_control(h2, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    flush(h2);
+    return -1;
+}
+
+static struct h2_stream *stream_find(struct h2_conn *h2, uint32_t id) {
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        if(h2->streams[i].id == id) return h2->streams + i;
+    }
+    return 0;
+}
+
+static void stream_release(struct h2_conn *h2, struct h2_stream *stream) {
+    if(stream->map) file_map_put(stream->map);
+    free(stream->page);
+    memset(stream, 0, sizeof(*stream));
+    h2->nb_streams--;
+}
+
+/* Resets `stream` and releases it
+ * Returns: 0 on success, -1 on error */
+static int stream_error(
+        struct h2_conn *h2,
+        struct h2_stream *stream,
+        enum h2_error code) {
+    uint8_t payload[4];
+    uint32_t id = stream->id;
+
+    put32(payload, code);
+    stream_release(h2, stream);
+    return send_control(h2, FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+/* Sends the HEADERS frame whose header block was encoded at `frame_payload` and
+ * queues `body`, the stream is done with when there is nothing to send
+ * Returns: 0 on success, -1 on error */
+static int stream_start(
+        struct h2_conn *h2,
+        struct h2_stream *stream,
+        size_t block_len,
+        const char *body,
+        size_t body_len,
+        int head) {
+    int end = head || !body_len;
+
+    if(send_frame(
+                h2,
+                FRAME_HEADERS,
+                FLAG_END_HEADERS | (end ? FLAG_END_STREAM : 0),
+                stream->id,
+                block_len)) {
+        return -1;
+    }
+    if(end) {
+        stream_release(h2, stream);
+        return 0;
+    }
+    stream->body = body;
+    stream->body_len = body_len;
+    return 0;
+}
+
+/* Answers `stream`, `type`, `field` and `cache` are left out when 0,
+ * `field` is the value of the static table entry `field_index` and `cache`
+ * the rule whose Cache-Control and Expires are sent
+ * Returns: 0 on success, -1 on error */
+static int respond_cached(
+        struct h2_conn *h2,
+        struct h2_stream *stream,
+        int status,
+        const char *type,
+        int field_index,
+        const char *field,
+        struct cache_rule *cache,
+        const char *body,
+        size_t body_len,
+        int head) {
+    uint8_t *block = frame_payload(h2);
+    char length[24];
+    size_t len;
+    size_t ret;
+
+    len = hpack_encode_status(block, FRAME_SIZE, status);
+    if(type) {
+        ret = hpack_encode_header(
+                block + len, FRAME_SIZE - len,
+                HPACK_CONTENT_TYPE, type, strlen(type));
+        if(!ret) goto too_large;
+        len += ret;
+    }
+    if(field) {
+        ret = hpack_encode_header(
+                block + len, FRAME_SIZE - len,
+                field_index, field, strlen(field));
+        if(!ret) goto too_large;
+        len += ret;
+    }
+    if(cache) {
+        const char *value;
+        size_t value_len;
+
+        cache_rule_lines(cache, time(0));
+        value = cache_rule_control(cache, &value_len);
+        ret = hpack_encode_header(
+                block + len, FRAME_SIZE - len,
+                HPACK_CACHE_CONTROL, value, value_len);
+        if(!ret) goto too_large;
+        len += ret;
+        value = cache_rule_expires(cache);
+        if(value) {
+            ret = hpack_encode_header(
+                    block + len, FRAME_SIZE - len,
+                    HPACK_EXPIRES, value, CACHE_DATE_LEN);
+            if(!ret) goto too_large;
+            len += ret;
+        }
+    }
+    /* a 204 has no body to measure */
+    if(status != 204) {
+        ret = hpack_encode_header(
+                block + len, FRAME_SIZE - len,
+                HPACK_CONTENT_LENGTH,
+                length, snprintf(length, sizeof(length), "%zu", body_len));
+        if(!ret) goto too_large;
+        len += ret;
+    }
+
+    return stream_start(h2, stream, len, body, body_len, head);
+
+too_large:
+    return stream_error(h2, stream, H2_INTERNAL_ERROR);
+}
+
+static int respond(
+        struct h2_conn *h2,
+        struct h2_stream *stream,
+        int status,
+        const char *type,
+        int field_index,
+        const char *field,
+        const char *body,
+        size_t body_len,
+        int head) {
+    return respond_cached(h2, stream, status, type, field_index, field, 0,
+            body, body_len, head);
+}
+
+/* Answers `stream` with an entry of the archive, its HTTP/1.1 headers are
+ * converted to a header block
+ * Returns: 0 on success, -1 on error */
+static int respond_pack(
+        struct h2_conn *h2,
+        struct h2_stream *stream,
+        const struct pack_entry *entry,
+        int gzip,
+        int head) {
+    uint8_t *block = frame_payload(h2);
+    struct iovec iov[2];
+    const char *line;
+    const char *end;
+    size_t len;
+
+    pack_entry_iov(&h2->config->pack, entry, gzip, iov);
+    line = iov[0].iov_base;
+    end = line + iov[0].iov_len;
+
+    /* `HTTP/1.1 200 OK` */
+    line = memchr(line, ' ', end - line);
+    if(!line) return stream_error(h2, stream, H2_INTERNAL_ERROR);
+    len = hpack_encode_status(block, FRAME_SIZE, atoi(line + 1));
+
+    for(;;) {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *colon;
+        size_t ret;
+
+        if(!eol) break;
+        line = eol + 1;
+        eol = memchr(line, '\r', end - line);
+        if(!eol || eol == line) break;
+        colon = memchr(line, ':', eol - line);
+        if(!colon) continue;
+
+        const char *value = colon + 1;
+        while(value < eol && *value == ' ') value++;
+        ret = hpack_encode_field(
+                block + len, FRAME_SIZE - len,
+                line, colon - line,
+                value, eol - value);
+        if(!ret) return stream_error(h2, stream, H2_INTERNAL_ERROR);
+        len += ret;
+    }
+
+    return stream_start(h2, stream, len, iov[1].iov_base, iov[1].iov_len, head);
+}
+
+/* Answers `stream` with the body of one of the config's error pages, its
+ * HTTP/1.1 headers are left behind */
+static int respond_error(
+        struct h2_conn *h2,
+        struct h2_stream *stream,
+        enum error_page_kind kind,
+        int field_index,
+        const char *field,
+        int head) {
+    const struct error_page *page = h2->config->error_pages + kind;
+
+    return respond(h2, stream, page->status, "text/html", field_index, field,
+            page->data + page->head_len, page->len - page->head_len, head);
+}
+
+static int respond_not_found(
+        struct h2_conn *h2,
+        struct h2_stream *stream,
+        const char *file,
+        int head) {
+    return respond_error(h2, stream, ERROR_PAGE_404, 0, 0, head);
+}
+
+/* Sends what a route handler filled `response` with, the stream takes over
+ * its body
+ * Returns: 0 on success, -1 on error */
+static int respond_routed(
+        struct h2_conn *h2,
+        struct h2_stream *stream,
+        struct route_response *response,
+        int head) {
+    if(response->error_page >= 0) {
+        route_response_cleanup(response);
+        return respond_error(h2, stream, response->error_page, 0, 0, head);
+    }
+    stream->page = response->owned;
+    response->owned = 0;
+    return respond(h2, stream, response->status, response->type,
+            response->location ? HPACK_LOCATION : 0, response->location,
+            response->body, response->body_len, head);
+}
+
+/* Answers a request the way `handle_conn` does over HTTP/1.1
+ * Returns: 0 on success, -1 on error */
+static int stream_respond(
+        struct h2_conn *h2,
+        struct h2_stream *stream,
+        const struct h2_request *request) {
+    struct config *config = h2->config;
+    struct route_response routed;
+    enum http_method method;
+    const struct vhost *vhost;
+    char path_buff[BUFFSIZE];
+    const char *base_dir;
+    size_t base_dir_len;
+    const char *file;
+    const char *type;
+    struct stat st;
+    char *copy;
+    int head;
+    int filtered;
+    int fd = -1;
+
+    /* FastCGI responses are only streamed over HTTP/1.1, clients retry
+     * there on this error */
+    if(fcgi_match_target(config->fastcgi, config->nb_fastcgi,
+                request->path, strlen(request->path))) {
+        return stream_error(h2, stream, H2_HTTP_1_1_REQUIRED);
+    }
+    method = http_method_parse(request->method);
+    PROBE(request_parsed, conn_fd(h2->conn), method, (const char*)request->path);
+    head = method == HEAD;
+    /* the endpoints served from memory shadow base_dir */
+    if(router_serve(&config->router, method, request->path,
+                conn_peer_in(h2->conn, config->status_allow, config->nb_status_allow),
+                &routed)) {
+        return respond_routed(h2, stream, &routed, head);
+    }
+    if(!strcmp(request->method, "OPTIONS")) {
+        return respond(h2, stream, 204, 0, HPACK_ALLOW, ALLOWED_METHODS,
+                0, 0, 1);
+    }
+    if(!head && strcmp(request->method, "GET")) {
+        return respond_error(h2, stream, ERROR_PAGE_405, HPACK_ALLOW, ALLOWED_METHODS,
+                head);
+    }
+    /* the health check path, query string or not */
+    if(config->health_path
+            && !strncmp(request->path, config->health_path, config->health_path_len)
+            && (request->path[config->health_path_len] == '\0'
+                || request->path[config->health_path_len] == '?')) {
+        return respond(h2, stream, 200, "text/plain", HPACK_CACHE_CONTROL, "no-store",
+                "ok\n", 3, head);
+    }
+    if(request->path[0] != '/') {
+        return respond_not_found(h2, stream, request->path, head);
+    }
+    file = request->path + 1;
+
+    /* the site asked for, the top level one when no vhost has the name */
+    vhost = vhost_lookup(&config->vhost_table, request->host, strlen(request->host));
+    base_dir = vhost ? vhost->base_dir : config->base_dir;
+    base_dir_len = vhost ? vhost->base_dir_len : config->base_dir_len;
+
+    /* the archive replaces the top level base_dir entirely */
+    if(!vhost && config->pack.data) {
+        const struct pack_entry *entry;
+        ssize_t len = resolve_decode(file, path_buff, BUFFSIZE);
+
+        if(len < 0) return respond_not_found(h2, stream, file, head);
+        entry = pack_lookup(&config->pack, path_buff, len);
+        if(entry) {
+            return respond_pack(h2, stream, entry, request->gzip, head);
+        }
+        /* `/dir` -> `/dir/` */
+        if((size_t)len + 1 < BUFFSIZE) {
+            path_buff[len] = '/';
+            if(pack_lookup(&config->pack, path_buff, len + 1)
+                    && resolve_redirect(file, path_buff, BUFFSIZE) >= 0) {
+                return respond(h2, stream, 308, 0, HPACK_LOCATION, path_buff,
+                        0, 0, head);
+            }
+        }
+        return respond_not_found(h2, stream, file, head);
+    }
+
+    filtered = pathfilter_lookup(base_dir, file);
+    if(filtered == PATHFILTER_ABSENT) {
+        return respond_not_found(h2, stream, file, head);
+    }
+
+    switch(resolve_path(
+                base_dir,
+                base_dir_len,
+                file,
+                path_buff,
+                BUFFSIZE,
+                &fd,
+                &st)) {
+        case RESOLVE_FILE:
+            PROBE(file_opened, fd, (char*)path_buff);
+            break;
+        case RESOLVE_REDIRECT:
+            /* `/dir` -> `/dir/` */
+            if(resolve_redirect(file, path_buff, BUFFSIZE) < 0) {
+                return respond_not_found(h2, stream, file, head);
+            }
+            return respond(h2, stream, 308, 0, HPACK_LOCATION, path_buff,
+                    0, 0, head);
+        case RESOLVE_DIR:
+            if((vhost ? vhost->autoindex : config->autoindex) > 0) {
+                const char *page;
+                size_t page_len;
+                if(autoindex_get(
+                            path_buff,
+                            path_buff + base_dir_len + 1,
+                            &st,
+                            &page,
+                            &page_len)) {
+                    goto server_error;
+                }
+                /* the cached listing can be rendered again before the
+                 * stream is done with it */
+                copy = malloc(page_len);
+                if(!copy) goto server_error;
+                memcpy(copy, page, page_len);
+                stream->page = copy;
+                return respond(h2, stream, 200, "text/html", 0, 0,
+                        stream->page, page_len, head);
+            }
+            return respond_not_found(h2, stream, file, head);
+        case RESOLVE_NOT_FOUND:
+            /* the filter had it */
+            if(filtered == PATHFILTER_MAYBE) pathfilter_false_positive();
+            return respond_not_found(h2, stream, file, head);
+    }
+
+    /* ##### At this point a file is found ##### */
+    type = mime_get(path_buff, fd);
+    PROBE(mime_resolved, (char*)path_buff, type);
+    if(!type) goto server_error;
+    if(st.st_size) {
+        /* the mapping holds on to the file, the streams interleave so the
+         * body is copied from it a frame at a time */
+        stream->map = file_map_get(fd, &st);
+        if(!stream->map) {
+            logging_errno(ERR, "mmap: ");
+            goto server_error;
+        }
+    }
+    close(fd);
+    return respond_cached(h2, stream, 200, type, 0, 0,
+            cache_rule_match(config->cache_rules, config->nb_cache_rules,
+                path_buff + base_dir_len, type),
+            stream->map ? (const char*)stream->map->data : 0, st.st_size, head);
+
+server_error:
+    if(fd != -1) close(fd);
+    return respond_error(h2, stream, ERROR_PAGE_500, 0, 0, head);
+}
+
+/* Returns: 1 if `token` appears in `value` */
+static int has_token(const char *value, size_t value_len, const char *token) {
+    size_t token_len = strlen(token);
+    for(size_t i = 0; i + token_len <= value_len; i++) {
+        if(!memcmp(value + i, token, token_len)) return 1;
+    }
+    return 0;
+}
+
+static int on_header(
+        void *ctx,
+        const char *name,
+        size_t name_len,
+        const char *value,
+        size_t value_len) {
+    struct h2_request *request = ctx;
+
+    if(name_len == sizeof(":method") - 1 && !memcmp(name, ":method", name_len)) {
+        if(value_len >= sizeof(request->method)) {
+            request->bad = 1;
+            return 0;
+        }
+        memcpy(request->method, value, value_len);
+        request->method[value_len] = '\0';
+        request->has_method = 1;
+    }
+    else if(name_len == sizeof(":path") - 1 && !memcmp(name, ":path", name_len)) {
+        if(value_len >= sizeof(request->path) || memchr(value, '\0', value_len)) {
+            request->bad = 1;
+            return 0;
+        }
+        memcpy(request->path, value, value_len);
+        request->path[value_len] = '\0';
+        request->has_path = 1;
+    }
+    else if((name_len == sizeof(":authority") - 1
+                && !memcmp(name, ":authority", name_len))
+            || (name_len == sizeof("host") - 1 && !memcmp(name, "host", name_len)
+                && !request->host[0])) {
+        if(value_len < sizeof(request->host) && !memchr(value, '\0', value_len)) {
+            memcpy(request->host, value, value_len);
+            request->host[value_len] = '\0';
+        }
+    }
+    else if(name_len == sizeof("accept-encoding") - 1
+            && !memcmp(name, "accept-encoding", name_len)) {
+        request->gzip = has_token(value, value_len, "gzip");
+    }
+    return 0;
+}
+
+/* Decodes the header block reassembled so far and answers its request
+ * Returns: 0 on success, -1 on a connection error */
+static int headers_done(struct h2_conn *h2) {
+    struct h2_request request = {0};
+    struct h2_stream *stream = 0;
+    uint32_t id = h2->block_stream;
+
+    h2->in_block = 0;
+    /* the decoder's table must see every block, even ones we drop */
+    if(hpack_decode(&h2->decoder, h2->block, h2->block_len, on_header, &request)) {
+        return conn_error(h2, H2_COMPRESSION_ERROR);
+    }
+    h2->block_len = 0;
+
+    /* trailers, the request was answered when its headers came in */
+    if(id <= h2->last_stream_id) return 0;
+    h2->last_stream_id = id;
+
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        if(!h2->streams[i].id) {
+            stream = h2->streams + i;
+            break;
+        }
+    }
+    if(!stream) {
+        uint8_t payload[4];
+        put32(payload, H2_REFUSED_STREAM);
+        return send_control(h2, FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+    }
+    stream->id = id;
+    stream->window = h2->initial_window;
+    stream->weight = h2->block_weight;
+    stream->pass = h2->pass;
+    h2->nb_streams++;
+    clock_gettime(CLOCK_MONOTONIC, &h2->active);
+
+    if(!request.has_method || !request.has_path || request.bad) {
+        return stream_error(h2, stream, H2_PROTOCOL_ERROR);
+    }
+    if(h2->nb_requests++
+            ? !ratelimit_take(&h2->config->rate_limit, (struct sockaddr*)&h2->conn->peer)
+            : h2->limited) {
+        if(h2->config->rate_limit_action == RATELIMIT_CLOSE) {
+            return stream_error(h2, stream, H2_ENHANCE_YOUR_CALM);
+        }
+        return respond(h2, stream, 429, 0, HPACK_RETRY_AFTER, "1", 0, 0, 0);
+    }
+    return stream_respond(h2, stream, &request);
+}
+
+/* Returns: 0 on success, -1 on a connection error */
+static int block_append(struct h2_conn *h2, const uint8_t *data, size_t len) {
+    if(len > MAX_HEADER_BLOCK - h2->block_len) {
+        logging(INFO, "HTTP/2 header block too large");
+        return conn_error(h2, H2_PROTOCOL_ERROR);
+    }
+    memcpy(h2->block + h2->block_len, data, len);
+    h2->block_len += len;
+    return 0;
+}
+
+/* Returns: 0 on success, -1 on a connection error */
+static int on_headers(struct h2_conn *h2, uint8_t flags, uint32_t id, size_t len) {
+    const uint8_t *payload = h2->in;
+    uint32_t weight = DEFAULT_WEIGHT;
+
+    if(!id || !(id & 1)) return conn_error(h2, H2_PROTOCOL_ERROR);
+    if(flags & FLAG_PADDED) {
+        if(!len || payload[0] >= len) return conn_error(h2, H2_PROTOCOL_ERROR);
+        len -= payload[0] + 1;
+        payload++;
+    }
+    if(flags & FLAG_PRIORITY) {
+        if(len < 5) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+        weight = payload[4] + 1;
+        payload += 5;
+        len -= 5;
+    }
+
+    h2->block_len = 0;
+    h2->block_stream = id;
+    h2->block_weight = weight;
+    h2->in_block = 1;
+    if(block_append(h2, payload, len)) return -1;
+    if(flags & FLAG_END_HEADERS) return headers_done(h2);
+    return 0;
+}
+
+/* Returns: 0 on success, -1 on a connection error */
+static int on_settings(struct h2_conn *h2, uint8_t flags, uint32_t id, size_t len) {
+    if(id) return conn_error(h2, H2_PROTOCOL_ERROR);
+    if(flags & FLAG_ACK) {
+        if(len) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+        return 0;
+    }
+    if(len % 6) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+
+    for(size_t i = 0; i < len; i += 6) {
+        uint16_t setting = h2->in[i] << 8 | h2->in[i + 1];
+        uint32_t value = get32(h2->in + i + 2);
+
+        switch(setting) {
+            case SETTINGS_ENABLE_PUSH:
+                if(value > 1) return conn_error(h2, H2_PROTOCOL_ERROR);
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                int64_t delta;
+                if(value > MAX_WINDOW) return conn_error(h2, H2_FLOW_CONTROL_ERROR);
+                delta = (int64_t)value - h2->initial_window;
+                for(size_t j = 0; j < H2_MAX_STREAMS; j++) {
+                    struct h2_stream *stream = h2->streams + j;
+                    if(!stream->id) continue;
+                    stream->window += delta;
+                    if(stream->window > MAX_WINDOW) {
+                        return conn_error(h2, H2_FLOW_CONTROL_ERROR);
+                    }
+                }
+                h2->initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                /* we never send more than the minimum anyway */
+                if(value < FRAME_SIZE || value > 0xffffff) {
+                    return conn_error(h2, H2_PROTOCOL_ERROR);
+                }
+                break;
+            default:
+                /* the encoder does not index so HEADER_TABLE_SIZE is moot */
+                break;
+        }
+    }
+    return send_control(h2, FRAME_SETTINGS, FLAG_ACK, 0, 0, 0);
+}
+
+/* Returns: 0 on success, -1 on a connection error */
+static int on_window_update(struct h2_conn *h2, uint32_t id, size_t len) {
+    struct h2_stream *stream;
+    uint32_t increment;
+
+    if(len != 4) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+    increment = get32(h2->in) & MAX_WINDOW;
+
+    if(!id) {
+        if(!increment) return conn_error(h2, H2_PROTOCOL_ERROR);
+        h2->window += increment;
+        if(h2->window > MAX_WINDOW) return conn_error(h2, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+    /* updates can race with the end of the stream */
+    stream = stream_find(h2, id);
+    if(!stream) return 0;
+    if(!increment) return stream_error(h2, stream, H2_PROTOCOL_ERROR);
+    stream->window += increment;
+    if(stream->window > MAX_WINDOW) {
+        return stream_error(h2, stream, H2_FLOW_CONTROL_ERROR);
+    }
+    return 0;
+}
+
+/* Reads and handles one frame
+ * Returns: 0 on success, -1 once the connection is over */
+static int read_frame(struct h2_conn *h2) {
+    uint8_t header[FRAME_HEADER_LEN];
+    struct h2_stream *stream;
+    size_t len;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t id;
+
+    if(read_exact(h2->conn, header, FRAME_HEADER_LEN)) return -1;
+    len = header[0] << 16 | header[1] << 8 | header[2];
+    type = header[3];
+    flags = header[4];
+    id = get32(header + 5) & MAX_WINDOW;
+
+    if(len > FRAME_SIZE) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+    if(read_exact(h2->conn, h2->in, len)) return -1;
+
+    /* a header block can't be interleaved with anything */
+    if(h2->in_block && (type != FRAME_CONTINUATION || id != h2->block_stream)) {
+        return conn_error(h2, H2_PROTOCOL_ERROR);
+    }
+
+    switch(type) {
+        case FRAME_DATA:
+            if(!id) return conn_error(h2, H2_PROTOCOL_ERROR);
+            /* request bodies are dropped, let the peer send the rest */
+            if(len) {
+                uint8_t payload[4];
+                put32(payload, len);
+                return send_control(h2, FRAME_WINDOW_UPDATE, 0, 0,
+                        payload, sizeof(payload));
+            }
+            return 0;
+        case FRAME_HEADERS:
+            return on_headers(h2, flags, id, len);
+        case FRAME_CONTINUATION:
+            if(!h2->in_block) return conn_error(h2, H2_PROTOCOL_ERROR);
+            if(block_append(h2, h2->in, len)) return -1;
+            if(flags & FLAG_END_HEADERS) return headers_done(h2);
+            return 0;
+        case FRAME_PRIORITY:
+            if(!id) return conn_error(h2, H2_PROTOCOL_ERROR);
+            if(len != 5) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+            /* only the weight is honoured, the dependency tree is not */
+            stream = stream_find(h2, id);
+            if(stream) stream->weight = h2->in[4] + 1;
+            return 0;
+        case FRAME_RST_STREAM:
+            if(!id) return conn_error(h2, H2_PROTOCOL_ERROR);
+            if(len != 4) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+            stream = stream_find(h2, id);
+            if(stream) stream_release(h2, stream);
+            return 0;
+        case FRAME_SETTINGS:
+            return on_settings(h2, flags, id, len);
+        case FRAME_PUSH_PROMISE:
+            /* clients can't push */
+            return conn_error(h2, H2_PROTOCOL_ERROR);
+        case FRAME_PING:
+            if(id) return conn_error(h2, H2_PROTOCOL_ERROR);
+            if(len != 8) return conn_error(h2, H2_FRAME_SIZE_ERROR);
+            if(flags & FLAG_ACK) return 0;
+            return send_control(h2, FRAME_PING, FLAG_ACK, 0, h2->in, len);
+        case FRAME_GOAWAY:
+            h2->goaway = 1;
+            return 0;
+        case FRAME_WINDOW_UPDATE:
+            return on_window_update(h2, id, len);
+        default:
+            /* unknown frames are ignored */
+            return 0;
+    }
+}
+
+/* Returns: the stream with the lowest pass among the ones the flow control
+ * lets send, 0 if there is none */
+static struct h2_stream *schedule(struct h2_conn *h2) {
+    struct h2_stream *next = 0;
+
+    if(h2->window <= 0) return 0;
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        struct h2_stream *stream = h2->streams + i;
+        if(!stream->id || stream->sent == stream->body_len || stream->window <= 0) {
+            continue;
+        }
+        if(!next || stream->pass < next->pass) next = stream;
+    }
+    return next;
+}
+
+/* Sends the next DATA frame of `stream`
+ * Returns: 0 on success, -1 on error */
+static int send_data(struct h2_conn *h2, struct h2_stream *stream) {
+    size_t len = stream->body_len - stream->sent;
+    sigjmp_buf jmp;
+    int end;
+
+    if(len > FRAME_SIZE) len = FRAME_SIZE;
+    if((int64_t)len > stream->window) len = stream->window;
+    if((int64_t)len > h2->window) len = h2->window;
+
+    if(stream->map) {
+        if(sigsetjmp(jmp, 1)) {
+            /* the file shrunk under us, only this stream is lost */
+            logging(WARN, "file truncated while being sent, %zu bytes sent",
+                    stream->sent);
+            file_map_invalidate(stream->map);
+            return stream_error(h2, stream, H2_INTERNAL_ERROR);
+        }
+        file_map_guard(&jmp);
+    }
+    memcpy(frame_payload(h2), stream->body + stream->sent, len);
+    if(stream->map) file_map_unguard();
+
+    stream->sent += len;
+    stream->window -= len;
+    h2->window -= len;
+    stream->pass += (uint64_t)len * STRIDE / FRAME_SIZE / stream->weight + 1;
+    h2->pass = stream->pass;
+
+    end = stream->sent == stream->body_len;
+    if(send_frame(h2, FRAME_DATA, end ? FLAG_END_STREAM : 0, stream->id, len)) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &h2->active);
+    if(end) stream_release(h2, stream);
+    return 0;
+}
+
+void h2_serve(struct conn *conn, struct config *config, int limited) {
+    struct h2_conn *h2;
+    char preface[PREFACE_LEN];
+    uint8_t settings[6];
+
+    h2 = calloc(1, sizeof(*h2));
+    if(!h2) {
+        logging_errno(ERR, "calloc: ");
+        return;
+    }
+    h2->conn = conn;
+    h2->config = config;
+    h2->limited = limited;
+    h2->window = DEFAULT_WINDOW;
+    h2->initial_window = DEFAULT_WINDOW;
+    hpack_table_init(&h2->decoder);
+    clock_gettime(CLOCK_MONOTONIC, &h2->started);
+    h2->active = h2->started;
+
+    /* writes are coalesced in `h2->out` already, Nagle would only hold back
+     * the last one, starting with the session tickets of the handshake */
+    int nodelay = 1;
+    setsockopt(conn_fd(conn), IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if(read_exact(conn, preface, PREFACE_LEN)
+            || memcmp(preface, PREFACE, PREFACE_LEN)) {
+        logging(INFO, "invalid HTTP/2 connection preface");
+        goto cleanup;
+    }
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, H2_MAX_STREAMS);
+    if(send_control(h2, FRAME_SETTINGS, 0, 0, settings, sizeof(settings))) {
+        goto cleanup;
+    }
+
+    for(;;) {
+        struct h2_stream *stream = schedule(h2);
+        int64_t idle_left = H2_IDLE_TIMEOUT_MS - ms_since(&h2->active);
+        int64_t life_left = H2_MAX_LIFETIME_MS - ms_since(&h2->started);
+        int ready;
+
+        if(h2->goaway && !h2->nb_streams) break;
+        /* idle, stalled on the flow control of the peer, kept up with
+         * PINGs and the like, or simply served long enough */
+        if(idle_left <= 0 || life_left <= 0) {
+            conn_error(h2, H2_NO_ERROR);
+            break;
+        }
+        /* about to wait on the peer, it must have everything we have */
+        if(!stream && flush(h2)) break;
+
+        /* frames coming in go first, answering requests is cheap and it
+         * gives their streams a share of the bandwidth early */
+        ready = input_ready(h2, stream ? 0 : (int)(idle_left < life_left ? idle_left : life_left));
+        if(ready < 0) break;
+        if(ready) {
+            if(read_frame(h2)) break;
+            continue;
+        }
+        if(stream) {
+            if(send_data(h2, stream)) break;
+        }
+    }
+
+cleanup:
+    flush(h2);
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        if(h2->streams[i].id) stream_release(h2, h2->streams + i);
+    }
+    hpack_table_cleanup(&h2->decoder);
+    free(h2);
+}
@@ -0,0 +1,39 @@
+#ifndef H2_H
+#define H2_H 1
+
+#include <openssl/ssl.h>
+
+#include "conn.h"
+#include "config.h"
+
+/* SETTINGS_MAX_CONCURRENT_STREAMS we advertise */
+#define H2_MAX_STREAMS 100
+
+/* connections are served one at a time, one that neither makes a request
+ * nor takes data for this long is sent a GOAWAY so the next one can be
+ * served, whatever other frames it sends */
+#define H2_IDLE_TIMEOUT_MS 2000
+
+/* and one is sent a GOAWAY this long after it came, however busy it is */
+#define H2_MAX_LIFETIME_MS 60000
+
+/* ALPN callback for `SSL_CTX_set_alpn_select_cb`, picks h2 over http/1.1
+ * Returns: SSL_TLSEXT_ERR_OK, SSL_TLSEXT_ERR_NOACK if nothing matched */
+int h2_alpn_select(
+        SSL *ssl,
+        const unsigned char **out,
+        unsigned char *out_len,
+        const unsigned char *in,
+        unsigned int in_len,
+        void *arg);
+
+/* Returns: 1 if h2 was negotiated during the handshake of `conn` */
+int h2_negotiated(struct conn *conn);
+
+/* Serves HTTP/2 on `conn` until the peer goes away or stays idle, the
+ * connection is left for the caller to close. `limited` is set when the
+ * connection came in over the client's rate limit, its first request is
+ * then refused too */
+void h2_serve(struct conn *conn, struct config *config, int limited);
+
+#endif
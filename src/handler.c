@@ -0,0 +1,493 @@
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "handler.h"
+#include "headers.h"
+#include "logging.h"
+#include "response_header.h"
+#include "send.h"
+#include "config.h"
+#include "resolve.h"
+#include "autoindex.h"
+#include "pack.h"
+#include "h2.h"
+#include "proxy.h"
+#include "fcgi.h"
+#include "ratelimit.h"
+#include "pathfilter.h"
+#include "router.h"
+#include "vhost.h"
+#include "bufpool.h"
+#include "egress.h"
+#include "fspool.h"
+#include "trace.h"
+
+#if BUFPOOL_BUFFER_SIZE != BUFFSIZE
+#error "requests are read into pooled buffers of BUFFSIZE"
+#endif
+
+static const char OPTIONS_RESPONSE[] = (
+    "HTTP/1.1 204 No Content"CRLF
+    "Allow: "ALLOWED_METHODS CRLF
+    CRLF
+);
+
+/* the body has to stay last, HEAD leaves it out */
+static const char HEALTH_RESPONSE[] = (
+    "HTTP/1.1 200 OK"CRLF
+    "Content-Type: text/plain"CRLF
+    "Content-Length: 3"CRLF
+    "Cache-Control: no-store"CRLF
+    CRLF
+    "ok\n"
+);
+
+#define HEALTH_BODY_LEN 3
+
+/* Checks the request line in `buff` against the health check path
+ * Returns: 1 for a GET of the path, 2 for a HEAD, 0 otherwise */
+static int health_match(const struct config *config, const char *buff, size_t len) {
+    size_t method_len;
+    int ret;
+
+    if(!config->health_path) return 0;
+    if(len >= 4 && !memcmp(buff, "GET ", 4)) {
+        method_len = 4;
+        ret = 1;
+    }
+    else if(len >= 5 && !memcmp(buff, "HEAD ", 5)) {
+        method_len = 5;
+        ret = 2;
+    }
+    else {
+        return 0;
+    }
+    len -= method_len;
+    buff += method_len;
+    /* the path, then the protocol or a query string */
+    if(len <= config->health_path_len
+            || memcmp(buff, config->health_path, config->health_path_len)
+            || (buff[config->health_path_len] != ' '
+                && buff[config->health_path_len] != '?')) {
+        return 0;
+    }
+    return ret;
+}
+
+/* Serves the target of `request` out of `pack`, `buff` is scratch space,
+ * only the header is sent for `head`
+ * Returns: 0 if the target was served, -1 if the archive does not hold it */
+static int pack_serve(
+        const struct pack *pack,
+        struct conn *sock,
+        const struct request_header *request,
+        int head,
+        char *buff,
+        size_t buff_size) {
+    const struct pack_entry *entry;
+    struct iovec iov[2];
+    ssize_t len;
+    int gzip;
+
+    len = resolve_decode(request->file, buff, buff_size);
+    if(len < 0) return -1;
+
+    entry = pack_lookup(pack, buff, len);
+    if(!entry) {
+        /* `/dir` -> `/dir/` */
+        if((size_t)len + 1 >= buff_size) return -1;
+        buff[len] = '/';
+        if(!pack_lookup(pack, buff, len + 1)) return -1;
+        if(resolve_redirect(request->file, buff, buff_size) < 0) return -1;
+        send_308(sock, buff);
+        return 0;
+    }
+
+    gzip = request->accept_encoding && strstr(request->accept_encoding, "gzip");
+    pack_entry_iov(pack, entry, gzip, iov);
+    if(conn_writev(sock, iov, head ? 1 : 2) < 0) {
+        logging_errno(WARN, "writev: ");
+    }
+    return 0;
+}
+
+/* Sends what a route handler filled `response` with, only the header for
+ * `head` */
+static void route_send(
+        struct conn *sock,
+        const struct config *config,
+        const struct route_response *response,
+        int head) {
+    struct response_header header = {0};
+
+    if(response->error_page >= 0) {
+        send_error(sock, config->error_pages + response->error_page, head);
+        return;
+    }
+    response_header_init(&header, response->status, response->reason, response->type);
+    if(response->location) {
+        struct key_value kv = {0};
+        kv.key = "Location";
+        kv.value = (char*)response->location;
+        kv_vec_push(&header.key_values, kv);
+    }
+    if(head) send_head(&header, response->body_len, sock);
+    else send_str(&header, response->body, response->body_len, sock);
+    response_header_cleanup(&header);
+}
+
+/* Charges what was sent on `sock` to its client's bandwidth, closes it and
+ * lets go of `data`, the config it was served with */
+static void conn_done(struct conn *sock, void *data) {
+    struct config *config = data;
+
+    if(config->rate_limit.bytes) {
+        ratelimit_charge(
+                &config->rate_limit,
+                (struct sockaddr*)&sock->peer,
+                conn_bytes_acked(sock));
+    }
+    conn_cleanup(sock);
+    config_put(config);
+}
+
+/* a request for a file of a site, kept while a file system thread looks it
+ * up */
+struct file_request {
+    /* first, the pool hands it back */
+    struct fs_job job;
+    struct conn sock;
+    struct config *config;
+    /* the request as read, `request` points in it, and the file's path */
+    char *buff;
+    char *path_buff;
+    struct request_header request;
+    /* the path filter had the target, a miss is one of its false positives */
+    int filtered;
+    int autoindex;
+    int head;
+};
+
+/* Answers `req` once its file is resolved and lets go of what it holds, the
+ * struct itself aside */
+static void serve_resolved(struct file_request *req) {
+    struct conn *sock = &req->sock;
+    struct config *config = req->config;
+    struct fs_job *job = &req->job;
+    char *path_buff = req->path_buff;
+    size_t base_dir_len = job->base_dir_len;
+    const char *type = 0;
+    int head = req->head;
+    int file = job->fd;
+    /* the file is sent in turns, the connection is the scheduler's */
+    int handed = 0;
+
+    switch(job->result) {
+        case RESOLVE_FILE:
+            PROBE(file_opened, file, path_buff);
+            break;
+        case RESOLVE_REDIRECT:
+            /* `/dir` -> `/dir/` */
+            if(resolve_redirect(req->request.file, path_buff, BUFFSIZE) < 0) {
+                send_error(sock, config->error_pages + ERROR_PAGE_404, head);
+                goto cleanup;
+            }
+            send_308(sock, path_buff);
+            goto cleanup;
+        case RESOLVE_DIR:
+            if(req->autoindex > 0) {
+                const char *page;
+                size_t page_len;
+                if(autoindex_get(
+                            path_buff,
+                            path_buff + base_dir_len + 1,
+                            &job->st,
+                            &page,
+                            &page_len)) {
+                    send_error(sock, config->error_pages + ERROR_PAGE_500, head);
+                    goto cleanup;
+                }
+                struct response_header response = {0};
+                response_header_init(&response, 200, "OK", 0);
+                if(head) send_head(&response, page_len, sock);
+                else send_str(&response, page, page_len, sock);
+                goto cleanup;
+            }
+            send_error(sock, config->error_pages + ERROR_PAGE_404, head);
+            goto cleanup;
+        case RESOLVE_NOT_FOUND:
+            if(req->filtered) pathfilter_false_positive();
+            goto not_found;
+    }
+
+    /* ##### At this point a file is found ##### */
+    /* set MIME info */
+    type = job->type[0] ? job->type : 0;
+    PROBE(mime_resolved, path_buff, type);
+    if(!type) {
+        send_error(sock, config->error_pages + ERROR_PAGE_500, head);
+        goto cleanup;
+    }
+
+    struct response_header response = {0};
+    response.status_code = 200;
+    response.content_type = type;
+    /* the lines of the first matching `cache` rule are sent as they are */
+    struct cache_rule *cache = cache_rule_match(
+            config->cache_rules, config->nb_cache_rules,
+            path_buff + base_dir_len, type);
+    if(cache) {
+        response.extra = cache_rule_lines(cache, time(0));
+        response.extra_len = cache->lines_len;
+    }
+
+    /* the size comes from resolve_path's stat, the file is not read */
+    if(head) {
+        send_head(&response, job->st.st_size, sock);
+        goto cleanup;
+    }
+
+    /* large files take turns with the other connections, the ones coming
+     * in meanwhile are not held up by them */
+    if(job->st.st_size > EGRESS_QUANTUM && egress_room(sock)) {
+        if(send_head(&response, job->st.st_size, sock) < 0) goto cleanup;
+        if(egress_submit(sock, file, job->st.st_size, conn_done, config)) {
+            logging(WARN, "unable to hand `%s` over to the scheduler", path_buff);
+            goto cleanup;
+        }
+        file = -1;
+        handed = 1;
+        goto cleanup;
+    }
+
+    /* send the file */
+    if(send_whole_file(&response, file, sock) < 0) {
+        send_error(sock, config->error_pages + ERROR_PAGE_500, 0);
+    }
+    goto cleanup;
+
+not_found:
+    /* return a boring old 404 */
+    send_error(sock, config->error_pages + ERROR_PAGE_404, head);
+
+cleanup:
+    if(file != -1) close(file);
+    bufpool_put(req->buff);
+    bufpool_put(req->path_buff);
+    if(!handed) conn_done(sock, config);
+}
+
+void handle_conn(struct conn sock) {
+    /* kept for the whole connection even if a reload happens meanwhile */
+    struct config *config = config_get();
+    /* borrowed once a request comes in, a connection waiting on its
+     * handshake or on HTTP/2 frames holds none */
+    char *buff = 0;
+    ssize_t buff_len;
+    char *path_buff = 0;
+
+    struct request_header request = {0};
+
+    int limited = 0;
+    int head = 0;
+
+    /* checked before the handshake so that refused clients cost little,
+     * TLS ones already were before being queued for it */
+    if(!sock.rate_taken
+            && !ratelimit_take(&config->rate_limit, (struct sockaddr*)&sock.peer)) {
+        if(config->rate_limit_action == RATELIMIT_CLOSE) {
+            logging(DEBUG, "client over its rate limit, closing");
+            goto cleanup;
+        }
+        limited = 1;
+    }
+
+    if(conn_init(&sock) <= 0) {
+        if(sock.type == CONN_SSL) {
+            logging(INFO, "Invalid SSL or plain text connection");
+            conn_ssl_to_conn_fd(&sock);
+
+            conn_flush(&sock);
+
+            // TODO(louis) use the values in the config
+            send_308(&sock, "https://localhost:9092");
+
+            goto cleanup;
+        }
+    }
+
+    /* the browser asked for HTTP/2 during the handshake */
+    if(h2_negotiated(&sock)) {
+        h2_serve(&sock, config, limited);
+        goto cleanup;
+    }
+
+
+    /* an idle keep-alive client holds no buffers while it thinks */
+    if(conn_wait(&sock)) {
+        logging(DEBUG, "client left before sending a request");
+        goto cleanup;
+    }
+
+    buff = bufpool_get();
+    path_buff = bufpool_get();
+    if(!buff || !path_buff) {
+        logging(ERR, "unable to borrow the buffers of a request");
+        goto cleanup;
+    }
+    path_buff[0] = '\0';
+
+    /* nothing to read */
+    if((buff_len = conn_read(&sock, buff, BUFFSIZE-1)) < 0) {
+        logging(WARN, "nothing to read on connection %d, closing", sock);
+        goto cleanup;
+    }
+    buff[buff_len] = '\0';
+
+    /* load balancers probe constantly, they get a fixed answer before
+     * anything else, rate limits included */
+    switch(health_match(config, buff, buff_len)) {
+        case 1:
+            conn_write(&sock, HEALTH_RESPONSE, sizeof(HEALTH_RESPONSE) - 1);
+            goto cleanup;
+        case 2:
+            conn_write(&sock, HEALTH_RESPONSE,
+                    sizeof(HEALTH_RESPONSE) - 1 - HEALTH_BODY_LEN);
+            goto cleanup;
+    }
+
+    /* answered once the request is read, closing on unread bytes would
+     * reset the connection before the client sees the 429 */
+    if(limited) {
+        logging(DEBUG, "client over its rate limit, answering 429");
+        conn_write(&sock, RATELIMIT_RESPONSE, RATELIMIT_RESPONSE_LEN);
+        goto cleanup;
+    }
+
+    /* proxied paths take any method */
+    const struct proxy_route *route = proxy_match(
+            config->proxies, config->nb_proxies, buff, buff_len);
+    if(route) {
+        proxy_serve(route, &sock, config->error_pages, buff, buff_len, BUFFSIZE - 1);
+        goto cleanup;
+    }
+    const struct fcgi_route *app = fcgi_match(
+            config->fastcgi, config->nb_fastcgi, buff, buff_len);
+    if(app) {
+        fcgi_serve(app, &sock, config->error_pages, config->base_dir,
+                buff, buff_len, BUFFSIZE - 1);
+        goto cleanup;
+    }
+
+    /* the header and the start of the body share packets even with
+     * TCP_NODELAY, closing the connection pushes what is left */
+    conn_cork(&sock, 1);
+
+    if(request_header_parse(&request, buff, BUFFSIZE) < 0) {
+        goto cleanup;
+    }
+    PROBE(request_parsed, conn_fd(&sock), request.metod, request.file);
+
+    /* the endpoints served from memory shadow base_dir */
+    struct route_response routed;
+    if(router_serve(&config->router, request.metod, request.file,
+                conn_peer_in(&sock, config->status_allow, config->nb_status_allow),
+                &routed)) {
+        route_send(&sock, config, &routed, request.metod == HEAD);
+        route_response_cleanup(&routed);
+        goto cleanup;
+    }
+
+    switch(request.metod) {
+        case GET:
+            break;
+        case HEAD:
+            /* same headers as a GET, out of the metadata alone */
+            head = 1;
+            break;
+        case OPTIONS:
+            conn_write(&sock, OPTIONS_RESPONSE, sizeof(OPTIONS_RESPONSE) - 1);
+            goto cleanup;
+        default:
+            logging(DEBUG, "unsupported method, answering 405");
+            send_error(&sock, config->error_pages + ERROR_PAGE_405, 0);
+            goto cleanup;
+    }
+
+    request.file++;
+
+    /* the site asked for, the top level one when no vhost has the name */
+    const struct vhost *vhost = request.host
+        ? vhost_lookup(&config->vhost_table, request.host, strlen(request.host))
+        : 0;
+    const char *base_dir = vhost ? vhost->base_dir : config->base_dir;
+    size_t base_dir_len = vhost ? vhost->base_dir_len : config->base_dir_len;
+    int autoindex = vhost ? vhost->autoindex : config->autoindex;
+
+    /* the archive replaces the top level base_dir entirely */
+    if(!vhost && config->pack.data) {
+        if(pack_serve(&config->pack, &sock, &request, head, path_buff, BUFFSIZE)) {
+            goto not_found;
+        }
+        goto cleanup;
+    }
+
+    /* scanners ask for paths that never existed, those skip the file system */
+    int filtered = pathfilter_lookup(base_dir, request.file);
+    if(filtered == PATHFILTER_ABSENT) {
+        send_error(&sock, config->error_pages + ERROR_PAGE_404, head);
+        goto cleanup;
+    }
+
+    struct file_request req = {
+        .job = {
+            .base_dir = base_dir,
+            .base_dir_len = base_dir_len,
+            .file = request.file,
+            .path = path_buff,
+            .path_size = BUFFSIZE,
+        },
+        .sock = sock,
+        .config = config,
+        .buff = buff,
+        .path_buff = path_buff,
+        .request = request,
+        .filtered = filtered == PATHFILTER_MAYBE,
+        .autoindex = autoindex,
+        .head = head,
+    };
+    struct file_request *deferred;
+
+    /* files not known to be in the page cache are looked up by a thread, a
+     * cold disk would hold up every connection otherwise */
+    if(fspool_fd() != -1 && (deferred = malloc(sizeof(*deferred)))) {
+        *deferred = req;
+        deferred->job.data = deferred;
+        if(!fspool_submit(&deferred->job)) return;
+        free(deferred);
+    }
+    fspool_resolve(&req.job);
+    serve_resolved(&req);
+    return;
+
+not_found:
+    /* return a boring old 404 */
+    send_error(&sock, config->error_pages + ERROR_PAGE_404, head);
+
+cleanup:
+    bufpool_put(buff);
+    bufpool_put(path_buff);
+    conn_done(&sock, config);
+    return;
+}
+
+void handle_resolved(struct fs_job *job) {
+    struct file_request *req = job->data;
+
+    serve_resolved(req);
+    free(req);
+}
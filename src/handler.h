@@ -0,0 +1,16 @@
+#ifndef HANDLER_H
+#define HANDLER_H 1
+
+#include "conn.h"
+#include "fspool.h"
+
+/* Serves the request, or the HTTP/2 streams, coming in on `sock` with the
+ * published config, then cleans `sock` up. Any transport will do, the
+ * tests and benchmarks drive it over memory. */
+void handle_conn(struct conn sock);
+
+/* Answers the request whose file `job` resolved, collected from the file
+ * system threads */
+void handle_resolved(struct fs_job *job);
+
+#endif
@@ -0,0 +1,73 @@
+#include "handshake.h"
+
+#include <time.h>
+#include <sys/socket.h>
+
+/* Runs the handshake of `job`, a connection, with a deadline, sockets are
+ * left blocking without one once it is over
+ * Returns: 0 on success, -1 if the handshake failed */
+static int handshake(void *job) {
+    struct conn *conn = job;
+    struct timeval timeout = {.tv_sec = HANDSHAKE_TIMEOUT};
+    struct timeval none = {0};
+    int fd = conn_fd(conn);
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    conn->handshake = conn_init(conn) > 0 ? 1 : -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+    return conn->handshake > 0 ? 0 : -1;
+}
+
+static struct conn PENDING[HANDSHAKE_QUEUE_SIZE];
+static struct conn FINISHED[HANDSHAKE_QUEUE_SIZE];
+static struct timespec QUEUED[HANDSHAKE_QUEUE_SIZE];
+
+static struct threadpool POOL = THREADPOOL_INIT(
+        "the TLS handshakes",
+        handshake,
+        struct conn,
+        HANDSHAKE_QUEUE_SIZE,
+        PENDING,
+        FINISHED,
+        QUEUED);
+
+int handshake_start(int nb_threads) {
+    return threadpool_start(&POOL, nb_threads);
+}
+
+int handshake_fd(void) {
+    return threadpool_fd(&POOL);
+}
+
+int handshake_submit(struct conn *conn) {
+    return threadpool_submit(&POOL, conn);
+}
+
+int handshake_collect(struct conn *conn) {
+    return threadpool_collect(&POOL, conn);
+}
+
+void handshake_stats(struct handshake_stats *stats) {
+    struct threadpool_stats pool;
+
+    threadpool_stats(&POOL, &pool);
+    stats->queued = pool.queued;
+    stats->overflowed = pool.overflowed;
+    stats->completed = pool.done - pool.failed;
+    stats->failed = pool.failed;
+    stats->depth = pool.depth;
+    stats->max_depth = pool.max_depth;
+    stats->wait_ns = pool.wait_ns;
+    stats->handshake_ns = pool.work_ns;
+    stats->max_latency_ns = pool.max_latency_ns;
+}
+
+void handshake_stop(void) {
+    struct conn conn;
+
+    threadpool_start(&POOL, 0);
+    while(handshake_collect(&conn)) conn_cleanup(&conn);
+    threadpool_stop(&POOL);
+}
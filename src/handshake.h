@@ -0,0 +1,60 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H 1
+
+#include <stdint.h>
+
+#include "conn.h"
+#include "threadpool.h"
+
+#define HANDSHAKE_THREADS_MAX THREADPOOL_THREADS_MAX
+
+/* accepted TLS connections waiting for a thread, past it they are shaken
+ * hands with on the serving thread */
+#define HANDSHAKE_QUEUE_SIZE 256
+
+/* seconds a client has to finish its handshake */
+#define HANDSHAKE_TIMEOUT 10
+
+struct handshake_stats {
+    /* handed to the threads */
+    uint64_t queued;
+    /* done by the serving thread, the queue was full */
+    uint64_t overflowed;
+    uint64_t completed;
+    uint64_t failed;
+    /* waiting for a thread right now, and at most */
+    uint64_t depth;
+    uint64_t max_depth;
+    /* nanoseconds spent waiting for a thread, then in the handshake */
+    uint64_t wait_ns;
+    uint64_t handshake_ns;
+    /* the longest of both together */
+    uint64_t max_latency_ns;
+};
+
+/* Starts `nb_threads` threads running the TLS handshakes of the accepted
+ * connections, the pool replaces the running one, 0 stops it
+ * Returns: 0 on success, -1 on error, handshakes then stay on the serving
+ *  thread */
+int handshake_start(int nb_threads);
+
+/* Returns: the eventfd that becomes readable once handshakes are done, -1
+ *  without threads */
+int handshake_fd(void);
+
+/* Queues the handshake of `conn`, a fresh TLS connection
+ * Returns: 0 if a thread will do it, -1 if the caller has to */
+int handshake_submit(struct conn *conn);
+
+/* Takes a connection whose handshake is over, `conn_init` then returns
+ * its result without doing it again
+ * Returns: 1 with `conn` filled, 0 if none is left */
+int handshake_collect(struct conn *conn);
+
+void handshake_stats(struct handshake_stats *stats);
+
+/* finishes the queued handshakes and stops the threads, the connections
+ * left to collect are closed */
+void handshake_stop(void);
+
+#endif
@@ -1,5 +1,8 @@
 #include "headers.h"
 
+#include <limits.h>
+#include <strings.h>
+
 void key_value_cleanup(struct key_value *kv) {
     if(kv->flags & KEY_VALUE_FREE_KEY) {
         free(kv->key);
@@ -10,34 +13,76 @@ void key_value_cleanup(struct key_value *kv) {
     }
 }
 
+int content_length_parse(const char *value, size_t len, unsigned long long *length) {
+    /* trailing whitespace is not part of the value */
+    while(len && (value[len - 1] == ' ' || value[len - 1] == '\t'
+                || value[len - 1] == '\r')) {
+        len--;
+    }
+    if(!len) return -1;
+    *length = 0;
+    for(size_t i = 0; i < len; i++) {
+        unsigned digit = value[i] - '0';
+        /* no sign, no list of lengths, strtoull would take both */
+        if(digit > 9) return -1;
+        if(*length > (ULLONG_MAX - digit) / 10) return -1;
+        *length = *length * 10 + digit;
+    }
+    return 0;
+}
+
+enum http_method http_method_parse(const char *name) {
+    if(!strcmp(name, "GET"))
+        return GET;
+    else if(!strcmp(name, "HEAD"))
+        return HEAD;
+    else if(!strcmp(name, "POST"))
+        return POST;
+    else if(!strcmp(name, "PUT"))
+        return PUT;
+    else if(!strcmp(name, "DELETE"))
+        return DELETE;
+    else if(!strcmp(name, "CONNECT"))
+        return CONNECT;
+    else if(!strcmp(name, "OPTIONS"))
+        return OPTIONS;
+    else if(!strcmp(name, "TRACE"))
+        return TRACE;
+    else if(!strcmp(name, "PATCH"))
+        return PATCH;
+    else
+        return UNKNOWN_METHOD;
+}
+
 int request_header_parse(struct request_header *header, char *buff, size_t buff_size){
     char *line = strtok(buff, " ");
-    if(!strcmp(line, "GET"))
-        header->metod = GET;
-    else if(!strcmp(line, "HEAD"))
-        header->metod = HEAD;
-    else if(!strcmp(line, "POST"))
-        header->metod = POST;
-    else if(!strcmp(line, "PUT"))
-        header->metod = PUT;
-    else if(!strcmp(line, "DELETE"))
-        header->metod = DELETE;
-    else if(!strcmp(line, "CONNECT"))
-        header->metod = CONNECT;
-    else if(!strcmp(line, "OPTIONS"))
-        header->metod = OPTIONS;
-    else if(!strcmp(line, "TRACE"))
-        header->metod = TRACE;
-    else if(!strcmp(line, "PATCH"))
-        header->metod = PATCH;
+    if(!line) return -1;
+    header->metod = http_method_parse(line);
     header->file = strtok(0, " ");
+    if(!header->file) return -1;
     strtok(0, "/");
     line = strtok(0, CRLF);
+    if(!line) return -1;
 
     char *remainder = 0;
     header->version = strtof(line, &remainder);
     /* malformed HTML/1.1 or whatever */
     if(line == remainder) return 1;
 
+    /* header fields */
+    while((line = strtok(0, CRLF))) {
+        char *value = strchr(line, ':');
+        if(!value) continue;
+        *value++ = '\0';
+        while(*value == ' ' || *value == '\t') value++;
+
+        if(!strcasecmp(line, "Accept-Encoding")) {
+            header->accept_encoding = value;
+        }
+        else if(!strcasecmp(line, "Host")) {
+            header->host = value;
+        }
+    }
+
     return 0;
 }
@@ -10,6 +10,9 @@
 
 #define HEADER_BUFF_SIZE 512
 
+/* what every target takes, proxied paths aside */
+#define ALLOWED_METHODS "GET, HEAD, OPTIONS"
+
 enum http_method {
     GET,
     HEAD,
@@ -19,7 +22,9 @@ enum http_method {
     CONNECT,
     OPTIONS,
     TRACE,
-    PATCH
+    PATCH,
+    /* anything else, answered with a 405 */
+    UNKNOWN_METHOD
 };
 
 struct request_header {
@@ -28,6 +33,7 @@ struct request_header {
     char *file;
     char *host;
     char *user_agent;
+    char *accept_encoding;
 };
 
 #define KEY_VALUE_FREE_KEY 1
@@ -39,6 +45,14 @@ struct key_value {
     unsigned char flags;
 };
 
+/* Parses the `len` bytes of a Content-Length value into `*length`, a
+ * request whose length is refused can't be told apart from the next one
+ * Returns: 0 on success, -1 if it is not a plain number or does not fit */
+int content_length_parse(const char *value, size_t len, unsigned long long *length);
+
+/* Returns: the method named `name`, UNKNOWN_METHOD if there is none */
+enum http_method http_method_parse(const char *name);
+
 /* returns the length written */
 int request_header_parse(struct request_header *header, char *buff, size_t buff_size);
 #endif
@@ -0,0 +1,483 @@
+#include "hpack.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/types.h>
+
+struct static_entry {
+    const char *name;
+    const char *value;
+};
+
+/* RFC 7541 Appendix A, indices start at 1 */
+static const struct static_entry STATIC_TABLE[] = {
+    {0, 0},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_TABLE_LEN (sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]) - 1)
+
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_LEN 30
+
+/* RFC 7541 Appendix B, the code is canonical so the lengths are enough to
+ * rebuild it */
+static const uint8_t HUFFMAN_CODE_LEN[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/* first code, and index of its symbol in HUFFMAN_SYMBOLS, of each length */
+static uint32_t HUFFMAN_FIRST_CODE[HUFFMAN_MAX_LEN + 1];
+static uint16_t HUFFMAN_FIRST_INDEX[HUFFMAN_MAX_LEN + 1];
+static uint16_t HUFFMAN_COUNT[HUFFMAN_MAX_LEN + 1];
+/* symbols ordered by code */
+static uint16_t HUFFMAN_SYMBOLS[257];
+
+static pthread_once_t HUFFMAN_ONCE = PTHREAD_ONCE_INIT;
+
+static void huffman_init(void) {
+    uint32_t code = 0;
+    uint16_t index = 0;
+
+    for(int sym = 0; sym <= HUFFMAN_EOS; sym++) {
+        HUFFMAN_COUNT[HUFFMAN_CODE_LEN[sym]]++;
+    }
+    for(int len = 1; len <= HUFFMAN_MAX_LEN; len++) {
+        HUFFMAN_FIRST_CODE[len] = code;
+        HUFFMAN_FIRST_INDEX[len] = index;
+        for(int sym = 0; sym <= HUFFMAN_EOS; sym++) {
+            if(HUFFMAN_CODE_LEN[sym] == len) HUFFMAN_SYMBOLS[index++] = sym;
+        }
+        code = (code + HUFFMAN_COUNT[len]) << 1;
+    }
+}
+
+/* Returns: the decoded length, -1 on error */
+static ssize_t huffman_decode(
+        const uint8_t *in,
+        size_t len,
+        char *out,
+        size_t out_size) {
+    uint32_t code = 0;
+    int code_len = 0;
+    size_t written = 0;
+
+    for(size_t i = 0; i < len; i++) {
+        for(int bit = 7; bit >= 0; bit--) {
+            code = code << 1 | ((in[i] >> bit) & 1);
+            code_len++;
+            if(code_len > HUFFMAN_MAX_LEN) return -1;
+
+            /* codes shorter than the first of this length wrap around */
+            uint32_t offset = code - HUFFMAN_FIRST_CODE[code_len];
+            if(offset >= HUFFMAN_COUNT[code_len]) continue;
+
+            uint16_t sym = HUFFMAN_SYMBOLS[HUFFMAN_FIRST_INDEX[code_len] + offset];
+            if(sym == HUFFMAN_EOS || written == out_size) return -1;
+            out[written++] = sym;
+            code = 0;
+            code_len = 0;
+        }
+    }
+    /* the padding is the most significant bits of EOS, ie: all ones */
+    if(code_len > 7 || code != (1u << code_len) - 1) return -1;
+    return written;
+}
+
+/* reads an integer with a `prefix` bits prefix
+ * Returns: 0 on success, -1 on error */
+static int decode_int(
+        const uint8_t **data,
+        const uint8_t *end,
+        int prefix,
+        uint32_t *out) {
+    uint32_t max = (1u << prefix) - 1;
+    uint32_t value;
+    int shift = 0;
+
+    if(*data >= end) return -1;
+    value = **data & max;
+    (*data)++;
+    if(value < max) {
+        *out = value;
+        return 0;
+    }
+    while(*data < end) {
+        uint8_t byte = **data;
+        (*data)++;
+        /* nothing we accept needs more than 28 bits */
+        if(shift > 21) return -1;
+        value += (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+        if(!(byte & 0x80)) {
+            *out = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* reads a string literal, huffman encoded ones are decoded into `buff`
+ * Returns: 0 on success, -1 on error */
+static int decode_string(
+        const uint8_t **data,
+        const uint8_t *end,
+        char *buff,
+        const char **str,
+        size_t *len) {
+    int huffman;
+    uint32_t str_len;
+
+    if(*data >= end) return -1;
+    huffman = **data & 0x80;
+    if(decode_int(data, end, 7, &str_len)) return -1;
+    if(str_len > (size_t)(end - *data)) return -1;
+
+    if(huffman) {
+        ssize_t ret = huffman_decode(*data, str_len, buff, HPACK_MAX_STRING);
+        if(ret < 0) return -1;
+        *str = buff;
+        *len = ret;
+    }
+    else {
+        if(str_len > HPACK_MAX_STRING) return -1;
+        *str = (const char*)*data;
+        *len = str_len;
+    }
+    *data += str_len;
+    return 0;
+}
+
+void hpack_table_init(struct hpack_table *table) {
+    pthread_once(&HUFFMAN_ONCE, huffman_init);
+    memset(table, 0, sizeof(*table));
+    table->max_size = HPACK_TABLE_SIZE;
+}
+
+static void table_evict(struct hpack_table *table) {
+    size_t oldest = (table->head + table->cap - (table->len - 1)) % table->cap;
+    struct hpack_entry *entry = table->entries + oldest;
+
+    table->size -= entry->name_len + entry->value_len + 32;
+    free(entry->name);
+    memset(entry, 0, sizeof(*entry));
+    table->len--;
+}
+
+static void table_shrink(struct hpack_table *table, size_t max_size) {
+    while(table->len && table->size > max_size) {
+        table_evict(table);
+    }
+}
+
+/* Returns: 0 on success, -1 on error */
+static int table_add(
+        struct hpack_table *table,
+        const char *name,
+        size_t name_len,
+        const char *value,
+        size_t value_len) {
+    size_t entry_size = name_len + value_len + 32;
+
+    if(entry_size > table->max_size) {
+        /* an entry larger than the table empties it */
+        table_shrink(table, 0);
+        return 0;
+    }
+    /* name and value share an allocation, copied before evicting as the
+     * name can be the one of an entry about to go, RFC 7541 4.4 */
+    char *buff = malloc(name_len + value_len + 1);
+    if(!buff) return -1;
+    memcpy(buff, name, name_len);
+    memcpy(buff + name_len, value, value_len);
+    table_shrink(table, table->max_size - entry_size);
+
+    if(!table->entries) {
+        /* the smallest entry takes 32 bytes */
+        table->cap = HPACK_TABLE_SIZE / 32;
+        table->entries = calloc(table->cap, sizeof(struct hpack_entry));
+        if(!table->entries) {
+            free(buff);
+            return -1;
+        }
+        table->head = table->cap - 1;
+    }
+
+    table->head = (table->head + 1) % table->cap;
+    struct hpack_entry *entry = table->entries + table->head;
+    entry->name = buff;
+    entry->name_len = name_len;
+    entry->value = buff + name_len;
+    entry->value_len = value_len;
+    table->len++;
+    table->size += entry_size;
+    return 0;
+}
+
+/* Returns: 0 on success, -1 if `index` is out of the tables */
+static int table_get(
+        const struct hpack_table *table,
+        uint32_t index,
+        const char **name,
+        size_t *name_len,
+        const char **value,
+        size_t *value_len) {
+    if(index == 0) return -1;
+    if(index <= STATIC_TABLE_LEN) {
+        *name = STATIC_TABLE[index].name;
+        *name_len = strlen(*name);
+        *value = STATIC_TABLE[index].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= STATIC_TABLE_LEN + 1;
+    if(index >= table->len) return -1;
+
+    const struct hpack_entry *entry = table->entries
+        + (table->head + table->cap - index) % table->cap;
+    *name = entry->name;
+    *name_len = entry->name_len;
+    *value = entry->value;
+    *value_len = entry->value_len;
+    return 0;
+}
+
+void hpack_table_cleanup(struct hpack_table *table) {
+    table_shrink(table, 0);
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+int hpack_decode(
+        struct hpack_table *table,
+        const uint8_t *data,
+        size_t len,
+        hpack_header_fn fn,
+        void *ctx) {
+    const uint8_t *end = data + len;
+    char name_buff[HPACK_MAX_STRING];
+    char value_buff[HPACK_MAX_STRING];
+
+    while(data < end) {
+        const char *name;
+        size_t name_len;
+        const char *value;
+        size_t value_len;
+        uint32_t index;
+        int add = 0;
+        uint8_t first = *data;
+
+        if(first & 0x80) {
+            /* indexed header field */
+            if(decode_int(&data, end, 7, &index)
+                    || table_get(table, index, &name, &name_len, &value, &value_len)) {
+                return -1;
+            }
+        }
+        else if((first & 0xe0) == 0x20) {
+            /* dynamic table size update */
+            if(decode_int(&data, end, 5, &index) || index > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            table->max_size = index;
+            table_shrink(table, index);
+            continue;
+        }
+        else {
+            /* literal, with incremental indexing or without / never indexed */
+            add = (first & 0xc0) == 0x40;
+            if(decode_int(&data, end, add ? 6 : 4, &index)) return -1;
+            if(index) {
+                const char *unused;
+                size_t unused_len;
+                if(table_get(table, index, &name, &name_len, &unused, &unused_len)) {
+                    return -1;
+                }
+            }
+            else if(decode_string(&data, end, name_buff, &name, &name_len)) {
+                return -1;
+            }
+            if(decode_string(&data, end, value_buff, &value, &value_len)) {
+                return -1;
+            }
+        }
+
+        /* before adding, which may evict the entry `name` points into */
+        if(fn(ctx, name, name_len, value, value_len)) return -1;
+        if(add && table_add(table, name, name_len, value, value_len)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Returns: the length written, 0 if `out` is too small */
+static size_t encode_int(
+        uint8_t *out,
+        size_t out_size,
+        uint8_t flags,
+        int prefix,
+        uint32_t value) {
+    uint32_t max = (1u << prefix) - 1;
+    size_t len = 0;
+
+    if(!out_size) return 0;
+    if(value < max) {
+        out[len++] = flags | value;
+        return len;
+    }
+    out[len++] = flags | max;
+    value -= max;
+    while(value >= 0x80) {
+        if(len == out_size) return 0;
+        out[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if(len == out_size) return 0;
+    out[len++] = value;
+    return len;
+}
+
+size_t hpack_encode_header(
+        uint8_t *out,
+        size_t out_size,
+        int name_index,
+        const char *value,
+        size_t value_len) {
+    size_t len = encode_int(out, out_size, 0x00, 4, name_index);
+    if(!len) return 0;
+    size_t ret = encode_int(out + len, out_size - len, 0x00, 7, value_len);
+    if(!ret) return 0;
+    len += ret;
+    if(value_len > out_size - len) return 0;
+    memcpy(out + len, value, value_len);
+    return len + value_len;
+}
+
+size_t hpack_encode_field(
+        uint8_t *out,
+        size_t out_size,
+        const char *name,
+        size_t name_len,
+        const char *value,
+        size_t value_len) {
+    size_t len;
+    size_t ret;
+
+    for(uint32_t i = 1; i <= STATIC_TABLE_LEN; i++) {
+        if(!strncasecmp(STATIC_TABLE[i].name, name, name_len)
+                && !STATIC_TABLE[i].name[name_len]) {
+            return hpack_encode_header(out, out_size, i, value, value_len);
+        }
+    }
+
+    len = encode_int(out, out_size, 0x00, 4, 0);
+    if(!len) return 0;
+    ret = encode_int(out + len, out_size - len, 0x00, 7, name_len);
+    if(!ret) return 0;
+    len += ret;
+    if(name_len > out_size - len) return 0;
+    for(size_t i = 0; i < name_len; i++) {
+        out[len++] = tolower((unsigned char)name[i]);
+    }
+    ret = encode_int(out + len, out_size - len, 0x00, 7, value_len);
+    if(!ret) return 0;
+    len += ret;
+    if(value_len > out_size - len) return 0;
+    memcpy(out + len, value, value_len);
+    return len + value_len;
+}
+
+size_t hpack_encode_status(uint8_t *out, size_t out_size, int status) {
+    char digits[4];
+
+    for(uint32_t i = HPACK_STATUS; i <= 14; i++) {
+        if(atoi(STATIC_TABLE[i].value) == status) {
+            return encode_int(out, out_size, 0x80, 7, i);
+        }
+    }
+    digits[0] = '0' + status / 100 % 10;
+    digits[1] = '0' + status / 10 % 10;
+    digits[2] = '0' + status % 10;
+    digits[3] = '\0';
+    return hpack_encode_header(out, out_size, HPACK_STATUS, digits, 3);
+}
@@ -0,0 +1,93 @@
+#ifndef HPACK_H
+#define HPACK_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* SETTINGS_HEADER_TABLE_SIZE we advertise, the default of RFC 7541 */
+#define HPACK_TABLE_SIZE 4096
+
+/* longest header name or value accepted */
+#define HPACK_MAX_STRING 4096
+
+/* indices of the static table used when encoding */
+#define HPACK_STATUS 8
+#define HPACK_ALLOW 22
+#define HPACK_CACHE_CONTROL 24
+#define HPACK_CONTENT_ENCODING 26
+#define HPACK_CONTENT_LENGTH 28
+#define HPACK_CONTENT_TYPE 31
+#define HPACK_ETAG 34
+#define HPACK_EXPIRES 36
+#define HPACK_LOCATION 46
+#define HPACK_RETRY_AFTER 53
+#define HPACK_VARY 59
+
+struct hpack_entry {
+    char *name;
+    size_t name_len;
+    char *value;
+    size_t value_len;
+};
+
+/* the dynamic table of a decoder, a ring of the most recent entries */
+struct hpack_table {
+    struct hpack_entry *entries;
+    size_t cap;
+    /* index of the newest entry */
+    size_t head;
+    size_t len;
+    /* as defined by RFC 7541, 32 bytes of overhead per entry */
+    size_t size;
+    size_t max_size;
+};
+
+/* called for every decoded header, the strings are only valid during the
+ * call and are not NUL terminated
+ * Returns: 0 to keep going, anything else aborts the decoding */
+typedef int (*hpack_header_fn)(
+        void *ctx,
+        const char *name,
+        size_t name_len,
+        const char *value,
+        size_t value_len);
+
+void hpack_table_init(struct hpack_table *table);
+
+void hpack_table_cleanup(struct hpack_table *table);
+
+/* Decodes the header block `data`, calling `fn` for each header
+ * Returns: 0 on success, -1 on a compression error */
+int hpack_decode(
+        struct hpack_table *table,
+        const uint8_t *data,
+        size_t len,
+        hpack_header_fn fn,
+        void *ctx);
+
+/* Writes `:status: status`
+ * Returns: the length written, 0 if `out` is too small */
+size_t hpack_encode_status(uint8_t *out, size_t out_size, int status);
+
+/* Writes a literal header without indexing whose name is the static entry
+ * `name_index`
+ * Returns: the length written, 0 if `out` is too small */
+size_t hpack_encode_header(
+        uint8_t *out,
+        size_t out_size,
+        int name_index,
+        const char *value,
+        size_t value_len);
+
+/* Writes a literal header without indexing, the name is looked up in the
+ * static table and lowercased when it is not there
+ * Returns: the length written, 0 if `out` is too small */
+size_t hpack_encode_field(
+        uint8_t *out,
+        size_t out_size,
+        const char *name,
+        size_t name_len,
+        const char *value,
+        size_t value_len);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/sendfile.h>
@@ -6,6 +7,7 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -20,15 +22,51 @@
 #include "send.h"
 
 #include <openssl/err.h>
-#include <magic.h>
 
 #include "conn.h"
 #include "config.h"
-
-#define ACCEPT_Q_SIZE 256
+#include "resolve.h"
+#include "autoindex.h"
+#include "mime.h"
+#include "pack.h"
+#include "file_map.h"
+#include "upgrade.h"
+#include "h2.h"
+#include "proxy.h"
+#include "fcgi.h"
+#include "pathfilter.h"
+#include "ratelimit.h"
+#include "handler.h"
+#include "vhost.h"
+#include "handshake.h"
+#include "bufpool.h"
+#include "egress.h"
+#include "fspool.h"
+#include "overload.h"
+#include "trace.h"
 
 static volatile bool KEEP_RUNNING = true;
 
+/* set on SIGHUP, the config is reloaded between two connections */
+static volatile sig_atomic_t RELOAD = 0;
+
+/* set on SIGUSR2, a new binary takes over the listeners */
+static volatile sig_atomic_t UPGRADE = 0;
+
+/* set on SIGCHLD, FastCGI workers are respawned between two connections */
+static volatile sig_atomic_t CHILD_EXITED = 0;
+
+/* set on SIGALRM once the connections left after an upgrade had their
+ * drain_timeout, the rest is cut short */
+static volatile sig_atomic_t DRAIN_EXPIRED = 0;
+
+/* what the last look at the load asked of new connections, see
+ * `overload_check` */
+static int OVERLOADED = 0;
+
+/* mtime of the certificate the current SSL_CTX was loaded from */
+static struct timespec PEM_MTIME = {0};
+
 static const uint8_t SSL_HELLO_BYTES[][3] = {
     {0x16, 0x03, 0x01}, // 3.1
     {0x16, 0x03, 0x02}, // 1.1
@@ -39,16 +77,6 @@ static const uint8_t SSL_HELLO_BYTES[][3] = {
 
 static const size_t SSL_HELLO_VARIANTS = sizeof(SSL_HELLO_BYTES) / sizeof(uint8_t[3]);
 
-magic_t magic;
-
-int mime_init(void) {
-    magic = magic_open(MAGIC_MIME_TYPE);
-    magic_load(magic, 0);
-    // on arch the db is already compiled
-    //magic_compile(magic, 0);
-    return 0;
-}
-
 void sigint_halder(int sig) {
     if(sig == SIGINT) {
         /* ignore / acknowledge the signal so that it does not propagate further */
@@ -60,10 +88,96 @@ void sigint_halder(int sig) {
     signal(sig, sigint_halder);
 }
 
-/* sets up the socket and starts listening on port_no
+void sighup_handler(int sig) {
+    RELOAD = 1;
+    /* reinstate the signal handler */
+    signal(sig, sighup_handler);
+}
+
+void sigusr2_handler(int sig) {
+    UPGRADE = 1;
+    /* reinstate the signal handler */
+    signal(sig, sigusr2_handler);
+}
+
+void sigchld_handler(int sig) {
+    CHILD_EXITED = 1;
+    /* reinstate the signal handler */
+    signal(sig, sigchld_handler);
+}
+
+void sigalrm_handler(int sig) {
+    DRAIN_EXPIRED = 1;
+    /* the drain loops stop on it */
+    KEEP_RUNNING = false;
+    /* reinstate the signal handler */
+    signal(sig, sigalrm_handler);
+}
+
+/* Returns: the port `fd` is bound to, -1 if it is not an inet socket */
+static int listener_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if(getsockname(fd, (struct sockaddr*)&addr, &addr_len)
+            || addr.sin_family != AF_INET) {
+        return -1;
+    }
+    return ntohs(addr.sin_port);
+}
+
+/* Returns: 1 if `fd` is a Unix socket bound to `path` */
+static int listener_is_path(int fd, const char *path) {
+    struct sockaddr_un addr = {0};
+    socklen_t addr_len = sizeof(addr);
+    if(!path
+            || getsockname(fd, (struct sockaddr*)&addr, &addr_len)
+            || addr.sun_family != AF_UNIX) {
+        return 0;
+    }
+    return !strncmp(addr.sun_path, path, sizeof(addr.sun_path));
+}
+
+/* Applies the listener options of `config` to `fd`, a listening socket can
+ * be tuned again when the config is reloaded
+ * Returns: 0 on success, -1 if `fd` cannot be made non blocking */
+static int listener_tune(int fd, const struct config *config) {
+    int flags = fcntl(fd, F_GETFL);
+    int opt;
+
+    /* connections are accepted until the backlog is empty */
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        logging_errno(ERR, "fcntl: ");
+        return -1;
+    }
+    /* listening again only changes the backlog */
+    if(listen(fd, config->listen_backlog)) {
+        logging_errno(WARN, "listen: ");
+    }
+    /* the rest only makes sense over TCP */
+    if(listener_port(fd) == -1) return 0;
+    /* the first bytes are peeked at right away, only wake up once they are
+     * there */
+    opt = config->tcp_defer_accept;
+    if(setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt))) {
+        logging_errno(WARN, "TCP_DEFER_ACCEPT: ");
+    }
+    /* lets the ClientHello ride on the SYN of returning clients */
+    opt = config->tcp_fastopen;
+    if(setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt))) {
+        logging_errno(WARN, "TCP_FASTOPEN: ");
+    }
+    /* inherited by the accepted sockets, responses are corked instead */
+    opt = config->tcp_nodelay;
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt))) {
+        logging_errno(WARN, "TCP_NODELAY: ");
+    }
+    return 0;
+}
+
+/* sets up the socket and starts listening on the https port of `config`
  * 0 normal
  * 1 err*/
-int serv_setup(int port_no, int *sock_fd, struct sockaddr_in *serv_addr) {
+int serv_setup(const struct config *config, int *sock_fd, struct sockaddr_in *serv_addr) {
 
     int opt = 1;
     socklen_t socklen = sizeof(*serv_addr);
@@ -82,7 +196,7 @@ int serv_setup(int port_no, int *sock_fd, struct sockaddr_in *serv_addr) {
     /* internet socket */
     serv_addr->sin_family = AF_INET;
     /* convert host byte order to network byte order (short) */
-    serv_addr->sin_port = htons(port_no);
+    serv_addr->sin_port = htons(config->https_port);
     /* address on the server */
     serv_addr->sin_addr.s_addr = INADDR_ANY;
 
@@ -91,184 +205,495 @@ int serv_setup(int port_no, int *sock_fd, struct sockaddr_in *serv_addr) {
         logging(ERR, "unable to bind %d: `%s`", serv_addr->sin_port, strerror(errno));
         return 1;
     }
-    if(listen(*sock_fd, ACCEPT_Q_SIZE) != 0) {
+    if(listen(*sock_fd, config->listen_backlog) != 0) {
         logging(ERR, "unable to listen on port %d: `%s`", serv_addr->sin_port, strerror(errno));
         close(*sock_fd);
         return 1;
     }
+    if(listener_tune(*sock_fd, config)) {
+        close(*sock_fd);
+        return 1;
+    }
     /* ready to start serving */
     return 0;
 }
 
-/* handles a connection */
-void handle_conn(struct conn sock) {
-    /* depends on basedir, basedir_len and mimes_hmap */
-    char buff[BUFFSIZE]={0};
-    ssize_t buff_len;
-    char path_buff[BUFFSIZE]={0};
-    int file=-1;
+/* sets up a Unix socket at the `unix_socket` path of `config` and starts
+ * listening on it, a socket left behind by a dead process is replaced
+ * 0 normal
+ * 1 err*/
+static int unix_setup(const struct config *config, int *sock_fd) {
+    struct sockaddr_un addr = {0};
+    struct stat st;
+    int probe;
+    int live;
+
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, config->unix_socket, sizeof(addr.sun_path) - 1);
+
+    if((*sock_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return 1;
+
+    if(bind(*sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        if(errno != EADDRINUSE
+                || lstat(addr.sun_path, &st) == -1
+                || !S_ISSOCK(st.st_mode)) {
+            goto failure;
+        }
+        /* nobody answering means nobody is listening anymore */
+        probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(probe == -1) goto failure;
+        live = connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0
+            || errno != ECONNREFUSED;
+        close(probe);
+        if(live) {
+            errno = EADDRINUSE;
+            goto failure;
+        }
+        logging(INFO, "replacing the stale socket `%s`", addr.sun_path);
+        if(unlink(addr.sun_path) == -1
+                || bind(*sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            goto failure;
+        }
+    }
+    /* before listening, nobody gets in with the umask's permissions */
+    if(chmod(addr.sun_path, config->unix_socket_mode) == -1) {
+        unlink(addr.sun_path);
+        goto failure;
+    }
+    if(listen(*sock_fd, config->listen_backlog) != 0
+            || listener_tune(*sock_fd, config)) {
+        unlink(addr.sun_path);
+        goto failure;
+    }
+    return 0;
 
-    struct request_header request = {0};
-    char index[] = "index.html";
+failure:
+    logging(ERR, "unable to listen on `%s`: `%s`", addr.sun_path, strerror(errno));
+    close(*sock_fd);
+    *sock_fd = -1;
+    return 1;
+}
 
-    size_t file_len = 0;
+/* Switches the handshake of `ssl` to the certificate of the vhost its client
+ * named through SNI, the default one is kept otherwise */
+static int sni_select(SSL *ssl, int *alert, void *arg) {
+    const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    const struct vhost *vhost;
+    struct config *config;
+
+    if(!name) return SSL_TLSEXT_ERR_NOACK;
+    config = config_get();
+    vhost = vhost_lookup(&config->vhost_table, name, strlen(name));
+    /* the SSL holds on to the context past a reload */
+    if(vhost && vhost->ctx) SSL_set_SSL_CTX(ssl, vhost->ctx);
+    config_put(config);
+    return SSL_TLSEXT_ERR_OK;
+}
 
-    const char *type = 0;
+/* returns 0 on err */
+SSL_CTX* ctx_init(void) {
+    const SSL_METHOD *meth;
+    SSL_CTX *ctx;
 
-    const char html_begin[] = "<!DOCTYPE html>";
-    const size_t html_begin_size = sizeof(html_begin);
-    static_assert(sizeof(html_begin) == 16, "weird compiler");
+    OpenSSL_add_all_algorithms();
+    SSL_load_error_strings();
 
-    if(conn_init(&sock) <= 0) {
-        if(sock.type == CONN_SSL) {
-            logging(INFO, "Invalid SSL or plain text connection");
-            conn_ssl_to_conn_fd(&sock);
+    meth = TLS_server_method();
+    ctx = SSL_CTX_new(meth);
+    if(!ctx) {
+        // TODO(louis) add err message
+        ERR_print_errors_fp(stderr);
+        return ctx;
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    /* lets send_file hand the encryption to the kernel when it supports it */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_set_alpn_select_cb(ctx, h2_alpn_select, 0);
+    SSL_CTX_set_tlsext_servername_callback(ctx, sni_select);
+    /* connections queued for a handshake thread or an idle HTTP/2 one
+     * would otherwise hold about 32KiB of buffers each */
+    conn_ctx_lean(ctx);
+    return ctx;
+}
 
-            conn_flush(&sock);
+/* Returns: 0 on success, -1 on error */
+int load_certificates(SSL_CTX *ctx, char *cert_file, char *key_file) {
+    if(SSL_CTX_use_certificate_file(
+                ctx, cert_file, SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
 
-            // TODO(louis) use the values in the config
-            send_308(&sock, "https://localhost:9092");
+    if(SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
 
-            goto cleanup;
-        }
+    if(!SSL_CTX_check_private_key(ctx)) {
+        logging(ERR, "Private key does not match cert");
+        return -1;
     }
+    return 0;
+}
 
-    memcpy(path_buff, CONFIG.base_dir, CONFIG.base_dir_len);
-    path_buff[CONFIG.base_dir_len] = '/';
+/* creates a context serving the certificate and key in `pem_file`
+ * Returns: 0 on err */
+static SSL_CTX *ctx_load(char *pem_file, struct timespec *mtime) {
+    struct stat st;
+    SSL_CTX *ctx;
 
-    /* nothing to read */
-    if((buff_len = conn_read(&sock, buff, BUFFSIZE)) < 0) {
-        conn_cleanup(&sock);
-        logging(WARN, "nothing to read on connection %d, closing", sock);
-        goto cleanup;
+    if(stat(pem_file, &st) == -1) {
+        logging(ERR, "unable to stat `%s`: %s", pem_file, strerror(errno));
+        return 0;
     }
-
-    /* check if the content isn't GET */
-    if(strncmp(buff, "GET ", 4)) {
-        /* unsuported protocol */
-        printf("buff: %s", buff);
-        send_405(&sock);
-        logging(DEBUG, "buff lenght: %ld", buff_len);
-        goto cleanup;
+    ctx = ctx_init();
+    if(!ctx) return 0;
+    if(load_certificates(ctx, pem_file, pem_file)) {
+        SSL_CTX_free(ctx);
+        return 0;
     }
+    *mtime = st.st_mtim;
+    return ctx;
+}
 
-    if(request_header_parse(&request, buff, BUFFSIZE) < 0) {
-        goto cleanup;
+/* Loads the certificates of the vhosts of `config` that have one, the ones
+ * `old` loaded from an unchanged file are shared. Tickets issued with
+ * `ctx`, the default context, stay valid.
+ * Returns: 0 on success, -1 on error */
+static int vhost_certificates(struct config *config, const struct config *old, SSL_CTX *ctx) {
+    unsigned char keys[80];
+    int has_keys = SSL_CTX_get_tlsext_ticket_keys(ctx, keys, sizeof(keys)) > 0;
+
+    for(size_t i = 0; i < config->nb_vhosts; i++) {
+        struct vhost *vhost = config->vhosts + i;
+        struct stat st;
+
+        if(!vhost->pem_file) continue;
+        if(stat(vhost->pem_file, &st) == -1) {
+            logging(ERR, "unable to stat `%s`: %s", vhost->pem_file, strerror(errno));
+            return -1;
+        }
+        /* a new context would throw away the session cache */
+        for(size_t j = 0; old && j < old->nb_vhosts; j++) {
+            const struct vhost *prev = old->vhosts + j;
+            if(prev->ctx && !strcmp(prev->pem_file, vhost->pem_file)
+                    && prev->pem_mtime.tv_sec == st.st_mtim.tv_sec
+                    && prev->pem_mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                SSL_CTX_up_ref(prev->ctx);
+                vhost->ctx = prev->ctx;
+                vhost->pem_mtime = prev->pem_mtime;
+                break;
+            }
+        }
+        if(vhost->ctx) continue;
+        vhost->ctx = ctx_load(vhost->pem_file, &vhost->pem_mtime);
+        if(!vhost->ctx) return -1;
+        if(has_keys) SSL_CTX_set_tlsext_ticket_keys(vhost->ctx, keys, sizeof(keys));
     }
+    return 0;
+}
 
-    request.file++;
-    file_len = strlen(request.file);
-    /* FIXME temporary workaroud */
-    if(file_len == 0) {
-        request.file = index;
-        file_len = 10;
+/* Returns: 1 if `new` serves other trees than `old` */
+static int sites_moved(const struct config *old, const struct config *new) {
+    if(!old->base_dir || !new->base_dir || strcmp(old->base_dir, new->base_dir)) {
+        return 1;
     }
+    if(old->nb_vhosts != new->nb_vhosts) return 1;
+    for(size_t i = 0; i < new->nb_vhosts; i++) {
+        if(strcmp(old->vhosts[i].base_dir, new->vhosts[i].base_dir)) return 1;
+    }
+    return 0;
+}
 
-    memcpy(path_buff + CONFIG.base_dir_len + 1, request.file, file_len);
-    path_buff[CONFIG.base_dir_len + 1 + file_len] = '\0';
-    printf("path buff: %s\n", path_buff);
-
-    /* open the file */
-    file = open(path_buff, O_RDONLY);
+/* Builds the path filter when `config` asks for one, an archive is served
+ * from memory and does not need it
+ * Returns: 1 if a filter was asked for, 0 otherwise */
+static int path_filter_setup(const struct config *config) {
+    if(config->path_filter <= 0 || !config->base_dir || config->pack.data) return 0;
+    /* on failure lookups go to the file system as without a filter */
+    pathfilter_build(config->base_dir);
+    return 1;
+}
 
-    /* file not found */
-    if(file == -1) {
-        /* check for the very important teapot */
-        if(!strcmp(request.file, "teapot")) {
-            struct response_header response = {0};
-            response_header_init(
-                    &response,
-                    418,
-                    "I'm a tea pot",
-                    0);
+/* Reloads the config at `path` and swaps it in, the listener and the
+ * certificates are only replaced when they changed and warm caches are kept.
+ * Nothing changes if any step fails.
+ * Returns: 0 on success, -1 on error */
+static int reload_config(const char *path, int *serv_fd, int *unix_fd, SSL_CTX **ctx) {
+    struct config *old = config_get();
+    struct config *new = 0;
+    SSL_CTX *new_ctx = 0;
+    struct timespec new_mtime = PEM_MTIME;
+    int new_fd = -1;
+    int new_unix_fd = -1;
+    int unix_moved;
+    struct stat st;
+    FILE *f;
+
+    logging(INFO, "Reloading `%s`", path);
+    f = fopen(path, "r");
+    if(!f) {
+        logging(ERR, "unable to open `%s`: %s", path, strerror(errno));
+        goto failure;
+    }
+    new = config_parse(f);
+    fclose(f);
+    if(!new || config_prepare(new)) {
+        logging(ERR, "unable to load config: %s", get_config_err());
+        goto failure;
+    }
 
-            send_str(&response,
-                     I_AM_A_TEAPOT,
-                     I_AM_A_TEAPOT_LEN,
-                     &sock);
-        }
-        /* return a boring old 404 */
-        else {
-            send_404(&sock);
+    /* a new context would throw away the session cache */
+    if(strcmp(old->pem_file, new->pem_file)
+            || stat(new->pem_file, &st) == -1
+            || st.st_mtim.tv_sec != PEM_MTIME.tv_sec
+            || st.st_mtim.tv_nsec != PEM_MTIME.tv_nsec) {
+        unsigned char keys[80];
+
+        new_ctx = ctx_load(new->pem_file, &new_mtime);
+        if(!new_ctx) goto failure;
+        /* keep the tickets handed out so far valid */
+        if(SSL_CTX_get_tlsext_ticket_keys(*ctx, keys, sizeof(keys)) > 0) {
+            SSL_CTX_set_tlsext_ticket_keys(new_ctx, keys, sizeof(keys));
         }
-        goto cleanup;
-    }
-    /* ##### At this point a file is found ##### */
-    int path_len = strlen(path_buff);
-    /* by default the linux mimetype database does not include css for some
-     * reason */
-    if(path_len + 4 < BUFFSIZE && !strncmp(path_buff+path_len-4, ".css", 4)) {
-        type = "text/css";
-    }
-
-    /* set MIME info */
-    if(!type) {
-        type = magic_file(magic, path_buff);
-    }
-    if(!type) {
-        type = "application/octet-stream";
-        /* support for untagged html pages */
-        if(read(file, buff, html_begin_size-1) == html_begin_size-1
-           && !strncmp(buff, html_begin, html_begin_size-1)) {
-            type = "text/html";
+    }
+
+    if(vhost_certificates(new, old, new_ctx ? new_ctx : *ctx)) goto failure;
+
+    if(new->https_port != old->https_port) {
+        struct sockaddr_in serv_addr;
+        if(serv_setup(new, &new_fd, &serv_addr)) {
+            logging(ERR, "unable to listen on port %d", new->https_port);
+            goto failure;
         }
-        if(lseek(file, 0, SEEK_SET) <0) {
-            logging_errno(ERR, "lseek");
-            goto cleanup;
+    }
+
+    unix_moved = !old->unix_socket != !new->unix_socket
+        || (old->unix_socket && strcmp(old->unix_socket, new->unix_socket));
+    if(unix_moved && new->unix_socket && unix_setup(new, &new_unix_fd)) {
+        goto failure;
+    }
+
+    /* ##### nothing can fail anymore ##### */
+    if(new_ctx) {
+        /* connections already set up hold a reference on the old one */
+        SSL_CTX_free(*ctx);
+        *ctx = new_ctx;
+        PEM_MTIME = new_mtime;
+    }
+    if(new_fd != -1) {
+        close(*serv_fd);
+        *serv_fd = new_fd;
+    }
+    else {
+        listener_tune(*serv_fd, new);
+    }
+    if(unix_moved) {
+        if(*unix_fd != -1) {
+            close(*unix_fd);
+            unlink(old->unix_socket);
         }
+        *unix_fd = new_unix_fd;
+    }
+    else if(*unix_fd != -1) {
+        listener_tune(*unix_fd, new);
+        chmod(new->unix_socket, new->unix_socket_mode);
+    }
+    if(sites_moved(old, new)) {
+        /* the listings of the old trees won't be asked for anymore */
+        autoindex_cleanup();
     }
+    config_publish(new);
+    if(handshake_start(new->handshake_threads)) {
+        logging(WARN, "handshakes are done while serving");
+    }
+    if(fspool_start(new->fs_threads)) {
+        logging(WARN, "files are looked up while serving");
+    }
+    egress_start(new->send_rate, new->egress_rate, new->send_timeout);
+    overload_start(&new->overload, new->overload_action);
+    /* apps whose route is gone are stopped, new ones started */
+    fcgi_spawn(new->fastcgi, new->nb_fastcgi, new->fastcgi_workers);
+    /* walked again even for the same base_dir, a reload is also how to
+     * resync it by hand */
+    if(!path_filter_setup(new)) pathfilter_cleanup();
+    config_put(old);
+    logging(INFO, "configuration reloaded");
+    return 0;
 
-    /* send the file */
-    if(send_whole_file(200, 0, type, file, &sock) < 0) {
-        send_500(&sock);
-        goto cleanup;
+failure:
+    if(new_ctx) SSL_CTX_free(new_ctx);
+    if(new_fd != -1) close(new_fd);
+    if(new_unix_fd != -1) {
+        close(new_unix_fd);
+        unlink(new->unix_socket);
     }
+    config_put(new);
+    config_put(old);
+    return -1;
+}
 
-cleanup:
-    conn_cleanup(&sock);
-    return;
+/* Detects TLS on the freshly accepted `fd` and serves it */
+static void serve_accepted(int fd, struct conn conn, SSL_CTX *ctx) {
+    /* turned away before even waiting on the first bytes */
+    if(OVERLOADED == OVERLOAD_503) {
+        overload_shed(fd);
+        return;
+    }
+    uint8_t first_tree_bytes[3] = {0};
+    if(recv(fd, first_tree_bytes, 3, MSG_PEEK) == -1) {
+        logging_errno(DEBUG, "recv: ");
+        close(fd);
+        return;
+    }
+
+    // Detect ssl headers and default to plain text,
+    // this is very cursed and should never be done.
+    _Bool is_ssl = false;
+    for(size_t i = 0; i < SSL_HELLO_VARIANTS; i++) {
+        if(!memcmp(SSL_HELLO_BYTES[i], first_tree_bytes, 3)) {
+            SSL *ssl = SSL_new(ctx);
+            SSL_set_fd(ssl, fd);
+            conn_new_ssl(ssl, &conn);
+            is_ssl = true;
+            break;
+        }
+    }
+    /* the handshake is the expensive step, a client over its rate limit
+     * does not get one, a 429 could only be sent after it */
+    if(is_ssl) {
+        struct config *config = config_get();
+        int allowed = ratelimit_take(&config->rate_limit, (struct sockaddr*)&conn.peer);
+        config_put(config);
+        if(!allowed) {
+            logging(DEBUG, "client over its rate limit, closing before the handshake");
+            SSL_free(conn.data.ssl);
+            close(fd);
+            return;
+        }
+        conn.rate_taken = 1;
+    }
+    /* served once a handshake thread is done with it */
+    if(is_ssl && !handshake_submit(&conn)) return;
+    if(!is_ssl) {
+        conn_new_fd(fd, &conn);
+    }
+    handle_conn(conn);
 }
 
-/* returns 0 on err */
-SSL_CTX* ctx_init(void) {
-    const SSL_METHOD *meth;
-    SSL_CTX *ctx;
+/* Finishes the files being sent, unless asked to stop */
+static void egress_drain(void) {
+    struct egress_stats stats;
 
-    OpenSSL_add_all_algorithms();
-    SSL_load_error_strings();
+    for(egress_stats(&stats); KEEP_RUNNING && stats.active; egress_stats(&stats)) {
+        struct timeval timeval = {.tv_sec = 5};
+        fd_set w;
+        int max;
 
-    meth = TLS_server_method();
-    ctx = SSL_CTX_new(meth);
-    if(!ctx) {
-        // TODO(louis) add err message
-        ERR_print_errors_fp(stderr);
+        FD_ZERO(&w);
+        max = egress_fds(&w, &timeval);
+        if(select(max + 1, 0, &w, 0, &timeval) == -1) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        egress_run(&w);
+    }
+    egress_stop();
+    egress_stats(&stats);
+    if(stats.submitted) {
+        logging(INFO, "large files: %llu sent in turns, %llu cut short, %llu of them stalled, at most %zu at once",
+                (unsigned long long)stats.completed,
+                (unsigned long long)stats.failed,
+                (unsigned long long)stats.stalled,
+                stats.max_active);
     }
-    return ctx;
 }
 
-void load_certificates(SSL_CTX *ctx, char *cert_file, char *key_file) {
-    if(SSL_CTX_use_certificate_file(
-                ctx, cert_file, SSL_FILETYPE_PEM) <= 0) {
-        ERR_print_errors_fp(stderr);
-        abort();
-    }
+static void overload_report(void) {
+    struct overload_stats stats;
 
-    if(SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) <= 0) {
-        ERR_print_errors_fp(stderr);
-        abort();
+    overload_stats(&stats);
+    if(!stats.episodes) return;
+    logging(INFO, "overload: %llu times, %llu connections shed, %llu dropped, %llu us of lag at worst",
+            (unsigned long long)stats.episodes,
+            (unsigned long long)stats.shed,
+            (unsigned long long)stats.dropped,
+            (unsigned long long)stats.max_lag_us);
+}
+
+/* Serves the connections whose handshake a thread finished */
+static void serve_handshaken(void) {
+    struct conn conn;
+
+    while(KEEP_RUNNING && handshake_collect(&conn)) handle_conn(conn);
+}
+
+/* Answers the requests whose file a thread resolved */
+static void serve_resolved(void) {
+    struct fs_job *job;
+
+    while(KEEP_RUNNING && (job = fspool_collect())) handle_resolved(job);
+}
+
+/* Answers the requests of the files being looked up and stops the threads */
+static void fspool_drain(void) {
+    struct fspool_stats stats;
+    struct fs_job *job;
+
+    fspool_start(0);
+    /* their connections are served even when asked to stop, a request
+     * holds the buffers and config it was read with */
+    while((job = fspool_collect())) handle_resolved(job);
+    if(fspool_fd() != -1) {
+        fspool_stats(&stats);
+        logging(INFO, "file system: %llu looked up by threads, %llu in the page cache, %llu while serving, %llu read ahead, %llu us at worst",
+                (unsigned long long)stats.queued,
+                (unsigned long long)stats.resident,
+                (unsigned long long)(stats.hot + stats.overflowed),
+                (unsigned long long)stats.readahead,
+                (unsigned long long)(stats.max_latency_ns / 1000));
     }
+    fspool_stop();
+}
 
-    if(!SSL_CTX_check_private_key(ctx)) {
-        logging(ERR, "Private key does not match cert");
-        abort();
+/* Accepts and serves connections on `listener` until its backlog is empty,
+ * a wakeup is not worth a single connection */
+static void accept_all(int listener, SSL_CTX *ctx) {
+    while(KEEP_RUNNING && !RELOAD && !UPGRADE) {
+        struct conn conn = {0};
+        conn.peer_len = sizeof(conn.peer);
+        /* accepted sockets stay blocking, they are served in one go */
+        int new_fd = accept4(
+                listener,
+                (struct sockaddr*)&conn.peer,
+                &conn.peer_len,
+                SOCK_CLOEXEC);
+        if(new_fd == -1) {
+            /* the client gave up while waiting in the backlog */
+            if(errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                logging_errno(WARN, "accept: ");
+            }
+            return;
+        }
+        PROBE(accept, new_fd);
+        serve_accepted(new_fd, conn, ctx);
     }
 }
 
 int main(int argc, const char **argv) {
     struct sockaddr_in serv_addr;
+    struct config *config;
     int serv_fd;
+    int unix_fd = -1;
 
     signal(SIGINT, sigint_halder);
+    signal(SIGHUP, sighup_handler);
+    signal(SIGUSR2, sigusr2_handler);
+    signal(SIGCHLD, sigchld_handler);
+    /* the default action would kill us mid-drain, see `sigalrm_handler` */
+    signal(SIGALRM, sigalrm_handler);
     /* prevent gdb and valgrind to stop execution on SIGPIPE */
 #ifndef NDEBUG
     signal(SIGPIPE, sigint_halder);
@@ -288,74 +713,235 @@ int main(int argc, const char **argv) {
         logging(ERR, "unable to load config: %s", get_config_err());
         return -1;
     }
+    fclose(config_file);
+    config = config_get();
 
     /* initialise openssl  */
     SSL_library_init();
 
     /* configure ssl */
-    SSL_CTX *ctx = ctx_init();
-    load_certificates(ctx, CONFIG.pem_file, CONFIG.pem_file);
+    SSL_CTX *ctx = ctx_load(config->pem_file, &PEM_MTIME);
+    if(!ctx) {
+        return -1;
+    }
+    /* nothing is served yet, the published snapshot can still be filled */
+    if(vhost_certificates(config, 0, ctx)) {
+        return -1;
+    }
 
     logging(INFO, "Initiating MIME DB");
     /* initialise the mime hashmap */
-    mime_init();
+    if(mime_init()) {
+        return -1;
+    }
+
+    if(file_map_init()) {
+        return -1;
+    }
+
+    ratelimit_init();
+
+    /* listeners handed over by the process we are replacing */
+    int inherited[UPGRADE_MAX_FDS];
+    int nb_inherited = upgrade_inherit(inherited, UPGRADE_MAX_FDS);
+    serv_fd = -1;
+    for(int i = 0; i < nb_inherited; i++) {
+        if(serv_fd == -1 && listener_port(inherited[i]) == config->https_port) {
+            logging(INFO, "taking over the listener on port %d", config->https_port);
+            serv_fd = inherited[i];
+            if(listener_tune(serv_fd, config)) {
+                return -1;
+            }
+        }
+        else if(unix_fd == -1 && listener_is_path(inherited[i], config->unix_socket)) {
+            logging(INFO, "taking over the listener on `%s`", config->unix_socket);
+            unix_fd = inherited[i];
+            if(listener_tune(unix_fd, config)) {
+                return -1;
+            }
+        }
+        else {
+            close(inherited[i]);
+        }
+    }
 
-    logging(INFO,"starting server on 0.0.0.0:%d", CONFIG.https_port);
+    logging(INFO,"starting server on 0.0.0.0:%d", config->https_port);
     /* setup socket for listen */
-    if(serv_setup(CONFIG.https_port, &serv_fd, &serv_addr)) {
+    if(serv_fd == -1 && serv_setup(config, &serv_fd, &serv_addr)) {
         perror("err setup");
         return -1;
     }
+    if(config->unix_socket && unix_fd == -1) {
+        logging(INFO, "also listening on `%s`", config->unix_socket);
+        if(unix_setup(config, &unix_fd)) {
+            return -1;
+        }
+    }
+    path_filter_setup(config);
+    if(handshake_start(config->handshake_threads)) {
+        logging(WARN, "handshakes are done while serving");
+    }
+    if(fspool_start(config->fs_threads)) {
+        logging(WARN, "files are looked up while serving");
+    }
+    egress_start(config->send_rate, config->egress_rate, config->send_timeout);
+    overload_start(&config->overload, config->overload_action);
+    if(fcgi_spawn(config->fastcgi, config->nb_fastcgi, config->fastcgi_workers)) {
+        logging(WARN, "some FastCGI apps are not running, their requests get a 502");
+    }
+    config_put(config);
+    upgrade_ready();
 
     logging(INFO, "server started");
 
     /* ###########################Start Serving############################# */
     while(KEEP_RUNNING) {
-        int code, nfds = 0;
+        if(RELOAD) {
+            RELOAD = 0;
+            reload_config(argv[1], &serv_fd, &unix_fd, &ctx);
+        }
+        if(CHILD_EXITED) {
+            CHILD_EXITED = 0;
+            /* a worker that died right away is started again later */
+            if(fcgi_reap()) CHILD_EXITED = 1;
+        }
+        if(UPGRADE) {
+            UPGRADE = 0;
+            logging(INFO, "Upgrading, handing the listeners over");
+            int listeners[2] = {serv_fd, unix_fd};
+            if(!upgrade_exec((char *const*)argv, listeners, unix_fd != -1 ? 2 : 1)) {
+                /* pending connections stay in the backlog for the new
+                 * process, finish ours within the deadline */
+                close(serv_fd);
+                serv_fd = -1;
+                /* the socket file is the new process' now */
+                if(unix_fd != -1) close(unix_fd);
+                unix_fd = -1;
+                config = config_get();
+                alarm(config->drain_timeout);
+                config_put(config);
+                goto cleanup;
+            }
+        }
+        int code, nfds = 0, filter_fd, handshake_done_fd, fs_done_fd, egress_fd;
+        struct timespec woke;
         fd_set r;
+        fd_set w;
         struct timeval timeval;
         timeval.tv_sec = 5;
         timeval.tv_usec = 0;
         FD_ZERO(&r);
-        FD_SET(serv_fd, &r);
-        nfds = nfds > serv_fd ? nfds : serv_fd;
+        FD_ZERO(&w);
+        OVERLOADED = overload_check(serv_fd);
+        if(OVERLOADED == OVERLOAD_PAUSE) {
+            /* new connections wait in the backlog, the load is looked at
+             * again shortly */
+            timeval.tv_sec = 0;
+            timeval.tv_usec = OVERLOAD_PAUSE_CHECK * 1000;
+        }
+        else {
+            FD_SET(serv_fd, &r);
+            nfds = nfds > serv_fd ? nfds : serv_fd;
+            if(unix_fd != -1) {
+                FD_SET(unix_fd, &r);
+                nfds = nfds > unix_fd ? nfds : unix_fd;
+            }
+        }
+        filter_fd = pathfilter_fd();
+        if(filter_fd != -1) {
+            FD_SET(filter_fd, &r);
+            nfds = nfds > filter_fd ? nfds : filter_fd;
+        }
+        handshake_done_fd = handshake_fd();
+        if(handshake_done_fd != -1) {
+            FD_SET(handshake_done_fd, &r);
+            nfds = nfds > handshake_done_fd ? nfds : handshake_done_fd;
+        }
+        fs_done_fd = fspool_fd();
+        if(fs_done_fd != -1) {
+            FD_SET(fs_done_fd, &r);
+            nfds = nfds > fs_done_fd ? nfds : fs_done_fd;
+        }
+
+        /* the large files being sent, whose turn comes with room in their
+         * socket */
+        egress_fd = egress_fds(&w, &timeval);
+        nfds = nfds > egress_fd ? nfds : egress_fd;
+        /* the walks the path filter's changes need, once they settle */
+        pathfilter_timeout(&timeval);
 
-        code = select(nfds+1, &r, 0, 0, &timeval);
+        code = select(nfds+1, &r, &w, 0, &timeval);
         if(code == -1) {
+            /* interrupted by a signal, its flag is checked above */
+            if(errno == EINTR) continue;
             goto cleanup;
         }
-        else if(code == 0) {
+        /* the time until the next select is the lag new events see */
+        clock_gettime(CLOCK_MONOTONIC, &woke);
+        pathfilter_refresh();
+        if(code == 0) {
+            overload_busy(&woke);
             continue;
         }
-        int new_fd = accept(serv_fd, 0, 0);
-        struct conn conn = {0};
-
-        uint8_t first_tree_bytes[3] = {0};
-        int ret = recv(new_fd, first_tree_bytes, 3, MSG_PEEK);
-        assert(ret != -1);
-
-        // Detect ssl headers and default to plain text,
-        // this is very cursed and should never be done.
-        _Bool is_ssl = false;
-        for(size_t i = 0; i < SSL_HELLO_VARIANTS; i++) {
-            if(!memcmp(SSL_HELLO_BYTES[i], first_tree_bytes, 3)) {
-                SSL *ssl = SSL_new(ctx);
-                SSL_set_fd(ssl, new_fd);
-                conn_new_ssl(ssl, &conn);
-                is_ssl = true;
-                break;
-            }
-        }
-        if(!is_ssl) {
-            conn_new_fd(new_fd, &conn);
+        if(FD_ISSET(serv_fd, &r)) accept_all(serv_fd, ctx);
+        if(unix_fd != -1 && FD_ISSET(unix_fd, &r)) accept_all(unix_fd, ctx);
+        if(filter_fd != -1 && FD_ISSET(filter_fd, &r)) pathfilter_update();
+        if(handshake_done_fd != -1 && FD_ISSET(handshake_done_fd, &r)) {
+            serve_handshaken();
         }
-        handle_conn(conn);
+        if(fs_done_fd != -1 && FD_ISSET(fs_done_fd, &r)) serve_resolved();
+        if(egress_fd != -1) egress_run(&w);
+        overload_busy(&woke);
     }
 cleanup:
     /* close the socket */
-    close(serv_fd);
+    if(serv_fd != -1) close(serv_fd);
+    if(unix_fd != -1) {
+        close(unix_fd);
+        config = config_get();
+        unlink(config->unix_socket);
+        config_put(config);
+    }
+    /* the queued handshakes are finished, their connections are still
+     * served when upgrading */
+    handshake_start(0);
+    serve_handshaken();
+    if(handshake_fd() != -1) {
+        struct handshake_stats stats;
+        handshake_stats(&stats);
+        logging(INFO, "handshakes: %llu queued, %llu done while serving, %llu failed, at most %llu waiting, %llu us at worst",
+                (unsigned long long)stats.queued,
+                (unsigned long long)stats.overflowed,
+                (unsigned long long)stats.failed,
+                (unsigned long long)stats.max_depth,
+                (unsigned long long)(stats.max_latency_ns / 1000));
+    }
+    handshake_stop();
+    /* so are the files being looked up */
+    fspool_drain();
+    /* so are the files being sent */
+    egress_drain();
+    if(DRAIN_EXPIRED) {
+        logging(WARN, "drain_timeout reached, the connections left were cut short");
+    }
+    overload_report();
     SSL_CTX_free(ctx);
-    magic_close(magic);
+    mime_cleanup();
+    file_map_cleanup();
+    autoindex_cleanup();
+    bufpool_cleanup();
+    proxy_cleanup();
+    fcgi_cleanup();
+    if(pathfilter_fd() != -1) {
+        struct pathfilter_stats stats;
+        pathfilter_stats(&stats);
+        logging(INFO, "path filter: %llu lookups, %llu misses, %llu false positives, %llu rebuilds",
+                (unsigned long long)stats.lookups,
+                (unsigned long long)stats.misses,
+                (unsigned long long)stats.false_positives,
+                (unsigned long long)stats.rebuilds);
+    }
+    pathfilter_cleanup();
     cleanup_config();
     return 0;
 }
@@ -0,0 +1,187 @@
+#include "mem_conn.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#define MIN(a,b) (a < b ? a : b)
+
+size_t mem_buf_put(struct mem_buf *buf, const void *data, size_t len) {
+    /* what was read is dropped to make room */
+    if(buf->off && buf->len + len > MEM_BUF_SIZE) {
+        memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+        buf->len -= buf->off;
+        buf->off = 0;
+    }
+    len = MIN(len, MEM_BUF_SIZE - buf->len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return len;
+}
+
+size_t mem_buf_take(struct mem_buf *buf, void *data, size_t size) {
+    size_t len = MIN(size, buf->len - buf->off);
+
+    memcpy(data, buf->data + buf->off, len);
+    buf->off += len;
+    if(buf->off == buf->len) {
+        buf->off = 0;
+        buf->len = 0;
+    }
+    return len;
+}
+
+void mem_pipe_reset(struct mem_pipe *pipe) {
+    pipe->in.len = pipe->in.off = 0;
+    pipe->out.len = pipe->out.off = 0;
+}
+
+/* Reads what the client side sent, asking it for more when there is
+ * nothing left
+ * Returns: the number of bytes read, 0 on an end of file */
+static size_t pipe_read(struct mem_pipe *pipe, void *buf, size_t size) {
+    while(pipe->in.off == pipe->in.len) {
+        if(!pipe->client || pipe->client(pipe, pipe->ctx)) return 0;
+    }
+    return mem_buf_take(&pipe->in, buf, size);
+}
+
+/* Writes all of `buf`, letting the client side take `out` when it is full
+ * Returns: the number of bytes written, -1 if the client is gone */
+static ssize_t pipe_write(struct mem_pipe *pipe, const void *buf, size_t size) {
+    size_t written = mem_buf_put(&pipe->out, buf, size);
+
+    while(written < size) {
+        /* a client that takes nothing would be waited on forever */
+        if(!pipe->client || pipe->client(pipe, pipe->ctx)
+                || pipe->out.len - pipe->out.off == MEM_BUF_SIZE) {
+            errno = EPIPE;
+            return -1;
+        }
+        written += mem_buf_put(&pipe->out, (const char*)buf + written, size - written);
+    }
+    return written;
+}
+
+static ssize_t mem_read(struct conn *conn, void *buf, size_t size) {
+    return pipe_read(conn->data.pipe, buf, size);
+}
+
+static ssize_t mem_write(struct conn *conn, const void *buf, size_t size) {
+    return pipe_write(conn->data.pipe, buf, size);
+}
+
+static ssize_t mem_writev(struct conn *conn, const struct iovec *iov, size_t nbv) {
+    ssize_t size = 0;
+
+    for(size_t i = 0; i < nbv; i++) {
+        if(mem_write(conn, iov[i].iov_base, iov[i].iov_len) < 0) return -1;
+        size += iov[i].iov_len;
+    }
+    return size;
+}
+
+static int mem_init(struct conn *conn) {
+    return 1;
+}
+
+static void mem_cleanup(struct conn *conn) {
+    /* the pipe belongs to whoever made the connection */
+}
+
+static int mem_fd(struct conn *conn) {
+    return -1;
+}
+
+static int mem_pending(struct conn *conn) {
+    struct mem_pipe *pipe = conn->data.pipe;
+    return pipe->in.off != pipe->in.len;
+}
+
+static int mem_wait(struct conn *conn) {
+    struct mem_pipe *pipe = conn->data.pipe;
+
+    while(pipe->in.off == pipe->in.len) {
+        if(!pipe->client || pipe->client(pipe, pipe->ctx)) return -1;
+    }
+    return 0;
+}
+
+static const struct conn_ops MEM_OPS = {
+    .read = mem_read,
+    .write = mem_write,
+    .writev = mem_writev,
+    .init = mem_init,
+    .cleanup = mem_cleanup,
+    .fd = mem_fd,
+    .pending = mem_pending,
+    .wait = mem_wait,
+};
+
+int conn_new_mem(struct mem_pipe *pipe, struct conn *conn) {
+    conn->type = CONN_MEM;
+    conn->ops = &MEM_OPS;
+    conn->data.pipe = pipe;
+    return 0;
+}
+
+static BIO_METHOD *PIPE_METHOD = 0;
+
+static pthread_once_t PIPE_METHOD_ONCE = PTHREAD_ONCE_INIT;
+
+static int bio_pipe_write(BIO *bio, const char *data, int len) {
+    struct mem_pipe *pipe = BIO_get_data(bio);
+
+    BIO_clear_retry_flags(bio);
+    return pipe_write(pipe, data, len);
+}
+
+static int bio_pipe_read(BIO *bio, char *data, int len) {
+    struct mem_pipe *pipe = BIO_get_data(bio);
+
+    BIO_clear_retry_flags(bio);
+    /* an end of file, the handshake or the read fails like on a closed
+     * socket */
+    return pipe_read(pipe, data, len);
+}
+
+static long bio_pipe_ctrl(BIO *bio, int cmd, long num, void *ptr) {
+    struct mem_pipe *pipe = BIO_get_data(bio);
+
+    switch(cmd) {
+        case BIO_CTRL_FLUSH:
+            return 1;
+        case BIO_CTRL_PENDING:
+            return pipe->in.len - pipe->in.off;
+        case BIO_CTRL_WPENDING:
+            return 0;
+    }
+    return 0;
+}
+
+static int bio_pipe_create(BIO *bio) {
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+static void pipe_method_init(void) {
+    PIPE_METHOD = BIO_meth_new(
+            BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+            "memory pipe");
+    if(!PIPE_METHOD) return;
+    BIO_meth_set_write(PIPE_METHOD, bio_pipe_write);
+    BIO_meth_set_read(PIPE_METHOD, bio_pipe_read);
+    BIO_meth_set_ctrl(PIPE_METHOD, bio_pipe_ctrl);
+    BIO_meth_set_create(PIPE_METHOD, bio_pipe_create);
+}
+
+BIO *mem_pipe_bio(struct mem_pipe *pipe) {
+    BIO *bio;
+
+    pthread_once(&PIPE_METHOD_ONCE, pipe_method_init);
+    if(!PIPE_METHOD) return 0;
+    bio = BIO_new(PIPE_METHOD);
+    if(!bio) return 0;
+    BIO_set_data(bio, pipe);
+    return bio;
+}
@@ -0,0 +1,52 @@
+#ifndef MEM_CONN_H
+#define MEM_CONN_H 1
+
+#include <stddef.h>
+#include <openssl/bio.h>
+
+#include "conn.h"
+
+/* room in each direction of a pipe, a full TLS record fits */
+#define MEM_BUF_SIZE (16 * 1024 + 512)
+
+/* bytes going one way, read from `off` up to `len` */
+struct mem_buf {
+    char data[MEM_BUF_SIZE];
+    size_t len;
+    size_t off;
+};
+
+/* A connection held in memory, the server side reads `in` and writes `out`.
+ * The client side is whoever feeds `in` and takes `out`. */
+struct mem_pipe {
+    struct mem_buf in;
+    struct mem_buf out;
+    /* called when the server side would block, on an empty `in` or a full
+     * `out`, this is where the client takes what the server wrote so far and
+     * answers it.
+     * Returns: 0 if the client took or fed something, -1 once it is gone */
+    int (*client)(struct mem_pipe *pipe, void *ctx);
+    void *ctx;
+};
+
+/* Copies as much of `data` as fits at the end of `buf`
+ * Returns: the number of bytes copied */
+size_t mem_buf_put(struct mem_buf *buf, const void *data, size_t len);
+
+/* Moves up to `size` bytes out of `buf`
+ * Returns: the number of bytes moved */
+size_t mem_buf_take(struct mem_buf *buf, void *data, size_t size);
+
+/* empties both directions of `pipe` */
+void mem_pipe_reset(struct mem_pipe *pipe);
+
+/* Makes `conn` a plain text connection over `pipe`, cleaning `conn` up
+ * leaves `pipe` to its owner
+ * Returns: 0 */
+int conn_new_mem(struct mem_pipe *pipe, struct conn *conn);
+
+/* Returns: a BIO over `pipe` for an SSL, 0 on error
+ *  the BIO does not own `pipe` */
+BIO *mem_pipe_bio(struct mem_pipe *pipe);
+
+#endif
@@ -0,0 +1,56 @@
+#include "mime.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <magic.h>
+
+#include "logging.h"
+
+/* libmagic's handles are not thread safe, each thread loads its own */
+static __thread magic_t MAGIC = 0;
+
+int mime_init(void) {
+    MAGIC = magic_open(MAGIC_MIME_TYPE);
+    if(!MAGIC) return -1;
+    if(magic_load(MAGIC, 0)) {
+        logging(ERR, "unable to load the mime database: %s", magic_error(MAGIC));
+        magic_close(MAGIC);
+        MAGIC = 0;
+        return -1;
+    }
+    // on arch the db is already compiled
+    //magic_compile(magic, 0);
+    return 0;
+}
+
+const char *mime_get(const char *path, int fd) {
+    const char html_begin[] = "<!DOCTYPE html>";
+    const size_t html_begin_size = sizeof(html_begin);
+    static_assert(sizeof(html_begin) == 16, "weird compiler");
+    char buff[sizeof(html_begin)];
+    const char *type = 0;
+    size_t path_len = strlen(path);
+
+    /* by default the linux mimetype database does not include css for some
+     * reason */
+    if(path_len >= 4 && !strncmp(path+path_len-4, ".css", 4)) {
+        return "text/css";
+    }
+
+    type = magic_file(MAGIC, path);
+    if(type) return type;
+
+    type = "application/octet-stream";
+    /* support for untagged html pages */
+    if(pread(fd, buff, html_begin_size-1, 0) == html_begin_size-1
+       && !strncmp(buff, html_begin, html_begin_size-1)) {
+        type = "text/html";
+    }
+    return type;
+}
+
+void mime_cleanup(void) {
+    if(MAGIC) magic_close(MAGIC);
+    MAGIC = 0;
+}
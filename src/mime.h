@@ -0,0 +1,17 @@
+#ifndef MIME_H
+#define MIME_H 1
+
+/* loads libmagic's database for the calling thread
+ * Returns: 0 on success, -1 otherwise */
+int mime_init(void);
+
+/* Finds the mime type of the file at `path`, `fd` is the same file opened for
+ * reading, its offset is left untouched.
+ * Returns: the mime type, it stays valid until the next call on the thread
+ *  0 on error */
+const char *mime_get(const char *path, int fd);
+
+/* unloads the database of the calling thread */
+void mime_cleanup(void);
+
+#endif
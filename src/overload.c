@@ -0,0 +1,124 @@
+#include "overload.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+/* glibc's netinet/tcp.h lacks the newer tcp_info fields */
+#include <linux/tcp.h>
+
+#include "egress.h"
+#include "fspool.h"
+#include "handshake.h"
+#include "logging.h"
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+const char OVERLOAD_RESPONSE[] = (
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: "XSTR(OVERLOAD_RETRY_AFTER)"\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+);
+const size_t OVERLOAD_RESPONSE_LEN = sizeof(OVERLOAD_RESPONSE) - 1;
+
+/* a TLS record carrying a handshake, a client hello on a fresh connection */
+#define TLS_HANDSHAKE 22
+
+/* served from the select loop alone, no lock */
+static struct overload_limits LIMITS = {0};
+static enum overload_action ACTION = OVERLOAD_503;
+
+static struct overload_stats STATS = {0};
+
+void overload_start(const struct overload_limits *limits, enum overload_action action) {
+    LIMITS = *limits;
+    ACTION = action;
+}
+
+void overload_busy(const struct timespec *woke) {
+    struct timespec now;
+    uint64_t busy;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    busy = (now.tv_sec - woke->tv_sec) * 1000000
+        + (now.tv_nsec - woke->tv_nsec) / 1000;
+    /* a moving average, a single slow turn is not an overload */
+    STATS.lag_us = (STATS.lag_us * 3 + busy) / 4;
+    if(busy > STATS.max_lag_us) STATS.max_lag_us = busy;
+}
+
+/* Returns: the connections waiting in the accept queue of `listener` */
+static uint32_t backlog(int listener) {
+    struct tcp_info info = {0};
+    socklen_t len = sizeof(info);
+
+    if(listener == -1) return 0;
+    if(getsockopt(listener, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) return 0;
+    /* a listener reports its queue there */
+    return info.tcpi_unacked;
+}
+
+int overload_check(int listener) {
+    struct handshake_stats handshakes;
+    struct egress_stats egress;
+    struct fspool_stats fs;
+    int over = 0;
+
+    if(!LIMITS.connections && !LIMITS.lag_ms && !LIMITS.handshakes) return 0;
+    handshake_stats(&handshakes);
+    egress_stats(&egress);
+    fspool_stats(&fs);
+
+    STATS.connections = handshakes.depth + fs.depth + egress.active;
+    /* a paused listener's backlog only shrinks once the pause is over, it
+     * would keep it going forever */
+    if(LIMITS.connections && ACTION == OVERLOAD_503) STATS.connections += backlog(listener);
+    if(LIMITS.connections && STATS.connections > LIMITS.connections) over = 1;
+    if(LIMITS.lag_ms && STATS.lag_us / 1000 > LIMITS.lag_ms) over = 1;
+    if(LIMITS.handshakes && handshakes.depth > LIMITS.handshakes) over = 1;
+
+    if(over && !STATS.overloaded) {
+        STATS.episodes++;
+        logging(WARN, "overloaded: %llu connections waiting, %llu us of lag, %llu handshakes queued",
+                (unsigned long long)STATS.connections,
+                (unsigned long long)STATS.lag_us,
+                (unsigned long long)handshakes.depth);
+    }
+    else if(!over && STATS.overloaded) {
+        logging(INFO, "load back under the limits");
+    }
+    STATS.overloaded = over;
+    return over ? ACTION : 0;
+}
+
+void overload_shed(int fd) {
+    char request[4096];
+    ssize_t len = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+
+    /* a full handshake is what an overloaded server can least afford, and
+     * a client could offer a made up session to get one */
+    if(len > 0 && (unsigned char)request[0] == TLS_HANDSHAKE) {
+        close(fd);
+        STATS.dropped++;
+        return;
+    }
+    /* whatever of the request already came is read, closing on unread
+     * bytes would reset the connection before the client sees the 503,
+     * nothing waits on the client either way */
+    while(len == sizeof(request)) len = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+    if(send(fd, OVERLOAD_RESPONSE, OVERLOAD_RESPONSE_LEN, MSG_DONTWAIT | MSG_NOSIGNAL)
+            == (ssize_t)OVERLOAD_RESPONSE_LEN) {
+        STATS.shed++;
+    }
+    else {
+        STATS.dropped++;
+    }
+    close(fd);
+}
+
+void overload_stats(struct overload_stats *stats) {
+    *stats = STATS;
+}
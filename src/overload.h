@@ -0,0 +1,71 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+/* seconds a shed client is told to wait before trying again */
+#define OVERLOAD_RETRY_AFTER 5
+
+/* milliseconds between two looks at the load while the listeners are
+ * paused */
+#define OVERLOAD_PAUSE_CHECK 100
+
+/* what happens to new connections past the limits */
+enum overload_action {
+    /* answered with a 503 without being served */
+    OVERLOAD_503 = 1,
+    /* left in the backlog, the listeners are not looked at */
+    OVERLOAD_PAUSE,
+};
+
+/* past any of these the server is overloaded, 0 leaves one out */
+struct overload_limits {
+    /* connections waiting to be accepted, with OVERLOAD_503 alone, in the
+     * handshake queue, on the file system threads or taking turns to send
+     * a file */
+    uint32_t connections;
+    /* milliseconds the select loop works between two waits, on average */
+    uint32_t lag_ms;
+    /* handshakes waiting for a thread */
+    uint32_t handshakes;
+};
+
+struct overload_stats {
+    /* connections answered with a 503, then those closed unanswered, TLS
+     * clients and those whose socket was full */
+    uint64_t shed;
+    uint64_t dropped;
+    /* times the server went over its limits */
+    uint64_t episodes;
+    /* what the last look saw */
+    uint64_t connections;
+    uint64_t lag_us;
+    uint64_t max_lag_us;
+    int overloaded;
+};
+
+/* a ready to send 503 for HTTP/1.1 */
+extern const char OVERLOAD_RESPONSE[];
+
+extern const size_t OVERLOAD_RESPONSE_LEN;
+
+/* Sets the limits and what is done past them, called again on reload */
+void overload_start(const struct overload_limits *limits, enum overload_action action);
+
+/* Accounts for a turn of the select loop whose work started at `woke` */
+void overload_busy(const struct timespec *woke);
+
+/* Looks at the load, `listener` is the TCP listener whose backlog is
+ * counted, -1 for none
+ * Returns: 0 under the limits, the `enum overload_action` to take otherwise */
+int overload_check(int listener);
+
+/* Answers the freshly accepted `fd` with OVERLOAD_RESPONSE out of what it
+ * already received, without waiting on the client, and closes it. A TLS
+ * client is closed unanswered. */
+void overload_shed(int fd);
+
+void overload_stats(struct overload_stats *stats);
+
+#endif
@@ -0,0 +1,158 @@
+#include "pack.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logging.h"
+
+uint32_t pack_hash(uint32_t seed, const char *key, size_t key_len) {
+    /* FNV-1a followed by murmur3's finalizer */
+    uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+    for(size_t i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* Returns: 1 if [off, off+len[ lies within the archive */
+static int in_bounds(const struct pack *pack, uint64_t off, uint64_t len) {
+    return off <= pack->size && len <= pack->size - off;
+}
+
+/* checks every offset once so that lookups don't have to, the index is
+ * only pointed to once it is known to be in the file */
+static int pack_validate(struct pack *pack) {
+    const struct pack_header *header = pack->header;
+
+    if(memcmp(header->magic, PACK_MAGIC, sizeof(header->magic))) {
+        logging(ERR, "not a sv-pack archive");
+        return -1;
+    }
+    if(header->version != PACK_VERSION
+            || header->entry_size != sizeof(struct pack_entry)) {
+        logging(ERR, "unsupported archive version %u", header->version);
+        return -1;
+    }
+    if(!header->nb_buckets || !header->nb_slots
+            || !in_bounds(pack, header->seeds_off,
+                (uint64_t)header->nb_buckets * sizeof(uint32_t))
+            || !in_bounds(pack, header->entries_off,
+                (uint64_t)header->nb_slots * sizeof(struct pack_entry))
+            || header->seeds_off % sizeof(uint32_t)
+            || header->entries_off % sizeof(uint64_t)) {
+        logging(ERR, "corrupted archive index");
+        return -1;
+    }
+    pack->seeds = (const uint32_t*)(pack->data + header->seeds_off);
+    pack->entries = (const struct pack_entry*)(pack->data + header->entries_off);
+    for(uint32_t i = 0; i < header->nb_slots; i++) {
+        const struct pack_entry *entry = pack->entries + i;
+        if(!(entry->flags & PACK_ENTRY_USED)) continue;
+        if(!in_bounds(pack, entry->path_off, entry->path_len)) {
+            logging(ERR, "corrupted archive entry %u", i);
+            return -1;
+        }
+        for(int j = 0; j < PACK_NB_VARIANTS; j++) {
+            const struct pack_variant *var = entry->variants + j;
+            if(!in_bounds(pack, var->header_off, var->header_len)
+                    || !in_bounds(pack, var->body_off, var->body_len)) {
+                logging(ERR, "corrupted archive entry %u", i);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int pack_open(const char *path, struct pack *pack) {
+    struct stat st;
+    void *data;
+    int fd;
+
+    memset(pack, 0, sizeof(*pack));
+
+    fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        logging(ERR, "unable to open `%s`: %s", path, strerror(errno));
+        return -1;
+    }
+    if(fstat(fd, &st) == -1) {
+        logging_errno(ERR, "fstat");
+        close(fd);
+        return -1;
+    }
+    if((size_t)st.st_size < sizeof(struct pack_header)) {
+        logging(ERR, "`%s` is too small to be an archive", path);
+        close(fd);
+        return -1;
+    }
+    data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    /* the mapping keeps the file alive */
+    close(fd);
+    if(data == MAP_FAILED) {
+        logging_errno(ERR, "mmap");
+        return -1;
+    }
+
+    pack->data = data;
+    pack->size = st.st_size;
+    pack->header = data;
+
+    if(pack_validate(pack)) {
+        pack_close(pack);
+        return -1;
+    }
+    return 0;
+}
+
+const struct pack_entry *pack_lookup(
+        const struct pack *pack,
+        const char *key,
+        size_t key_len) {
+    const struct pack_header *header = pack->header;
+    uint32_t bucket = pack_hash(0, key, key_len) % header->nb_buckets;
+    uint32_t slot = pack_hash(pack->seeds[bucket], key, key_len) % header->nb_slots;
+    const struct pack_entry *entry = pack->entries + slot;
+
+    /* a perfect hash maps unknown keys anywhere, confirm the hit */
+    if(!(entry->flags & PACK_ENTRY_USED)
+            || entry->path_len != key_len
+            || memcmp(pack->data + entry->path_off, key, key_len)) {
+        return 0;
+    }
+    return entry;
+}
+
+enum pack_variant_kind pack_entry_iov(
+        const struct pack *pack,
+        const struct pack_entry *entry,
+        int gzip,
+        struct iovec iov[2]) {
+    enum pack_variant_kind kind = PACK_IDENTITY;
+
+    if(gzip && entry->variants[PACK_GZIP].header_len) {
+        kind = PACK_GZIP;
+    }
+    iov[0].iov_base = (void*)(pack->data + entry->variants[kind].header_off);
+    iov[0].iov_len = entry->variants[kind].header_len;
+    iov[1].iov_base = (void*)(pack->data + entry->variants[kind].body_off);
+    iov[1].iov_len = entry->variants[kind].body_len;
+    return kind;
+}
+
+void pack_close(struct pack *pack) {
+    if(pack->data) {
+        munmap((void*)pack->data, pack->size);
+    }
+    memset(pack, 0, sizeof(*pack));
+}
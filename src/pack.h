@@ -0,0 +1,89 @@
+#ifndef PACK_H
+#define PACK_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* An archive produced by `sv-pack`, every offset is relative to the start of
+ * the file and every body starts on a page boundary.
+ *
+ *  struct pack_header
+ *  uint32_t seeds[nb_buckets]       displacement of each bucket
+ *  struct pack_entry entries[nb_slots]
+ *  paths and serialized response headers
+ *  bodies, page aligned */
+
+#define PACK_MAGIC "SVPACK\0"
+#define PACK_VERSION 1
+
+/* the entry is in use */
+#define PACK_ENTRY_USED 1
+
+enum pack_variant_kind {
+    PACK_IDENTITY = 0,
+    PACK_GZIP,
+    PACK_NB_VARIANTS,
+};
+
+struct pack_header {
+    char magic[8];
+    uint32_t version;
+    /* sizeof(struct pack_entry) on the packing host, catches abi mismatches */
+    uint32_t entry_size;
+    uint32_t nb_buckets;
+    uint32_t nb_slots;
+    uint64_t seeds_off;
+    uint64_t entries_off;
+};
+
+struct pack_variant {
+    /* full status line and headers, including the empty line */
+    uint64_t header_off;
+    uint64_t header_len;
+    uint64_t body_off;
+    /* 0 with header_len 0 means the variant is absent */
+    uint64_t body_len;
+};
+
+struct pack_entry {
+    uint64_t path_off;
+    uint32_t path_len;
+    uint32_t flags;
+    struct pack_variant variants[PACK_NB_VARIANTS];
+};
+
+struct pack {
+    const uint8_t *data;
+    size_t size;
+    const struct pack_header *header;
+    const uint32_t *seeds;
+    const struct pack_entry *entries;
+};
+
+/* hash used for both the bucket and the slot of a path */
+uint32_t pack_hash(uint32_t seed, const char *key, size_t key_len);
+
+/* maps the archive at `path` and checks its index
+ * Returns: 0 on success, -1 on error */
+int pack_open(const char *path, struct pack *pack);
+
+/* Looks up the request target `key` (decoded, without its leading '/')
+ * Returns: the entry or 0 if the archive does not hold `key` */
+const struct pack_entry *pack_lookup(
+        const struct pack *pack,
+        const char *key,
+        size_t key_len);
+
+/* Fills `iov[0]` with the serialized headers and `iov[1]` with the body of
+ * `entry`, the gzip variant is used if `gzip` is set and the entry has one.
+ * Returns: the variant picked */
+enum pack_variant_kind pack_entry_iov(
+        const struct pack *pack,
+        const struct pack_entry *entry,
+        int gzip,
+        struct iovec iov[2]);
+
+void pack_close(struct pack *pack);
+
+#endif
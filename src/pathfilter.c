@@ -0,0 +1,528 @@
+#define _GNU_SOURCE
+#include "pathfilter.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/random.h>
+
+#include "logging.h"
+#include "resolve.h"
+
+/* smallest filter, a few entries still get a usable false positive rate */
+#define PATHFILTER_MIN_BITS 1024
+
+/* what the watches report, deletions only count towards a rebuild */
+#define WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM \
+        | IN_DELETE_SELF | IN_ONLYDIR)
+
+struct pathfilter {
+    uint64_t *bits;
+    /* a power of 2 */
+    size_t nb_bits;
+    uint64_t seed;
+    char *base_dir;
+    size_t base_dir_len;
+    /* paths inserted, past `capacity` the false positives pile up */
+    size_t nb_entries;
+    size_t capacity;
+    /* paths removed since the build, they stay in the bits */
+    size_t nb_deleted;
+    /* paths are missing until the pending walks, it is not asked */
+    int stale;
+    int refs;
+};
+
+/* the directory a watch descriptor stands for, relative to base_dir */
+struct watch {
+    char *path;
+};
+
+static struct pathfilter *CURRENT = 0;
+
+static pthread_mutex_t CURRENT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static int INOTIFY_FD = -1;
+
+/* indexed by watch descriptor, the kernel hands them out in order */
+static struct watch *WATCHES = 0;
+static size_t WATCHES_SIZE = 0;
+
+static struct pathfilter_stats STATS = {0};
+
+/* what pathfilter_update left for pathfilter_refresh, select loop only */
+static struct {
+    /* new directories to walk, relative to base_dir */
+    char *dirs[PATHFILTER_PENDING_DIRS];
+    size_t nb_dirs;
+    int rebuild;
+    /* when the walks are due, set by the first change */
+    struct timespec due;
+} PENDING;
+
+/* state of the walk in progress, nftw has no room for a context */
+static struct {
+    size_t base_dir_len;
+    uint64_t seed;
+    uint64_t *hashes;
+    size_t nb_hashes;
+    size_t size;
+    /* the relative path of the walk's root, under base_dir */
+    const char *prefix;
+} WALK;
+
+/* FNV-1a followed by murmur3's finalizer */
+static uint64_t path_hash(const char *path, size_t len, uint64_t seed) {
+    uint64_t hash = 14695981039346656037ull ^ seed;
+
+    for(size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)path[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Rewrites `path` the way the file system reads it: no empty or `.`
+ * segments and no trailing '/'
+ * Returns: the new length */
+static size_t path_normalize(char *path, size_t len) {
+    size_t out = 0;
+    size_t i = 0;
+
+    while(i < len) {
+        size_t end = i;
+        while(end < len && path[end] != '/') end++;
+        if(end - i && !(end - i == 1 && path[i] == '.')) {
+            if(out) path[out++] = '/';
+            memmove(path + out, path + i, end - i);
+            out += end - i;
+        }
+        i = end + 1;
+    }
+    path[out] = '\0';
+    return out;
+}
+
+/* probes derived from one hash, see Kirsch and Mitzenmacher */
+static void filter_insert(struct pathfilter *filter, uint64_t hash) {
+    uint32_t h1 = hash;
+    uint32_t h2 = (hash >> 32) | 1;
+
+    for(uint32_t i = 0; i < PATHFILTER_PROBES; i++) {
+        size_t bit = (h1 + i * h2) & (filter->nb_bits - 1);
+        __atomic_fetch_or(filter->bits + bit / 64, 1ull << bit % 64, __ATOMIC_RELAXED);
+    }
+}
+
+static int filter_has(const struct pathfilter *filter, uint64_t hash) {
+    uint32_t h1 = hash;
+    uint32_t h2 = (hash >> 32) | 1;
+
+    for(uint32_t i = 0; i < PATHFILTER_PROBES; i++) {
+        size_t bit = (h1 + i * h2) & (filter->nb_bits - 1);
+        uint64_t word = __atomic_load_n(filter->bits + bit / 64, __ATOMIC_RELAXED);
+        if(!(word & 1ull << bit % 64)) return 0;
+    }
+    return 1;
+}
+
+static struct pathfilter *filter_get(void) {
+    struct pathfilter *filter;
+
+    pthread_mutex_lock(&CURRENT_LOCK);
+    filter = CURRENT;
+    if(filter) __atomic_add_fetch(&filter->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&CURRENT_LOCK);
+    return filter;
+}
+
+static void filter_put(struct pathfilter *filter) {
+    if(!filter) return;
+    if(__atomic_sub_fetch(&filter->refs, 1, __ATOMIC_ACQ_REL)) return;
+    free(filter->bits);
+    free(filter->base_dir);
+    free(filter);
+}
+
+static void filter_publish(struct pathfilter *filter) {
+    struct pathfilter *old;
+
+    pthread_mutex_lock(&CURRENT_LOCK);
+    old = CURRENT;
+    CURRENT = filter;
+    pthread_mutex_unlock(&CURRENT_LOCK);
+    filter_put(old);
+}
+
+/* Returns: 1 if most lookups of missing paths would go through */
+static int filter_worn(const struct pathfilter *filter) {
+    return filter->nb_entries > filter->capacity
+        || filter->nb_deleted > filter->nb_entries / 4;
+}
+
+static int pending(void) {
+    return PENDING.rebuild || PENDING.nb_dirs;
+}
+
+static void pending_clear(void) {
+    for(size_t i = 0; i < PENDING.nb_dirs; i++) {
+        free(PENDING.dirs[i]);
+    }
+    PENDING.nb_dirs = 0;
+    PENDING.rebuild = 0;
+}
+
+/* the changes that come next are done along with the first one */
+static void pending_start(void) {
+    if(pending()) return;
+    clock_gettime(CLOCK_MONOTONIC, &PENDING.due);
+    PENDING.due.tv_nsec += PATHFILTER_SETTLE_MS % 1000 * 1000000;
+    PENDING.due.tv_sec += PATHFILTER_SETTLE_MS / 1000 + PENDING.due.tv_nsec / 1000000000;
+    PENDING.due.tv_nsec %= 1000000000;
+}
+
+/* a `stale` filter is missing paths until it is rebuilt */
+static void pending_rebuild(struct pathfilter *filter, int stale) {
+    pending_start();
+    pending_clear();
+    PENDING.rebuild = 1;
+    if(stale) __atomic_store_n(&filter->stale, 1, __ATOMIC_RELAXED);
+}
+
+/* `rel_path` is a new directory, the paths under it are missing until it
+ * is walked */
+static void pending_dir(struct pathfilter *filter, const char *rel_path) {
+    char *dir;
+
+    __atomic_store_n(&filter->stale, 1, __ATOMIC_RELAXED);
+    pending_start();
+    /* the rebuild walks it too */
+    if(PENDING.rebuild) return;
+    if(PENDING.nb_dirs == PATHFILTER_PENDING_DIRS || !(dir = strdup(rel_path))) {
+        pending_rebuild(filter, 1);
+        return;
+    }
+    PENDING.dirs[PENDING.nb_dirs++] = dir;
+}
+
+static void watches_cleanup(void) {
+    for(size_t i = 0; i < WATCHES_SIZE; i++) {
+        free(WATCHES[i].path);
+    }
+    free(WATCHES);
+    WATCHES = 0;
+    WATCHES_SIZE = 0;
+    if(INOTIFY_FD != -1) close(INOTIFY_FD);
+    INOTIFY_FD = -1;
+}
+
+/* Returns: 0 on success, -1 on error */
+static int watch_add(const char *path, const char *rel_path) {
+    int wd = inotify_add_watch(INOTIFY_FD, path, WATCH_MASK);
+
+    if(wd == -1) {
+        logging_errno(WARN, "inotify_add_watch: ");
+        return -1;
+    }
+    if((size_t)wd >= WATCHES_SIZE) {
+        size_t size = WATCHES_SIZE ? WATCHES_SIZE : 64;
+        struct watch *watches;
+        while(size <= (size_t)wd) size *= 2;
+        watches = realloc(WATCHES, size * sizeof(struct watch));
+        if(!watches) return -1;
+        memset(watches + WATCHES_SIZE, 0, (size - WATCHES_SIZE) * sizeof(struct watch));
+        WATCHES = watches;
+        WATCHES_SIZE = size;
+    }
+    /* the same directory watched again keeps its descriptor */
+    free(WATCHES[wd].path);
+    WATCHES[wd].path = strdup(rel_path);
+    return WATCHES[wd].path ? 0 : -1;
+}
+
+/* Returns: 0 on success, -1 on error */
+static int walk_push(const char *rel_path, size_t len) {
+    if(WALK.nb_hashes == WALK.size) {
+        size_t size = WALK.size ? WALK.size * 2 : 1024;
+        uint64_t *hashes = realloc(WALK.hashes, size * sizeof(uint64_t));
+        if(!hashes) return -1;
+        WALK.hashes = hashes;
+        WALK.size = size;
+    }
+    WALK.hashes[WALK.nb_hashes++] = path_hash(rel_path, len, WALK.seed);
+    return 0;
+}
+
+static int walk_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    char rel_path[PATH_MAX];
+    const char *rel = path + WALK.base_dir_len;
+    int len;
+
+    /* relative to base_dir, where the walk started below it */
+    while(*rel == '/') rel++;
+    len = snprintf(rel_path, sizeof(rel_path), "%s%s%s",
+            WALK.prefix,
+            *WALK.prefix && *rel ? "/" : "",
+            rel);
+    if(len < 0 || (size_t)len >= sizeof(rel_path)) return 0;
+
+    /* watched before nftw lists it, a file created meanwhile is reported */
+    if(type == FTW_D && watch_add(path, rel_path)) return -1;
+    return walk_push(rel_path, len) ? -1 : 0;
+}
+
+/* Walks `path`, which is `prefix` under base_dir, into WALK.hashes
+ * Returns: 0 on success, -1 on error */
+static int walk(const char *path, const char *prefix) {
+    WALK.base_dir_len = strlen(path);
+    WALK.prefix = prefix;
+    if(nftw(path, walk_entry, PATHFILTER_WALK_FDS, 0)) {
+        logging(WARN, "unable to walk `%s`", path);
+        return -1;
+    }
+    return 0;
+}
+
+int pathfilter_build(const char *base_dir) {
+    struct pathfilter *filter = calloc(1, sizeof(struct pathfilter));
+    size_t nb_bits = PATHFILTER_MIN_BITS;
+
+    /* the watches of the previous filter would insert into this one */
+    watches_cleanup();
+    pending_clear();
+    free(WALK.hashes);
+    memset(&WALK, 0, sizeof(WALK));
+    if(!filter) goto failure;
+    filter->refs = 1;
+    filter->base_dir = strdup(base_dir);
+    if(!filter->base_dir) goto failure;
+    filter->base_dir_len = strlen(base_dir);
+    /* the bits can be probed by anyone, the seed keeps them from finding
+     * paths that collide with real ones */
+    if(getrandom(&filter->seed, sizeof(filter->seed), 0) != sizeof(filter->seed)) {
+        filter->seed = (uint64_t)time(0) * 0x9e3779b97f4a7c15ull;
+    }
+
+    INOTIFY_FD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(INOTIFY_FD == -1) {
+        logging_errno(WARN, "inotify_init1: ");
+        goto failure;
+    }
+    WALK.seed = filter->seed;
+    if(walk(base_dir, "")) {
+        goto failure;
+    }
+
+    /* room for as many new paths as there are now */
+    while(nb_bits < WALK.nb_hashes * 2 * PATHFILTER_BITS_PER_ENTRY) nb_bits *= 2;
+    filter->nb_bits = nb_bits;
+    filter->capacity = nb_bits / PATHFILTER_BITS_PER_ENTRY;
+    filter->bits = calloc(nb_bits / 64, sizeof(uint64_t));
+    if(!filter->bits) goto failure;
+    for(size_t i = 0; i < WALK.nb_hashes; i++) {
+        filter_insert(filter, WALK.hashes[i]);
+    }
+    filter->nb_entries = WALK.nb_hashes;
+    free(WALK.hashes);
+    memset(&WALK, 0, sizeof(WALK));
+
+    __atomic_store_n(&STATS.entries, filter->nb_entries, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&STATS.rebuilds, 1, __ATOMIC_RELAXED);
+    logging(INFO, "path filter of `%s` built, %zu paths in %zu KiB",
+            base_dir, filter->nb_entries, nb_bits / 8 / 1024);
+    filter_publish(filter);
+    return 0;
+
+failure:
+    logging(WARN, "no path filter for `%s`, every lookup goes to the file system", base_dir);
+    free(WALK.hashes);
+    memset(&WALK, 0, sizeof(WALK));
+    watches_cleanup();
+    filter_publish(0);
+    if(filter) filter_put(filter);
+    return -1;
+}
+
+int pathfilter_fd(void) {
+    return INOTIFY_FD;
+}
+
+/* Inserts `name` created in the directory of `wd`, a directory is left for
+ * pathfilter_refresh to walk */
+static void event_created(struct pathfilter *filter, int wd, const char *name, int is_dir) {
+    char rel_path[PATH_MAX];
+    const char *parent;
+    int len;
+
+    if(wd < 0 || (size_t)wd >= WATCHES_SIZE || !WATCHES[wd].path) return;
+    parent = WATCHES[wd].path;
+    len = snprintf(rel_path, sizeof(rel_path), "%s%s%s", parent, *parent ? "/" : "", name);
+    if(len < 0 || (size_t)len >= sizeof(rel_path)) return;
+
+    /* it may have been moved in whole, or filled before it is watched */
+    if(is_dir) {
+        pending_dir(filter, rel_path);
+        return;
+    }
+    filter_insert(filter, path_hash(rel_path, len, filter->seed));
+    filter->nb_entries++;
+}
+
+void pathfilter_update(void) {
+    char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pathfilter *filter = filter_get();
+    ssize_t len;
+
+    if(!filter) return;
+    while((len = read(INOTIFY_FD, buff, sizeof(buff))) > 0) {
+        for(char *ptr = buff; ptr < buff + len;) {
+            const struct inotify_event *event = (const struct inotify_event*)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if(event->mask & IN_Q_OVERFLOW) {
+                logging(WARN, "path filter events were lost, rebuilding it");
+                pending_rebuild(filter, 1);
+            }
+            else if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                event_created(filter, event->wd, event->name, event->mask & IN_ISDIR);
+            }
+            else if(event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                filter->nb_deleted++;
+            }
+            else if(event->mask & IN_IGNORED
+                    && event->wd >= 0 && (size_t)event->wd < WATCHES_SIZE) {
+                free(WATCHES[event->wd].path);
+                WATCHES[event->wd].path = 0;
+            }
+        }
+    }
+    __atomic_store_n(&STATS.entries, filter->nb_entries, __ATOMIC_RELAXED);
+    /* still right meanwhile, only less useful */
+    if(!PENDING.rebuild && filter_worn(filter)) pending_rebuild(filter, 0);
+    filter_put(filter);
+}
+
+int pathfilter_timeout(struct timeval *timeout) {
+    struct timespec now;
+    int64_t left;
+
+    if(!pending()) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = (int64_t)(PENDING.due.tv_sec - now.tv_sec) * 1000000
+        + (PENDING.due.tv_nsec - now.tv_nsec) / 1000;
+    if(left < 0) left = 0;
+    if(left < (int64_t)timeout->tv_sec * 1000000 + timeout->tv_usec) {
+        timeout->tv_sec = left / 1000000;
+        timeout->tv_usec = left % 1000000;
+    }
+    return 1;
+}
+
+void pathfilter_refresh(void) {
+    struct pathfilter *filter;
+    struct timespec now;
+    char path[PATH_MAX];
+    char *base_dir;
+
+    if(!pending()) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(now.tv_sec < PENDING.due.tv_sec
+            || (now.tv_sec == PENDING.due.tv_sec && now.tv_nsec < PENDING.due.tv_nsec)) {
+        return;
+    }
+    filter = filter_get();
+    if(!filter) {
+        pending_clear();
+        return;
+    }
+
+    WALK.seed = filter->seed;
+    for(size_t i = 0; i < PENDING.nb_dirs && !PENDING.rebuild; i++) {
+        if(snprintf(path, sizeof(path), "%s/%s", filter->base_dir, PENDING.dirs[i])
+                >= (int)sizeof(path)) {
+            continue;
+        }
+        if(walk(path, PENDING.dirs[i])) PENDING.rebuild = 1;
+    }
+    if(!PENDING.rebuild) {
+        for(size_t i = 0; i < WALK.nb_hashes; i++) {
+            filter_insert(filter, WALK.hashes[i]);
+        }
+        filter->nb_entries += WALK.nb_hashes;
+        WALK.nb_hashes = 0;
+        __atomic_store_n(&STATS.entries, filter->nb_entries, __ATOMIC_RELAXED);
+        __atomic_store_n(&filter->stale, 0, __ATOMIC_RELAXED);
+        pending_clear();
+        if(!filter_worn(filter)) {
+            filter_put(filter);
+            return;
+        }
+    }
+
+    WALK.nb_hashes = 0;
+    pending_clear();
+    base_dir = strdup(filter->base_dir);
+    filter_put(filter);
+    if(base_dir) pathfilter_build(base_dir);
+    else pathfilter_cleanup();
+    free(base_dir);
+}
+
+int pathfilter_lookup(const char *base_dir, const char *file) {
+    struct pathfilter *filter = filter_get();
+    char path[PATH_MAX];
+    ssize_t len;
+    int result = PATHFILTER_UNKNOWN;
+
+    if(!filter) return result;
+    if(!base_dir || strcmp(filter->base_dir, base_dir)) goto cleanup;
+    if(__atomic_load_n(&filter->stale, __ATOMIC_RELAXED)) goto cleanup;
+
+    len = resolve_decode(file, path, sizeof(path));
+    /* left for resolve_path to refuse */
+    if(len < 0 || resolve_has_dot_dot(path)) goto cleanup;
+    __atomic_add_fetch(&STATS.lookups, 1, __ATOMIC_RELAXED);
+    len = path_normalize(path, len);
+    if(filter_has(filter, path_hash(path, len, filter->seed))) {
+        result = PATHFILTER_MAYBE;
+    }
+    else {
+        result = PATHFILTER_ABSENT;
+        __atomic_add_fetch(&STATS.misses, 1, __ATOMIC_RELAXED);
+    }
+
+cleanup:
+    filter_put(filter);
+    return result;
+}
+
+void pathfilter_false_positive(void) {
+    __atomic_add_fetch(&STATS.false_positives, 1, __ATOMIC_RELAXED);
+}
+
+void pathfilter_stats(struct pathfilter_stats *stats) {
+    stats->lookups = __atomic_load_n(&STATS.lookups, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&STATS.misses, __ATOMIC_RELAXED);
+    stats->false_positives = __atomic_load_n(&STATS.false_positives, __ATOMIC_RELAXED);
+    stats->entries = __atomic_load_n(&STATS.entries, __ATOMIC_RELAXED);
+    stats->rebuilds = __atomic_load_n(&STATS.rebuilds, __ATOMIC_RELAXED);
+}
+
+void pathfilter_cleanup(void) {
+    pending_clear();
+    free(WALK.hashes);
+    memset(&WALK, 0, sizeof(WALK));
+    watches_cleanup();
+    filter_publish(0);
+}
@@ -0,0 +1,80 @@
+#ifndef PATHFILTER_H
+#define PATHFILTER_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/* bits per path, with 7 probes about 1% of the misses look like hits */
+#define PATHFILTER_BITS_PER_ENTRY 10
+#define PATHFILTER_PROBES 7
+
+/* open directories while walking base_dir */
+#define PATHFILTER_WALK_FDS 16
+
+/* changes needing a walk are let settle this long, a burst costs one */
+#define PATHFILTER_SETTLE_MS 500
+/* new directories waiting for their walk, past that the filter is rebuilt */
+#define PATHFILTER_PENDING_DIRS 64
+
+enum pathfilter_result {
+    /* not asked: no filter for the tree, it is waiting for a walk, or the
+     * target is malformed or leaves the tree and resolve_path refuses it */
+    PATHFILTER_UNKNOWN,
+    /* definitely not there */
+    PATHFILTER_ABSENT,
+    /* in the filter, it may be there */
+    PATHFILTER_MAYBE,
+};
+
+struct pathfilter_stats {
+    /* targets looked up */
+    uint64_t lookups;
+    /* definite misses, answered without the file system */
+    uint64_t misses;
+    /* looked present but were not found */
+    uint64_t false_positives;
+    /* paths in the filter, deleted ones included */
+    uint64_t entries;
+    uint64_t rebuilds;
+};
+
+/* Walks `base_dir` into a Bloom filter of the paths under it and watches
+ * every directory with inotify to keep it up to date. The filter replaces
+ * the previous one.
+ * Returns: 0 on success, -1 on error, lookups then always miss the filter
+ *  and go to the file system */
+int pathfilter_build(const char *base_dir);
+
+/* Returns: the inotify fd to wait on, -1 if there is no filter */
+int pathfilter_fd(void);
+
+/* Applies the pending inotify events. New files go in right away, a new
+ * directory or a rebuild, needed when events were lost or too many paths
+ * went away, is left for pathfilter_refresh. Until then a filter missing
+ * paths is not asked */
+void pathfilter_update(void);
+
+/* Lowers `timeout` to when the walks left by pathfilter_update are due
+ * Returns: 1 if there are some, 0 otherwise */
+int pathfilter_timeout(struct timeval *timeout);
+
+/* Walks the new directories or rebuilds the filter once the changes have
+ * settled, does nothing before */
+void pathfilter_refresh(void);
+
+/* Looks `file`, a request target without its leading '/', up under
+ * `base_dir`
+ * Returns: a `enum pathfilter_result` */
+int pathfilter_lookup(const char *base_dir, const char *file);
+
+/* counts a target the filter found, PATHFILTER_MAYBE, and the file system
+ * did not */
+void pathfilter_false_positive(void);
+
+void pathfilter_stats(struct pathfilter_stats *stats);
+
+/* drops the filter and its watches */
+void pathfilter_cleanup(void);
+
+#endif
@@ -0,0 +1,680 @@
+#define _GNU_SOURCE
+#include "proxy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+#include "logging.h"
+#include "send.h"
+
+#define MIN(a,b) (a < b ? a : b)
+
+/* longest response head relayed, also the size of the relay buffer */
+#define PROXY_BUFF_SIZE 16384
+
+/* room for a rewritten head and the headers added to it */
+#define PROXY_HEAD_SIZE (PROXY_BUFF_SIZE + 128)
+
+/* `count` of a body delimited by the end of the connection */
+#define UNTIL_EOF SIZE_MAX
+
+/* headers about the connection they came over, they are not forwarded */
+static const char *const HOP_HEADERS[] = {
+    "Connection",
+    "Keep-Alive",
+    "Proxy-Connection",
+    "TE",
+    "Trailer",
+    "Upgrade",
+    /* the whole body is sent right away */
+    "Expect",
+    0,
+};
+
+/* an idle upstream connection */
+struct pooled {
+    int used;
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    time_t since;
+};
+
+/* each worker has its own pool */
+static struct pooled POOL[PROXY_POOL_SIZE];
+
+/* bodies between two plain sockets are spliced through it */
+static int PIPE[2] = {-1, -1};
+
+int proxy_route_parse(const char *value, struct proxy_route *route) {
+    const char *target = strchr(value, ' ');
+    struct addrinfo hints = {0};
+    struct addrinfo *res;
+    char host[256];
+    const char *port;
+    int ret;
+
+    memset(route, 0, sizeof(*route));
+    if(value[0] != '/' || !target) return -1;
+
+    route->prefix_len = target - value;
+    while(*target == ' ') target++;
+
+    if(!strncmp(target, "unix:", sizeof("unix:") - 1)) {
+        struct sockaddr_un *addr = (struct sockaddr_un*)&route->addr;
+        const char *path = target + sizeof("unix:") - 1;
+        size_t path_len = strlen(path);
+
+        if(!path_len || path_len >= sizeof(addr->sun_path)) return -1;
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path, path_len + 1);
+        route->addr_len = offsetof(struct sockaddr_un, sun_path) + path_len + 1;
+    }
+    else {
+        port = strrchr(target, ':');
+        if(!port || port == target || (size_t)(port - target) >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, target, port - target);
+        host[port - target] = '\0';
+        port++;
+
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        ret = getaddrinfo(host, port, &hints, &res);
+        if(ret) {
+            logging(ERR, "unable to resolve `%s`: %s", target, gai_strerror(ret));
+            return -1;
+        }
+        memcpy(&route->addr, res->ai_addr, res->ai_addrlen);
+        route->addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+
+    route->prefix = strndup(value, route->prefix_len);
+    if(!route->prefix) return -1;
+    return 0;
+}
+
+void proxy_route_cleanup(struct proxy_route *route) {
+    free(route->prefix);
+    memset(route, 0, sizeof(*route));
+}
+
+const struct proxy_route *proxy_match(
+        const struct proxy_route *routes,
+        size_t nb_routes,
+        const char *request,
+        size_t request_len) {
+    const struct proxy_route *best = 0;
+    const char *end = request + request_len;
+    const char *path = memchr(request, ' ', request_len);
+
+    if(!path) return 0;
+    path++;
+
+    for(size_t i = 0; i < nb_routes; i++) {
+        const struct proxy_route *route = routes + i;
+        size_t len = route->prefix_len;
+
+        if((size_t)(end - path) < len || memcmp(path, route->prefix, len)) {
+            continue;
+        }
+        /* `/api` covers `/api/x` and `/api?x` but not `/apix` */
+        if(route->prefix[len - 1] != '/' && path + len < end
+                && path[len] != '/' && path[len] != '?' && path[len] != ' ') {
+            continue;
+        }
+        if(!best || len > best->prefix_len) best = route;
+    }
+    return best;
+}
+
+/* Returns: 1 if `fd` is an idle connection the upstream did not close */
+static int upstream_alive(int fd) {
+    char c;
+    ssize_t ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Returns: a new connection to the upstream of `route`, -1 on error */
+static int upstream_connect(const struct proxy_route *route) {
+    struct timeval timeout = {.tv_sec = PROXY_IO_TIMEOUT};
+    int opt = 1;
+    int fd;
+
+    fd = socket(route->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        logging_errno(ERR, "socket: ");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if(route->addr.ss_family != AF_UNIX) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    if(connect(fd, (const struct sockaddr*)&route->addr, route->addr_len)) {
+        logging(WARN, "unable to reach the upstream of `%s`: %s",
+                route->prefix, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Takes a connection to the upstream of `route` out of the pool or opens
+ * one, `*reused` tells which
+ * Returns: the connection, -1 on error */
+static int upstream_get(const struct proxy_route *route, int *reused) {
+    time_t now = time(0);
+
+    for(size_t i = 0; i < PROXY_POOL_SIZE; i++) {
+        struct pooled *pooled = POOL + i;
+        if(!pooled->used
+                || pooled->addr_len != route->addr_len
+                || memcmp(&pooled->addr, &route->addr, route->addr_len)) {
+            continue;
+        }
+        pooled->used = 0;
+        if(now - pooled->since > PROXY_IDLE_TIMEOUT || !upstream_alive(pooled->fd)) {
+            close(pooled->fd);
+            continue;
+        }
+        *reused = 1;
+        return pooled->fd;
+    }
+    *reused = 0;
+    return upstream_connect(route);
+}
+
+/* puts `fd` back in the pool, evicting the oldest connection when full */
+static void upstream_put(const struct proxy_route *route, int fd) {
+    struct pooled *slot = POOL;
+
+    for(size_t i = 0; i < PROXY_POOL_SIZE; i++) {
+        if(!POOL[i].used) {
+            slot = POOL + i;
+            break;
+        }
+        if(POOL[i].since < slot->since) slot = POOL + i;
+    }
+    if(slot->used) close(slot->fd);
+
+    slot->used = 1;
+    slot->fd = fd;
+    memcpy(&slot->addr, &route->addr, route->addr_len);
+    slot->addr_len = route->addr_len;
+    slot->since = time(0);
+}
+
+void proxy_cleanup(void) {
+    for(size_t i = 0; i < PROXY_POOL_SIZE; i++) {
+        if(POOL[i].used) close(POOL[i].fd);
+        POOL[i].used = 0;
+    }
+    if(PIPE[0] != -1) {
+        close(PIPE[0]);
+        close(PIPE[1]);
+        PIPE[0] = PIPE[1] = -1;
+    }
+}
+
+/* Returns: the length of the head at the start of `buff`, up to and
+ * including its empty line, 0 if it is not complete */
+static size_t head_length(const char *buff, size_t len) {
+    for(size_t i = 3; i < len; i++) {
+        if(buff[i] == '\n' && buff[i - 1] == '\r'
+                && buff[i - 2] == '\n' && buff[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Reads into `buff` until it holds a whole head, `*len` bytes are already in
+ * Returns: the length of the head
+ *  0 if the connection ended before anything was read
+ *  -1 on error or if the head does not fit */
+static ssize_t read_head(struct conn *from, char *buff, size_t *len, size_t size) {
+    size_t head;
+
+    while(!(head = head_length(buff, *len))) {
+        ssize_t ret;
+        if(*len == size) return -1;
+        ret = conn_read(from, buff + *len, size - *len);
+        if(ret <= 0) return *len ? -1 : 0;
+        *len += ret;
+    }
+    return head;
+}
+
+/* Returns: 0 once all of `data` was written, -1 on error */
+static int write_all(struct conn *to, const char *data, size_t len) {
+    while(len) {
+        ssize_t ret = conn_write(to, data, len);
+        if(ret <= 0) return -1;
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* like `relay` between two plain sockets, the bytes never reach userspace */
+static int relay_splice(int in, int out, size_t count) {
+    int until_eof = count == UNTIL_EOF;
+
+    if(PIPE[0] == -1 && pipe2(PIPE, O_CLOEXEC)) {
+        logging_errno(ERR, "pipe2: ");
+        return -1;
+    }
+    while(count) {
+        ssize_t ret = splice(in, 0, PIPE[1], 0, MIN(count, PROXY_SPLICE_CHUNK),
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(ret == 0 && until_eof) return 0;
+        if(ret <= 0) return -1;
+        if(!until_eof) count -= ret;
+
+        while(ret) {
+            ssize_t moved = splice(PIPE[0], 0, out, 0, ret, SPLICE_F_MOVE);
+            if(moved <= 0) {
+                /* what is left in the pipe belongs to nobody anymore */
+                close(PIPE[0]);
+                close(PIPE[1]);
+                PIPE[0] = PIPE[1] = -1;
+                return -1;
+            }
+            ret -= moved;
+        }
+    }
+    return 0;
+}
+
+/* Moves `count` bytes, or everything up to the end of the stream when it is
+ * UNTIL_EOF, from `from` to `to`. Nothing more is read until what was read
+ * is written, a slow side slows the other one down.
+ * Returns: 0 on success, -1 on error */
+static int relay(
+        struct conn *from,
+        struct conn *to,
+        size_t count,
+        char *buff,
+        size_t buff_size) {
+    int until_eof = count == UNTIL_EOF;
+
+    if(from->type == CONN_PLAIN && to->type == CONN_PLAIN) {
+        return relay_splice(from->data.fd, to->data.fd, count);
+    }
+    while(count) {
+        ssize_t ret = conn_read(from, buff, MIN(count, buff_size));
+        if(ret == 0 && until_eof) return 0;
+        if(ret <= 0) return -1;
+        if(write_all(to, buff, ret)) return -1;
+        if(!until_eof) count -= ret;
+    }
+    return 0;
+}
+
+enum chunked_state {
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+};
+
+/* follows a chunked body as it goes by to find where it ends */
+struct chunked {
+    enum chunked_state state;
+    uint64_t left;
+    int digits;
+};
+
+static int hex_value(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Feeds `len` more bytes of the body to `chunked`
+ * Returns: 1 once the body ended, `*used` bytes of `data` belonged to it
+ *  0 if more is to come
+ *  -1 if the body is malformed */
+static int chunked_feed(
+        struct chunked *chunked,
+        const char *data,
+        size_t len,
+        size_t *used) {
+    for(size_t i = 0; i < len; i++) {
+        char c = data[i];
+        switch(chunked->state) {
+            case CHUNK_SIZE:
+                if(hex_value(c) >= 0) {
+                    if(chunked->left >> 60) return -1;
+                    chunked->left = chunked->left << 4 | hex_value(c);
+                    chunked->digits++;
+                    break;
+                }
+                chunked->state = CHUNK_EXT;
+                /* fallthrough */
+            case CHUNK_EXT:
+                if(c != '\n') break;
+                if(!chunked->digits) return -1;
+                chunked->digits = 0;
+                chunked->state = chunked->left ? CHUNK_DATA : CHUNK_TRAILER;
+                break;
+            case CHUNK_DATA: {
+                size_t take = MIN(chunked->left, len - i);
+                chunked->left -= take;
+                i += take - 1;
+                if(!chunked->left) chunked->state = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if(c == '\r') break;
+                if(c != '\n') return -1;
+                chunked->state = CHUNK_SIZE;
+                break;
+            case CHUNK_TRAILER:
+                if(c == '\r') break;
+                if(c == '\n') {
+                    *used = i + 1;
+                    return 1;
+                }
+                chunked->state = CHUNK_TRAILER_LINE;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if(c == '\n') chunked->state = CHUNK_TRAILER;
+                break;
+        }
+    }
+    return 0;
+}
+
+/* Relays a chunked body, `data` holds its first `len` bytes
+ * Returns: 1 if the body ended exactly where the upstream stopped sending
+ *  0 if it was followed by more bytes
+ *  -1 on error */
+static int relay_chunked(
+        struct conn *from,
+        struct conn *to,
+        char *data,
+        size_t len,
+        size_t buff_size) {
+    struct chunked chunked = {0};
+    size_t used;
+
+    for(;;) {
+        int ret = chunked_feed(&chunked, data, len, &used);
+        if(ret < 0) return -1;
+        if(write_all(to, data, ret ? used : len)) return -1;
+        if(ret) return used == len;
+
+        ssize_t got = conn_read(from, data, buff_size);
+        if(got <= 0) return -1;
+        len = got;
+    }
+}
+
+/* Returns: 1 if the header line `line` is named `name` */
+static int header_is(const char *line, size_t name_len, const char *name) {
+    return strlen(name) == name_len && !strncasecmp(line, name, name_len);
+}
+
+static int is_hop_header(const char *line, size_t name_len) {
+    for(size_t i = 0; HOP_HEADERS[i]; i++) {
+        if(header_is(line, name_len, HOP_HEADERS[i])) return 1;
+    }
+    return 0;
+}
+
+/* what the rewriting of a head learnt about the message */
+struct message {
+    int has_length;
+    uint64_t length;
+    int chunked;
+    /* a Transfer-Encoding of any kind */
+    int encoded;
+    /* the end of the body is not certain: a Content-Length that is
+     * malformed, repeated or next to a Transfer-Encoding */
+    int ambiguous;
+    /* `Connection: close` */
+    int close;
+};
+
+/* Copies the head `head` into `out` without its hop-by-hop headers and
+ * without its final empty line
+ * Returns: the length written, -1 if it does not fit */
+static ssize_t head_rewrite(
+        const char *head,
+        size_t head_len,
+        char *out,
+        size_t out_size,
+        struct message *message) {
+    const char *end = head + head_len;
+    const char *line = head;
+    size_t len = 0;
+
+    memset(message, 0, sizeof(*message));
+    while(line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *colon;
+        size_t line_len;
+        size_t name_len;
+
+        if(!eol) break;
+        line_len = eol + 1 - line;
+        /* the empty line */
+        if(line_len <= 2 && line != head) break;
+
+        colon = line == head ? 0 : memchr(line, ':', line_len);
+        if(colon) {
+            name_len = colon - line;
+            const char *value = colon + 1;
+            while(*value == ' ' || *value == '\t') value++;
+
+            if(header_is(line, name_len, "Content-Length")) {
+                unsigned long long length;
+                if(message->has_length || content_length_parse(value, eol - value, &length)) {
+                    message->ambiguous = 1;
+                }
+                else {
+                    message->length = length;
+                }
+                message->has_length = 1;
+            }
+            else if(header_is(line, name_len, "Transfer-Encoding")) {
+                message->encoded = 1;
+                message->chunked = !!strcasestr(value, "chunked");
+            }
+            else if(header_is(line, name_len, "Connection")) {
+                message->close = !strncasecmp(value, "close", sizeof("close") - 1);
+            }
+            if(is_hop_header(line, name_len)) {
+                line = eol + 1;
+                continue;
+            }
+        }
+        if(line_len > out_size - len) return -1;
+        memcpy(out + len, line, line_len);
+        len += line_len;
+        line = eol + 1;
+    }
+    if(message->has_length && message->encoded) message->ambiguous = 1;
+    return len;
+}
+
+/* Returns: the length of the line appended to `out`, -1 if it does not fit */
+static ssize_t head_append(char *out, size_t len, size_t out_size, const char *line) {
+    size_t line_len = strlen(line);
+    if(line_len > out_size - len) return -1;
+    memcpy(out + len, line, line_len);
+    return line_len;
+}
+
+static void send_status(
+        struct conn *client,
+        const struct error_page *pages,
+        enum error_page_kind kind) {
+    send_error(client, pages ? pages + kind : error_page_default(kind), 0);
+}
+
+int proxy_serve(
+        const struct proxy_route *route,
+        struct conn *client,
+        const struct error_page *pages,
+        char *buff,
+        size_t buff_len,
+        size_t buff_size) {
+    char head[PROXY_HEAD_SIZE];
+    char resp[PROXY_BUFF_SIZE];
+    struct conn upstream;
+    struct message request;
+    struct message response;
+    ssize_t request_head;
+    ssize_t response_head = -1;
+    ssize_t head_len;
+    ssize_t ret;
+    size_t resp_len = 0;
+    size_t body_in;
+    char *body;
+    size_t body_len;
+    int is_head;
+    int status;
+    int clean = 0;
+    int fd = -1;
+
+    request_head = read_head(client, buff, &buff_len, buff_size);
+    if(request_head <= 0) {
+        if(buff_len == buff_size) send_status(client, pages, ERROR_PAGE_431);
+        return -1;
+    }
+    is_head = !strncmp(buff, "HEAD ", sizeof("HEAD ") - 1);
+
+    head_len = head_rewrite(buff, request_head, head, sizeof(head), &request);
+    if(head_len < 0) {
+        send_status(client, pages, ERROR_PAGE_431);
+        return -1;
+    }
+    /* the upstream connection is shared, were it to find the end of the
+     * body elsewhere the rest would be taken for another client's request */
+    if(request.ambiguous || request.encoded) {
+        send_status(client, pages, ERROR_PAGE_400);
+        return -1;
+    }
+    ret = head_append(head, head_len, sizeof(head),
+            client->type == CONN_SSL
+                ? "Connection: keep-alive" CRLF "X-Forwarded-Proto: https" CRLF CRLF
+                : "Connection: keep-alive" CRLF "X-Forwarded-Proto: http" CRLF CRLF);
+    if(ret < 0) {
+        send_status(client, pages, ERROR_PAGE_431);
+        return -1;
+    }
+    head_len += ret;
+
+    /* the part of the body that came with the head */
+    body_in = MIN(buff_len - request_head, request.length);
+
+    for(;;) {
+        int reused;
+        int streamed = 0;
+
+        fd = upstream_get(route, &reused);
+        if(fd == -1) {
+            send_status(client, pages, ERROR_PAGE_502);
+            return -1;
+        }
+        conn_new_fd(fd, &upstream);
+
+        ret = write_all(&upstream, head, head_len);
+        if(!ret) ret = write_all(&upstream, buff + request_head, body_in);
+        if(!ret && request.length > body_in) {
+            streamed = 1;
+            ret = relay(client, &upstream, request.length - body_in, resp, sizeof(resp));
+        }
+        if(!ret) {
+            resp_len = 0;
+            response_head = read_head(&upstream, resp, &resp_len, sizeof(resp));
+            if(response_head > 0) break;
+        }
+        close(fd);
+        fd = -1;
+        /* the upstream closed the pooled connection meanwhile, nothing was
+         * lost so another one can be tried */
+        if(reused && !streamed && (ret || response_head == 0)) continue;
+
+        logging(WARN, "no response from the upstream of `%s`", route->prefix);
+        send_status(client, pages, ERROR_PAGE_502);
+        return -1;
+    }
+
+    /* ##### relay the response ##### */
+    status = 0;
+    if(resp_len > sizeof("HTTP/1.x ") && !strncmp(resp, "HTTP/1.", sizeof("HTTP/1.") - 1)) {
+        status = atoi(resp + sizeof("HTTP/1.x ") - 1);
+    }
+    head_len = head_rewrite(resp, response_head, head, sizeof(head), &response);
+    /* HTTP/1.0 upstreams close by default, `resp` is reused by the relay */
+    if(resp[sizeof("HTTP/1.") - 1] != '1') response.close = 1;
+    if(!status || head_len < 0 || response.ambiguous) {
+        logging(WARN, "malformed response from the upstream of `%s`", route->prefix);
+        send_status(client, pages, ERROR_PAGE_502);
+        goto cleanup;
+    }
+    /* the client connection is closed after each response */
+    ret = head_append(head, head_len, sizeof(head), "Connection: close" CRLF CRLF);
+    if(ret < 0) {
+        send_status(client, pages, ERROR_PAGE_502);
+        goto cleanup;
+    }
+    head_len += ret;
+    if(write_all(client, head, head_len)) goto cleanup;
+
+    body = resp + response_head;
+    body_len = resp_len - response_head;
+
+    if(is_head || status / 100 == 1 || status == 204 || status == 304) {
+        clean = !body_len && status / 100 != 1;
+    }
+    else if(response.chunked) {
+        if(relay_chunked(&upstream, client, body, body_len, sizeof(resp)) == 1) {
+            clean = 1;
+        }
+    }
+    else if(response.has_length) {
+        size_t first = MIN(body_len, response.length);
+        if(write_all(client, body, first)) goto cleanup;
+        if(relay(&upstream, client, response.length - first, resp, sizeof(resp))) {
+            goto cleanup;
+        }
+        clean = body_len <= response.length;
+    }
+    else {
+        /* the body ends with the connection */
+        if(write_all(client, body, body_len)) goto cleanup;
+        relay(&upstream, client, UNTIL_EOF, resp, sizeof(resp));
+    }
+    if(response.close) clean = 0;
+
+cleanup:
+    if(clean) {
+        upstream_put(route, fd);
+    }
+    else {
+        close(fd);
+    }
+    return 0;
+}
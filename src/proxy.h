@@ -0,0 +1,65 @@
+#ifndef PROXY_H
+#define PROXY_H 1
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "conn.h"
+#include "error_page.h"
+
+/* idle upstream connections kept around by a worker */
+#define PROXY_POOL_SIZE 16
+
+/* seconds an idle upstream connection is kept */
+#define PROXY_IDLE_TIMEOUT 30
+
+/* seconds an upstream has to accept or answer a read or a write */
+#define PROXY_IO_TIMEOUT 30
+
+/* bytes moved by each splice */
+#define PROXY_SPLICE_CHUNK (64 * 1024)
+
+struct proxy_route {
+    /* requests whose path starts with it are forwarded */
+    char *prefix;
+    size_t prefix_len;
+    /* the upstream, a TCP or a Unix socket */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+};
+
+/* Parses `<prefix> <host>:<port>` or `<prefix> unix:<path>` into `route`,
+ * host names are resolved right away
+ * Returns: 0 on success, -1 on error */
+int proxy_route_parse(const char *value, struct proxy_route *route);
+
+void proxy_route_cleanup(struct proxy_route *route);
+
+/* Finds the route of the request whose head starts `request`, the longest
+ * prefix wins
+ * Returns: the route, 0 if the request is not proxied */
+const struct proxy_route *proxy_match(
+        const struct proxy_route *routes,
+        size_t nb_routes,
+        const char *request,
+        size_t request_len);
+
+/* Forwards the request starting in `buff` to the upstream of `route` and
+ * relays the response to `client`. `buff` holds the `buff_len` bytes read
+ * so far, it is reused to read the rest of the request's head.
+ * The upstream connection goes back to the pool when the exchange leaves
+ * it usable. Errors are answered with `pages`, the config's error pages, or
+ * the built-in ones when it is 0.
+ * Returns: 0 on success, -1 on error */
+int proxy_serve(
+        const struct proxy_route *route,
+        struct conn *client,
+        const struct error_page *pages,
+        char *buff,
+        size_t buff_len,
+        size_t buff_size);
+
+/* closes the pooled upstream connections */
+void proxy_cleanup(void);
+
+#endif
@@ -0,0 +1,222 @@
+#include "ratelimit.h"
+
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+
+/* tokens are kept in thousandths, a bucket refilled every millisecond then
+ * gains `rate` of them instead of a fraction rounded down to nothing */
+#define MILLI 1000
+
+/* bandwidth is accounted for in KiB */
+#define KIB_SHIFT 10
+
+const char RATELIMIT_RESPONSE[] = (
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+);
+const size_t RATELIMIT_RESPONSE_LEN = sizeof(RATELIMIT_RESPONSE) - 1;
+
+/* Every field is only accessed atomically, entries are claimed and evicted
+ * by compare and swap on `key` so that workers never wait on each other.
+ * A bucket state packs the millisecond it was last updated in its high half
+ * and its level in thousandths of a token in its low half, 0 is a full
+ * bucket. */
+struct ratelimit_entry {
+    /* hash of the client, 0 for a free slot */
+    uint64_t key;
+    uint64_t requests;
+    uint64_t bytes;
+    /* seconds, for the eviction */
+    uint32_t last_seen;
+} __attribute__((aligned(32)));
+
+static struct ratelimit_entry TABLE[RATELIMIT_SHARDS][RATELIMIT_SHARD_SLOTS];
+
+/* keeps clients from picking addresses that land in the same slots */
+static uint64_t SEED = 0;
+
+void ratelimit_init(void) {
+    if(getrandom(&SEED, sizeof(SEED), 0) != sizeof(SEED)) {
+        SEED = (uint64_t)time(0) * 0x9e3779b97f4a7c15ull;
+    }
+}
+
+int ratelimit_enabled(const struct ratelimit_limits *limits) {
+    return limits->requests || limits->bytes;
+}
+
+/* Returns: the key of the client at `addr`, 0 if it is not an inet client */
+static uint64_t client_key(const struct sockaddr *addr) {
+    static const uint8_t V4_MAPPED[12] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff,
+    };
+    const uint8_t *bytes;
+    size_t len;
+    uint64_t hash;
+
+    switch(addr->sa_family) {
+        case AF_INET:
+            bytes = (const uint8_t*)&((const struct sockaddr_in*)addr)->sin_addr;
+            len = 4;
+            break;
+        case AF_INET6:
+            bytes = ((const struct sockaddr_in6*)addr)->sin6_addr.s6_addr;
+            if(!memcmp(bytes, V4_MAPPED, sizeof(V4_MAPPED))) {
+                bytes += sizeof(V4_MAPPED);
+                len = 4;
+            }
+            else {
+                /* a single host usually gets a whole /64 */
+                len = 8;
+            }
+            break;
+        default:
+            return 0;
+    }
+
+    /* FNV-1a followed by murmur3's finalizer */
+    hash = 14695981039346656037ull ^ SEED;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash ? hash : 1;
+}
+
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Finds the entry of `key`, claiming one if the client has none
+ * Returns: the entry */
+static struct ratelimit_entry *entry_get(uint64_t key, uint32_t now_s) {
+    struct ratelimit_entry *shard = TABLE[(key >> 32) % RATELIMIT_SHARDS];
+    struct ratelimit_entry *victim = 0;
+    struct ratelimit_entry *entry;
+    uint64_t expected;
+
+    for(size_t i = 0; i < RATELIMIT_PROBES; i++) {
+        entry = shard + (key + i) % RATELIMIT_SHARD_SLOTS;
+        expected = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+        if(expected == key) goto found;
+        if(!expected) {
+            if(__atomic_compare_exchange_n(&entry->key, &expected, key, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                goto claimed;
+            }
+            /* another worker was quicker, maybe for the same client */
+            if(expected == key) goto found;
+            continue;
+        }
+        if(!victim || __atomic_load_n(&entry->last_seen, __ATOMIC_RELAXED)
+                < __atomic_load_n(&victim->last_seen, __ATOMIC_RELAXED)) {
+            victim = entry;
+        }
+    }
+
+    /* an approximate LRU, the least recently seen of the probed slots goes.
+     * Losing the race only means sharing a bucket for a moment */
+    entry = victim;
+    expected = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+    __atomic_compare_exchange_n(&entry->key, &expected, key, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+claimed:
+    __atomic_store_n(&entry->requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->bytes, 0, __ATOMIC_RELAXED);
+found:
+    __atomic_store_n(&entry->last_seen, now_s, __ATOMIC_RELAXED);
+    return entry;
+}
+
+/* Returns: the level of the bucket `state` at `now` for a refill of `rate`
+ * tokens per second, capped to `cap` thousandths */
+static int64_t bucket_level(uint64_t state, uint32_t now, int64_t rate, int64_t cap) {
+    int32_t elapsed;
+    int64_t level;
+
+    if(!state) return cap;
+    elapsed = (int32_t)(now - (uint32_t)(state >> 32));
+    /* a bucket left alone for more than 24 days wraps around */
+    if(elapsed < -MILLI) return cap;
+    /* another worker updated it with a clock a tick ahead */
+    if(elapsed < 0) elapsed = 0;
+    level = (int32_t)(uint32_t)state + (int64_t)elapsed * rate;
+    return level > cap ? cap : level;
+}
+
+static uint64_t bucket_state(uint32_t now, int64_t level) {
+    if(level < INT32_MIN) level = INT32_MIN;
+    /* the low bit keeps the state from ever reading as a full bucket */
+    return (uint64_t)(now | 1) << 32 | (uint32_t)(int32_t)level;
+}
+
+int ratelimit_take(const struct ratelimit_limits *limits, const struct sockaddr *addr) {
+    struct ratelimit_entry *entry;
+    uint64_t key = client_key(addr);
+    uint32_t now;
+    uint64_t state;
+    int64_t level;
+
+    if(!ratelimit_enabled(limits) || !key) return 1;
+    now = now_ms();
+    entry = entry_get(key, now / 1000);
+
+    if(limits->bytes) {
+        int64_t rate = limits->bytes >> KIB_SHIFT;
+        state = __atomic_load_n(&entry->bytes, __ATOMIC_RELAXED);
+        if(bucket_level(state, now, rate, rate * MILLI * limits->burst) <= 0) {
+            return 0;
+        }
+    }
+    if(!limits->requests) return 1;
+
+    state = __atomic_load_n(&entry->requests, __ATOMIC_RELAXED);
+    do {
+        level = bucket_level(
+                state,
+                now,
+                limits->requests,
+                (int64_t)limits->requests * MILLI * limits->burst);
+        if(level < MILLI) return 0;
+    } while(!__atomic_compare_exchange_n(&entry->requests, &state,
+                bucket_state(now, level - MILLI), 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+void ratelimit_charge(
+        const struct ratelimit_limits *limits,
+        const struct sockaddr *addr,
+        uint64_t bytes) {
+    struct ratelimit_entry *entry;
+    uint64_t key = client_key(addr);
+    int64_t rate = limits->bytes >> KIB_SHIFT;
+    int64_t cost = (int64_t)((bytes + (1 << KIB_SHIFT) - 1) >> KIB_SHIFT) * MILLI;
+    uint32_t now;
+    uint64_t state;
+    int64_t level;
+
+    if(!limits->bytes || !key || !bytes) return;
+    now = now_ms();
+    entry = entry_get(key, now / 1000);
+
+    state = __atomic_load_n(&entry->bytes, __ATOMIC_RELAXED);
+    do {
+        level = bucket_level(state, now, rate, rate * MILLI * limits->burst);
+    } while(!__atomic_compare_exchange_n(&entry->bytes, &state,
+                bucket_state(now, level - cost), 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,62 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* the table is split in shards, each an open addressing hash table */
+#define RATELIMIT_SHARDS 16
+#define RATELIMIT_SHARD_SLOTS 4096
+
+/* slots probed for an address, the least recently seen of them is evicted
+ * when none is free */
+#define RATELIMIT_PROBES 8
+
+#define DEFAULT_RATE_LIMIT_BURST 2
+
+/* most requests or KiB a bucket can hold, levels are kept in thousandths
+ * on 32 bits */
+#define RATELIMIT_MAX_TOKENS 2000000
+
+enum ratelimit_action {
+    /* over limit connections are closed before anything is read */
+    RATELIMIT_CLOSE,
+    /* over limit requests are answered with a 429 */
+    RATELIMIT_429,
+};
+
+struct ratelimit_limits {
+    /* requests per second per client, 0 for no limit */
+    uint32_t requests;
+    /* bytes per second per client, 0 for no limit */
+    uint64_t bytes;
+    /* seconds worth of requests and bytes a client can use at once */
+    uint32_t burst;
+};
+
+/* a ready to send 429 for HTTP/1.1 */
+extern const char RATELIMIT_RESPONSE[];
+
+extern const size_t RATELIMIT_RESPONSE_LEN;
+
+/* seeds the hash of the addresses, call it once before anything else */
+void ratelimit_init(void);
+
+/* Takes a request token from the bucket of `addr`, clients without a bucket
+ * get a full one. IPv6 clients are limited per /64.
+ * Returns: 1 if the request can go through, 0 if the client is over one
+ *  of its limits */
+int ratelimit_take(const struct ratelimit_limits *limits, const struct sockaddr *addr);
+
+/* takes the `bytes` sent to `addr` out of its bandwidth bucket, it can go
+ * into debt until it refills */
+void ratelimit_charge(
+        const struct ratelimit_limits *limits,
+        const struct sockaddr *addr,
+        uint64_t bytes);
+
+/* Returns: 1 if `limits` limits anything */
+int ratelimit_enabled(const struct ratelimit_limits *limits);
+
+#endif
@@ -0,0 +1,124 @@
+#include "resolve.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static int hex_value(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+ssize_t resolve_decode(const char *file, char *out, size_t out_size) {
+    size_t len = 0;
+
+    for(; *file && *file != '?' && *file != '#'; file++) {
+        char c = *file;
+        if(c == '%') {
+            int hi = hex_value(file[1]);
+            int lo = hi < 0 ? -1 : hex_value(file[2]);
+            if(lo < 0) return -1;
+            c = (char)(hi << 4 | lo);
+            /* a NUL would silently truncate the path */
+            if(!c) return -1;
+            file += 2;
+        }
+        if(len + 1 >= out_size) return -1;
+        out[len++] = c;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+ssize_t resolve_redirect(const char *file, char *out, size_t out_size) {
+    size_t path_len = strcspn(file, "?#");
+    const char *query = file + path_len;
+    int len;
+
+    /* a fragment is not the server's to send back */
+    len = snprintf(out, out_size, "/%.*s/%.*s",
+            (int)path_len, file,
+            *query == '?' ? (int)strcspn(query, "#") : 0, query);
+    if(len < 0 || (size_t)len >= out_size) return -1;
+    return len;
+}
+
+int resolve_has_dot_dot(const char *path) {
+    const char *seg = path;
+    for(;;) {
+        if(seg[0] == '.' && seg[1] == '.' && (seg[2] == '/' || !seg[2])) {
+            return 1;
+        }
+        seg = strchr(seg, '/');
+        if(!seg) return 0;
+        seg++;
+    }
+}
+
+int resolve_path(
+        const char *base_dir,
+        size_t base_dir_len,
+        const char *file,
+        char *out,
+        size_t out_size,
+        int *fd,
+        struct stat *st) {
+    ssize_t file_len;
+    int dir_fd;
+    int index_fd;
+
+    if(base_dir_len + 2 >= out_size) return RESOLVE_NOT_FOUND;
+
+    memcpy(out, base_dir, base_dir_len);
+    out[base_dir_len] = '/';
+
+    file_len = resolve_decode(
+            file,
+            out + base_dir_len + 1,
+            out_size - base_dir_len - 1);
+    if(file_len < 0) return RESOLVE_NOT_FOUND;
+    if(resolve_has_dot_dot(out + base_dir_len + 1)) return RESOLVE_NOT_FOUND;
+
+    *fd = open(out, O_RDONLY);
+    if(*fd == -1) return RESOLVE_NOT_FOUND;
+
+    if(fstat(*fd, st) == -1) {
+        close(*fd);
+        *fd = -1;
+        return RESOLVE_NOT_FOUND;
+    }
+    if(!S_ISDIR(st->st_mode)) {
+        return RESOLVE_FILE;
+    }
+
+    /* ##### the target is a directory ##### */
+    dir_fd = *fd;
+    *fd = -1;
+
+    /* relative links in the page would be resolved against the parent */
+    if(file_len && out[base_dir_len + file_len] != '/') {
+        close(dir_fd);
+        return RESOLVE_REDIRECT;
+    }
+
+    index_fd = openat(dir_fd, INDEX_FILE, O_RDONLY);
+    if(index_fd != -1) {
+        struct stat index_st;
+        if(fstat(index_fd, &index_st) == 0 && !S_ISDIR(index_st.st_mode)) {
+            size_t len = base_dir_len + 1 + file_len;
+            if(len + sizeof(INDEX_FILE) <= out_size) {
+                memcpy(out + len, INDEX_FILE, sizeof(INDEX_FILE));
+                close(dir_fd);
+                *st = index_st;
+                *fd = index_fd;
+                return RESOLVE_FILE;
+            }
+        }
+        close(index_fd);
+    }
+    close(dir_fd);
+    return RESOLVE_DIR;
+}
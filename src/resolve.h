@@ -0,0 +1,50 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H 1
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define INDEX_FILE "index.html"
+
+enum resolve_result {
+    /* no such file, or the path tries to escape base_dir */
+    RESOLVE_NOT_FOUND = -1,
+    /* a regular file, or the index of a directory, was opened */
+    RESOLVE_FILE = 0,
+    /* a directory without an index, `out` holds the directory's path */
+    RESOLVE_DIR,
+    /* a directory was asked for without a trailing '/' */
+    RESOLVE_REDIRECT,
+};
+
+/* percent-decodes the request target `file` into `out` up to its query string
+ * Returns: the decoded length, -1 if the target is malformed or too long */
+ssize_t resolve_decode(const char *file, char *out, size_t out_size);
+
+/* writes into `out` where the request target `file` of a directory without
+ * its trailing '/' is redirected to, the path with the '/' then the query
+ * Returns: the length written, -1 if it does not fit */
+ssize_t resolve_redirect(const char *file, char *out, size_t out_size);
+
+/* Returns: 1 if one of the segments of `path` is `..` */
+int resolve_has_dot_dot(const char *path);
+
+/* Maps the request target `file` (without its leading '/') onto `base_dir`
+ * and writes the resulting path into `out`.
+ * The target is percent-decoded, its query string is dropped and any `..`
+ * segment is refused. Directories resolve to their `index.html` when it
+ * exists.
+ * Returns: one of `enum resolve_result`
+ *  on RESOLVE_FILE `*fd` is an open file and `st` holds its stat
+ *  on RESOLVE_DIR `st` holds the stat of the directory */
+int resolve_path(
+        const char *base_dir,
+        size_t base_dir_len,
+        const char *file,
+        char *out,
+        size_t out_size,
+        int *fd,
+        struct stat *st);
+
+#endif
@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <string.h>
 
 #include "response_header.h"
 
@@ -12,13 +13,8 @@ void response_header_init(
 
     response->status_code = code;
 
-    if(!msg) {
-        response->reason = "";
-    }
-
-    if(!mime) {
-        response->content_type = "text/html";
-    }
+    response->reason = msg ? msg : "";
+    response->content_type = mime ? mime : "text/html";
     kv_vec_init(&response->key_values, 0, 0);
 }
 
@@ -63,6 +59,12 @@ ssize_t response_header_write(
         if(written >= vec->iov_len) return -1;
     }
 
+    if(header->extra_len) {
+        if(header->extra_len >= vec->iov_len - written) return -1;
+        memcpy(vec->iov_base + written, header->extra, header->extra_len);
+        written += header->extra_len;
+    }
+
     /* write terminator */
     ret = snprintf(
             vec->iov_base + written,
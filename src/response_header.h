@@ -14,6 +14,9 @@ struct response_header {
     char *reason;
     const char *content_type;
     struct kv_vec key_values;
+    /* header lines written as is after `key_values`, each ending with CRLF */
+    const char *extra;
+    size_t extra_len;
 };
 
 void response_header_init(
@@ -22,6 +25,8 @@ void response_header_init(
         char *msg,
         const char *mime);
 
+void response_header_cleanup(struct response_header *header);
+
 ssize_t response_header_write(
         struct response_header *header,
         struct iovec *vec);
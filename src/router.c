@@ -0,0 +1,198 @@
+#include "router.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "error_page.h"
+#include "logging.h"
+
+/* Returns: the child of `node` whose label starts with `c`, 0 if none */
+static size_t node_child(const struct router *router, size_t node, char c) {
+    for(size_t i = router->nodes[node].child; i; i = router->nodes[i].sibling) {
+        if(router->labels[router->nodes[i].label] == c) return i;
+    }
+    return 0;
+}
+
+/* Adds a node labelled with the `len` bytes of `label`, unattached
+ * Returns: its index, 0 on error */
+static size_t node_new(struct router *router, const char *label, size_t len) {
+    struct router_node *nodes;
+    char *labels;
+
+    nodes = realloc(router->nodes, (router->nb_nodes + 1) * sizeof(*nodes));
+    if(!nodes) return 0;
+    router->nodes = nodes;
+    labels = realloc(router->labels, router->labels_len + len);
+    if(!labels && len) return 0;
+    router->labels = labels;
+
+    if(len) memcpy(router->labels + router->labels_len, label, len);
+    memset(nodes + router->nb_nodes, 0, sizeof(*nodes));
+    nodes[router->nb_nodes].label = router->labels_len;
+    nodes[router->nb_nodes].label_len = len;
+    router->labels_len += len;
+    return router->nb_nodes++;
+}
+
+/* Cuts the label of `node` after `at` bytes, what follows becomes its only
+ * child and takes its routes and children along
+ * Returns: 0 on success, -1 on error */
+static int node_split(struct router *router, size_t node, size_t at) {
+    size_t rest = node_new(router, 0, 0);
+    struct router_node *nodes = router->nodes;
+
+    if(!rest) return -1;
+    nodes[rest].label = nodes[node].label + at;
+    nodes[rest].label_len = nodes[node].label_len - at;
+    nodes[rest].child = nodes[node].child;
+    nodes[rest].exact = nodes[node].exact;
+    nodes[rest].prefix = nodes[node].prefix;
+
+    nodes[node].label_len = at;
+    nodes[node].child = rest;
+    memset(&nodes[node].exact, 0, sizeof(nodes[node].exact));
+    memset(&nodes[node].prefix, 0, sizeof(nodes[node].prefix));
+    return 0;
+}
+
+int router_add(
+        struct router *router,
+        const char *path,
+        int prefix,
+        unsigned methods,
+        route_handler handler,
+        void *data) {
+    size_t len = strlen(path);
+    size_t node = 0;
+    struct route *route;
+
+    /* the root, at index 0 */
+    if(!router->nb_nodes) {
+        node_new(router, 0, 0);
+        if(!router->nb_nodes) return -1;
+    }
+
+    while(len) {
+        size_t child = node_child(router, node, path[0]);
+        const struct router_node *found;
+        size_t common = 0;
+
+        if(!child) {
+            child = node_new(router, path, len);
+            if(!child) return -1;
+            router->nodes[child].sibling = router->nodes[node].child;
+            router->nodes[node].child = child;
+            node = child;
+            break;
+        }
+        found = router->nodes + child;
+        while(common < found->label_len && common < len
+                && router->labels[found->label + common] == path[common]) {
+            common++;
+        }
+        if(common < found->label_len && node_split(router, child, common)) return -1;
+        node = child;
+        path += common;
+        len -= common;
+    }
+
+    route = prefix ? &router->nodes[node].prefix : &router->nodes[node].exact;
+    if(route->handler) return -1;
+    route->methods = methods;
+    route->handler = handler;
+    route->data = data;
+    return 0;
+}
+
+const struct route *router_match(
+        const struct router *router,
+        const char *path,
+        size_t path_len,
+        size_t *matched) {
+    const struct route *best = 0;
+    size_t depth = 0;
+    size_t node = 0;
+
+    if(!router->nb_nodes) return 0;
+    for(;;) {
+        const struct router_node *current = router->nodes + node;
+        const struct router_node *child;
+        size_t next;
+
+        if(depth == path_len && current->exact.handler) {
+            *matched = depth;
+            return &current->exact;
+        }
+        if(current->prefix.handler) {
+            best = &current->prefix;
+            *matched = depth;
+        }
+        if(depth == path_len) break;
+
+        next = node_child(router, node, path[depth]);
+        if(!next) break;
+        child = router->nodes + next;
+        if(child->label_len > path_len - depth
+                || memcmp(router->labels + child->label, path + depth, child->label_len)) {
+            break;
+        }
+        depth += child->label_len;
+        node = next;
+    }
+    return best;
+}
+
+int router_serve(
+        const struct router *router,
+        enum http_method method,
+        const char *target,
+        int trusted,
+        struct route_response *response) {
+    struct route_request request = {0};
+    const struct route *route;
+    const char *query = strchr(target, '?');
+    unsigned allowed;
+    size_t matched;
+
+    request.path = target;
+    request.path_len = query ? (size_t)(query - target) : strlen(target);
+    route = router_match(router, request.path, request.path_len, &matched);
+    if(!route) return 0;
+
+    allowed = route->methods;
+    if(allowed & ROUTE_METHOD(GET)) allowed |= ROUTE_METHOD(HEAD);
+    /* left to the file server, which answers the other methods */
+    if(method >= UNKNOWN_METHOD || !(allowed & ROUTE_METHOD(method))) return 0;
+
+    request.method = method;
+    request.head = method == HEAD;
+    request.rest = request.path + matched;
+    request.rest_len = request.path_len - matched;
+    request.query = query ? query + 1 : 0;
+    request.trusted = trusted;
+
+    memset(response, 0, sizeof(*response));
+    response->status = 200;
+    response->reason = "OK";
+    response->error_page = -1;
+    if(route->handler(&request, response, route->data)) {
+        logging(WARN, "the handler of `%.*s` failed", (int)request.path_len, request.path);
+        route_response_cleanup(response);
+        response->error_page = ERROR_PAGE_500;
+    }
+    return 1;
+}
+
+void route_response_cleanup(struct route_response *response) {
+    free(response->owned);
+    response->owned = 0;
+    response->body = 0;
+    response->body_len = 0;
+}
+
+void router_cleanup(struct router *router) {
+    free(router->nodes);
+    free(router->labels);
+    memset(router, 0, sizeof(*router));
+}
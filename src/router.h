@@ -0,0 +1,115 @@
+#ifndef ROUTER_H
+#define ROUTER_H 1
+
+#include <stddef.h>
+
+#include "headers.h"
+
+/* the methods a route takes, a GET route also answers HEAD */
+#define ROUTE_METHOD(method) (1u << (method))
+
+#define ROUTE_ANY_METHOD (ROUTE_METHOD(UNKNOWN_METHOD) - 1)
+
+struct route_request {
+    enum http_method method;
+    /* only the headers will be sent, the body can be filled regardless */
+    int head;
+    /* the target up to its query string, as sent */
+    const char *path;
+    size_t path_len;
+    /* what follows the matched prefix, empty for an exact path */
+    const char *rest;
+    size_t rest_len;
+    /* what follows the '?', 0 without a query string */
+    const char *query;
+    /* the client is in one of the `status_allow` networks, see
+     * `conn_peer_in` */
+    int trusted;
+};
+
+struct route_response {
+    int status;
+    char *reason;
+    const char *type;
+    /* sent as the `Location` header when set */
+    const char *location;
+    const char *body;
+    size_t body_len;
+    /* freed along with the response, usually what `body` points into */
+    char *owned;
+    /* one of `enum error_page_kind`, the config's page is sent instead of
+     * the fields above, -1 for none */
+    int error_page;
+};
+
+/* Fills `response` for `request`, `data` is what the route was added with
+ * Returns: 0 on success, -1 on error, the client then gets a 500 */
+typedef int (*route_handler)(
+        const struct route_request *request,
+        struct route_response *response,
+        void *data);
+
+struct route {
+    unsigned methods;
+    route_handler handler;
+    void *data;
+};
+
+/* a node of the radix tree, `label` is what its edge adds to the path of
+ * its parent. Nodes refer to each other by their index in `router.nodes`,
+ * 0 is the root and stands for none */
+struct router_node {
+    /* offset in `router.labels` */
+    size_t label;
+    size_t label_len;
+    size_t child;
+    size_t sibling;
+    /* for the path ending here, then for every path starting with it */
+    struct route exact;
+    struct route prefix;
+};
+
+struct router {
+    struct router_node *nodes;
+    size_t nb_nodes;
+    /* every label, a split node keeps pointing into its parent's */
+    char *labels;
+    size_t labels_len;
+};
+
+/* Adds `handler` for `path`, or for every path starting with it when
+ * `prefix` is set, `methods` is a mask of ROUTE_METHOD
+ * Returns: 0 on success, -1 on error or if the path already has a route */
+int router_add(
+        struct router *router,
+        const char *path,
+        int prefix,
+        unsigned methods,
+        route_handler handler,
+        void *data);
+
+/* Finds the route of `path`, an exact path wins over the prefixes and the
+ * longest prefix over the others, `*matched` is the length it covers
+ * Returns: the route, 0 if there is none */
+const struct route *router_match(
+        const struct router *router,
+        const char *path,
+        size_t path_len,
+        size_t *matched);
+
+/* Calls the handler of the request target `target` for `method`, `trusted`
+ * is set for a client the config lets see its internals
+ * Returns: 1 with `response` filled, to be cleaned up once sent
+ *  0 if no route takes the request */
+int router_serve(
+        const struct router *router,
+        enum http_method method,
+        const char *target,
+        int trusted,
+        struct route_response *response);
+
+void route_response_cleanup(struct route_response *response);
+
+void router_cleanup(struct router *router);
+
+#endif
@@ -1,14 +1,21 @@
 #include "send.h"
 
 #include <unistd.h>
+#include <setjmp.h>
 #include <sys/stat.h>
 
+#include "file_map.h"
+#include "trace.h"
+
 
 #define MIN(a,b) (a < b ? a : b)
 
 #define BUFFSIZE 4096
 #define MAX_BUFF_COUNT_FAST 128
 
+/* bytes handed to SSL_write at once from a mapping */
+#define MAP_SEND_CHUNK (256 * 1024)
+
 
 /* Tries to send data_size from data into sock
  * Returns
@@ -103,24 +110,97 @@ failure:
     return -1;
 }
 
-/* Tries to send count char of fd
- * Returns:
- *  the size sent
- *  -1 on fail, check errno */
-ssize_t send_file(
-        int code,
-        char *msg,
-        const char *mime,
+/* sends count bytes of fd over a TLS connection straight out of a mapping of
+ * the file, sparing the copy through a bounce buffer
+ * Returns
+ *  -1 on error */
+static ssize_t send_mapped_file(
+        int fd,
+        const struct stat *st,
+        size_t count,
+        struct conn *sock,
+        struct response_header response) {
+    SSL *ssl = sock->data.ssl;
+    char header[BUFFSIZE];
+    struct iovec buff = {.iov_base = header, .iov_len = BUFFSIZE};
+    struct file_map *map;
+    sigjmp_buf jmp;
+    volatile size_t sent = 0;
+    off_t off;
+    int ret;
+
+    off = lseek(fd, 0, SEEK_CUR);
+    if(off < 0 || (size_t)off + count > (size_t)st->st_size) return -1;
+
+    if((buff.iov_len = response_header_write(&response, &buff)) == 0) {
+        return -1;
+    }
+    if(SSL_write(ssl, buff.iov_base, buff.iov_len) <= 0) {
+        return -1;
+    }
+    if(!count) return 0;
+
+#ifndef OPENSSL_NO_KTLS
+    /* the kernel does the record encryption, let it read the page cache */
+    if(BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        while(sent < count) {
+            ossl_ssize_t ret = SSL_sendfile(ssl, fd, off + sent, count - sent, 0);
+            if(ret <= 0) return -1;
+            sent += ret;
+        }
+        return sent;
+    }
+#endif
+
+    map = file_map_get(fd, st);
+    if(!map) {
+        logging_errno(ERR, "mmap: ");
+        return -1;
+    }
+
+    if(sigsetjmp(jmp, 1)) {
+        /* the file shrunk under us, the pages past its new end are gone and
+         * the record SSL_write was building is lost with them */
+        logging(WARN, "file truncated while being sent, %zu bytes sent", sent);
+        file_map_invalidate(map);
+        file_map_put(map);
+        SSL_set_quiet_shutdown(ssl, 1);
+        return -1;
+    }
+    file_map_guard(&jmp);
+    while(sent < count) {
+        ret = SSL_write(
+                ssl,
+                (const char*)map->data + off + sent,
+                MIN(count - sent, MAP_SEND_CHUNK));
+        if(ret <= 0) break;
+        sent += ret;
+    }
+    file_map_unguard();
+    file_map_put(map);
+
+    if(sent != count) return -1;
+    return sent;
+}
+
+/* `send_file` between its probes */
+static ssize_t send_file_untraced(
+        const struct response_header *header,
         int fd,
         size_t count,
         struct conn *sock) {
 
     size_t ret;
-    struct response_header response = {0};
+    struct response_header response = *header;
 
-    response.status_code = code;
-    response.reason = msg;
-    response.content_type = mime;
+    if(sock->type == CONN_SSL) {
+        struct stat st;
+        if(fstat(fd, &st) == -1) {
+            logging_errno(ERR, "fstat");
+            return -1;
+        }
+        return send_mapped_file(fd, &st, count, sock, response);
+    }
 
     int nb_vecs = count / BUFFSIZE + 1;
     size_t cur_count = count;
@@ -198,13 +278,25 @@ failure:
     return -1;
 }
 
+ssize_t send_file(
+        const struct response_header *response,
+        int fd,
+        size_t count,
+        struct conn *sock) {
+    ssize_t sent;
+
+    PROBE(send_start, fd, count);
+    sent = send_file_untraced(response, fd, count, sock);
+    PROBE(send_end, fd, sent);
+    return sent;
+}
+
 /* Tries to send a whole file
  * Returns:
  *  the size sent
  *  -1 on fail, check errno */
 ssize_t send_whole_file(
-        int code, char *msg,
-        const char *mime,
+        const struct response_header *response,
         int fd,
         struct conn *sock) {
     /* send a file */
@@ -214,47 +306,46 @@ ssize_t send_whole_file(
         return -1;
     }
 
-    return send_file(code, msg, mime, fd, stat.st_size, sock);
+    return send_file(response, fd, stat.st_size, sock);
 }
 
-int send_404(struct conn *sock) {
-    struct response_header response = {0};
-    response_header_init(&response, 404, "page not found", 0);
+ssize_t send_head(
+        struct response_header *response,
+        size_t length,
+        struct conn *sock) {
+    char header[BUFFSIZE];
+    struct iovec vec = {.iov_base = header, .iov_len = BUFFSIZE};
+    ssize_t len;
+    int ret;
 
-    return send_str(
-            &response,
-            NOT_FOUND_PAGE,
-            NOT_FOUND_PAGE_LEN,
-            sock);
+    len = response_header_write(response, &vec);
+    if(len <= 0) {
+        logging(ERR, "unable to write response header into iovec");
+        return -1;
+    }
+    /* in place of the terminating CRLF */
+    len -= 2;
+    ret = snprintf(header + len, BUFFSIZE - len,
+            "Content-Length: %zu"CRLF CRLF,
+            length);
+    if(ret <= 0 || ret >= BUFFSIZE - len) return -1;
+    return conn_write(sock, header, len + ret);
 }
 
-int send_405(struct conn *sock) {
-    struct response_header response = {0};
-    response_header_init(
-            &response,
-            405,
-            "this server only supports http GET",
-            0);
+ssize_t send_error(struct conn *sock, const struct error_page *page, int head) {
+    return conn_write(sock, page->data, head ? page->head_len : page->len);
+}
 
-    return send_str(
-            &response,
-            NOT_FOUND_PAGE,
-            NOT_FOUND_PAGE_LEN,
-            sock);
+int send_404(struct conn *sock) {
+    return send_error(sock, error_page_default(ERROR_PAGE_404), 0);
 }
 
-int send_500(struct conn *sock) {
-    struct response_header response = {0};
-    response_header_init(
-            &response,
-            500,
-            "server error",
-            0);
+int send_405(struct conn *sock) {
+    return send_error(sock, error_page_default(ERROR_PAGE_405), 0);
+}
 
-    return send_str(
-            &response,
-            SERVER_ERROR_PAGE, SERVER_ERROR_PAGE_LEN,
-            sock);
+int send_500(struct conn *sock) {
+    return send_error(sock, error_page_default(ERROR_PAGE_500), 0);
 }
 
 int send_308(struct conn *sock, char *location) {
@@ -262,49 +353,27 @@ int send_308(struct conn *sock, char *location) {
     response_header_init(
             &response,
             308,
-            "upgrade",
+            "Permanent Redirect",
             0);
     struct key_value kv = {0};
     kv.key = "Location";
     kv.value = location;
+    int ret;
 
     kv_vec_push(
         &response.key_values,
         kv);
 
 
-    return send_str(
+    ret = send_str(
             &response,
             "",
             0,
             sock);
+    response_header_cleanup(&response);
+    return ret;
 }
 
-int send_426(struct conn *sock, const char *protocol) {
-    struct response_header response = {0};
-    response_header_init(
-            &response,
-            426,
-            "upgrade",
-            0);
-    struct key_value kv = {0};
-    kv.key = "Connection";
-    kv.value = "Upgrade";
-
-    kv_vec_push(
-        &response.key_values,
-        kv);
-
-    kv.key = "Upgrade";
-    kv.value = (char*)protocol;
-
-    kv_vec_push(
-        &response.key_values,
-        kv);
-
-    return send_str(
-            &response,
-            UPGRADE_REQUIRED_PAGE,
-            UPGRADE_REQUIRED_PAGE_LEN,
-            sock);
+int send_426(struct conn *sock) {
+    return send_error(sock, error_page_default(ERROR_PAGE_426), 0);
 }
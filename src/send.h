@@ -6,6 +6,7 @@
 #include "conn.h"
 
 #include "default_pages.h"
+#include "error_page.h"
 
 
 #define BUFFSIZE 4096
@@ -22,29 +23,42 @@ ssize_t send_str(
         size_t data_size,
         struct conn *sock);
 
-/* Tries to send a whole file
+/* Tries to send a whole file after the header `response`
  * Returns:
  *  the size sent
  *  -1 on fail, check errno */
 ssize_t send_whole_file(
-        int code, char *msg,
-        const char *mime,
+        const struct response_header *response,
         int fd,
         struct conn *sock);
 
-/* Tries to send count char of fd
+/* Tries to send count char of fd after the header `response`
  * Returns:
  *  the size sent
  *  -1 on fail, check errno */
 ssize_t send_file(
-        int code,
-        char *msg,
-        const char *mime,
+        const struct response_header *response,
         int fd,
         size_t count,
         struct conn *sock);
 
+/* Sends only the header of `response`, announcing a body of `length` bytes,
+ * what a HEAD request gets
+ * Returns:
+ *  the size sent
+ *  -1 on fail, check errno */
+ssize_t send_head(
+        struct response_header *response,
+        size_t length,
+        struct conn *sock);
+
+/* Writes the whole of `page` at once, or its header alone for `head`
+ * Returns:
+ *  the size sent
+ *  -1 on fail, check errno */
+ssize_t send_error(struct conn *sock, const struct error_page *page, int head);
 
+/* the built-in pages, see `send_error` for the ones from the config */
 int send_404(struct conn *sock);
 
 int send_405(struct conn *sock);
@@ -53,6 +67,6 @@ int send_500(struct conn *sock);
 
 int send_308(struct conn *sock, char *location);
 
-int send_426(struct conn *sock, const char *protocol);
+int send_426(struct conn *sock);
 
 #endif
@@ -0,0 +1,420 @@
+/* sv-pack: packs a site into an archive that `sv` serves through its
+ * `pack_file` key, see pack.h for the layout */
+#define _XOPEN_SOURCE 700
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pack.h"
+#include "mime.h"
+#include "logging.h"
+
+#define CRLF "\xd\xa"
+#define HEADER_BUFF_SIZE 512
+#define COPY_BUFF_SIZE (64 * 1024)
+#define MAX_SEED (1u << 24)
+
+struct file {
+    char *path;
+    /* relative to base_dir */
+    const char *rel;
+    size_t size;
+    struct timespec mtime;
+    uint64_t body_off;
+};
+
+struct item {
+    const char *key;
+    size_t key_len;
+    size_t file;
+    /* index of the .gz sibling or -1 */
+    ssize_t gz_file;
+    char *headers[PACK_NB_VARIANTS];
+    uint32_t bucket;
+};
+
+static struct file *FILES = 0;
+static size_t NB_FILES = 0;
+static size_t FILES_SIZE = 0;
+static size_t BASE_DIR_LEN = 0;
+
+static int collect(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    if(type != FTW_F || !S_ISREG(st->st_mode)) return 0;
+
+    if(NB_FILES == FILES_SIZE) {
+        size_t new_size = FILES_SIZE ? FILES_SIZE * 2 : 64;
+        struct file *files = realloc(FILES, sizeof(struct file) * new_size);
+        if(!files) return -1;
+        FILES = files;
+        FILES_SIZE = new_size;
+    }
+    struct file *file = FILES + NB_FILES;
+    file->path = strdup(path);
+    if(!file->path) return -1;
+    file->rel = file->path + BASE_DIR_LEN + 1;
+    file->size = st->st_size;
+    file->mtime = st->st_mtim;
+    file->body_off = 0;
+    NB_FILES++;
+    return 0;
+}
+
+static int cmp_files(const void *a, const void *b) {
+    return strcmp(((const struct file*)a)->rel, ((const struct file*)b)->rel);
+}
+
+/* FILES must be sorted
+ * Returns: the index of the file at `rel` or -1 */
+static ssize_t find_file(const char *rel) {
+    struct file key = {.rel = rel};
+    struct file *found = bsearch(&key, FILES, NB_FILES, sizeof(struct file), cmp_files);
+    return found ? found - FILES : -1;
+}
+
+/* serializes the response headers of a file
+ * Returns: a malloced string, 0 on error */
+static char *serialize_headers(
+        const struct file *file,
+        const char *mime,
+        int gzip,
+        int has_variant) {
+    char *buff = malloc(HEADER_BUFF_SIZE);
+    if(!buff) return 0;
+
+    int ret = snprintf(buff, HEADER_BUFF_SIZE,
+            "HTTP/1.1 200 OK"CRLF
+            "Content-Type: %s"CRLF
+            "Content-Length: %zu"CRLF
+            "ETag: \"%lx-%lx%s\""CRLF
+            "%s"
+            "%s"
+            CRLF,
+            mime,
+            file->size,
+            (unsigned long)file->size,
+            (unsigned long)file->mtime.tv_sec,
+            gzip ? "-gz" : "",
+            gzip ? "Content-Encoding: gzip"CRLF : "",
+            has_variant ? "Vary: Accept-Encoding"CRLF : "");
+    if(ret <= 0 || ret >= HEADER_BUFF_SIZE) {
+        free(buff);
+        return 0;
+    }
+    return buff;
+}
+
+/* Finds a seed for every bucket so that no two items share a slot
+ * Returns: 0 on success, -1 if no displacement could be found */
+static int build_index(
+        struct item *items,
+        size_t nb_items,
+        uint32_t nb_buckets,
+        uint32_t nb_slots,
+        uint32_t *seeds,
+        ssize_t *slots) {
+    /* items grouped by bucket, bucket `b` spans [starts[b], starts[b+1][ */
+    size_t *members = malloc(sizeof(size_t) * (nb_items + 1));
+    size_t *starts = calloc(nb_buckets + 1, sizeof(size_t));
+    size_t *order = malloc(sizeof(size_t) * nb_buckets);
+    uint32_t *taken = malloc(sizeof(uint32_t) * (nb_items + 1));
+    int ret = -1;
+
+    if(!members || !starts || !order || !taken) goto cleanup;
+
+    for(size_t i = 0; i < nb_slots; i++) slots[i] = -1;
+    for(size_t i = 0; i < nb_items; i++) {
+        items[i].bucket = pack_hash(0, items[i].key, items[i].key_len) % nb_buckets;
+        starts[items[i].bucket + 1]++;
+    }
+    for(size_t b = 0; b < nb_buckets; b++) starts[b + 1] += starts[b];
+    for(size_t b = 0; b < nb_buckets; b++) order[b] = starts[b];
+    for(size_t i = 0; i < nb_items; i++) members[order[items[i].bucket]++] = i;
+
+#define BUCKET_SIZE(b) (starts[(b) + 1] - starts[(b)])
+    /* place the largest buckets first while the table is still empty */
+    for(size_t b = 0; b < nb_buckets; b++) order[b] = b;
+    for(size_t i = 1; i < nb_buckets; i++) {
+        size_t cur = order[i];
+        size_t j = i;
+        for(; j > 0 && BUCKET_SIZE(order[j-1]) < BUCKET_SIZE(cur); j--) {
+            order[j] = order[j-1];
+        }
+        order[j] = cur;
+    }
+
+    for(size_t b = 0; b < nb_buckets && BUCKET_SIZE(order[b]); b++) {
+        size_t bucket = order[b];
+        uint32_t seed;
+
+        for(seed = 1; seed < MAX_SEED; seed++) {
+            size_t nb_taken = 0;
+            size_t m;
+            for(m = starts[bucket]; m < starts[bucket + 1]; m++) {
+                struct item *item = items + members[m];
+                uint32_t slot = pack_hash(seed, item->key, item->key_len) % nb_slots;
+                if(slots[slot] != -1) break;
+                size_t k = 0;
+                for(; k < nb_taken && taken[k] != slot; k++);
+                if(k != nb_taken) break;
+                taken[nb_taken++] = slot;
+            }
+            if(m != starts[bucket + 1]) continue;
+            /* every item of the bucket fits */
+            for(size_t k = 0; k < nb_taken; k++) {
+                slots[taken[k]] = members[starts[bucket] + k];
+            }
+            seeds[bucket] = seed;
+            break;
+        }
+        if(seed == MAX_SEED) {
+            logging(ERR, "unable to build the perfect hash");
+            goto cleanup;
+        }
+    }
+#undef BUCKET_SIZE
+    ret = 0;
+
+cleanup:
+    free(members);
+    free(starts);
+    free(order);
+    free(taken);
+    return ret;
+}
+
+static int write_all(int fd, const void *data, size_t size, uint64_t off) {
+    while(size) {
+        ssize_t ret = pwrite(fd, data, size, off);
+        if(ret < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        data = (const char*)data + ret;
+        size -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+static int copy_file(int out, const struct file *file, char *buff) {
+    uint64_t off = file->body_off;
+    size_t left = file->size;
+    int fd = open(file->path, O_RDONLY);
+    if(fd == -1) return -1;
+
+    while(left) {
+        ssize_t ret = read(fd, buff, COPY_BUFF_SIZE);
+        if(ret <= 0) {
+            if(ret < 0 && errno == EINTR) continue;
+            close(fd);
+            logging(ERR, "`%s` changed while packing", file->path);
+            return -1;
+        }
+        if((size_t)ret > left) ret = left;
+        if(write_all(out, buff, ret, off)) {
+            close(fd);
+            return -1;
+        }
+        off += ret;
+        left -= ret;
+    }
+    close(fd);
+    return 0;
+}
+
+static uint64_t align_up(uint64_t off, uint64_t align) {
+    return (off + align - 1) / align * align;
+}
+
+int main(int argc, const char **argv) {
+    struct item *items = 0;
+    size_t nb_items = 0;
+    uint32_t *seeds = 0;
+    ssize_t *slots = 0;
+    struct pack_entry *entries = 0;
+    char *copy_buff = 0;
+    int out = -1;
+    int ret = 1;
+
+    if(argc != 3) {
+        fprintf(stderr, "Usage: %s <base dir> <archive>\n", argv[0]);
+        return 1;
+    }
+    const char *base_dir = argv[1];
+    BASE_DIR_LEN = strlen(base_dir);
+    while(BASE_DIR_LEN > 1 && base_dir[BASE_DIR_LEN-1] == '/') BASE_DIR_LEN--;
+
+    if(mime_init()) return 1;
+
+    if(nftw(base_dir, collect, 16, FTW_PHYS)) {
+        logging(ERR, "unable to walk `%s`: %s", base_dir, strerror(errno));
+        goto cleanup;
+    }
+
+    if(NB_FILES) qsort(FILES, NB_FILES, sizeof(struct file), cmp_files);
+
+    /* every file plus an alias for each directory index */
+    items = calloc(NB_FILES * 2 + 1, sizeof(struct item));
+    if(!items) goto cleanup;
+
+    for(size_t i = 0; i < NB_FILES; i++) {
+        const struct file *file = FILES + i;
+        size_t rel_len = strlen(file->rel);
+        char gz[BUFSIZ];
+        const char *index;
+        int fd;
+
+        struct item *item = items + nb_items++;
+        item->key = file->rel;
+        item->key_len = rel_len;
+        item->file = i;
+        item->gz_file = -1;
+        if(snprintf(gz, sizeof(gz), "%s.gz", file->rel) < (int)sizeof(gz)) {
+            item->gz_file = find_file(gz);
+        }
+
+        fd = open(file->path, O_RDONLY);
+        if(fd == -1) {
+            logging(ERR, "unable to open `%s`: %s", file->path, strerror(errno));
+            goto cleanup;
+        }
+        const char *mime = mime_get(file->path, fd);
+        close(fd);
+        if(!mime) goto cleanup;
+
+        item->headers[PACK_IDENTITY] = serialize_headers(
+                file, mime, 0, item->gz_file != -1);
+        if(!item->headers[PACK_IDENTITY]) goto cleanup;
+        if(item->gz_file != -1) {
+            item->headers[PACK_GZIP] = serialize_headers(
+                    FILES + item->gz_file, mime, 1, 1);
+            if(!item->headers[PACK_GZIP]) goto cleanup;
+        }
+
+        /* `dir/index.html` is also served as `dir/` */
+        index = strrchr(file->rel, '/');
+        index = index ? index + 1 : file->rel;
+        if(!strcmp(index, "index.html")) {
+            struct item *alias = items + nb_items++;
+            *alias = *item;
+            alias->key_len = index - file->rel;
+            for(int j = 0; j < PACK_NB_VARIANTS; j++) {
+                if(item->headers[j]) {
+                    alias->headers[j] = strdup(item->headers[j]);
+                    if(!alias->headers[j]) goto cleanup;
+                }
+            }
+        }
+    }
+
+    uint32_t nb_buckets = nb_items / 4 + 1;
+    uint32_t nb_slots = nb_items + nb_items / 4 + 1;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    seeds = calloc(nb_buckets, sizeof(uint32_t));
+    slots = malloc(sizeof(ssize_t) * nb_slots);
+    entries = calloc(nb_slots, sizeof(struct pack_entry));
+    copy_buff = malloc(COPY_BUFF_SIZE);
+    if(!seeds || !slots || !entries || !copy_buff) goto cleanup;
+
+    if(build_index(items, nb_items, nb_buckets, nb_slots, seeds, slots)) {
+        goto cleanup;
+    }
+
+    struct pack_header header = {0};
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    header.entry_size = sizeof(struct pack_entry);
+    header.nb_buckets = nb_buckets;
+    header.nb_slots = nb_slots;
+    header.seeds_off = align_up(sizeof(header), sizeof(uint64_t));
+    header.entries_off = align_up(
+            header.seeds_off + sizeof(uint32_t) * nb_buckets,
+            sizeof(uint64_t));
+
+    out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out == -1) {
+        logging(ERR, "unable to create `%s`: %s", argv[2], strerror(errno));
+        goto cleanup;
+    }
+
+    /* paths and headers go right after the index */
+    uint64_t off = header.entries_off + sizeof(struct pack_entry) * nb_slots;
+    for(uint32_t slot = 0; slot < nb_slots; slot++) {
+        if(slots[slot] == -1) continue;
+        struct item *item = items + slots[slot];
+        struct pack_entry *entry = entries + slot;
+
+        entry->flags = PACK_ENTRY_USED;
+        entry->path_off = off;
+        entry->path_len = item->key_len;
+        if(write_all(out, item->key, item->key_len, off)) goto write_err;
+        off += item->key_len;
+
+        for(int j = 0; j < PACK_NB_VARIANTS; j++) {
+            if(!item->headers[j]) continue;
+            size_t len = strlen(item->headers[j]);
+            entry->variants[j].header_off = off;
+            entry->variants[j].header_len = len;
+            if(write_all(out, item->headers[j], len, off)) goto write_err;
+            off += len;
+        }
+    }
+
+    /* bodies, once per file and page aligned */
+    for(size_t i = 0; i < NB_FILES; i++) {
+        off = align_up(off, page_size);
+        FILES[i].body_off = off;
+        if(copy_file(out, FILES + i, copy_buff)) goto write_err;
+        off += FILES[i].size;
+    }
+    for(uint32_t slot = 0; slot < nb_slots; slot++) {
+        if(slots[slot] == -1) continue;
+        struct item *item = items + slots[slot];
+        struct pack_entry *entry = entries + slot;
+
+        entry->variants[PACK_IDENTITY].body_off = FILES[item->file].body_off;
+        entry->variants[PACK_IDENTITY].body_len = FILES[item->file].size;
+        if(item->gz_file != -1) {
+            entry->variants[PACK_GZIP].body_off = FILES[item->gz_file].body_off;
+            entry->variants[PACK_GZIP].body_len = FILES[item->gz_file].size;
+        }
+    }
+
+    if(write_all(out, &header, sizeof(header), 0)
+            || write_all(out, seeds, sizeof(uint32_t) * nb_buckets, header.seeds_off)
+            || write_all(out, entries, sizeof(struct pack_entry) * nb_slots, header.entries_off)
+            || ftruncate(out, off)) {
+        goto write_err;
+    }
+
+    printf("packed %zu files (%zu paths) into `%s`\n", NB_FILES, nb_items, argv[2]);
+    ret = 0;
+    goto cleanup;
+
+write_err:
+    logging(ERR, "unable to write `%s`: %s", argv[2], strerror(errno));
+cleanup:
+    if(out != -1) close(out);
+    for(size_t i = 0; items && i < nb_items; i++) {
+        for(int j = 0; j < PACK_NB_VARIANTS; j++) {
+            free(items[i].headers[j]);
+        }
+    }
+    free(items);
+    for(size_t i = 0; i < NB_FILES; i++) {
+        free(FILES[i].path);
+    }
+    free(FILES);
+    free(seeds);
+    free(slots);
+    free(entries);
+    free(copy_buff);
+    mime_cleanup();
+    return ret;
+}
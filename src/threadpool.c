@@ -0,0 +1,177 @@
+#include "threadpool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "logging.h"
+
+static uint64_t elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000000ull
+        + to->tv_nsec - from->tv_nsec;
+}
+
+/* Returns: the job at `index` of the ring `ring` */
+static void *slot(const struct threadpool *pool, void *ring, size_t index) {
+    return (char*)ring + index % pool->queue_size * pool->job_size;
+}
+
+static void *worker(void *arg) {
+    struct threadpool *pool = arg;
+    const uint64_t one = 1;
+    void *job = malloc(pool->job_size);
+
+    if(!job) {
+        logging(ERR, "no memory for a thread doing %s", pool->what);
+        return 0;
+    }
+    if(pool->thread_init) pool->thread_init();
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        struct timespec queued, started, ended;
+        uint64_t latency;
+        int ret;
+
+        while(!pool->nb_pending && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        /* the queue is finished before stopping */
+        if(!pool->nb_pending) break;
+        memcpy(job, slot(pool, pool->pending, pool->pending_head), pool->job_size);
+        queued = pool->queued[pool->pending_head];
+        pool->pending_head = (pool->pending_head + 1) % pool->queue_size;
+        pool->stats.depth = --pool->nb_pending;
+        pthread_mutex_unlock(&pool->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        ret = pool->work(job);
+        clock_gettime(CLOCK_MONOTONIC, &ended);
+
+        pthread_mutex_lock(&pool->lock);
+        memcpy(slot(pool, pool->finished, pool->finished_head + pool->nb_finished++),
+                job, pool->job_size);
+        pool->stats.done++;
+        if(ret) pool->stats.failed++;
+        pool->stats.wait_ns += elapsed_ns(&queued, &started);
+        pool->stats.work_ns += elapsed_ns(&started, &ended);
+        latency = elapsed_ns(&queued, &ended);
+        if(latency > pool->stats.max_latency_ns) pool->stats.max_latency_ns = latency;
+        if(write(pool->event_fd, &one, sizeof(one)) == -1) {
+            logging_errno(WARN, "write: ");
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if(pool->thread_cleanup) pool->thread_cleanup();
+    free(job);
+    return 0;
+}
+
+/* stops the threads once the queue is empty, the jobs done are kept */
+static void threads_join(struct threadpool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 0; i < pool->nb_threads; i++) {
+        pthread_join(pool->threads[i], 0);
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->nb_threads = 0;
+    pool->stopping = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int threadpool_start(struct threadpool *pool, int nb_threads) {
+    int started = 0;
+
+    if(nb_threads > THREADPOOL_THREADS_MAX) nb_threads = THREADPOOL_THREADS_MAX;
+    if(nb_threads == pool->nb_threads) return 0;
+    threads_join(pool);
+    if(nb_threads <= 0) return 0;
+
+    if(pool->event_fd == -1) {
+        pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(pool->event_fd == -1) {
+            logging_errno(ERR, "eventfd: ");
+            return -1;
+        }
+    }
+    for(int i = 0; i < nb_threads; i++) {
+        int err = pthread_create(pool->threads + i, 0, worker, pool);
+        if(err) {
+            logging(ERR, "unable to start a thread doing %s: %s", pool->what, strerror(err));
+            break;
+        }
+        started++;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->nb_threads = started;
+    pthread_mutex_unlock(&pool->lock);
+    if(!started) return -1;
+    logging(INFO, "%d threads doing %s", started, pool->what);
+    return 0;
+}
+
+int threadpool_fd(const struct threadpool *pool) {
+    return pool->event_fd;
+}
+
+int threadpool_submit(struct threadpool *pool, const void *job) {
+    size_t index;
+
+    pthread_mutex_lock(&pool->lock);
+    if(!pool->nb_threads) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    if(pool->outstanding >= pool->queue_size) {
+        pool->stats.overflowed++;
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    index = (pool->pending_head + pool->nb_pending++) % pool->queue_size;
+    memcpy(slot(pool, pool->pending, index), job, pool->job_size);
+    clock_gettime(CLOCK_MONOTONIC, pool->queued + index);
+    pool->outstanding++;
+    pool->stats.queued++;
+    pool->stats.depth = pool->nb_pending;
+    if(pool->nb_pending > pool->stats.max_depth) pool->stats.max_depth = pool->nb_pending;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int threadpool_collect(struct threadpool *pool, void *job) {
+    uint64_t count;
+
+    pthread_mutex_lock(&pool->lock);
+    if(!pool->nb_finished) {
+        /* every wakeup is answered, the counter can go */
+        if(pool->event_fd != -1 && read(pool->event_fd, &count, sizeof(count)) == -1
+                && errno != EAGAIN) {
+            logging_errno(WARN, "read: ");
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+    memcpy(job, slot(pool, pool->finished, pool->finished_head), pool->job_size);
+    pool->finished_head = (pool->finished_head + 1) % pool->queue_size;
+    pool->nb_finished--;
+    pool->outstanding--;
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+void threadpool_stats(struct threadpool *pool, struct threadpool_stats *stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void threadpool_stop(struct threadpool *pool) {
+    threads_join(pool);
+    if(pool->event_fd != -1) close(pool->event_fd);
+    pool->event_fd = -1;
+}
@@ -0,0 +1,107 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define THREADPOOL_THREADS_MAX 64
+
+/* Does `job` on a pool thread, it is handed back to the serving thread
+ * once done
+ * Returns: 0 on success, -1 if the job failed, for the stats */
+typedef int (*threadpool_work)(void *job);
+
+struct threadpool_stats {
+    /* handed to the threads, then done by the caller, the queue was full */
+    uint64_t queued;
+    uint64_t overflowed;
+    /* done by the threads, and of those the ones that failed */
+    uint64_t done;
+    uint64_t failed;
+    /* waiting for a thread right now, and at most */
+    uint64_t depth;
+    uint64_t max_depth;
+    /* nanoseconds spent waiting for a thread, then on the job */
+    uint64_t wait_ns;
+    uint64_t work_ns;
+    /* the longest from submission to completion */
+    uint64_t max_latency_ns;
+};
+
+/* Threads doing the jobs of the serving thread, a job is `job_size` bytes
+ * copied in and out of rings of `queue_size` jobs that the owner of the
+ * pool provides, see THREADPOOL_INIT */
+struct threadpool {
+    /* what the threads are doing, for the logs */
+    const char *what;
+    threadpool_work work;
+    /* run by each thread as it starts and as it ends, 0 for none */
+    void (*thread_init)(void);
+    void (*thread_cleanup)(void);
+    size_t job_size;
+    size_t queue_size;
+    /* `queue_size` jobs each, and the time each pending one was queued */
+    void *pending;
+    void *finished;
+    struct timespec *queued;
+
+    /* the pool's own, guarded by `lock`. A job is in one of the rings or
+     * in a thread's hands from its submission to its collection */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t threads[THREADPOOL_THREADS_MAX];
+    int nb_threads;
+    int stopping;
+    size_t pending_head;
+    size_t nb_pending;
+    size_t finished_head;
+    size_t nb_finished;
+    size_t outstanding;
+    struct threadpool_stats stats;
+    int event_fd;
+};
+
+/* A pool doing `work` on the jobs of type `type`, out of the arrays of
+ * `size` jobs `pending` and `finished` and the `size` timespecs `queued`,
+ * followed by the other fields to set, such as `.thread_init` */
+#define THREADPOOL_INIT(_what, _work, type, size, _pending, _finished, _queued, ...) { \
+    .what = (_what), \
+    .work = (_work), \
+    .job_size = sizeof(type), \
+    .queue_size = (size), \
+    .pending = (_pending), \
+    .finished = (_finished), \
+    .queued = (_queued), \
+    .lock = PTHREAD_MUTEX_INITIALIZER, \
+    .wake = PTHREAD_COND_INITIALIZER, \
+    .event_fd = -1, \
+    __VA_ARGS__ \
+}
+
+/* Starts `nb_threads` threads, they replace the running ones, 0 stops
+ * them once the queue is empty, the jobs done are kept
+ * Returns: 0 on success, -1 on error, the jobs then stay with the caller */
+int threadpool_start(struct threadpool *pool, int nb_threads);
+
+/* Returns: the eventfd that becomes readable once jobs are done, -1 if
+ *  the pool never ran */
+int threadpool_fd(const struct threadpool *pool);
+
+/* Queues a copy of `job`
+ * Returns: 0 if a thread will do it, -1 if the caller has to, there are no
+ *  threads or the queue is full */
+int threadpool_submit(struct threadpool *pool, const void *job);
+
+/* Takes a job that is done into `job`
+ * Returns: 1 with `job` filled, 0 if none is left */
+int threadpool_collect(struct threadpool *pool, void *job);
+
+void threadpool_stats(struct threadpool *pool, struct threadpool_stats *stats);
+
+/* stops the threads and closes the eventfd, the jobs done are still to be
+ * collected */
+void threadpool_stop(struct threadpool *pool);
+
+#endif
@@ -0,0 +1,9 @@
+#include "trace.h"
+
+#if SV_TRACE
+/* one per probe, in the section where tracers look for them */
+#define PROBE_SEMAPHORE(name) \
+    unsigned short sv_##name##_semaphore __attribute__((section(".probes")));
+SV_PROBES(PROBE_SEMAPHORE)
+#undef PROBE_SEMAPHORE
+#endif
@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+
+/* USDT probes of the `sv` provider, a disabled probe is a test of its
+ * semaphore, its arguments are only evaluated while a tracer is attached.
+ * Attach with `bpftrace -e 'usdt:./sv:sv:<probe> { ... }'`, see trace/.
+ *
+ *  accept(fd)
+ *  tls_handshake_start(fd)
+ *  tls_handshake_end(fd, ret), `ret` is SSL_accept's, 1 on success
+ *  request_parsed(fd, method, path), `method` is an `enum http_method`
+ *  file_opened(fd, path), `fd` is the file's
+ *  mime_resolved(path, type)
+ *  send_start(fd, count), `fd` is the file's
+ *  send_end(fd, sent), `sent` is -1 on error
+ *  conn_closed(fd)
+ *
+ * SV_TRACE is set by the Makefile: 1 when sys/sdt.h (systemtap-sdt-dev) is
+ * there, the build fails without it if probes were asked for, 0 leaves the
+ * probes out. Unset, they are in if sys/sdt.h is found. */
+#define SV_PROBES(X) \
+    X(accept) \
+    X(tls_handshake_start) \
+    X(tls_handshake_end) \
+    X(request_parsed) \
+    X(file_opened) \
+    X(mime_resolved) \
+    X(send_start) \
+    X(send_end) \
+    X(conn_closed)
+
+#ifndef SV_TRACE
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define SV_TRACE 1
+#endif
+#endif
+#endif
+
+#if SV_TRACE
+/* the probes' notes point to their semaphore, see trace.c */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name) \
+    extern unsigned short sv_##name##_semaphore;
+SV_PROBES(PROBE_SEMAPHORE)
+#undef PROBE_SEMAPHORE
+
+/* set by the kernel while a tracer is attached to the probe */
+#define PROBE_ENABLED(name) __builtin_expect(sv_##name##_semaphore, 0)
+
+#define PROBE(name, ...) do { \
+    if(PROBE_ENABLED(name)) STAP_PROBEV(sv, name, __VA_ARGS__); \
+} while(0)
+#else
+#define PROBE_ENABLED(name) 0
+#define PROBE(...) ((void)0)
+#endif
+
+#endif
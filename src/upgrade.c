@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include "upgrade.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "logging.h"
+
+extern char **environ;
+
+/* channel to the old process, kept until `upgrade_ready` */
+static int PARENT_FD = -1;
+
+/* where the new process finds the channel */
+static char CHANNEL_ENV[] = UPGRADE_ENV "=3";
+
+/* Returns: the environment of the new process, ours with CHANNEL_ENV, only
+ *  the array is to be freed, 0 on error */
+static char **channel_environ(void) {
+    char **envp;
+    size_t nb = 0;
+
+    for(char **env = environ; *env; env++) nb++;
+    envp = malloc((nb + 2) * sizeof(char*));
+    if(!envp) return 0;
+    nb = 0;
+    for(char **env = environ; *env; env++) {
+        /* left over from an upgrade of our own */
+        if(!strncmp(*env, UPGRADE_ENV "=", sizeof(UPGRADE_ENV))) continue;
+        envp[nb++] = *env;
+    }
+    envp[nb++] = CHANNEL_ENV;
+    envp[nb] = 0;
+    return envp;
+}
+
+/* sends `fds` along with their count over `sock` */
+static int send_fds(int sock, const int *fds, int nb_fds) {
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)] = {0};
+    struct iovec iov = {.iov_base = &nb_fds, .iov_len = sizeof(nb_fds)};
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nb_fds);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg) return -1;
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nb_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nb_fds);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+int upgrade_exec(char *const argv[], const int *fds, int nb_fds) {
+    int channel[2];
+    char ready = 0;
+    struct pollfd pollfd;
+    char **envp;
+    pid_t pid;
+
+    if(nb_fds < 1 || nb_fds > UPGRADE_MAX_FDS) return -1;
+
+    /* the threads may hold the malloc or environ locks at the fork, the
+     * child can't take them, it only makes system calls */
+    envp = channel_environ();
+    if(!envp) {
+        logging(ERR, "no memory for the environment of the new process");
+        return -1;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel)) {
+        logging_errno(ERR, "socketpair: ");
+        free(envp);
+        return -1;
+    }
+
+    pid = fork();
+    if(pid == -1) {
+        logging_errno(ERR, "fork: ");
+        free(envp);
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+    if(pid == 0) {
+        /* the new process only gets what is handed to it explicitly */
+        if(channel[1] == 3) {
+            /* dup2 onto itself would leave FD_CLOEXEC set */
+            if(fcntl(3, F_SETFD, 0) == -1) _exit(127);
+        }
+        else if(dup2(channel[1], 3) == -1) _exit(127);
+        close_range(4, ~0U, 0);
+        execvpe(argv[0], argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(channel[1]);
+
+    if(send_fds(channel[0], fds, nb_fds)) {
+        logging_errno(ERR, "unable to hand over the listeners: ");
+        goto failure;
+    }
+
+    pollfd.fd = channel[0];
+    pollfd.events = POLLIN;
+    if(poll(&pollfd, 1, UPGRADE_READY_TIMEOUT * 1000) != 1
+            || read(channel[0], &ready, 1) != 1
+            || ready != 1) {
+        logging(ERR, "process %d did not take over the listeners", pid);
+        goto failure;
+    }
+    close(channel[0]);
+    logging(INFO, "process %d took over the listeners", pid);
+    return 0;
+
+failure:
+    close(channel[0]);
+    /* the new process may have exited already or be stuck, don't leave it
+     * half started next to us */
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+    return -1;
+}
+
+int upgrade_inherit(int *fds, int max_fds) {
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)] = {0};
+    int nb_fds = 0;
+    struct iovec iov = {.iov_base = &nb_fds, .iov_len = sizeof(nb_fds)};
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    const char *env = getenv(UPGRADE_ENV);
+    char *end;
+
+    if(!env) return 0;
+    PARENT_FD = strtol(env, &end, 10);
+    unsetenv(UPGRADE_ENV);
+    if(*end || PARENT_FD < 0) {
+        PARENT_FD = -1;
+        return -1;
+    }
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if(recvmsg(PARENT_FD, &msg, MSG_CMSG_CLOEXEC) != sizeof(nb_fds)) {
+        logging_errno(ERR, "unable to receive the listeners: ");
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || nb_fds < 1 || nb_fds > UPGRADE_MAX_FDS
+            || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * nb_fds)) {
+        logging(ERR, "malformed listener hand over");
+        return -1;
+    }
+    if(nb_fds > max_fds) nb_fds = max_fds;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nb_fds);
+    return nb_fds;
+}
+
+void upgrade_ready(void) {
+    char ready = 1;
+    if(PARENT_FD == -1) return;
+    if(write(PARENT_FD, &ready, 1) != 1) {
+        logging_errno(WARN, "unable to notify the previous process: ");
+    }
+    close(PARENT_FD);
+    PARENT_FD = -1;
+}
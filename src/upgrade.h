@@ -0,0 +1,26 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H 1
+
+/* environment variable holding the fd of the channel to the old process */
+#define UPGRADE_ENV "SV_UPGRADE_FD"
+
+/* most listeners handed over at once */
+#define UPGRADE_MAX_FDS 16
+
+/* seconds the new process has to report it is serving */
+#define UPGRADE_READY_TIMEOUT 30
+
+/* Starts `argv` as a new process and hands it the listening sockets `fds`.
+ * Returns once the new process reported it is accepting on them.
+ * Returns: 0 on success, -1 if the new process failed to take over */
+int upgrade_exec(char *const argv[], const int *fds, int nb_fds);
+
+/* Receives the listeners handed over by the process being upgraded, if any
+ * Returns: the number of fds written into `fds`, 0 on a fresh start
+ *  -1 on error */
+int upgrade_inherit(int *fds, int max_fds);
+
+/* tells the old process that the listeners were taken over */
+void upgrade_ready(void);
+
+#endif
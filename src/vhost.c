@@ -0,0 +1,154 @@
+#include "vhost.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "logging.h"
+
+/* FNV-1a over the lower case bytes */
+static uint64_t name_hash(const char *name, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)tolower((unsigned char)name[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/* Returns: 1 if `name` can be a host name or a wildcard over one */
+static int name_valid(const char *name, size_t len) {
+    if(!len || len > VHOST_NAME_MAX) return 0;
+    if(len > 2 && name[0] == '*' && name[1] == '.') {
+        name += 2;
+        len -= 2;
+    }
+    for(size_t i = 0; i < len; i++) {
+        if(!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '.') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int vhost_add_names(struct vhost *vhost, const char *value) {
+    while(*value) {
+        size_t len = strcspn(value, " \t");
+        char *names;
+
+        if(!len) {
+            value++;
+            continue;
+        }
+        if(!name_valid(value, len)) return -1;
+        names = realloc(vhost->names, vhost->names_len + len + 1);
+        if(!names) return -1;
+        vhost->names = names;
+        for(size_t i = 0; i < len; i++) {
+            names[vhost->names_len + i] = tolower((unsigned char)value[i]);
+        }
+        names[vhost->names_len + len] = '\0';
+        vhost->names_len += len + 1;
+        vhost->nb_names++;
+        value += len;
+    }
+    return 0;
+}
+
+/* Returns: the slot holding `name`, or the empty one it would go in */
+static struct vhost_slot *table_probe(
+        const struct vhost_table *table,
+        const char *name,
+        size_t len) {
+    size_t i = name_hash(name, len) & table->mask;
+
+    for(;;) {
+        struct vhost_slot *slot = table->slots + i;
+        if(!slot->name) return slot;
+        if(slot->name_len == len && !strncasecmp(slot->name, name, len)) return slot;
+        i = (i + 1) & table->mask;
+    }
+}
+
+int vhost_table_build(
+        struct vhost_table *table,
+        const struct vhost *vhosts,
+        size_t nb_vhosts) {
+    size_t nb_names = 0;
+    size_t size = 8;
+
+    memset(table, 0, sizeof(*table));
+    for(size_t i = 0; i < nb_vhosts; i++) nb_names += vhosts[i].nb_names;
+    /* at most half full, probes stay short */
+    while(size < nb_names * 2) size *= 2;
+    table->slots = calloc(size, sizeof(*table->slots));
+    if(!table->slots) return -1;
+    table->mask = size - 1;
+
+    for(size_t i = 0; i < nb_vhosts; i++) {
+        const char *name = vhosts[i].names;
+        for(size_t j = 0; j < vhosts[i].nb_names; j++, name += strlen(name) + 1) {
+            size_t len = strlen(name);
+            struct vhost_slot *slot = table_probe(table, name, len);
+
+            if(slot->name) {
+                logging(ERR, "`%s` is the name of two vhosts", name);
+                vhost_table_cleanup(table);
+                return -1;
+            }
+            slot->name = name;
+            slot->name_len = len;
+            slot->vhost = vhosts + i;
+        }
+    }
+    return 0;
+}
+
+const struct vhost *vhost_lookup(
+        const struct vhost_table *table,
+        const char *host,
+        size_t host_len) {
+    char wildcard[VHOST_NAME_MAX + 1];
+    const struct vhost_slot *slot;
+    const char *dot;
+    size_t len;
+
+    if(!table->slots || !host_len) return 0;
+    /* `[::1]:443` keeps its brackets, ports go */
+    if(host[0] == '[') {
+        const char *end = memchr(host, ']', host_len);
+        len = end ? (size_t)(end - host) + 1 : host_len;
+    }
+    else {
+        const char *colon = memchr(host, ':', host_len);
+        len = colon ? (size_t)(colon - host) : host_len;
+    }
+    if(len && host[len - 1] == '.') len--;
+    if(!len || len > VHOST_NAME_MAX) return 0;
+
+    slot = table_probe(table, host, len);
+    if(slot->name) return slot->vhost;
+
+    /* `a.example.com` -> `*.example.com` */
+    dot = memchr(host, '.', len);
+    if(!dot) return 0;
+    wildcard[0] = '*';
+    memcpy(wildcard + 1, dot, len - (dot - host));
+    slot = table_probe(table, wildcard, len - (dot - host) + 1);
+    return slot->name ? slot->vhost : 0;
+}
+
+void vhost_table_cleanup(struct vhost_table *table) {
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+void vhost_cleanup(struct vhost *vhost) {
+    free(vhost->names);
+    free(vhost->base_dir);
+    free(vhost->pem_file);
+    if(vhost->ctx) SSL_CTX_free(vhost->ctx);
+    memset(vhost, 0, sizeof(*vhost));
+}
@@ -0,0 +1,69 @@
+#ifndef VHOST_H
+#define VHOST_H 1
+
+#include <stddef.h>
+#include <time.h>
+#include <openssl/ssl.h>
+
+/* the longest host name, as DNS allows */
+#define VHOST_NAME_MAX 253
+
+/* a `[vhost]` section of the config */
+struct vhost {
+    /* the host names it answers one after the other, each ending with a
+     * NUL, lower case and without a port. `*.example.com` answers every
+     * name directly under example.com */
+    char *names;
+    size_t names_len;
+    size_t nb_names;
+    char *base_dir;
+    size_t base_dir_len;
+    int autoindex;
+    /* served to the clients asking for one of `names` through SNI, the
+     * top level certificate when unset */
+    char *pem_file;
+    /* loaded by main, 0 until then */
+    SSL_CTX *ctx;
+    /* mtime of `pem_file` when `ctx` was loaded */
+    struct timespec pem_mtime;
+};
+
+struct vhost_slot {
+    const char *name;
+    size_t name_len;
+    const struct vhost *vhost;
+};
+
+/* open addressing over every name of every vhost */
+struct vhost_table {
+    struct vhost_slot *slots;
+    /* a power of 2 minus one */
+    size_t mask;
+};
+
+/* Adds the space separated names of `value` to `vhost`
+ * Returns: 0 on success, -1 on error or if a name is malformed */
+int vhost_add_names(struct vhost *vhost, const char *value);
+
+/* Indexes the names of the `nb_vhosts` vhosts, they must not move while the
+ * table is in use
+ * Returns: 0 on success, -1 on error or if two vhosts share a name, the
+ *  name is logged */
+int vhost_table_build(
+        struct vhost_table *table,
+        const struct vhost *vhosts,
+        size_t nb_vhosts);
+
+/* Finds the vhost of `host`, a Host header or an SNI name: the port and a
+ * trailing dot are ignored, case too. An exact name wins over a wildcard.
+ * Returns: the vhost, 0 if none answers `host` */
+const struct vhost *vhost_lookup(
+        const struct vhost_table *table,
+        const char *host,
+        size_t host_len);
+
+void vhost_table_cleanup(struct vhost_table *table);
+
+void vhost_cleanup(struct vhost *vhost);
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_TSC 1
+#else
+#define HAS_TSC 0
+#endif
+
+/* samples taken for each benchmark once it is warmed up */
+#define BENCH_REPS 15
+
+/* a sample runs for at least this long, the iterations are doubled until
+ * it does */
+#define BENCH_SAMPLE_NS 10000000ull
+
+/* a median slower than the baseline by more than this is reported */
+#define BENCH_SLOWER 0.10
+
+#define BENCH_NAME_SIZE 64
+
+/* allocations made by the process, counted by the `malloc` below */
+static uint64_t ALLOCS = 0;
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+/* these take the place of glibc's for the whole process, OpenSSL and
+ * libmagic included */
+void *malloc(size_t size) {
+    ALLOCS++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    ALLOCS++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    ALLOCS++;
+    return __libc_realloc(ptr, size);
+}
+
+struct bench {
+    /* times the benchmark has to repeat its operation */
+    uint64_t iterations;
+    /* measured between `bench_start` and `bench_stop` */
+    uint64_t ns;
+    uint64_t cycles;
+    uint64_t allocs;
+    /* set by the benchmark when its setup failed */
+    const char *error;
+    struct timespec start_time;
+    uint64_t start_cycles;
+    uint64_t start_allocs;
+};
+
+struct bench_stats {
+    double median;
+    double stddev;
+    double cycles;
+    double allocs;
+};
+
+struct baseline {
+    char name[BENCH_NAME_SIZE];
+    double median;
+};
+
+static inline uint64_t cycles_now(void) {
+#if HAS_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* starts measuring, the setup of a benchmark goes before it */
+static inline void bench_start(struct bench *b) {
+    b->start_allocs = ALLOCS;
+    clock_gettime(CLOCK_MONOTONIC, &b->start_time);
+    b->start_cycles = cycles_now();
+}
+
+/* stops measuring, the teardown of a benchmark goes after it */
+static inline void bench_stop(struct bench *b) {
+    struct timespec end;
+    uint64_t cycles = cycles_now();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    b->cycles += cycles - b->start_cycles;
+    b->ns += (end.tv_sec - b->start_time.tv_sec) * 1000000000ull
+        + end.tv_nsec - b->start_time.tv_nsec;
+    b->allocs += ALLOCS - b->start_allocs;
+}
+
+/* keeps the compiler from dropping a result nobody reads */
+static inline void bench_keep(const void *ptr) {
+    __asm__ volatile("" : : "g"(ptr) : "memory");
+}
+
+#include "benches.c"
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Warms `fn` up while finding how many iterations fill a sample, then
+ * takes BENCH_REPS samples
+ * Returns: 0 on success, -1 if the benchmark failed */
+static int bench_run(void (*fn)(struct bench*), struct bench_stats *stats) {
+    double ns[BENCH_REPS];
+    double cycles[BENCH_REPS];
+    double mean = 0;
+    double var = 0;
+    uint64_t iterations = 1;
+
+    for(;;) {
+        struct bench b = {.iterations = iterations};
+        fn(&b);
+        if(b.error) {
+            fprintf(stderr, "%s\n", b.error);
+            return -1;
+        }
+        if(b.ns >= BENCH_SAMPLE_NS || iterations >= (1ull << 40)) break;
+        iterations *= 2;
+    }
+
+    for(int i = 0; i < BENCH_REPS; i++) {
+        struct bench b = {.iterations = iterations};
+        fn(&b);
+        if(b.error) {
+            fprintf(stderr, "%s\n", b.error);
+            return -1;
+        }
+        ns[i] = (double)b.ns / iterations;
+        cycles[i] = (double)b.cycles / iterations;
+        /* the same for every sample unless something is cached on the way */
+        if(!i || (double)b.allocs / iterations < stats->allocs) {
+            stats->allocs = (double)b.allocs / iterations;
+        }
+        mean += ns[i];
+    }
+    mean /= BENCH_REPS;
+    for(int i = 0; i < BENCH_REPS; i++) {
+        var += (ns[i] - mean) * (ns[i] - mean);
+    }
+
+    qsort(ns, BENCH_REPS, sizeof(double), cmp_double);
+    qsort(cycles, BENCH_REPS, sizeof(double), cmp_double);
+    stats->median = ns[BENCH_REPS / 2];
+    stats->stddev = sqrt(var / (BENCH_REPS - 1));
+    stats->cycles = cycles[BENCH_REPS / 2];
+    return 0;
+}
+
+/* Reads the `<name> <median ns>` lines of `path` into `baselines`
+ * Returns: the number of lines read, 0 if there is no baseline */
+static size_t baseline_load(const char *path, struct baseline *baselines, size_t max) {
+    FILE *f = fopen(path, "r");
+    size_t nb = 0;
+
+    if(!f) return 0;
+    while(nb < max && fscanf(f, "%63s %lf", baselines[nb].name, &baselines[nb].median) == 2) {
+        nb++;
+    }
+    fclose(f);
+    return nb;
+}
+
+#define MAX_BENCHES 64
+
+#define RUN_BENCH(fn) \
+    failed += print_bench(fn, #fn, baselines, nb_baselines, save, &slower);
+
+static int print_bench(
+        void (*fn)(struct bench*),
+        const char *name,
+        const struct baseline *baselines,
+        size_t nb_baselines,
+        FILE *save,
+        int *slower) {
+    struct bench_stats stats;
+
+    printf("%-32s ", name);
+    fflush(stdout);
+    if(bench_run(fn, &stats)) {
+        printf("[FAIL]\n");
+        return 1;
+    }
+    printf("%10.1f ns/op  ±%5.1f%%  %8.0f cycles/op  %6.2f allocs/op",
+            stats.median,
+            100 * stats.stddev / stats.median,
+            stats.cycles,
+            stats.allocs);
+    for(size_t i = 0; i < nb_baselines; i++) {
+        if(strcmp(baselines[i].name, name)) continue;
+        double delta = (stats.median - baselines[i].median) / baselines[i].median;
+        printf("  %+6.1f%%", 100 * delta);
+        /* past the noise of this run too */
+        if(delta > BENCH_SLOWER && stats.median - baselines[i].median > 3 * stats.stddev) {
+            printf(" [SLOWER]");
+            (*slower)++;
+        }
+    }
+    printf("\n");
+    if(save) fprintf(save, "%s %.1f\n", name, stats.median);
+    return 0;
+}
+
+int main(int argc, const char **argv) {
+    struct baseline baselines[MAX_BENCHES];
+    size_t nb_baselines = 0;
+    FILE *save = 0;
+    int failed = 0;
+    int slower = 0;
+
+    if(argc == 3 && !strcmp(argv[1], "--save")) {
+        save = fopen(argv[2], "w");
+        if(!save) {
+            perror(argv[2]);
+            return 1;
+        }
+    }
+    else if(argc == 2) {
+        nb_baselines = baseline_load(argv[1], baselines, MAX_BENCHES);
+    }
+    else if(argc != 1) {
+        fprintf(stderr, "Usage: %s [baseline | --save baseline]\n", argv[0]);
+        return 1;
+    }
+    if(!HAS_TSC) puts("no cycle counter on this machine, cycles/op are 0");
+    puts("RUNNING BENCHMARKS\n");
+    /* ADD BENCHMARKS HERE */
+    RUN_BENCH(bench_request_header_parse);
+    RUN_BENCH(bench_response_header_write);
+    RUN_BENCH(bench_mime_get);
+    RUN_BENCH(bench_mime_get_css);
+    RUN_BENCH(bench_resolve_path);
+    RUN_BENCH(bench_resolve_path_index);
+    RUN_BENCH(bench_ssl_writev);
+    RUN_BENCH(bench_handle_conn_plain);
+    RUN_BENCH(bench_handle_conn_tls);
+
+    /* END OF BENCHMARKS */
+    if(save) fclose(save);
+    printf("REPORT:\n\tfailed: %d\tslower than the baseline: %d\n", failed, slower);
+    return failed;
+}
@@ -0,0 +1,394 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/ssl.h>
+
+#include "../src/headers.h"
+#include "../src/response_header.h"
+#include "../src/mime.h"
+#include "../src/resolve.h"
+#include "../src/conn.h"
+#include "../src/config.h"
+#include "../src/handler.h"
+#include "../src/mem_conn.h"
+
+/* certificate and key the TLS benchmarks serve with */
+#define BENCH_PEM "cert0.pem"
+
+static const char REQUEST[] = (
+    "GET /sub/index.html HTTP/1.1\r\n"
+    "Host: localhost:9092\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-CA,en-US;q=0.7,en;q=0.3\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+);
+
+static const char PAGE[] = (
+    "<!DOCTYPE html>\n"
+    "<html><head><title>bench</title></head><body>hello</body></html>\n"
+);
+
+/* a site shared by the file system benchmarks, removed at exit */
+static char SITE[] = "/tmp/sv-bench-XXXXXX";
+
+static void site_remove(void) {
+    char path[sizeof(SITE) + 32];
+    const char *files[] = {"index.html", "style.css", "sub/index.html", "page", "sub"};
+
+    for(size_t i = 0; i < sizeof(files) / sizeof(*files); i++) {
+        snprintf(path, sizeof(path), "%s/%s", SITE, files[i]);
+        if(unlink(path) == -1) rmdir(path);
+    }
+    rmdir(SITE);
+}
+
+static int site_file(const char *name) {
+    char path[sizeof(SITE) + 32];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", SITE, name);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) return -1;
+    if(write(fd, PAGE, sizeof(PAGE) - 1) != sizeof(PAGE) - 1) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Returns: the path of the site, 0 if it could not be made */
+static const char *site_get(void) {
+    static int made = 0;
+    char path[sizeof(SITE) + 32];
+
+    if(made) return SITE;
+    if(!mkdtemp(SITE)) return 0;
+    atexit(site_remove);
+    snprintf(path, sizeof(path), "%s/sub", SITE);
+    if(mkdir(path, 0755) == -1
+            || site_file("index.html")
+            || site_file("style.css")
+            || site_file("sub/index.html")
+            || site_file("page")) {
+        return 0;
+    }
+    made = 1;
+    return SITE;
+}
+
+void bench_request_header_parse(struct bench *b) {
+    char buff[sizeof(REQUEST)];
+
+    bench_start(b);
+    for(uint64_t i = 0; i < b->iterations; i++) {
+        struct request_header request = {0};
+        /* the parser cuts the buffer up in place */
+        memcpy(buff, REQUEST, sizeof(REQUEST));
+        request_header_parse(&request, buff, sizeof(REQUEST) - 1);
+        bench_keep(request.file);
+    }
+    bench_stop(b);
+}
+
+void bench_response_header_write(struct bench *b) {
+    char buff[HEADER_BUFF_SIZE];
+
+    bench_start(b);
+    for(uint64_t i = 0; i < b->iterations; i++) {
+        struct response_header response = {0};
+        struct iovec vec = {.iov_base = buff, .iov_len = sizeof(buff)};
+        response.status_code = 200;
+        response.reason = "OK";
+        response.content_type = "text/html";
+        response_header_write(&response, &vec);
+        bench_keep(buff);
+    }
+    bench_stop(b);
+}
+
+static void bench_mime(struct bench *b, const char *name) {
+    const char *site = site_get();
+    char path[sizeof(SITE) + 32];
+    int fd;
+
+    if(!site || mime_init()) {
+        b->error = "unable to set up the site or the MIME DB";
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", site, name);
+    fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        b->error = "unable to open the page";
+        mime_cleanup();
+        return;
+    }
+
+    bench_start(b);
+    for(uint64_t i = 0; i < b->iterations; i++) {
+        bench_keep(mime_get(path, fd));
+    }
+    bench_stop(b);
+
+    close(fd);
+    mime_cleanup();
+}
+
+/* a file libmagic has to look into */
+void bench_mime_get(struct bench *b) {
+    bench_mime(b, "page");
+}
+
+/* the extension shortcut */
+void bench_mime_get_css(struct bench *b) {
+    bench_mime(b, "style.css");
+}
+
+static void bench_resolve(struct bench *b, const char *target) {
+    const char *site = site_get();
+    char out[4096];
+    struct stat st;
+    int fd;
+
+    if(!site) {
+        b->error = "unable to set up the site";
+        return;
+    }
+
+    bench_start(b);
+    for(uint64_t i = 0; i < b->iterations; i++) {
+        fd = -1;
+        resolve_path(site, strlen(site), target, out, sizeof(out), &fd, &st);
+        if(fd != -1) close(fd);
+    }
+    bench_stop(b);
+}
+
+/* a percent-encoded file with a query string */
+void bench_resolve_path(struct bench *b) {
+    bench_resolve(b, "sub/%69ndex.html?v=3");
+}
+
+/* a directory falling back on its index.html */
+void bench_resolve_path_index(struct bench *b) {
+    bench_resolve(b, "sub/");
+}
+
+/* a response written to a TLS connection whose records land in memory */
+void bench_ssl_writev(struct bench *b) {
+    SSL_CTX *server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL *server = 0;
+    SSL *client = 0;
+    BIO *to_server = BIO_new(BIO_s_mem());
+    BIO *to_client = BIO_new(BIO_s_mem());
+    char header[HEADER_BUFF_SIZE];
+    struct iovec iov[2];
+
+    if(!server_ctx || !client_ctx || !to_server || !to_client
+            || SSL_CTX_use_certificate_chain_file(server_ctx, BENCH_PEM) != 1
+            || SSL_CTX_use_PrivateKey_file(server_ctx, BENCH_PEM, SSL_FILETYPE_PEM) != 1) {
+        b->error = "unable to load " BENCH_PEM ", run from the root of the repo";
+        BIO_free(to_server);
+        BIO_free(to_client);
+        goto cleanup;
+    }
+    server = SSL_new(server_ctx);
+    client = SSL_new(client_ctx);
+    /* each SSL owns the BIO it reads from */
+    BIO_up_ref(to_server);
+    BIO_up_ref(to_client);
+    SSL_set_bio(server, to_server, to_client);
+    SSL_set_bio(client, to_client, to_server);
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+
+    for(int i = 0; i < 16 && !(SSL_is_init_finished(server) && SSL_is_init_finished(client)); i++) {
+        SSL_do_handshake(client);
+        SSL_do_handshake(server);
+    }
+    if(!SSL_is_init_finished(server)) {
+        b->error = "the TLS handshake did not finish";
+        goto cleanup;
+    }
+    /* session tickets and the like */
+    BIO_reset(to_client);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = snprintf(header, sizeof(header),
+            "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n",
+            sizeof(PAGE) - 1);
+    iov[1].iov_base = (void*)PAGE;
+    iov[1].iov_len = sizeof(PAGE) - 1;
+
+    bench_start(b);
+    for(uint64_t i = 0; i < b->iterations; i++) {
+        SSL_writev(server, iov, 2);
+        BIO_reset(to_client);
+    }
+    bench_stop(b);
+
+cleanup:
+    SSL_free(server);
+    SSL_free(client);
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+}
+
+/* the other end of the in-memory connections, the response is dropped */
+struct bench_client {
+    const char *request;
+    size_t request_len;
+    SSL *ssl;
+    BIO *rbio;
+    BIO *wbio;
+};
+
+static int bench_client_plain(struct mem_pipe *pipe, void *ctx) {
+    struct bench_client *client = ctx;
+    size_t moved = pipe->out.len - pipe->out.off;
+    size_t len;
+
+    pipe->out.len = pipe->out.off = 0;
+    len = mem_buf_put(&pipe->in, client->request, client->request_len);
+    client->request += len;
+    client->request_len -= len;
+    return moved + len ? 0 : -1;
+}
+
+static int bench_client_tls(struct mem_pipe *pipe, void *ctx) {
+    struct bench_client *client = ctx;
+    char buff[4096];
+    size_t moved = 0;
+    size_t len;
+    int ret;
+
+    while((len = mem_buf_take(&pipe->out, buff, sizeof(buff)))) {
+        BIO_write(client->rbio, buff, len);
+        moved += len;
+    }
+    if(client->request_len
+            && SSL_write(client->ssl, client->request, client->request_len) > 0) {
+        client->request_len = 0;
+    }
+    while(SSL_read(client->ssl, buff, sizeof(buff)) > 0);
+    while((len = MEM_BUF_SIZE - (pipe->in.len - pipe->in.off))
+            && (ret = BIO_read(client->wbio, buff, len < sizeof(buff) ? len : sizeof(buff))) > 0) {
+        mem_buf_put(&pipe->in, buff, ret);
+        moved += ret;
+    }
+    return moved ? 0 : -1;
+}
+
+/* Publishes a config serving the benchmark site
+ * Returns: 0 on success, -1 on error */
+static int bench_config(struct bench *b) {
+    const char *site = site_get();
+    char text[256];
+    FILE *f;
+    int ret;
+
+    if(!site || mime_init()) {
+        b->error = "unable to set up the site or the MIME DB";
+        return -1;
+    }
+    snprintf(text, sizeof(text),
+            "https_port = 9092\npem_file = \"" BENCH_PEM "\"\nbase_dir = \"%s\"\n",
+            site);
+    f = fmemopen(text, strlen(text), "r");
+    if(!f) {
+        b->error = "unable to read the config";
+        mime_cleanup();
+        return -1;
+    }
+    ret = load_config(f);
+    fclose(f);
+    if(ret) {
+        b->error = "unable to load the config";
+        mime_cleanup();
+        return -1;
+    }
+    return 0;
+}
+
+/* a whole plain text connection, from the request to the cleanup */
+void bench_handle_conn_plain(struct bench *b) {
+    struct mem_pipe *pipe = calloc(1, sizeof(struct mem_pipe));
+
+    if(!pipe || bench_config(b)) {
+        if(!b->error) b->error = "unable to allocate the pipe";
+        free(pipe);
+        return;
+    }
+    pipe->client = bench_client_plain;
+
+    bench_start(b);
+    for(uint64_t i = 0; i < b->iterations; i++) {
+        struct bench_client client = {
+            .request = REQUEST,
+            .request_len = sizeof(REQUEST) - 1,
+        };
+        struct conn conn = {0};
+        mem_pipe_reset(pipe);
+        pipe->ctx = &client;
+        conn_new_mem(pipe, &conn);
+        handle_conn(conn);
+    }
+    bench_stop(b);
+
+    cleanup_config();
+    mime_cleanup();
+    free(pipe);
+}
+
+/* the same over TLS, the handshake included */
+void bench_handle_conn_tls(struct bench *b) {
+    struct mem_pipe *pipe = calloc(1, sizeof(struct mem_pipe));
+    SSL_CTX *server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+
+    if(!pipe || !server_ctx || !client_ctx
+            || SSL_CTX_use_certificate_chain_file(server_ctx, BENCH_PEM) != 1
+            || SSL_CTX_use_PrivateKey_file(server_ctx, BENCH_PEM, SSL_FILETYPE_PEM) != 1) {
+        b->error = "unable to load " BENCH_PEM ", run from the root of the repo";
+        goto cleanup;
+    }
+    if(bench_config(b)) goto cleanup;
+    pipe->client = bench_client_tls;
+
+    bench_start(b);
+    for(uint64_t i = 0; i < b->iterations; i++) {
+        struct bench_client client = {
+            .request = REQUEST,
+            .request_len = sizeof(REQUEST) - 1,
+            .ssl = SSL_new(client_ctx),
+            .rbio = BIO_new(BIO_s_mem()),
+            .wbio = BIO_new(BIO_s_mem()),
+        };
+        SSL *server = SSL_new(server_ctx);
+        BIO *bio = mem_pipe_bio(pipe);
+        struct conn conn = {0};
+
+        SSL_set_bio(client.ssl, client.rbio, client.wbio);
+        SSL_set_connect_state(client.ssl);
+        SSL_set_bio(server, bio, bio);
+        mem_pipe_reset(pipe);
+        pipe->ctx = &client;
+        bench_client_tls(pipe, &client);
+        conn_new_ssl(server, &conn);
+        handle_conn(conn);
+        bench_client_tls(pipe, &client);
+        SSL_free(client.ssl);
+    }
+    bench_stop(b);
+
+    cleanup_config();
+    mime_cleanup();
+cleanup:
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    free(pipe);
+}
@@ -43,6 +43,23 @@ int main(int argc, const char **argv) {
     puts("RUNNING TESTS\n");
     /* ADD TESTS HERE */
     RUN_TEST(test_ky_split);
+    RUN_TEST(test_config_parse);
+    RUN_TEST(test_hpack_decode);
+    RUN_TEST(test_pack);
+    RUN_TEST(test_proxy_pool);
+    RUN_TEST(test_fastcgi);
+    RUN_TEST(test_ratelimit);
+    RUN_TEST(test_handle_conn);
+    RUN_TEST(test_resolve);
+    RUN_TEST(test_pathfilter);
+    RUN_TEST(test_router);
+    RUN_TEST(test_vhost);
+    RUN_TEST(test_cache_rule);
+    RUN_TEST(test_handshake);
+    RUN_TEST(test_egress);
+    RUN_TEST(test_overload);
+    RUN_TEST(test_fspool);
+    RUN_TEST(test_idle_memory);
 
     /* END OF TESTS */
     printf("REPORT:\n\tfailed: %d\tpassed: %d\n", failed, TOTAL_TESTS-failed);
@@ -2,6 +2,36 @@
 #include "test_assert.h"
 
 #include "../src/config.c"
+#include "../src/hpack.h"
+#include "../src/proxy.h"
+#include "../src/fcgi.h"
+#include "../src/ratelimit.h"
+#include "../src/handler.h"
+#include "../src/mem_conn.h"
+#include "../src/mime.h"
+#include "../src/pathfilter.h"
+#include "../src/router.h"
+#include "../src/vhost.h"
+#include "../src/handshake.h"
+#include "../src/bufpool.h"
+#include "../src/egress.h"
+#include "../src/overload.h"
+#include "../src/fspool.h"
+#include "../src/resolve.h"
+#include "../src/autoindex.h"
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <malloc.h>
+#include <openssl/ssl.h>
 
 void test_ky_split(void) {
     {
@@ -25,3 +55,1899 @@ void test_ky_split(void) {
     }
 cleanup:;
 }
+
+void test_config_parse(void) {
+    char text[] =
+        "# comment\n"
+        "https_port = 9092\n"
+        "pem_file = \"cert0.pem\"\n"
+        "base_dir = \"./site\"\n"
+        "autoindex = yes\n";
+    FILE *f = fmemopen(text, sizeof(text) - 1, "r");
+    struct config *config = config_parse(f);
+    fclose(f);
+    assert(config);
+    assert(config->https_port == 9092);
+    assert(config->http_port == -1);
+    assert(!strcmp(config->pem_file, "cert0.pem"));
+    assert(!strcmp(config->base_dir, "./site"));
+    assert(config->base_dir_len == 6);
+    assert(config->autoindex == 1);
+    assert(config->refs == 1);
+
+    char dup[] = "https_port = 1\nhttps_port = 2\n";
+    f = fmemopen(dup, sizeof(dup) - 1, "r");
+    struct config *rejected = config_parse(f);
+    fclose(f);
+    assert(!rejected);
+    assert(get_config_err());
+cleanup:
+    config_put(config);
+}
+
+static int collect_header(
+        void *ctx,
+        const char *name,
+        size_t name_len,
+        const char *value,
+        size_t value_len) {
+    char *out = ctx;
+    size_t len = strlen(out);
+    snprintf(out + len, 256 - len, "%.*s: %.*s\n",
+            (int)name_len, name, (int)value_len, value);
+    return 0;
+}
+
+void test_hpack_decode(void) {
+    /* RFC 7541 C.4, requests with huffman coding sharing a dynamic table */
+    const uint8_t first[] = {
+        0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a,
+        0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff,
+    };
+    const uint8_t second[] = {
+        0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c,
+        0xbf,
+    };
+    /* the padding of `www.example.com` is not all ones */
+    const uint8_t bad_padding[] = {
+        0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab,
+        0x90, 0xf4, 0xfe,
+    };
+    /* a table of 100 bytes, filled with two entries of 40, then a third
+     * named after the oldest one, read back */
+    const uint8_t evicting[] = {
+        0x3f, 0x45,
+        0x40, 0x04, 'a', 'a', 'a', 'a', 0x04, 'b', 'b', 'b', 'b',
+        0x40, 0x04, 'c', 'c', 'c', 'c', 0x04, 'd', 'd', 'd', 'd',
+        0x7f, 0x00, 0x14, 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e',
+            'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e',
+        0xbe,
+    };
+    struct hpack_table table;
+    char out[256] = {0};
+
+    hpack_table_init(&table);
+    assert(!hpack_decode(&table, first, sizeof(first), collect_header, out));
+    assert(!strcmp(out,
+                ":method: GET\n"
+                ":scheme: http\n"
+                ":path: /\n"
+                ":authority: www.example.com\n"));
+    assert(table.len == 1 && table.size == 57);
+
+    out[0] = '\0';
+    assert(!hpack_decode(&table, second, sizeof(second), collect_header, out));
+    assert(!strcmp(out,
+                ":method: GET\n"
+                ":scheme: http\n"
+                ":path: /\n"
+                ":authority: www.example.com\n"
+                "cache-control: no-cache\n"));
+    assert(table.len == 2 && table.size == 110);
+
+    out[0] = '\0';
+    assert(hpack_decode(&table, bad_padding, sizeof(bad_padding), collect_header, out));
+
+    /* the name of the new entry is the one of the entry it evicts */
+    hpack_table_cleanup(&table);
+    hpack_table_init(&table);
+    out[0] = '\0';
+    assert(!hpack_decode(&table, evicting, sizeof(evicting), collect_header, out));
+    assert(!strcmp(out,
+                "aaaa: bbbb\n"
+                "cccc: dddd\n"
+                "aaaa: eeeeeeeeeeeeeeeeeeee\n"
+                "aaaa: eeeeeeeeeeeeeeeeeeee\n"));
+    assert(table.len == 2 && table.size == 96);
+cleanup:
+    hpack_table_cleanup(&table);
+}
+
+/* answers two requests, the first one with a length and the second one
+ * chunked, exits with the number of connections it took */
+static int stand_in_backend(int listener) {
+    const char *responses[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello",
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+            "5\r\nworld\r\n0\r\n\r\n",
+    };
+    int nb_conns = 0;
+    int served = 0;
+
+    while(served < 2) {
+        char buff[4096];
+        size_t len = 0;
+        int fd = accept(listener, 0, 0);
+        if(fd == -1) return 255;
+        nb_conns++;
+        for(;;) {
+            ssize_t ret = read(fd, buff + len, sizeof(buff) - len - 1);
+            if(ret <= 0) break;
+            len += ret;
+            buff[len] = '\0';
+            if(!strstr(buff, "\r\n\r\n")) continue;
+            /* hop-by-hop headers from the client are not forwarded */
+            if(strstr(buff, "close")) return 254;
+            write(fd, responses[served], strlen(responses[served]));
+            len = 0;
+            if(++served == 2) break;
+        }
+        close(fd);
+    }
+    return nb_conns;
+}
+
+void test_proxy_pool(void) {
+    static const char *const bad_lengths[] = {
+        "Content-Length: 4x",
+        "Content-Length: -4",
+        "Content-Length: +4",
+        "Content-Length: 4, 4",
+        "Content-Length: ",
+        "Content-Length: 18446744073709551616",
+        "Content-Length: 4\r\nContent-Length: 4",
+        "Content-Length: 4\r\nTransfer-Encoding: chunked",
+        "Transfer-Encoding: gzip",
+        "Transfer-Encoding: chunked",
+    };
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char value[128];
+    char sock_path[64] = {0};
+    struct proxy_route route = {0};
+    int listener = -1;
+    pid_t pid = -1;
+    int status;
+
+    assert(mkdtemp(dir));
+    snprintf(sock_path, sizeof(sock_path), "%s/upstream.sock", dir);
+    snprintf(value, sizeof(value), "/app unix:%s", sock_path);
+    assert(!proxy_route_parse(value, &route));
+    assert(!strcmp(route.prefix, "/app"));
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(listener != -1);
+    assert(!bind(listener, (struct sockaddr*)&route.addr, route.addr_len));
+    assert(!listen(listener, 4));
+    pid = fork();
+    assert(pid != -1);
+    if(!pid) _exit(stand_in_backend(listener));
+    close(listener);
+    listener = -1;
+
+    /* refused before they reach the shared upstream connection, it could
+     * take the rest of the body for another client's request */
+    for(size_t i = 0; i < sizeof(bad_lengths) / sizeof(*bad_lengths); i++) {
+        char buff[4096];
+        char resp[512] = {0};
+        struct conn client;
+        int pair[2];
+
+        snprintf(buff, sizeof(buff),
+                "POST /app/x HTTP/1.1\r\nHost: a\r\n%s\r\n\r\n4321", bad_lengths[i]);
+        assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+        shutdown(pair[1], SHUT_WR);
+        conn_new_fd(pair[0], &client);
+        proxy_serve(&route, &client, 0, buff, strlen(buff), sizeof(buff));
+        close(pair[0]);
+        assert(read(pair[1], resp, sizeof(resp) - 1) > 0);
+        close(pair[1]);
+        assert(!strncmp(resp, "HTTP/1.1 400", 12));
+    }
+
+    for(int i = 0; i < 2; i++) {
+        char buff[4096] = "GET /app/x HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n";
+        char resp[512] = {0};
+        size_t len = 0;
+        ssize_t ret;
+        struct conn client;
+        int pair[2];
+
+        assert(proxy_match(&route, 1, buff, strlen(buff)) == &route);
+        assert(!proxy_match(&route, 1, "GET /apps HTTP/1.1", 18));
+        assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+        conn_new_fd(pair[0], &client);
+        proxy_serve(&route, &client, 0, buff, strlen(buff), sizeof(buff));
+        close(pair[0]);
+        while((ret = read(pair[1], resp + len, sizeof(resp) - len - 1)) > 0) {
+            len += ret;
+        }
+        close(pair[1]);
+        assert(!strncmp(resp, "HTTP/1.1 200 OK", 15));
+        assert(strstr(resp, "Connection: close"));
+        assert(strstr(resp, i ? "5\r\nworld\r\n0\r\n\r\n" : "\r\n\r\nhello"));
+    }
+
+    /* both requests went over the same upstream connection */
+    assert(waitpid(pid, &status, 0) == pid);
+    pid = -1;
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+cleanup:
+    if(pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, 0, 0);
+    }
+    if(listener != -1) close(listener);
+    proxy_cleanup();
+    proxy_route_cleanup(&route);
+    unlink(sock_path);
+    rmdir(dir);
+}
+
+static struct sockaddr_in client_addr(uint32_t ip) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(ip);
+    return addr;
+}
+
+void test_ratelimit(void) {
+    struct ratelimit_limits requests = {.requests = 2, .bytes = 0, .burst = 1};
+    struct ratelimit_limits bytes = {.requests = 0, .bytes = 4096, .burst = 1};
+    struct sockaddr_in first = client_addr(0x0a000001);
+    struct sockaddr_in second = client_addr(0x0a000002);
+    struct sockaddr_in third = client_addr(0x0a000003);
+
+    ratelimit_init();
+
+    assert(ratelimit_take(&requests, (struct sockaddr*)&first));
+    assert(ratelimit_take(&requests, (struct sockaddr*)&first));
+    assert(!ratelimit_take(&requests, (struct sockaddr*)&first));
+    /* buckets are per client */
+    assert(ratelimit_take(&requests, (struct sockaddr*)&second));
+
+    assert(ratelimit_take(&bytes, (struct sockaddr*)&third));
+    ratelimit_charge(&bytes, (struct sockaddr*)&third, 8192);
+    assert(!ratelimit_take(&bytes, (struct sockaddr*)&third));
+
+    /* more clients than slots, the least recently seen make room */
+    for(uint32_t i = 0; i < 100000; i++) {
+        struct sockaddr_in addr = client_addr(0x0b000000 + i);
+        assert(ratelimit_take(&requests, (struct sockaddr*)&addr));
+    }
+cleanup:
+    return;
+}
+
+/* the other end of an in-memory connection, sends `request` and keeps the
+ * response */
+struct mem_client {
+    const char *request;
+    size_t request_len;
+    char response[4096];
+    size_t response_len;
+    /* over TLS, the client's records go through the pipe */
+    SSL *ssl;
+    BIO *rbio;
+    BIO *wbio;
+};
+
+static int mem_client_plain(struct mem_pipe *pipe, void *ctx) {
+    struct mem_client *client = ctx;
+    size_t moved = 0;
+    size_t len;
+
+    while((len = mem_buf_take(
+                    &pipe->out,
+                    client->response + client->response_len,
+                    sizeof(client->response) - client->response_len - 1))) {
+        client->response_len += len;
+        moved += len;
+    }
+    len = mem_buf_put(&pipe->in, client->request, client->request_len);
+    client->request += len;
+    client->request_len -= len;
+    moved += len;
+    return moved ? 0 : -1;
+}
+
+static int mem_client_tls(struct mem_pipe *pipe, void *ctx) {
+    struct mem_client *client = ctx;
+    char buff[4096];
+    size_t moved = 0;
+    size_t len;
+    int ret;
+
+    while((len = mem_buf_take(&pipe->out, buff, sizeof(buff)))) {
+        BIO_write(client->rbio, buff, len);
+        moved += len;
+    }
+    /* fails until the handshake is done */
+    if(client->request_len
+            && SSL_write(client->ssl, client->request, client->request_len) > 0) {
+        client->request_len = 0;
+    }
+    while((ret = SSL_read(
+                    client->ssl,
+                    client->response + client->response_len,
+                    sizeof(client->response) - client->response_len - 1)) > 0) {
+        client->response_len += ret;
+    }
+    while((len = MEM_BUF_SIZE - (pipe->in.len - pipe->in.off))
+            && (ret = BIO_read(client->wbio, buff, MIN(len, sizeof(buff)))) > 0) {
+        mem_buf_put(&pipe->in, buff, ret);
+        moved += ret;
+    }
+    return moved ? 0 : -1;
+}
+
+/* Serves `request` from the client at `peer`, 0 for none, over `pipe` in
+ * plain text, the response is left terminated in `client` */
+static void mem_serve_from(
+        struct mem_pipe *pipe,
+        struct mem_client *client,
+        const char *request,
+        const struct sockaddr_in *peer) {
+    struct conn conn = {0};
+
+    memset(client, 0, sizeof(*client));
+    mem_pipe_reset(pipe);
+    client->request = request;
+    client->request_len = strlen(request);
+    conn_new_mem(pipe, &conn);
+    if(peer) {
+        memcpy(&conn.peer, peer, sizeof(*peer));
+        conn.peer_len = sizeof(*peer);
+    }
+    handle_conn(conn);
+    mem_client_plain(pipe, client);
+    client->response[client->response_len] = 0;
+}
+
+static void mem_serve(struct mem_pipe *pipe, struct mem_client *client, const char *request) {
+    mem_serve_from(pipe, client, request, 0);
+}
+
+void test_handle_conn(void) {
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char path[64] = {0};
+    char page_path[64] = {0};
+    char text[512];
+    const char get[] = "GET /page.txt HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    const char missing[] = "GET /nothing HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    struct sockaddr_in loopback = {.sin_family = AF_INET};
+    struct sockaddr_in remote = {.sin_family = AF_INET};
+    struct mem_pipe *pipe = calloc(1, sizeof(struct mem_pipe));
+    struct mem_client client = {0};
+    struct conn conn = {0};
+    SSL_CTX *server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL *server = 0;
+    BIO *bio;
+    FILE *f;
+    int fd;
+
+    assert(pipe && server_ctx && client_ctx);
+    loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    remote.sin_addr.s_addr = htonl(0xcb007101);
+    assert(mkdtemp(dir));
+    snprintf(path, sizeof(path), "%s/page.txt", dir);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(write(fd, "hello from memory\n", 18) == 18);
+    close(fd);
+    snprintf(page_path, sizeof(page_path), "%s/404.html", dir);
+    fd = open(page_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(write(fd, "gone", 4) == 4);
+    close(fd);
+
+    snprintf(text, sizeof(text),
+            "https_port = 9092\npem_file = \"cert0.pem\"\nbase_dir = \"%s\"\n"
+            "health_path = \"/healthz\"\n"
+            "status_path = \"/_sv\"\n"
+            "status_allow = \"127.0.0.1/8\"\n"
+            "status_allow = \"::1\"\n"
+            "redirect = \"/old /page.txt\"\n"
+            "error_page = \"404 %s\"\n",
+            dir,
+            page_path);
+    f = fmemopen(text, strlen(text), "r");
+    assert(f);
+    fd = load_config(f);
+    fclose(f);
+    assert(!fd);
+    assert(!mime_init());
+
+    /* plain text */
+    pipe->client = mem_client_plain;
+    pipe->ctx = &client;
+    mem_serve(pipe, &client, get);
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(strstr(client.response, "\r\n\r\nhello from memory\n"));
+
+    /* the page from the config, written whole */
+    mem_serve(pipe, &client, missing);
+    assert(!strncmp(client.response, "HTTP/1.1 404 Not Found\r\n", 24));
+    assert(strstr(client.response, "Content-Length: 4\r\n\r\ngone"));
+    assert(client.response_len == strstr(client.response, "gone") + 4 - client.response);
+
+    /* the length of the file without its body */
+    mem_serve(pipe, &client, "HEAD /page.txt HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(strstr(client.response, "Content-Length: 18\r\n\r\n"));
+    assert(!strstr(client.response, "hello"));
+
+    mem_serve(pipe, &client, "OPTIONS * HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 204", 12));
+    assert(strstr(client.response, "Allow: GET, HEAD, OPTIONS\r\n"));
+
+    mem_serve(pipe, &client, "DELETE /page.txt HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 405", 12));
+    assert(strstr(client.response, "Allow: GET, HEAD, OPTIONS\r\n"));
+    /* the built-in page, its length without the NUL */
+    assert(strstr(client.response, "</html>") + 7 - client.response
+            == (long)client.response_len);
+
+    mem_serve(pipe, &client, "GET /healthz?probe=1 HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(strstr(client.response, "\r\n\r\nok\n"));
+    /* a path that only starts like it is not the health check */
+    mem_serve(pipe, &client, "GET /healthzz HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 404", 12));
+
+    /* served from memory */
+    mem_serve(pipe, &client, "GET /teapot HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 418", 12));
+    mem_serve(pipe, &client, "POST /old?q=1 HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 308", 12));
+    assert(strstr(client.response, "Location: /page.txt\r\n"));
+    mem_serve_from(pipe, &client, "GET /_sv/config HTTP/1.1\r\n\r\n", &loopback);
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(strstr(client.response, "redirect = \"/old /page.txt\"\n"));
+    assert(strstr(client.response, "status_allow = \"127.0.0.0/8\"\n"));
+    assert(strstr(client.response, "status_allow = \"::1/128\"\n"));
+    mem_serve_from(pipe, &client, "GET /_sv HTTP/1.1\r\n\r\n", &loopback);
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(strstr(client.response, "\nuptime: "));
+    /* nothing there for the others */
+    mem_serve_from(pipe, &client, "GET /_sv/config HTTP/1.1\r\n\r\n", &remote);
+    assert(!strncmp(client.response, "HTTP/1.1 404", 12));
+    assert(!strstr(client.response, "redirect"));
+    mem_serve_from(pipe, &client, "GET /_sv HTTP/1.1\r\n\r\n", &remote);
+    assert(!strncmp(client.response, "HTTP/1.1 404", 12));
+    assert(!strstr(client.response, "uptime"));
+    /* the networks allowed, never the unix socket whoever is behind it */
+    {
+        struct peer_net nets[2];
+        struct peer_net bad;
+        struct conn peer = {0};
+        struct sockaddr_in *in = (struct sockaddr_in*)&peer.peer;
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&peer.peer;
+        char net[PEER_NET_STR_SIZE];
+
+        assert(!peer_net_parse("10.1.2.3/8", nets));
+        peer_net_format(nets, net);
+        assert(!strcmp(net, "10.0.0.0/8"));
+        assert(!peer_net_parse("2001:db8::/32", nets + 1));
+        assert(peer_net_parse("10.0.0.0/33", &bad) == -1);
+        assert(peer_net_parse("10.0.0.0/", &bad) == -1);
+        assert(peer_net_parse("10.0.0.0/8x", &bad) == -1);
+        assert(peer_net_parse("::1/-1", &bad) == -1);
+        assert(peer_net_parse("localhost", &bad) == -1);
+
+        peer.peer.ss_family = AF_UNIX;
+        assert(!conn_peer_in(&peer, nets, 2));
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = htonl(0x0a090909);
+        assert(conn_peer_in(&peer, nets, 2));
+        in->sin_addr.s_addr = htonl(0x0b000001);
+        assert(!conn_peer_in(&peer, nets, 2));
+        assert(!conn_peer_in(&peer, nets, 0));
+        in6->sin6_family = AF_INET6;
+        assert(inet_pton(AF_INET6, "::ffff:10.9.9.9", &in6->sin6_addr) == 1);
+        assert(conn_peer_in(&peer, nets, 2));
+        assert(inet_pton(AF_INET6, "2001:db8:1::1", &in6->sin6_addr) == 1);
+        assert(conn_peer_in(&peer, nets, 2));
+        assert(inet_pton(AF_INET6, "2001:db9::1", &in6->sin6_addr) == 1);
+        assert(!conn_peer_in(&peer, nets, 2));
+    }
+    /* the status page only takes a GET, the rest goes to the files */
+    mem_serve(pipe, &client, "DELETE /_sv HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 405", 12));
+
+    /* TLS, the server's SSL reads and writes the pipe through its BIO */
+    assert(SSL_CTX_use_certificate_chain_file(server_ctx, "cert0.pem") == 1);
+    assert(SSL_CTX_use_PrivateKey_file(server_ctx, "cert0.pem", SSL_FILETYPE_PEM) == 1);
+    memset(&client, 0, sizeof(client));
+    mem_pipe_reset(pipe);
+    pipe->client = mem_client_tls;
+    client.request = get;
+    client.request_len = sizeof(get) - 1;
+    client.ssl = SSL_new(client_ctx);
+    client.rbio = BIO_new(BIO_s_mem());
+    client.wbio = BIO_new(BIO_s_mem());
+    assert(client.ssl && client.rbio && client.wbio);
+    SSL_set_bio(client.ssl, client.rbio, client.wbio);
+    SSL_set_connect_state(client.ssl);
+    /* sends the client hello */
+    mem_client_tls(pipe, &client);
+
+    server = SSL_new(server_ctx);
+    bio = mem_pipe_bio(pipe);
+    assert(server && bio);
+    SSL_set_bio(server, bio, bio);
+    conn_new_ssl(server, &conn);
+    /* freed along with the connection */
+    server = 0;
+    handle_conn(conn);
+    mem_client_tls(pipe, &client);
+    client.response[client.response_len] = 0;
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(strstr(client.response, "\r\n\r\nhello from memory\n"));
+cleanup:
+    SSL_free(server);
+    SSL_free(client.ssl);
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    cleanup_config();
+    mime_cleanup();
+    free(pipe);
+    unlink(path);
+    unlink(page_path);
+    rmdir(dir);
+}
+
+void test_resolve(void) {
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char sub[64] = {0};
+    char file[64] = {0};
+    char out[256];
+    char text[256];
+    struct mem_pipe *pipe = calloc(1, sizeof(struct mem_pipe));
+    struct mem_client client = {0};
+    struct stat st;
+    int fd = -1;
+    FILE *f;
+
+    assert(pipe);
+    assert(mkdtemp(dir));
+    snprintf(sub, sizeof(sub), "%s/a <dir>", dir);
+    assert(!mkdir(sub, 0755));
+    snprintf(file, sizeof(file), "%s/a <dir>/x&y.txt", dir);
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    close(fd);
+    fd = -1;
+
+    assert(resolve_path(dir, strlen(dir), "a%20%3Cdir%3E/x%26y.txt?v=2",
+                out, sizeof(out), &fd, &st) == RESOLVE_FILE);
+    assert(fd != -1 && !st.st_size);
+    close(fd);
+    fd = -1;
+    assert(resolve_path(dir, strlen(dir), "a%20%3Cdir%3E?x=1",
+                out, sizeof(out), &fd, &st) == RESOLVE_REDIRECT);
+    assert(resolve_path(dir, strlen(dir), "a%20%3Cdir%3E/?x=1",
+                out, sizeof(out), &fd, &st) == RESOLVE_DIR);
+    assert(!strcmp(out + strlen(dir) + 1, "a <dir>/"));
+    assert(resolve_path(dir, strlen(dir), "a%20%3Cdir%3E/../../etc/passwd",
+                out, sizeof(out), &fd, &st) == RESOLVE_NOT_FOUND);
+    assert(resolve_path(dir, strlen(dir), "a%2",
+                out, sizeof(out), &fd, &st) == RESOLVE_NOT_FOUND);
+
+    /* the query comes after the added '/', the fragment is dropped */
+    assert(resolve_redirect("dir", out, sizeof(out)) == 5 && !strcmp(out, "/dir/"));
+    assert(resolve_redirect("dir?x=1", out, sizeof(out)) == 9
+            && !strcmp(out, "/dir/?x=1"));
+    assert(resolve_redirect("dir?x=1#top", out, sizeof(out)) == 9
+            && !strcmp(out, "/dir/?x=1"));
+    assert(resolve_redirect("dir#top?x", out, sizeof(out)) == 5
+            && !strcmp(out, "/dir/"));
+    assert(resolve_redirect("dir?x=1", out, 9) == -1);
+
+    snprintf(text, sizeof(text),
+            "https_port = 9092\npem_file = \"cert0.pem\"\nbase_dir = \"%s\"\n"
+            "autoindex = yes\n",
+            dir);
+    f = fmemopen(text, strlen(text), "r");
+    assert(f);
+    assert(!load_config(f));
+    fclose(f);
+    assert(!mime_init());
+    pipe->client = mem_client_plain;
+    pipe->ctx = &client;
+
+    mem_serve(pipe, &client, "GET /a%20%3Cdir%3E?x=1 HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 308", 12));
+    assert(strstr(client.response, "Location: /a%20%3Cdir%3E/?x=1\r\n"));
+
+    /* names are escaped in the text and encoded in the links */
+    mem_serve(pipe, &client, "GET /a%20%3Cdir%3E/?x=1 HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(strstr(client.response, "<title>Index of /a &lt;dir&gt;/</title>"));
+    assert(strstr(client.response, "<li><a href=\"../\">../</a></li>"));
+    assert(strstr(client.response, "<li><a href=\"x%26y.txt\">x&amp;y.txt</a></li>"));
+
+    /* the top level has no parent, directories end with '/' */
+    mem_serve(pipe, &client, "GET / HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(!strstr(client.response, "../"));
+    assert(strstr(client.response, "<li><a href=\"a%20%3Cdir%3E/\">a &lt;dir&gt;/</a></li>"));
+cleanup:
+    if(fd != -1) close(fd);
+    cleanup_config();
+    mime_cleanup();
+    autoindex_cleanup();
+    free(pipe);
+    unlink(file);
+    rmdir(sub);
+    rmdir(dir);
+}
+
+void test_pathfilter(void) {
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char path[128];
+    char text[256];
+    struct pathfilter_stats stats;
+    struct timeval timeout;
+    struct mem_pipe *pipe = calloc(1, sizeof(struct mem_pipe));
+    struct mem_client client = {0};
+    FILE *f;
+    int fd;
+
+    assert(pipe);
+    assert(mkdtemp(dir));
+    snprintf(path, sizeof(path), "%s/a.html", dir);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1);
+    close(fd);
+    snprintf(path, sizeof(path), "%s/sub", dir);
+    assert(!mkdir(path, 0755));
+    snprintf(path, sizeof(path), "%s/sub/b%%20c.txt", dir);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1);
+    close(fd);
+
+    assert(!pathfilter_build(dir));
+    assert(pathfilter_fd() != -1);
+    assert(pathfilter_lookup(dir, "") == PATHFILTER_MAYBE);
+    assert(pathfilter_lookup(dir, "a.html") == PATHFILTER_MAYBE);
+    assert(pathfilter_lookup(dir, "sub/") == PATHFILTER_MAYBE);
+    assert(pathfilter_lookup(dir, "sub//b%2520c.txt") == PATHFILTER_MAYBE);
+    assert(pathfilter_lookup(dir, "./sub/b%2520c.txt") == PATHFILTER_MAYBE);
+    assert(pathfilter_lookup(dir, "sub/b%2520c.txt") == PATHFILTER_MAYBE);
+    assert(pathfilter_lookup(dir, "wp-login.php") == PATHFILTER_ABSENT);
+    assert(pathfilter_lookup(dir, "sub/.env") == PATHFILTER_ABSENT);
+    /* only the filter's own tree is answered, targets leaving it or not
+     * decoding are left to resolve_path */
+    assert(pathfilter_lookup("/elsewhere", "wp-login.php") == PATHFILTER_UNKNOWN);
+    assert(pathfilter_lookup(dir, "sub/../../etc/passwd") == PATHFILTER_UNKNOWN);
+    assert(pathfilter_lookup(dir, "a%2") == PATHFILTER_UNKNOWN);
+
+    /* picked up from the watches, a new directory once the changes settle */
+    snprintf(path, sizeof(path), "%s/new.html", dir);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1);
+    close(fd);
+    snprintf(path, sizeof(path), "%s/sub/deeper", dir);
+    assert(!mkdir(path, 0755));
+    snprintf(path, sizeof(path), "%s/sub/deeper/d.txt", dir);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1);
+    close(fd);
+    pathfilter_update();
+    /* the filter is missing paths until then */
+    assert(pathfilter_lookup(dir, "wp-login.php") == PATHFILTER_UNKNOWN);
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    assert(pathfilter_timeout(&timeout));
+    assert(timeout.tv_sec * 1000 + timeout.tv_usec / 1000 <= PATHFILTER_SETTLE_MS);
+    pathfilter_refresh();
+    assert(pathfilter_lookup(dir, "new.html") == PATHFILTER_UNKNOWN);
+    usleep(PATHFILTER_SETTLE_MS * 1000);
+    pathfilter_refresh();
+    assert(!pathfilter_timeout(&timeout));
+    assert(pathfilter_lookup(dir, "new.html") == PATHFILTER_MAYBE);
+    assert(pathfilter_lookup(dir, "sub/deeper/d.txt") == PATHFILTER_MAYBE);
+
+    /* a removed file stays in the filter, the file system has the last
+     * word and that alone is a false positive */
+    snprintf(path, sizeof(path), "%s/a.html", dir);
+    assert(!unlink(path));
+    snprintf(text, sizeof(text),
+            "https_port = 9092\npem_file = \"cert0.pem\"\nbase_dir = \"%s\"\n",
+            dir);
+    f = fmemopen(text, strlen(text), "r");
+    assert(f);
+    fd = load_config(f);
+    fclose(f);
+    assert(!fd);
+    assert(!mime_init());
+    pipe->client = mem_client_plain;
+    pipe->ctx = &client;
+    mem_serve(pipe, &client, "GET /a.html HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 404", 12));
+    mem_serve(pipe, &client, "GET /wp-login.php HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 404", 12));
+    mem_serve(pipe, &client, "GET /sub/%2e%2e/%2e%2e/etc/passwd HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 404", 12));
+
+    pathfilter_stats(&stats);
+    assert(stats.lookups == 12);
+    assert(stats.misses == 3);
+    assert(stats.false_positives == 1);
+    assert(stats.rebuilds == 1);
+cleanup:
+    cleanup_config();
+    mime_cleanup();
+    free(pipe);
+    pathfilter_cleanup();
+    assert(pathfilter_fd() == -1);
+    snprintf(path, sizeof(path), "%s/sub/deeper/d.txt", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/sub/deeper", dir);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/sub/b%%20c.txt", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/sub", dir);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/a.html", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/new.html", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+/* reads a FastCGI record, exits the stand-in on a short read */
+static int stand_in_record(int fd, unsigned char *header, char *content) {
+    size_t len;
+    size_t got = 0;
+
+    while(got < 8) {
+        ssize_t ret = read(fd, header + got, 8 - got);
+        if(ret <= 0) return -1;
+        got += ret;
+    }
+    len = (header[4] << 8 | header[5]) + header[6];
+    for(got = 0; got < len;) {
+        ssize_t ret = read(fd, content + got, len - got);
+        if(ret <= 0) return -1;
+        got += ret;
+    }
+    return header[4] << 8 | header[5];
+}
+
+/* Returns: 1 if the `len` bytes at `data` hold `needle` */
+static int holds(const char *data, size_t len, const char *needle, size_t needle_len) {
+    for(size_t i = 0; i + needle_len <= len; i++) {
+        if(!memcmp(data + i, needle, needle_len)) return 1;
+    }
+    return 0;
+}
+
+/* answers two requests with their body, exits with the number of
+ * connections it took */
+static int stand_in_app(int listener) {
+    static const char head[] = "Status: 201 Created\nContent-Type: text/plain\n\n";
+    static const unsigned char end[] = {1, 3, 0, 1, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    int nb_conns = 0;
+    int served = 0;
+
+    while(served < 2) {
+        int fd = accept(listener, 0, 0);
+        if(fd == -1) return 255;
+        nb_conns++;
+        while(served < 2) {
+            unsigned char header[8];
+            char content[65536 + 256];
+            char params[4096];
+            char out[8 + sizeof(head) + 64] = {1, 6, 0, 1};
+            size_t params_len = 0;
+            size_t body_len = 0;
+            int keep = 0;
+            int len;
+
+            while((len = stand_in_record(fd, header, content)) >= 0) {
+                if(header[1] == 1) keep = content[2] & 1;
+                if(header[1] == 4 && params_len + len < sizeof(params)) {
+                    memcpy(params + params_len, content, len);
+                    params_len += len;
+                }
+                if(header[1] == 5) {
+                    if(!len) break;
+                    memcpy(out + 8 + sizeof(head) - 1 + body_len, content, len);
+                    body_len += len;
+                }
+            }
+            if(len < 0) break;
+            if(!keep) return 254;
+            if(!holds(params, params_len, "\x0b\x04SCRIPT_NAME/app", 17)
+                    || !holds(params, params_len, "\x09\x02PATH_INFO/x", 13)) {
+                return 253;
+            }
+            memcpy(out + 8, head, sizeof(head) - 1);
+            len = sizeof(head) - 1 + body_len;
+            out[5] = len;
+            write(fd, out, 8 + len);
+            write(fd, end, sizeof(end));
+            served++;
+        }
+        close(fd);
+    }
+    return nb_conns;
+}
+
+void test_fastcgi(void) {
+    static const char *const bad_lengths[] = {
+        "Content-Length: 4x",
+        "Content-Length: -4",
+        "Content-Length: +4",
+        "Content-Length: 4, 4",
+        "Content-Length: ",
+        "Content-Length: 18446744073709551616",
+        "Content-Length: 4\r\nContent-Length: 4",
+    };
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char value[128];
+    char sock_path[64] = {0};
+    struct fcgi_route routes[2] = {0};
+    int listener = -1;
+    pid_t pid = -1;
+    int status;
+
+    assert(mkdtemp(dir));
+    snprintf(sock_path, sizeof(sock_path), "%s/app.sock", dir);
+    snprintf(value, sizeof(value), "/app unix:%s", sock_path);
+    assert(!fcgi_route_parse(value, routes));
+    assert(!routes[0].command);
+    snprintf(value, sizeof(value), ".php unix:%s sleep 30", sock_path);
+    assert(!fcgi_route_parse(value, routes + 1));
+    assert(!strcmp(routes[1].command, "sleep 30"));
+
+    assert(fcgi_match(routes, 2, "GET /app/x HTTP/1.1", 19) == routes);
+    assert(!fcgi_match(routes, 2, "GET /apps HTTP/1.1", 18));
+    assert(fcgi_match_target(routes, 2, "/a/b.php?x=1", 12) == routes + 1);
+    /* the file server would decode it */
+    assert(fcgi_match_target(routes, 2, "/b.ph%70", 8) == routes + 1);
+    assert(!fcgi_match_target(routes, 2, "/b.php/", 7));
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(listener != -1);
+    assert(!bind(listener, (struct sockaddr*)&routes[0].addr, routes[0].addr_len));
+    assert(!listen(listener, 4));
+    pid = fork();
+    assert(pid != -1);
+    if(!pid) _exit(stand_in_app(listener));
+    close(listener);
+    listener = -1;
+
+    /* refused before the app sees them, it would take them for requests */
+    for(size_t i = 0; i < sizeof(bad_lengths) / sizeof(*bad_lengths); i++) {
+        char buff[4096];
+        char resp[512] = {0};
+        struct conn client;
+        int pair[2];
+
+        snprintf(buff, sizeof(buff), "POST /app/x HTTP/1.1\r\n%s\r\n\r\n", bad_lengths[i]);
+        assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+        /* no body comes, a request let through would not wait for one */
+        shutdown(pair[1], SHUT_WR);
+        conn_new_fd(pair[0], &client);
+        fcgi_serve(routes, &client, 0, dir, buff, strlen(buff), sizeof(buff));
+        close(pair[0]);
+        assert(read(pair[1], resp, sizeof(resp) - 1) > 0);
+        close(pair[1]);
+        assert(!strncmp(resp, "HTTP/1.1 400", 12));
+    }
+
+    for(int i = 0; i < 2; i++) {
+        char buff[4096] =
+            "POST /app/x?q HTTP/1.1\r\nHost: a\r\nContent-Length: 4\r\n\r\npi";
+        char resp[512] = {0};
+        size_t len = 0;
+        ssize_t ret;
+        struct conn client;
+        int pair[2];
+
+        assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+        /* the rest of the body comes after the head */
+        assert(write(pair[1], "ng", 2) == 2);
+        conn_new_fd(pair[0], &client);
+        fcgi_serve(routes, &client, 0, dir, buff, strlen(buff), sizeof(buff));
+        close(pair[0]);
+        while((ret = read(pair[1], resp + len, sizeof(resp) - len - 1)) > 0) {
+            len += ret;
+        }
+        close(pair[1]);
+        assert(!strncmp(resp, "HTTP/1.1 201 Created\r\n", 22));
+        assert(strstr(resp, "Content-Type: text/plain\r\nConnection: close\r\n\r\nping"));
+    }
+
+    /* both requests went over the same app connection */
+    assert(waitpid(pid, &status, 0) == pid);
+    pid = -1;
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    unlink(sock_path);
+
+    /* sv listens for the apps it starts */
+    assert(!fcgi_spawn(routes + 1, 1, 2));
+    assert(!access(sock_path, F_OK));
+    fcgi_cleanup();
+    assert(access(sock_path, F_OK));
+cleanup:
+    if(listener != -1) close(listener);
+    if(pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, 0, 0);
+    }
+    fcgi_cleanup();
+    fcgi_route_cleanup(routes);
+    fcgi_route_cleanup(routes + 1);
+    unlink(sock_path);
+    rmdir(dir);
+}
+
+/* Writes `len` bytes of `data` to `dir`/`name`
+ * Returns: 0 on success, -1 on error */
+static int write_file(const char *dir, const char *name, const char *data, size_t len) {
+    char path[128];
+    int fd;
+    int ret;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1) return -1;
+    ret = write(fd, data, len) == (ssize_t)len ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+/* Returns: 1 if `iov` holds exactly `str` */
+static int iov_is(const struct iovec *iov, const char *str) {
+    return iov->iov_len == strlen(str) && !memcmp(iov->iov_base, str, iov->iov_len);
+}
+
+/* Returns: 1 if `str` is somewhere in `iov` */
+static int iov_has(const struct iovec *iov, const char *str) {
+    return holds(iov->iov_base, iov->iov_len, str, strlen(str));
+}
+
+void test_pack(void) {
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char site[64] = {0};
+    char sub[64] = {0};
+    char archive[64] = {0};
+    char broken[64] = {0};
+    static const char *const names[] = {
+        "index.html", "app.js", "app.js.gz", "sub/index.html",
+    };
+    static const char gz[] = "\x1f\x8b not really gzip";
+    const struct pack_entry *entry;
+    struct pack pack = {0};
+    struct pack_header header;
+    struct iovec iov[2];
+    pid_t pid;
+    int status;
+    int fd;
+
+    assert(mkdtemp(dir));
+    snprintf(site, sizeof(site), "%s/site", dir);
+    snprintf(sub, sizeof(sub), "%s/site/sub", dir);
+    snprintf(archive, sizeof(archive), "%s/site.pack", dir);
+    snprintf(broken, sizeof(broken), "%s/broken.pack", dir);
+    assert(!mkdir(site, 0755) && !mkdir(sub, 0755));
+    assert(!write_file(site, names[0], "<p>top</p>", 10));
+    assert(!write_file(site, names[1], "var x;", 6));
+    assert(!write_file(site, names[2], gz, sizeof(gz) - 1));
+    assert(!write_file(site, names[3], "<p>sub</p>", 10));
+
+    pid = fork();
+    assert(pid != -1);
+    if(!pid) {
+        execl("./sv-pack", "sv-pack", site, archive, (char*)0);
+        _exit(127);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && !WEXITSTATUS(status));
+
+    assert(!pack_open(archive, &pack));
+    assert(pack_lookup(&pack, "index.html", 10));
+    /* a directory is served its index, under the '/' only */
+    assert(pack_lookup(&pack, "", 0));
+    assert(pack_lookup(&pack, "sub/", 4) && !pack_lookup(&pack, "sub", 3));
+    assert(!pack_lookup(&pack, "nothing", 7) && !pack_lookup(&pack, "app", 3));
+
+    /* with its compressed sibling, both ways */
+    entry = pack_lookup(&pack, "app.js", 6);
+    assert(entry);
+    assert(pack_entry_iov(&pack, entry, 1, iov) == PACK_GZIP);
+    assert(iov_has(iov, "Content-Encoding: gzip\r\n"));
+    assert(iov_has(iov, "Vary: Accept-Encoding\r\n"));
+    assert(iov_is(iov + 1, gz));
+    assert(pack_entry_iov(&pack, entry, 0, iov) == PACK_IDENTITY);
+    assert(!memcmp(iov[0].iov_base, "HTTP/1.1 200 OK\r\n", 17));
+    assert(iov_has(iov, "Content-Length: 6\r\n"));
+    assert(!iov_has(iov, "Content-Encoding"));
+    assert(iov_is(iov + 1, "var x;"));
+    /* without one, gzip or not */
+    entry = pack_lookup(&pack, "sub/index.html", 14);
+    assert(entry);
+    assert(pack_entry_iov(&pack, entry, 1, iov) == PACK_IDENTITY);
+    assert(!iov_has(iov, "Vary"));
+    assert(iov_is(iov + 1, "<p>sub</p>"));
+    memcpy(&header, pack.header, sizeof(header));
+    pack_close(&pack);
+
+    /* an index past the end of the file is refused before it is read */
+    header.entries_off = (uint64_t)1 << 40;
+    fd = open(broken, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    assert(fd != -1);
+    assert(write(fd, &header, sizeof(header)) == sizeof(header));
+    close(fd);
+    assert(pack_open(broken, &pack) == -1);
+cleanup:
+    pack_close(&pack);
+    for(size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s/%s", site, names[i]);
+        unlink(path);
+    }
+    unlink(archive);
+    unlink(broken);
+    rmdir(sub);
+    rmdir(site);
+    rmdir(dir);
+}
+
+static int route_echo(
+        const struct route_request *request,
+        struct route_response *response,
+        void *data) {
+    response->body = data;
+    response->body_len = strlen(data);
+    return 0;
+}
+
+static int route_fail(
+        const struct route_request *request,
+        struct route_response *response,
+        void *data) {
+    return -1;
+}
+
+void test_router(void) {
+    struct router router = {0};
+    struct route_response response;
+    const struct route *route;
+    size_t matched;
+
+    assert(!router_add(&router, "/api/users", 0, ROUTE_METHOD(GET), route_echo, "users"));
+    assert(!router_add(&router, "/api/", 1, ROUTE_ANY_METHOD, route_echo, "api"));
+    /* splits the node of `/api/users` */
+    assert(!router_add(&router, "/api/us", 1, ROUTE_METHOD(POST), route_echo, "us"));
+    assert(!router_add(&router, "/broken", 0, ROUTE_METHOD(GET), route_fail, 0));
+    assert(router_add(&router, "/api/users", 0, ROUTE_METHOD(GET), route_echo, 0));
+
+    route = router_match(&router, "/api/users", 10, &matched);
+    assert(route && !strcmp(route->data, "users") && matched == 10);
+    /* the longest prefix */
+    route = router_match(&router, "/api/users/1", 12, &matched);
+    assert(route && !strcmp(route->data, "us") && matched == 7);
+    route = router_match(&router, "/api/u", 6, &matched);
+    assert(route && !strcmp(route->data, "api") && matched == 5);
+    assert(!router_match(&router, "/ap", 3, &matched));
+    assert(!router_match(&router, "/api", 4, &matched));
+
+    assert(router_serve(&router, HEAD, "/api/users?page=2", 0, &response));
+    assert(response.status == 200 && response.body_len == 5);
+    route_response_cleanup(&response);
+    /* not taken by `/api/us`, nor by the exact path */
+    assert(!router_serve(&router, GET, "/api/usx", 0, &response));
+    assert(!router_serve(&router, POST, "/api/users", 0, &response));
+    assert(router_serve(&router, GET, "/broken", 0, &response));
+    assert(response.error_page == ERROR_PAGE_500);
+cleanup:
+    router_cleanup(&router);
+}
+
+void test_vhost(void) {
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char site[64] = {0};
+    char path[96] = {0};
+    char text[512];
+    struct mem_pipe *pipe = calloc(1, sizeof(struct mem_pipe));
+    struct mem_client client = {0};
+    struct config *config = 0;
+    const struct vhost *vhost;
+    FILE *f;
+    int fd;
+
+    assert(pipe);
+    assert(mkdtemp(dir));
+    snprintf(site, sizeof(site), "%s/site", dir);
+    assert(!mkdir(site, 0755));
+    snprintf(path, sizeof(path), "%s/only.txt", site);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(write(fd, "vhost\n", 6) == 6);
+    close(fd);
+
+    snprintf(text, sizeof(text),
+            "https_port = 9092\npem_file = \"cert0.pem\"\nbase_dir = \"%s\"\n"
+            "[vhost]\n"
+            "server_name = \"Example.test www.example.test\"\n"
+            "server_name = \"*.apps.test\"\n"
+            "base_dir = \"%s\"\n"
+            "[vhost]\n"
+            "server_name = \"other.test\"\n"
+            "base_dir = \"%s\"\n"
+            "autoindex = true\n",
+            dir, site, dir);
+    f = fmemopen(text, strlen(text), "r");
+    assert(f);
+    config = config_parse(f);
+    fclose(f);
+    assert(config && !config_prepare(config));
+    assert(config->nb_vhosts == 2);
+    assert(config->vhosts[0].nb_names == 3);
+    assert(config->vhosts[0].autoindex == 0 && config->vhosts[1].autoindex == 1);
+
+    vhost = vhost_lookup(&config->vhost_table, "example.TEST:9092", 17);
+    assert(vhost == config->vhosts);
+    assert(vhost_lookup(&config->vhost_table, "www.example.test.", 17) == config->vhosts);
+    assert(vhost_lookup(&config->vhost_table, "a.apps.test", 11) == config->vhosts);
+    /* only one label under the wildcard */
+    assert(!vhost_lookup(&config->vhost_table, "a.b.apps.test", 13));
+    assert(!vhost_lookup(&config->vhost_table, "apps.test", 9));
+    assert(vhost_lookup(&config->vhost_table, "other.test", 10) == config->vhosts + 1);
+    assert(!vhost_lookup(&config->vhost_table, "[::1]:9092", 10));
+    config_put(config);
+    config = 0;
+
+    /* a name can only be one vhost's, keys are the site's in a section */
+    snprintf(text, sizeof(text),
+            "https_port = 9092\npem_file = \"cert0.pem\"\nbase_dir = \"%s\"\n"
+            "[vhost]\nserver_name = a.test\nbase_dir = /\n"
+            "[vhost]\nserver_name = A.test\nbase_dir = /\n",
+            dir);
+    f = fmemopen(text, strlen(text), "r");
+    assert(f);
+    config = config_parse(f);
+    fclose(f);
+    assert(config && config_prepare(config));
+    config_put(config);
+    snprintf(text, sizeof(text), "[vhost]\nhttps_port = 9092\n");
+    f = fmemopen(text, strlen(text), "r");
+    assert(f);
+    config = config_parse(f);
+    fclose(f);
+    assert(!config);
+
+    /* the Host header picks the tree */
+    snprintf(text, sizeof(text),
+            "https_port = 9092\npem_file = \"cert0.pem\"\nbase_dir = \"%s\"\n"
+            "[vhost]\nserver_name = \"www.example.test\"\nbase_dir = \"%s\"\n"
+            "[vhost]\nserver_name = \"other.test\"\nbase_dir = \"%s\"\n",
+            dir, site, dir);
+    f = fmemopen(text, strlen(text), "r");
+    assert(f);
+    fd = load_config(f);
+    fclose(f);
+    assert(!fd);
+    pipe->client = mem_client_plain;
+    pipe->ctx = &client;
+    mem_serve(pipe, &client, "GET /only.txt HTTP/1.1\r\nHost: www.example.test\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(strstr(client.response, "\r\n\r\nvhost\n"));
+    mem_serve(pipe, &client, "GET /only.txt HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 404", 12));
+    mem_serve(pipe, &client, "GET /site/only.txt HTTP/1.1\r\nHost: other.test\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+cleanup:
+    cleanup_config();
+    free(pipe);
+    unlink(path);
+    rmdir(site);
+    rmdir(dir);
+}
+
+void test_cache_rule(void) {
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char sub[64] = {0};
+    char path[96] = {0};
+    char text[512];
+    struct mem_pipe *pipe = calloc(1, sizeof(struct mem_pipe));
+    struct mem_client client = {0};
+    struct cache_rule rules[6] = {0};
+    struct cache_rule bad;
+    const char *value;
+    size_t len;
+    FILE *f;
+    int fd;
+
+    assert(pipe);
+    assert(!cache_rule_parse("/static/** public max-age=31536000 immutable", rules));
+    assert(rules[0].kind == CACHE_PATH_PREFIX && rules[0].max_age == 31536000);
+    assert(!cache_rule_parse("*.css max-age=3600 expires", rules + 1));
+    assert(rules[1].kind == CACHE_NAME_SUFFIX && rules[1].expires);
+    assert(!cache_rule_parse("/app/*/main.js no-cache", rules + 2));
+    assert(rules[2].kind == CACHE_PATH_GLOB);
+    assert(!cache_rule_parse("image/* max-age=60", rules + 3));
+    assert(rules[3].kind == CACHE_TYPE_PREFIX);
+    assert(!cache_rule_parse("text/html no-store", rules + 4));
+    assert(!cache_rule_parse("index*.html  private", rules + 5));
+    assert(rules[5].kind == CACHE_NAME_GLOB);
+
+    assert(cache_rule_match(rules, 6, "/static/a/b.css", "text/css") == rules);
+    assert(cache_rule_match(rules, 6, "/staticx.css", "text/css") == rules + 1);
+    assert(cache_rule_match(rules, 6, "/app/v1/main.js", 0) == rules + 2);
+    /* `*` stops at a `/` */
+    assert(!cache_rule_match(rules, 6, "/app/v1/x/main.js", 0));
+    assert(cache_rule_match(rules, 6, "/a.png", "image/png") == rules + 3);
+    assert(cache_rule_match(rules, 6, "/a", "text/html; charset=utf-8") == rules + 4);
+    assert(cache_rule_match(rules, 6, "/d/index2.html", "text/plain") == rules + 5);
+    assert(!cache_rule_match(rules, 6, "/a.txt", "text/plain"));
+
+    value = cache_rule_control(rules, &len);
+    assert(len == 35 && !memcmp(value, "public, max-age=31536000, immutable", len));
+    assert(!cache_rule_expires(rules));
+    assert(!strcmp(cache_rule_lines(rules + 1, 0),
+                "Cache-Control: max-age=3600\r\n"
+                "Expires: Thu, 01 Jan 1970 01:00:00 GMT\r\n"));
+    assert(!memcmp(cache_rule_expires(rules + 1), "Thu, 01 Jan 1970 01:00:00 GMT",
+                CACHE_DATE_LEN));
+
+    /* expires is counted from max-age */
+    assert(cache_rule_parse("*.js expires", &bad) == -1);
+    assert(cache_rule_parse("*.js max-age=soon", &bad) == -1);
+    assert(cache_rule_parse("*.js", &bad) == -1);
+    assert(cache_rule_parse("*/html max-age=1", &bad) == -1);
+
+    /* sent with the files it matches */
+    assert(mkdtemp(dir));
+    snprintf(sub, sizeof(sub), "%s/static", dir);
+    assert(!mkdir(sub, 0755));
+    snprintf(path, sizeof(path), "%s/app.css", sub);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(write(fd, "a{}\n", 4) == 4);
+    close(fd);
+    snprintf(text, sizeof(text),
+            "https_port = 9092\npem_file = \"cert0.pem\"\nbase_dir = \"%s\"\n"
+            "cache = \"/static/** public max-age=600 expires\"\n",
+            dir);
+    f = fmemopen(text, strlen(text), "r");
+    assert(f);
+    fd = load_config(f);
+    fclose(f);
+    assert(!fd);
+    pipe->client = mem_client_plain;
+    pipe->ctx = &client;
+    mem_serve(pipe, &client, "GET /static/app.css HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 200", 12));
+    assert(strstr(client.response, "\r\nCache-Control: public, max-age=600\r\nExpires: "));
+    mem_serve(pipe, &client, "HEAD /static/app.css HTTP/1.1\r\n\r\n");
+    assert(strstr(client.response, "\r\nCache-Control: public, max-age=600\r\n"));
+cleanup:
+    cleanup_config();
+    for(size_t i = 0; i < sizeof(rules) / sizeof(*rules); i++) {
+        cache_rule_cleanup(rules + i);
+    }
+    free(pipe);
+    unlink(path);
+    rmdir(sub);
+    rmdir(dir);
+}
+
+/* the transfers in the order they ended */
+static int EGRESS_ENDED[2];
+static int NB_EGRESS_ENDED = 0;
+
+static void egress_ended(struct conn *conn, void *data) {
+    EGRESS_ENDED[NB_EGRESS_ENDED++] = *(int*)data;
+    conn_cleanup(conn);
+}
+
+/* Runs the transfers, reading what they send on `clients`, until both ended
+ * Returns: the seconds it took */
+static double egress_until_ended(int *clients, size_t *received) {
+    struct timespec start, end;
+    char buf[16384];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(NB_EGRESS_ENDED < 2) {
+        struct timeval timeout = {.tv_sec = 1};
+        fd_set w;
+        int max;
+
+        FD_ZERO(&w);
+        max = egress_fds(&w, &timeout);
+        if(select(max + 1, 0, &w, 0, &timeout) > 0) egress_run(&w);
+        for(int i = 0; i < 2; i++) {
+            ssize_t ret;
+            while((ret = read(clients[i], buf, sizeof(buf))) > 0) received[i] += ret;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void test_egress(void) {
+    char path[] = "/tmp/sv-test-XXXXXX";
+    static const size_t sizes[2] = {600000, 100000};
+    static int ids[2] = {0, 1};
+    int clients[2] = {-1, -1};
+    size_t received[2] = {0};
+    struct egress_stats stats;
+    struct conn conn = {0};
+    char *data = malloc(sizes[0]);
+    int fd = -1;
+
+    assert(data);
+    for(size_t i = 0; i < sizes[0]; i++) data[i] = i * 7;
+    fd = mkstemp(path);
+    assert(fd != -1);
+    assert(write(fd, data, sizes[0]) == (ssize_t)sizes[0]);
+    close(fd);
+    fd = -1;
+
+    /* not started, the caller sends */
+    assert(!egress_room(&conn));
+    egress_start(0, 0, DEFAULT_SEND_TIMEOUT);
+    for(int round = 0; round < 2; round++) {
+        NB_EGRESS_ENDED = 0;
+        received[0] = received[1] = 0;
+        for(int i = 0; i < 2; i++) {
+            int pair[2];
+            assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair));
+            clients[i] = pair[1];
+            assert(!fcntl(clients[i], F_SETFL, O_NONBLOCK));
+            conn_new_fd(pair[0], &conn);
+            assert(egress_room(&conn));
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+            assert(fd != -1);
+            assert(!egress_submit(&conn, fd, sizes[i], egress_ended, ids + i));
+            fd = -1;
+        }
+
+        if(!round) {
+            egress_until_ended(clients, received);
+            /* the shorter one, handed over last, is done with first */
+            assert(EGRESS_ENDED[0] == 1 && EGRESS_ENDED[1] == 0);
+        }
+        else {
+            /* 200KB/s together, the 700KB take about 3s */
+            egress_start(0, 200000, DEFAULT_SEND_TIMEOUT);
+            assert(egress_until_ended(clients, received) > 2);
+            egress_start(0, 0, DEFAULT_SEND_TIMEOUT);
+        }
+        assert(received[0] == sizes[0] && received[1] == sizes[1]);
+        for(int i = 0; i < 2; i++) {
+            close(clients[i]);
+            clients[i] = -1;
+        }
+    }
+    egress_stats(&stats);
+    assert(stats.submitted == 4 && stats.completed == 4 && !stats.failed);
+    assert(stats.bytes == 2 * (sizes[0] + sizes[1]) && !stats.active);
+    assert(stats.max_active == 2 && stats.throttled);
+
+    /* a client that reads nothing is cut short once its socket is full */
+    egress_start(0, 0, 1);
+    NB_EGRESS_ENDED = 0;
+    {
+        int pair[2];
+        struct timespec start, now;
+
+        assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair));
+        clients[0] = pair[1];
+        conn_new_fd(pair[0], &conn);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        assert(fd != -1);
+        assert(!egress_submit(&conn, fd, sizes[0], egress_ended, ids));
+        fd = -1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            struct timeval timeout = {.tv_sec = 5};
+            fd_set w;
+            int max;
+
+            FD_ZERO(&w);
+            max = egress_fds(&w, &timeout);
+            if(NB_EGRESS_ENDED) break;
+            /* woken up by the deadline, not by the 5s */
+            assert(timeout.tv_sec <= 1);
+            if(select(max + 1, 0, &w, 0, &timeout) > 0) egress_run(&w);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            assert(now.tv_sec - start.tv_sec < 4);
+        } while(!NB_EGRESS_ENDED);
+    }
+    egress_stats(&stats);
+    assert(stats.failed == 1 && stats.stalled == 1 && !stats.active);
+cleanup:
+    egress_stop();
+    if(fd != -1) close(fd);
+    for(int i = 0; i < 2; i++) {
+        if(clients[i] != -1) close(clients[i]);
+    }
+    free(data);
+    unlink(path);
+}
+
+void test_overload(void) {
+    char text[] =
+        "https_port = 9092\npem_file = \"cert0.pem\"\nbase_dir = \"/tmp\"\n"
+        "overload_connections = 1\noverload_action = \"pause\"\n";
+    char bad[] = "overload_action = \"drop\"\n";
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addr_len = sizeof(addr);
+    struct overload_limits limits = {0};
+    struct overload_stats stats;
+    struct config *config = 0;
+    struct timespec woke;
+    SSL *client = 0;
+    int pair[2] = {-1, -1};
+    int clients[2] = {-1, -1};
+    int listener = -1;
+    char buf[256] = {0};
+    FILE *f;
+
+    /* the keys */
+    f = fmemopen(text, sizeof(text) - 1, "r");
+    assert(f);
+    assert(!load_config(f));
+    fclose(f);
+    config = config_get();
+    assert(config->overload.connections == 1 && !config->overload.lag_ms);
+    assert(config->overload_action == OVERLOAD_PAUSE);
+    f = fmemopen(bad, sizeof(bad) - 1, "r");
+    assert(f);
+    assert(!config_parse(f));
+    fclose(f);
+    assert(strstr(get_config_err(), "`503` or `pause`"));
+
+    /* the backlog counts, up to the limit */
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(listener != -1);
+    assert(!bind(listener, (struct sockaddr*)&addr, sizeof(addr)));
+    assert(!listen(listener, 16));
+    assert(!getsockname(listener, (struct sockaddr*)&addr, &addr_len));
+    overload_start(&config->overload, OVERLOAD_503);
+    assert(!overload_check(listener));
+    for(int i = 0; i < 2; i++) {
+        clients[i] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        assert(clients[i] != -1);
+        assert(!connect(clients[i], (struct sockaddr*)&addr, sizeof(addr)));
+    }
+    assert(overload_check(listener) == OVERLOAD_503);
+    for(int i = 0; i < 2; i++) {
+        int fd = accept(listener, 0, 0);
+        assert(fd != -1);
+        close(fd);
+    }
+    assert(!overload_check(listener));
+
+    /* so does the lag, a slow turn alone is not enough */
+    limits.lag_ms = 20;
+    overload_start(&limits, OVERLOAD_503);
+    clock_gettime(CLOCK_MONOTONIC, &woke);
+    woke.tv_sec -= 1;
+    overload_busy(&woke);
+    assert(overload_check(-1) == OVERLOAD_503);
+    clock_gettime(CLOCK_MONOTONIC, &woke);
+    for(int i = 0; i < 20 && overload_check(-1); i++) overload_busy(&woke);
+    assert(!overload_check(-1));
+    overload_stats(&stats);
+    assert(stats.episodes == 2 && stats.max_lag_us >= 1000000);
+
+    /* paused, the backlog past the limit is not counted, it is only
+     * accepted once the pause is over */
+    for(int i = 0; i < 2; i++) {
+        close(clients[i]);
+        clients[i] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        assert(clients[i] != -1);
+        assert(!connect(clients[i], (struct sockaddr*)&addr, sizeof(addr)));
+    }
+    limits.connections = 1;
+    overload_start(&limits, OVERLOAD_PAUSE);
+    clock_gettime(CLOCK_MONOTONIC, &woke);
+    woke.tv_sec -= 1;
+    overload_busy(&woke);
+    {
+        int accepted = 0;
+        /* the turns of the select loop, the listener is read when not paused */
+        for(int turn = 0; turn < 40 && accepted < 2; turn++) {
+            int fd;
+            clock_gettime(CLOCK_MONOTONIC, &woke);
+            if(overload_check(listener) != OVERLOAD_PAUSE) {
+                while((fd = accept(listener, 0, 0)) != -1) {
+                    close(fd);
+                    accepted++;
+                }
+            }
+            else {
+                assert(!accepted);
+            }
+            overload_busy(&woke);
+        }
+        assert(accepted == 2);
+    }
+    overload_stats(&stats);
+    assert(stats.episodes == 3 && !stats.overloaded);
+
+    /* a plain request is read and answered */
+    assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair));
+    assert(write(pair[1], "GET / HTTP/1.1\r\n\r\n", 18) == 18);
+    overload_shed(pair[0]);
+    pair[0] = -1;
+    assert(read(pair[1], buf, sizeof(buf) - 1) == (ssize_t)OVERLOAD_RESPONSE_LEN);
+    assert(!strncmp(buf, "HTTP/1.1 503 ", 13) && strstr(buf, "\r\nRetry-After: 5\r\n"));
+    close(pair[1]);
+    pair[1] = -1;
+
+    /* a TLS client is closed before any handshake, whatever it offers */
+    assert(client_ctx);
+    assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair));
+    assert(!fcntl(pair[1], F_SETFL, O_NONBLOCK));
+    client = SSL_new(client_ctx);
+    assert(client);
+    SSL_set_fd(client, pair[1]);
+    assert(SSL_connect(client) == -1);
+    overload_shed(pair[0]);
+    pair[0] = -1;
+    assert(!fcntl(pair[1], F_SETFL, 0));
+    assert(!read(pair[1], buf, sizeof(buf)));
+    overload_stats(&stats);
+    assert(stats.shed == 1 && stats.dropped == 1);
+cleanup:
+    limits.connections = 0;
+    limits.lag_ms = 0;
+    overload_start(&limits, OVERLOAD_503);
+    config_put(config);
+    cleanup_config();
+    SSL_free(client);
+    SSL_CTX_free(client_ctx);
+    if(listener != -1) close(listener);
+    for(int i = 0; i < 2; i++) {
+        if(clients[i] != -1) close(clients[i]);
+        if(pair[i] != -1) close(pair[i]);
+    }
+}
+
+void test_fspool(void) {
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char path[256] = {0};
+    char cold[256] = {0};
+    char out[2][256];
+    struct fs_job jobs[2] = {{0}};
+    struct fspool_stats stats;
+    struct pollfd done = {0};
+    struct fs_job *job;
+    int nb_done = 0;
+    int evicted;
+    int fd;
+
+    jobs[0].fd = jobs[1].fd = -1;
+    assert(mkdtemp(dir));
+    snprintf(path, sizeof(path), "%s/a.txt", dir);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(write(fd, "hello\n", 6) == 6);
+    close(fd);
+    for(int i = 0; i < 2; i++) {
+        jobs[i].base_dir = dir;
+        jobs[i].base_dir_len = strlen(dir);
+        jobs[i].file = i ? "missing.txt" : "a.txt";
+        jobs[i].path = out[i];
+        jobs[i].path_size = sizeof(out[i]);
+    }
+
+    /* without threads the caller does it */
+    assert(fspool_submit(jobs) == -1);
+    assert(!fspool_start(2));
+    assert(fspool_fd() != -1);
+    assert(!fspool_submit(jobs) && !fspool_submit(jobs + 1));
+    done.fd = fspool_fd();
+    done.events = POLLIN;
+    while(nb_done < 2) {
+        assert(poll(&done, 1, 5000) == 1);
+        while((job = fspool_collect())) nb_done++;
+    }
+    assert(jobs[0].result == RESOLVE_FILE && jobs[0].fd != -1);
+    assert(jobs[0].st.st_size == 6 && !strcmp(jobs[0].type, "text/plain"));
+    assert(!strcmp(out[0], path));
+    assert(jobs[1].result == RESOLVE_NOT_FOUND && jobs[1].fd == -1);
+
+    /* just written, the file is in the page cache and is looked up by the
+     * caller from now on */
+    assert(fspool_submit(jobs) == -1);
+    fspool_stats(&stats);
+    assert(stats.queued == 2 && stats.resident == 1 && stats.hot == 1);
+    assert(!stats.depth && !stats.readahead);
+
+    /* a small file out of the page cache is read ahead by the thread too,
+     * not by the serving thread as it is sent */
+    snprintf(cold, sizeof(cold), "%s/b.txt", dir);
+    fd = open(cold, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(write(fd, "cold\n", 5) == 5);
+    assert(!fsync(fd));
+    assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
+    close(fd);
+    fd = open(cold, O_RDONLY);
+    assert(fd != -1);
+    {
+        unsigned char page = 1;
+        void *map = mmap(0, 5, PROT_READ, MAP_SHARED, fd, 0);
+        assert(map != MAP_FAILED);
+        assert(!mincore(map, 5, &page));
+        munmap(map, 5);
+        close(fd);
+        /* tmpfs keeps everything in memory */
+        evicted = !(page & 1);
+    }
+    close(jobs[0].fd);
+    memset(jobs, 0, sizeof(*jobs));
+    jobs[0].fd = -1;
+    jobs[0].base_dir = dir;
+    jobs[0].base_dir_len = strlen(dir);
+    jobs[0].file = "b.txt";
+    jobs[0].path = out[0];
+    jobs[0].path_size = sizeof(out[0]);
+    assert(!fspool_submit(jobs));
+    for(job = 0; !job;) {
+        assert(poll(&done, 1, 5000) == 1);
+        job = fspool_collect();
+    }
+    assert(job == jobs && jobs[0].result == RESOLVE_FILE);
+    fspool_stats(&stats);
+    assert(stats.readahead == (uint64_t)evicted && stats.resident == 2 - (uint64_t)evicted);
+cleanup:
+    fspool_stop();
+    if(jobs[0].fd != -1) close(jobs[0].fd);
+    unlink(cold);
+    unlink(path);
+    rmdir(dir);
+}
+
+void test_handshake(void) {
+    SSL_CTX *server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+    struct handshake_stats stats;
+    struct pollfd done = {0};
+    struct conn conn = {0};
+    SSL *client = 0;
+    SSL *server = 0;
+    int pair[2] = {-1, -1};
+
+    assert(server_ctx && client_ctx);
+    assert(SSL_CTX_use_certificate_chain_file(server_ctx, "cert0.pem") == 1);
+    assert(SSL_CTX_use_PrivateKey_file(server_ctx, "cert0.pem", SSL_FILETYPE_PEM) == 1);
+    assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair));
+    server = SSL_new(server_ctx);
+    client = SSL_new(client_ctx);
+    assert(server && client);
+    SSL_set_fd(server, pair[0]);
+    SSL_set_fd(client, pair[1]);
+
+    /* the connection owns them */
+    conn_new_ssl(server, &conn);
+    server = 0;
+    pair[0] = -1;
+
+    /* without threads the caller does it */
+    assert(handshake_submit(&conn));
+    assert(!handshake_start(2));
+    assert(handshake_fd() != -1);
+    assert(!handshake_submit(&conn));
+    /* the pool's until it is collected */
+    memset(&conn, 0, sizeof(conn));
+    assert(SSL_connect(client) == 1);
+
+    done.fd = handshake_fd();
+    done.events = POLLIN;
+    assert(poll(&done, 1, 5000) == 1);
+    assert(handshake_collect(&conn));
+    assert(conn.handshake == 1);
+    /* not done again */
+    assert(conn_init(&conn) == 1);
+    assert(SSL_write(client, "ping", 4) == 4);
+    {
+        char buf[4];
+        assert(conn_read(&conn, buf, 4) == 4 && !memcmp(buf, "ping", 4));
+    }
+
+    handshake_stats(&stats);
+    assert(stats.queued == 1 && stats.completed == 1 && !stats.failed);
+    assert(stats.max_depth == 1 && !stats.depth);
+cleanup:
+    if(conn.type == CONN_SSL) conn_cleanup(&conn);
+    handshake_stop();
+    SSL_free(server);
+    SSL_free(client);
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    if(pair[0] != -1) close(pair[0]);
+    if(pair[1] != -1) close(pair[1]);
+}
+
+/* heap kept by an idle TLS connection once its buffers are released, about
+ * 15KiB with OpenSSL 3 against 48KiB with them */
+#define IDLE_TLS_BYTES_MAX (24 * 1024)
+/* at least a record's worth is released */
+#define IDLE_TLS_BUFFERS_MIN (16 * 1024)
+
+#define IDLE_CONNS 32
+
+/* what a plain idle connection keeps, its struct and nothing on the heap */
+#define IDLE_PLAIN_BYTES_MAX 256
+
+/* the buffers lent out when the server first waited on its client, -1 while
+ * it did not */
+static ssize_t IDLE_IN_USE = -1;
+
+static int mem_client_idle(struct mem_pipe *pipe, void *ctx) {
+    struct bufpool_stats stats;
+
+    if(IDLE_IN_USE == -1) {
+        bufpool_stats(&stats);
+        IDLE_IN_USE = stats.in_use;
+    }
+    return mem_client_plain(pipe, ctx);
+}
+
+/* Shakes hands over `pair` and exchanges a request and its response
+ * Returns: 0 on success, -1 on error */
+static int idle_tls_setup(SSL *server, SSL *client) {
+    char buf[8];
+    int accepted = 0;
+    int connected = 0;
+
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+    for(int i = 0; i < 1000 && (accepted != 1 || connected != 1); i++) {
+        if(accepted != 1) accepted = SSL_do_handshake(server);
+        if(connected != 1) connected = SSL_do_handshake(client);
+    }
+    if(accepted != 1 || connected != 1) return -1;
+    if(SSL_write(client, "ping", 4) != 4 || SSL_read(server, buf, sizeof(buf)) != 4) {
+        return -1;
+    }
+    if(SSL_write(server, "pong", 4) != 4 || SSL_read(client, buf, sizeof(buf)) != 4) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Measures the heap kept by an idle TLS connection of `server_ctx`, made
+ * IDLE_CONNS at a time into `conns`, their client ends in `peers`
+ * Returns: 0 on success, -1 on error */
+static int idle_tls_bytes(
+        SSL_CTX *server_ctx,
+        SSL_CTX *client_ctx,
+        struct conn *conns,
+        int *peers,
+        size_t *bytes) {
+    size_t before = 0;
+    size_t after = 0;
+
+    /* the first ones warm up the library's own caches */
+    for(int round = 0; round < 2; round++) {
+        before = mallinfo2().uordblks;
+        for(int i = 0; i < IDLE_CONNS; i++) {
+            int pair[2];
+            SSL *server;
+            SSL *client;
+            int ret;
+
+            if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair)) {
+                return -1;
+            }
+            server = SSL_new(server_ctx);
+            client = SSL_new(client_ctx);
+            if(!server || !client) {
+                SSL_free(server);
+                SSL_free(client);
+                close(pair[0]);
+                close(pair[1]);
+                return -1;
+            }
+            SSL_set_fd(server, pair[0]);
+            SSL_set_fd(client, pair[1]);
+            conn_new_ssl(server, conns + i);
+            peers[i] = pair[1];
+            ret = idle_tls_setup(server, client);
+            SSL_free(client);
+            if(ret) return -1;
+        }
+        after = mallinfo2().uordblks;
+        for(int i = 0; i < IDLE_CONNS; i++) {
+            conn_cleanup(conns + i);
+            memset(conns + i, 0, sizeof(conns[i]));
+            close(peers[i]);
+            peers[i] = -1;
+        }
+    }
+    *bytes = (after - before) / IDLE_CONNS;
+    return 0;
+}
+
+void test_idle_memory(void) {
+    SSL_CTX *server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+    struct conn conns[IDLE_CONNS] = {0};
+    /* the client ends stay open, the server's close_notify has a reader */
+    int peers[IDLE_CONNS];
+    struct mem_pipe *pipe = calloc(1, sizeof(struct mem_pipe));
+    struct mem_client client = {0};
+    struct bufpool_stats stats;
+    char dir[] = "/tmp/sv-test-XXXXXX";
+    char text[256];
+    size_t kept;
+    size_t released;
+    FILE *f;
+    int ret;
+
+    for(int i = 0; i < IDLE_CONNS; i++) peers[i] = -1;
+    assert(pipe && server_ctx && client_ctx);
+    assert(SSL_CTX_use_certificate_chain_file(server_ctx, "cert0.pem") == 1);
+    assert(SSL_CTX_use_PrivateKey_file(server_ctx, "cert0.pem", SSL_FILETYPE_PEM) == 1);
+
+    /* the connections of a context left alone keep their record buffers */
+    assert(!idle_tls_bytes(server_ctx, client_ctx, conns, peers, &kept));
+    conn_ctx_lean(server_ctx);
+    assert(!idle_tls_bytes(server_ctx, client_ctx, conns, peers, &released));
+    /* mallinfo2 only sees glibc's heap, a sanitizer's reads as nothing */
+    if(kept) {
+        assert(released < IDLE_TLS_BYTES_MAX);
+        assert(released + IDLE_TLS_BUFFERS_MIN < kept);
+    }
+
+    /* request buffers are only held while a request is served */
+    assert(mkdtemp(dir));
+    snprintf(text, sizeof(text),
+            "https_port = 9092\npem_file = \"cert0.pem\"\nbase_dir = \"%s\"\n",
+            dir);
+    f = fmemopen(text, strlen(text), "r");
+    assert(f);
+    ret = load_config(f);
+    fclose(f);
+    assert(!ret);
+    pipe->client = mem_client_plain;
+    pipe->ctx = &client;
+    mem_serve(pipe, &client, "GET /teapot HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 418", 12));
+    mem_serve(pipe, &client, "GET /teapot HTTP/1.1\r\n\r\n");
+    bufpool_stats(&stats);
+    assert(!stats.in_use && stats.free == 2);
+
+    /* a plain connection waiting for its request is only its struct */
+    assert(sizeof(struct conn) <= IDLE_PLAIN_BYTES_MAX);
+    pipe->client = mem_client_idle;
+    IDLE_IN_USE = -1;
+    mem_serve(pipe, &client, "GET /teapot HTTP/1.1\r\n\r\n");
+    assert(!strncmp(client.response, "HTTP/1.1 418", 12));
+    assert(IDLE_IN_USE == 0);
+cleanup:
+    for(int i = 0; i < IDLE_CONNS; i++) {
+        if(conns[i].type == CONN_SSL) conn_cleanup(conns + i);
+        if(peers[i] != -1) close(peers[i]);
+    }
+    cleanup_config();
+    bufpool_cleanup();
+    free(pipe);
+    rmdir(dir);
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+}